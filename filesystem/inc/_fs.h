@@ -6,6 +6,13 @@
 #include <ctype.h>
 #include <stdio.h>
 
+#if !defined(_WIN64) && !defined(_WIN32)
+#include <pthread.h>
+#endif
+
+#include "stats.h"
+#include "trace.h"
+
 #define ANSI_COLOR_RED     "\x1b[31m"
 #define ANSI_COLOR_GREEN   "\x1b[32m"
 #define ANSI_COLOR_YELLOW  "\x1b[33m"
@@ -23,7 +30,7 @@
 #define NBLOCKS_IBLOCK 8			// Number of direct blocks an indirect block can point to
 #define NIBLOCKS 8				// Number of indirect blocks an indirect block can point to
 
-#define SUPERBLOCK_MAXBLOCKS 64			// Number of blocks we can allocate to the superblock
+#define SUPERBLOCK_MAXBLOCKS 128		// Number of blocks we can allocate to the superblock
 
 // Maximum number of blocks that an inode can address
 #define MAXBLOCKS_DIRECT NBLOCKS
@@ -33,12 +40,36 @@
 #define MAXFILEBLOCKS (MAXBLOCKS_DIRECT + \
 		MAXBLOCKS_IB1 + MAXBLOCKS_IB2 + MAXBLOCKS_IB3)
 
+#define FS_INLINEDATA 224			// Max file size in bytes stored inline in the inode instead of in data blocks
+
+#define FS_DINODESIZE 512			// Size of an on-disk inode
+#define FS_INODES_PER_BLOCK (BLKSIZE/FS_DINODESIZE)	// Number of on-disk inodes in an inode table block
+#define FS_NEXTENTS (FS_INLINEDATA/4)		// Number of extents held in an on-disk inode
+#define FS_XEXTENTS (BLKSIZE/4)			// Number of extents held in an extent overflow block
+
+#define FS_MAGIC 0x4B303635			// "560K"
+
+#define FS_ZFRAME 8				// Data blocks of a file compressed together, see zframe
+#define FS_MAXZFRAMES ((MAXFILEBLOCKS + FS_ZFRAME - 1) / FS_ZFRAME)
+#define FS_ZMINBLOCKS 3				// Files of fewer data blocks are not stored compressed: they would not get smaller
+
+#define FS_ZFILE 0x1				// Inode flag: compress the file's data
+#define FS_ZSTORED 0x2				// Inode flag: the file's data is stored compressed
+#define FS_ZVOLUME 0x1				// Filesystem flag: compress new files
+#define FS_DDVOLUME 0x2				// Filesystem flag: share data blocks that hold the same data
+#define FS_RECLAIMING 0x4			// Filesystem flag: removed files are not all freed yet, see _reclaim_replay
+
+#define FS_DEDUPBUCKETS 4096			// Buckets of the in-memory fingerprint index, see _dedup_find
+
+#define FS_NFREECLASSES 16			// Size classes of free extents: class k holds extents of 2^k to 2^(k+1)-1 blocks
+
 #define FS_NAMEMAXLEN 256			// Max length of a directory or file name
-#define FS_MAXPATHFIELDS 32			// Max number of forward-slash "/"-separated fields in a path (i.e. max directory recursion)
-#define FS_MAXPATHLEN (FS_NAMEMAXLEN*FS_MAXPATHFIELDS)	// Maximum path length
+#define FS_PATHFIELDS_MIN 16			// Room for fields a path starts with. It grows as needed
+#define FS_LOOKUPCACHE 8			// Directories remembered by path lookups, see _lookup
+#define FS_MAXLINKDEPTH 8			// Links followed in a row by a path lookup
 
-#define FS_MAXFILES 256				// Max number of files in a dir
-#define FS_MAXLINKS 256				// Max number of links in a dir
+#define FS_DIRENTS_MIN 16			// Room for subdirectories, files or links a directory starts with. It grows as needed
+#define FS_DIR_HASHMIN 64			// Entries past which a directory keeps the hash of each name on disk
 
 #define FS_MAXOPENFILES 16
 
@@ -60,9 +91,8 @@ enum { OK, ERR, DIREXISTS, BADPATH, NOTONDISK, TOOFEWARGS } FS_MESSAGE;
 enum { FS_FILE, FS_DIR, FS_LINK } FILETYPE;
 enum { FS_READ, FS_WRITE, FS_RW } FILEMODES;
 
-extern const char* fname;			/* The name our filesystem will have on disk */
 extern char* fs_responses[6];
-extern size_t stride;
+extern const size_t stride;
 
 typedef unsigned int uint;
 typedef uint16_t block_t;			// Block number
@@ -70,9 +100,18 @@ typedef uint16_t inode_t;			// Inode number
 typedef uint8_t fs_mode_t;			// File mode (0 =='r', 1 =='w')
 typedef unsigned int fd_t;			/* File descriptor */
 
-typedef struct map {
+typedef struct map {				/* One bit per block or inode, set when it is in use */
 	char data[BLKSIZE];
 } map;
+typedef struct io_counts {			/* Disk traffic, counted by readblock, readrun and writeblock */
+	size_t nreads;				// Number of reads from the image
+	size_t nwrites;				// Number of writes to the image
+	size_t blocks_read;			// Number of blocks read
+	size_t blocks_written;			// Number of blocks written
+} io_counts;
+extern STATS_THREAD io_counts fs_io;		/* The calling thread's, on any filesystem */
+
+typedef char map_size_check[(MAXBLOCKS/8 <= BLKSIZE && MAXINODES/8 <= BLKSIZE && 0 == MAXBLOCKS%8) ? 1 : -1];
 
 typedef struct block {
 	block_t num;				// Index of this block. The block knows where it is in the fs
@@ -108,21 +147,59 @@ typedef struct hlink {				// On-disk link
 	char name[FS_NAMEMAXLEN];		// link name
 } hlink;		/* hardlink */
 
-typedef struct dent {				// On-disk directory entry
+typedef struct ddirent {			/* Entry of an FS_DIR_HASHED directory, see ddent */
+	uint32_t hash;				// Hash of the entry's name
+	uint32_t seq;				// When it was added, to keep the entries in order
+	inode_t ino;				// Its inode, 0 for an empty slot
+	uint16_t mode;				// FS_DIR, FS_FILE or FS_LINK
+} ddirent;
+
+#define FS_DIRSLOTS ((BLKSIZE - 2*sizeof(block_t)) / sizeof(ddirent))	// Entries in a bucket block of a hashed directory
+
+typedef struct dent {				// Directory contents. Kept on disk in the directory's data blocks, see ddent
 	inode_t ino;				// Inode number
 	inode_t parent;				// Parent directory inode number
-	inode_t head;				// First dir added here
-	inode_t tail;				// Last dir added here
-	inode_t next;				// Next dir in parent
-	inode_t prev;				// Previous dir in parent
 
-	inode_t files[FS_MAXFILES];		// Files in this dir
-	inode_t links[FS_MAXLINKS];		// Links in this dir
+	inode_t* dirs;				// Subdirectories of this dir
+	inode_t* files;				// Files in this dir
+	inode_t* links;				// Links in this dir
+	uint32_t* dhash;			// Hash of each subdirectory's name, 0 until it is known
+	uint32_t* fhash;			// Hash of each file's name, 0 until it is known
+	uint32_t* lhash;			// Hash of each link's name, 0 until it is known
+	uint32_t* dseq;				// When each subdirectory was added. Ascending
+	uint32_t* fseq;				// When each file was added. Ascending
+	uint32_t* lseq;				// When each link was added. Ascending
 	size_t ndirs, nfiles, nlinks;
+	size_t maxdirs, maxfiles, maxlinks;	// Room in dirs, files and links
+	uint32_t nextseq;			// seq of the next entry added
+
+	ddirent* index;				// Hashed: the entries by hash, as the bucket blocks hold them. NULL until _dir_fit builds it
+	size_t nbuckets;			// Blocks of FS_DIRSLOTS entries in index
 
 	char name[FS_NAMEMAXLEN];		// dir name
 } dent;
 
+enum { FS_DIR_LINEAR, FS_DIR_HASHED };		/* On-disk directory layouts */
+
+/* On-disk directory header, at the start of the data of the directory's first block.
+ * A directory of up to FS_DIR_HASHMIN entries is FS_DIR_LINEAR: the inode numbers of
+ * its subdirectories, files then links follow the header, each kind in one run.
+ * A bigger one is FS_DIR_HASHED: the header has its block to itself, and each of the
+ * nbuckets blocks after it is a table of FS_DIRSLOTS ddirents. An entry goes in
+ * block hash % nbuckets, at the first empty slot from (hash / nbuckets) % FS_DIRSLOTS,
+ * so a lookup reads one bucket, and adding or removing an entry changes one block
+ * and the header. */
+typedef struct ddent {
+	inode_t ino;				// Inode number
+	inode_t parent;				// Parent directory inode number
+	uint16_t layout;			// FS_DIR_LINEAR or FS_DIR_HASHED
+	uint16_t nbuckets;			// FS_DIR_HASHED: bucket blocks after the header
+	uint32_t ndirs, nfiles, nlinks;
+	uint32_t nextseq;			// seq of the next entry added
+
+	char name[FS_NAMEMAXLEN];		// dir name
+} ddent;
+
 struct inode;					/* Forward declaration because of mutual 
 						 * dependence inode <-> { file, dent, link } */
 typedef struct filev {
@@ -143,32 +220,32 @@ typedef struct hlinkv {				// In-memory link
 typedef struct dentv {				// In-memory directory entry
 	struct inode* ino;			// Inode
 	struct inode* parent;			// Parent directory (inode number)
-	struct inode* head;			// First dir added here
-	struct inode* tail;			// Last dir added here
-	struct inode* next;			// Next dir in parent
-	struct inode* prev;			// Previous dir in parent
 
-	struct inode** files;			// Files in this dir
+	struct inode** dirs;			// Subdirectories, NULL for those not loaded yet
+	struct inode** files;			// Files in this dir, NULL for those not loaded yet
 	struct inode** links;			// Links in this dir
 
 	size_t ndirs, nfiles, nlinks;
+	size_t maxdirs, maxfiles, maxlinks;	// Room in dirs, files and links
 
 	char name[FS_NAMEMAXLEN];		// Dir name
 } dentv;
 
-/* By intention the block, inode, and superblock have identical in-memory and disk structure */
+/* By intention the block and superblock have identical in-memory and disk structure. 
+ * The inode has an in-memory form (below) and a compact on-disk form (dinode). */
 typedef struct inode {
 	inode_t num;				/* Inode number */
 
-	size_t nblocks;				/* Size in blocks == ndatablocks + ninoblocks */
+	size_t nblocks;				/* Size in blocks == ndatablocks + extent overflow block */
 	size_t ndatablocks;			/* Number of data blocks */
 
 	size_t size;				/* File size in bytes */
 	size_t nlinks;				/* Number of hard links to the inode */
 
-	uint16_t ninoblocks;			/* Of the allocated blocks, how many are for the inode itself */
 	uint16_t mode;				/* 0 file, 1 directory, 2 link */
 	uint16_t v_attached;			/* Did we load the volatile version already ? true : false */
+	uint16_t dirty;				/* Has the inode changed since it was last written ? true : false */
+	uint16_t flags;				/* FS_ZFILE, FS_ZSTORED */
 
 	union {
 		struct file file;
@@ -182,7 +259,23 @@ typedef struct inode {
 		struct hlinkv* link;
 	} datav;				/* In-memory data of this inode  */
 	
-	block_t blocks[MAXFILEBLOCKS];		/* Indices to all blocks */
+	block_t blocks[MAXFILEBLOCKS];		/* Indices to all data blocks. 0 for a block that is only
+						 * buffered in memory until the file is next flushed, or
+						 * for a hole if it is not in memory either */
+	block_t xblock;				/* Block holding the extents that did not fit in the dinode, 0 if none */
+
+	block_t* zblocks;			/* Stored compressed: the blocks on disk, see zframe.
+						 * blocks is then all 0, as the data blocks have no block of their own */
+	size_t nzblocks;			/* Number of zblocks */
+	struct zframe* zframes;			/* Stored compressed: the frame table, NULL until it is read */
+	size_t nzdata;				/* Stored compressed: data blocks the frames on disk hold */
+	block_t* zfreed;			/* Blocks given up when the frames were last rewritten, freed once the inode is stored */
+	size_t nzfreed;
+
+	uint8_t dirtyblocks[MAXFILEBLOCKS];	/* Which in-memory data blocks have changes that are not on disk */
+
+	char idata[FS_INLINEDATA];		/* Contents of a small file while it has no data blocks.
+						 * Spilled into the first data block once it outgrows this */
 
 	block* directblocks[NBLOCKS];		/* Direct block pointers */
 		
@@ -201,23 +294,183 @@ typedef struct inode {
 						 */
 } inode;
 
+typedef struct extent {				/* A run of contiguous blocks */
+	block_t start;				/* First block of the run. 0 for a run of holes: data blocks
+						 * that were never written, or were punched out, and read as zeros */
+	uint16_t len;				/* Number of blocks in the run */
+} extent;
+
+/* On-disk inode. Packed into the inode table FS_INODES_PER_BLOCK to a block.
+ * A directory's dent is kept in its first data block, not here. */
+typedef struct dinode {
+	inode_t num;				/* Inode number, 0 if the slot is unused */
+	inode_t parent;				/* Inode number of parent dir */
+	uint16_t mode;				/* 0 file, 1 directory, 2 link */
+	uint16_t nlinks;			/* Number of hard links to the inode */
+	uint32_t size;				/* File size in bytes */
+	uint16_t ndatablocks;			/* Number of data blocks */
+	uint16_t nextents;			/* Number of extents, 0 while the file is inline */
+	block_t xblock;				/* Block holding extents past FS_NEXTENTS, 0 if none */
+	inode_t dest;				/* Link: inode pointed to */
+	uint16_t destmode;			/* Link: 0 file, 1 dir, 2 link */
+	uint16_t flags;				/* FS_ZFILE, FS_ZSTORED */
+	uint16_t nzdata;			/* Stored compressed: number of data blocks. ndatablocks is then
+						 * the number of blocks on disk */
+	uint16_t nholes;			/* Data blocks that are holes, see extent */
+	uint16_t reserved[2];
+
+	char name[FS_NAMEMAXLEN];		/* File, dir or link name */
+
+	union {
+		char idata[FS_INLINEDATA];	/* Inline file contents */
+		extent ext[FS_NEXTENTS];	/* Data blocks as runs of contiguous blocks */
+	} u;
+} dinode;
+
+/* The dinode must tile a block exactly */
+typedef char dinode_size_check[(sizeof(dinode) == FS_DINODESIZE) ? 1 : -1];
+
+/* A file stored compressed has its data blocks in frames of FS_ZFRAME,
+ * the last one maybe fewer. Each frame is compressed on its own and takes
+ * as few blocks as that needs, or is stored as it is if compressing does
+ * not save a block. Its blocks on disk are the frame table, then the
+ * blocks of each frame in turn. */
+typedef struct zframe {
+	uint16_t nblocks;			/* Blocks on disk */
+	uint16_t reserved;
+	uint32_t len;				/* Bytes of compressed data, 0 if the frame is stored as it is */
+} zframe;
+
+/* The frame table must fit in a block */
+typedef char zframe_size_check[(FS_MAXZFRAMES*sizeof(zframe) <= BLKSIZE - 2*sizeof(block_t)) ? 1 : -1];
+
+typedef struct fingerprint {			/* 128-bit hash of the data of a block, see _block_hash */
+	uint64_t lo;
+	uint64_t hi;
+} fingerprint;
+
+/* Reference counts and fingerprints of the data blocks files may share.
+ * A block is in the index while its count is above 0. Kept on disk in the
+ * blocks sb_i.dedup_blocks names, once dedup has been turned on. */
+typedef struct dedup_table {
+	uint16_t refs[MAXBLOCKS];		// Number of file data blocks that are this block, 0 if it is not in the index
+	fingerprint fps[MAXBLOCKS];		// Fingerprint of the data of each block in the index
+} dedup_table;
+
+#define FS_DEDUPBLOCKS ((sizeof(dedup_table) + BLKSIZE - 2*sizeof(block_t) - 1) / (BLKSIZE - 2*sizeof(block_t)))
+
+typedef struct dedup_report {			/* What sharing blocks saves */
+	int on;					/* Are blocks shared on write ? true : false */
+	size_t nindexed;			/* Blocks in the index */
+	size_t nshared;				/* Of those, blocks that are more than one file data block */
+	size_t nrefs;				/* File data blocks that are blocks in the index */
+	size_t nsaved;				/* Blocks not used thanks to sharing: nrefs - nindexed */
+} dedup_report;
+
 typedef struct superblock {
 	size_t free_blocks_base;			// Index of lowest unallocated block
 	inode_t free_inodes_base;			// Index of lowest unallocated inode
 	inode_t root;					// Inode number of root directory entry
-	block_t inode_first_blocks[MAXINODES];		// Index of first allocated block for each inode.
+	size_t nfree_blocks;				// Number of free blocks
+	size_t nfree_inodes;				// Number of free inode numbers
+	size_t free_extents[FS_NFREECLASSES];		// Number of runs of free blocks in each size class
+	block_t inode_first_blocks[MAXINODES];		// Index of the inode table block holding each inode, 0 if unallocated.
+	block_t inode_table[MAXINODES/FS_INODES_PER_BLOCK];	// Inode table blocks, allocated as inode numbers are handed out.
 	size_t inode_block_counts[MAXINODES];		// How many allocated blocks for each inode.
 
 } superblock;
 
+/* The superblock must fit in the blocks superblock_i can point to */
+typedef char superblock_size_check[(sizeof(superblock)/(BLKSIZE - 2*sizeof(block_t)) < SUPERBLOCK_MAXBLOCKS) ? 1 : -1];
+
 /* Need these fields outside of superblock because we can be certain they fit into one block */
 typedef struct superblock_i {
+	uint32_t magic;				// FS_MAGIC. Tells us the file holds a filesystem of this format
 	size_t nblocks;				// The number of blocks allocated to the superblock
 	block_t blocks[SUPERBLOCK_MAXBLOCKS];	// Indices to superblock's blocks
+	uint32_t flags;				// FS_ZVOLUME, FS_DDVOLUME, FS_RECLAIMING
+	block_t dedup_blocks[FS_DEDUPBLOCKS];	// Blocks holding the dedup table, all 0 until dedup is first turned on
 
 } superblock_i;
 
+/* superblock_i is read and written as one block */
+typedef char superblock_i_size_check[(sizeof(superblock_i) <= BLKSIZE - 2*sizeof(block_t)) ? 1 : -1];
+
+typedef struct defrag_report {			/* What a defragmentation pass did */
+	size_t nfiles;				/* Files looked at */
+	size_t nmoved;				/* Files moved into a single extent */
+	size_t nblocks;				/* Data blocks moved */
+	size_t extents_before;			/* Extents of the files looked at, before the pass */
+	size_t extents_after;			/* Extents of the files looked at, after the pass */
+} defrag_report;
+
+typedef struct fsck_report {			/* What a consistency check found */
+	size_t ninodes;				/* Inodes in use */
+	size_t nblocks;				/* Blocks in use */
+	size_t nproblems;			/* Problems found */
+	size_t nrepaired;			/* Of those, problems repaired */
+	size_t nbytes;				/* Bytes of the image read */
+	uint npasses;				/* Checks made. More than one if the first made repairs */
+	uint nthreads;				/* Worker threads */
+	FILE* log;				/* Where each problem is described, one to a line, NULL for nowhere */
+} fsck_report;
+
+#define FS_FSCK_MAXTHREADS 32			// Most worker threads fsck runs
+#define FS_FSCK_BATCH 256			// Most blocks fsck reads at once
+#define FS_FSCK_GAP 16				// Unwanted blocks fsck reads through between two it wants, rather than read twice
+#define FS_FSCK_MAXPASSES 3			// Most checks fsck makes when repairing, each after the repairs of the last
+
+typedef struct fs_import_file {			/* A file or directory for _import to create */
+	char* path;				/* Absolute path in the filesystem */
+	char* data;				/* The file's contents, NUL-terminated. NULL for a directory */
+} fs_import_file;
+
+typedef struct import_report {			/* What imports did, added to by each */
+	size_t nfiles;				/* Files created */
+	size_t ndirs;				/* Directories created, those made for the files included */
+	size_t nbytes;				/* Bytes written to the files */
+	size_t nfailed;				/* Entries not created: already there, bad name, too big or no room */
+	size_t ncommits;			/* Batches written, one commit each */
+} import_report;
+
+#define FS_BATCH_OFF 0				// Inodes are written as they change
+#define FS_BATCH_OPEN 1				// Inodes are held for the commit, see _import
+#define FS_BATCH_COMMIT 2			// Inode table blocks are written at the end of the commit
+
+#define FS_WALK_MAXTHREADS 32			// Most worker threads a walk runs
+#define FS_WALK_PRUNE 2				// Visitor return value: do not descend into this directory
+
+typedef struct fs_walk_entry {			/* A file, directory or link found by a walk */
+	const char* path;			/* Absolute path */
+	const char* name;
+	inode_t num;				/* Inode number */
+	inode_t parent;				/* Inode number of parent dir */
+	uint16_t mode;				/* 0 file, 1 directory, 2 link */
+	inode_t dest;				/* Link: inode pointed to */
+	uint16_t destmode;			/* Link: 0 file, 1 dir, 2 link */
+	size_t size;				/* Size in bytes */
+	size_t nlinks;				/* Number of hard links to it */
+	size_t nblocks;				/* Blocks on disk */
+	uint depth;				/* 1 for the entries of the start dir */
+	const uint* order;			/* Position among its siblings at each depth, order[0..depth-1]. 
+						 * Sorting by it gives the order a serial walk would visit in:
+						 * subdirectories, then files, then links */
+	uint worker;				/* Worker thread that found it, below FS_WALK_MAXTHREADS */
+} fs_walk_entry;
+
+/* Called by a walk for every entry below the start directory, from any
+ * worker thread. Returns FS_ERR to stop the walk, FS_WALK_PRUNE to skip
+ * the contents of a directory, anything else to go on. 
+ * Must not call back into the filesystem. */
+typedef int (* fs_visitor)(const fs_walk_entry*, void*);
+
 typedef struct filesystem {	
+	char* fname;				/* Name of the file the filesystem is kept in */
+	FILE* fp;				/* That file, open */
+	block* block_cache;			/* MAXBLOCKS in-memory copies of blocks on disk */
+	uint8_t* block_cache_valid;		/* Which entries of block_cache hold a current copy of an inode table block */
+	struct inode** attached_inodes;		/* MAXINODES inodes that are already loaded into memory, by number */
+
 	dentv* root;				/* Root directory entry */
 	filev* fds[FS_MAXOPENFILES];		/* File descriptors. Pointers to open files */
 	fd_t first_free_fd;			/* Index into the first free file descriptor */
@@ -232,11 +485,74 @@ typedef struct filesystem {
 	superblock_i sb_i;			/* Block 2. Tells us where the superblock blocks are. */
 	superblock sb;				/* Blocks 3...sizeof(superblock)/sizeof(block)+1. 
 						 * Superblock. Contains filesystem topology */
+
+	struct {
+		map fb_map;
+		map ino_map;
+		superblock_i sb_i;
+		superblock sb;
+		dedup_table* dedup;
+	} ondisk;				/* The above as last written. _sync writes only the blocks that differ */
+
+	struct {
+#if !defined(_WIN64) && !defined(_WIN32)
+		pthread_mutex_t lock;
+		pthread_cond_t done;		/* Signalled when a commit finishes */
+#endif
+		uint64_t requested;		/* Number of commits asked for */
+		uint64_t completed;		/* Requests covered by the last finished commit */
+		int running;			/* Is a commit in flight ? true : false */
+		int status;			/* Result of the last finished commit */
+	} commit;				/* Group commit state, see _group_commit */
+
+	struct {
+		inode_t* queue;			/* Files left to defragment, NULL if none */
+		size_t nqueued;			/* Number of files in queue */
+		size_t next;			/* Index into queue of the next file to defragment */
+		defrag_report report;		/* Progress so far */
+	} defrag;				/* Defragmentation in progress, see _defrag_step */
+
+	struct {
+		inode_t* queue;			/* Removed inodes whose space is not freed yet, NULL if none */
+		size_t first;			/* Index into queue of the next one to free */
+		size_t nqueued;			/* Number of inodes in queue, which wraps around at MAXINODES */
+	} reclaim;				/* Space of removed files, freed in the background, see _reclaim_step */
+
+	struct {
+		block_t* blocks;		/* Directory data blocks read ahead, sorted, NULL if none */
+		block* data;			/* Their contents, in the same order */
+		size_t n;			/* Number of blocks */
+	} prefetch;				/* Read by _dir_read in place of the disk while _inode_prefetch loads */
+
+	size_t nreserved_blocks;		/* Free blocks promised to data buffered in memory, see _inode_alloc_delayed */
+
+	dedup_table* dedup;			/* Reference counts and fingerprints, NULL until dedup is first turned on */
+	block_t* dedup_buckets;			/* Fingerprint index: the first block in each of FS_DEDUPBUCKETS buckets, 0 if none */
+	block_t* dedup_chain;			/* The next block in the same bucket, by block, 0 at the end */
+
+	struct {
+		char* path[FS_LOOKUPCACHE];	/* Absolute paths of directories, NULL for an empty slot */
+		size_t len[FS_LOOKUPCACHE];	/* Their lengths */
+		inode_t num[FS_LOOKUPCACHE];	/* Their inodes */
+		size_t next;			/* Slot to replace next */
+	} lookup;				/* Directories lookups start from, see _lookup */
+
+	struct {
+		int state;			/* FS_BATCH_OFF, FS_BATCH_OPEN or FS_BATCH_COMMIT */
+		inode_t* inodes;		/* Inodes to write at the commit, in the order they first changed */
+		uint8_t* held;			/* MAXINODES flags: which inodes are in inodes */
+		size_t n;			/* Number of inodes */
+		uint8_t tables[MAXINODES/FS_INODES_PER_BLOCK];	/* Inode table blocks to write at the end */
+		block_t* pool;			/* Data blocks allocated for the whole batch, taken in order */
+		size_t npool;			/* Number of blocks in pool */
+		size_t next;			/* Index into pool of the next block to take */
+	} batch;				/* Metadata changes written together, see _import */
 } filesystem;
 
 typedef struct fs_path {			/* A struct for storing the fields of a path */
-	char* fields[FS_MAXPATHFIELDS];
+	char** fields;				/* Each FS_NAMEMAXLEN chars */
 	size_t nfields;
+	size_t maxfields;			/* Room in fields */
 	size_t firstField;
 } fs_path;
 
@@ -289,6 +605,7 @@ typedef struct {
 
 	hlinkv*			(* _new_link)		(filesystem* , dentv*, inode*, const char*);
 	int			(* _rmlink)		(filesystem* , hlinkv*);
+	int			(* _rm)			(filesystem* , inode*);
 
 	int			(* _v_attach)		(filesystem* , inode*);
 	int			(* _v_detach)		(filesystem* , inode*);
@@ -296,15 +613,17 @@ typedef struct {
 	int			(* _get_fd)		(filesystem*);
 	int			(* _free_fd)		(filesystem*, int);
 
-	int			(* _prealloc)		();
-	int			(* _zero)		();
-	filesystem*		(* _open)		();
-	filesystem*		(* _mkfs)		();
-	filesystem*		(* _init)		(int);
+	int			(* _prealloc)		(filesystem*);
+	int			(* _zero)		(filesystem*);
+	filesystem*		(* _open)		(const char*);
+	filesystem*		(* _mkfs)		(const char*);
+	filesystem*		(* _init)		(const char*, int);
+	void			(* _release)		(filesystem*);
 	
 	int			(* __balloc)		(filesystem* );
 	int			(* _mballoc)		(filesystem*, const size_t, block_t*);
 	int			(* _bfree)		(filesystem* , block*);
+	int			(* _mbfree)		(filesystem*, const size_t, block_t*);
 	block*			(* _newBlock)		();
 	inode*			(* _new_inode)		();
 	void			(* _free_inode)		(inode*);
@@ -313,31 +632,62 @@ typedef struct {
 	int			(* _ifree)		(filesystem* , inode_t);
 
 	int			(* _inode_fill_blocks_from_data) (filesystem*, inode*, size_t, char*);
-	int			(* _inode_fill_blocks_from_disk) (inode*);
+	int			(* _inode_fill_blocks_from_disk) (filesystem*, inode*);
 
-	int			(* _inode_extend_datablocks)	(filesystem*, inode*, block**);
-	size_t			(* _inode_read_direct_blocks)	(char*, block**, size_t);
+	block**			(* _inode_block_slot)		(inode*, size_t);
+	int			(* _inode_hole)			(inode*, size_t);
+	int			(* _inode_extend_datablocks)	(filesystem*, inode*, size_t);
+	int			(* _inode_alloc_delayed)	(filesystem*, inode*);
 	char*			(* _inode_read_data)		(inode*, size_t, size_t);
-	int			(* _inode_commit_data)		(inode*);
+	int			(* _inode_commit_data)		(filesystem*, inode*);
+	int			(* _punch_hole)			(filesystem*, inode*, size_t, size_t);
+	int			(* _truncate)			(filesystem*, inode*, size_t);
+	int			(* _fallocate)			(filesystem*, inode*, size_t, size_t);
+	int			(* _zframe_load)		(filesystem*, inode*, size_t);
+	int			(* _zfile_pack)			(filesystem*, inode*);
+	int			(* _zfile_unpack)		(filesystem*, inode*);
+	int			(* _compress)			(filesystem*, inode*, int);
+	void			(* _dedup_inode)		(filesystem*, inode*, fingerprint*);
+	int			(* _dedup)			(filesystem*, int);
+	void			(* _dedup_report)		(filesystem*, dedup_report*);
+	size_t			(* _inode_nextents)		(inode*);
+	int			(* _defrag_inode)		(filesystem*, inode*, defrag_report*);
+	int			(* _defrag_collect)		(filesystem*, inode_t);
+	int			(* _defrag_start)		(filesystem*, inode_t);
+	size_t			(* _defrag_step)		(filesystem*, size_t);
+	size_t			(* _reclaim_step)		(filesystem*, size_t);
+	int			(* _walk)			(filesystem*, inode_t, const char*, uint, fs_visitor, void*);
+	int			(* _readdir_plus)		(filesystem*, inode_t, const char*, fs_visitor, void*);
+	fs_walk_entry*		(* _readdir_list)		(filesystem*, inode_t, const char*, size_t*);
+	int			(* _fsck)			(const char*, uint, int, fsck_report*);
+	int			(* _import)			(filesystem*, fs_import_file*, size_t, import_report*);
 
 	inode*			(* _inode_load)		(filesystem* , inode_t);
+	size_t			(* _inode_prefetch)	(filesystem*, const inode_t*, size_t);
 	int			(* _inode_unload)	(filesystem*, inode*);
+	dinode*			(* _itable_slot)	(filesystem*, inode_t);
+	int			(* _inode_store)	(filesystem*, inode*);
 
-	int			(* readblock)		(void*, block_t);
-	int			(* writeblock)		(block_t, size_t, void*);
+	int			(* readblock)		(filesystem*, void*, block_t);
+	int			(* readrun)		(filesystem*, void*, block_t, size_t);
+	int			(* writeblock)		(filesystem*, block_t, size_t, void*);
 
-	int			(* readirectblocks)	(void*, block_t*, size_t, size_t);
-	int			(* writeblocks)		(void*, block_t*, size_t, size_t);
+	int			(* readirectblocks)	(filesystem*, void*, block_t*, size_t, size_t);
+	int			(* writeblocks)		(filesystem*, void*, block_t*, size_t, size_t);
 
 	int			(* write_commit)	(filesystem*, inode*);
-	inode*			(* _stat_recurse)	(filesystem* , dentv*, size_t, size_t, fs_path*);
-	inode*			(* _files_iterate)	(filesystem*, dentv*, fs_path*, size_t);
-	inode*			(* _links_iterate)	(filesystem*, dentv*, fs_path*, size_t);
+	inode*			(* _lookup)		(filesystem*, const char*);
+	void			(* _lookup_forget)	(filesystem*);
+	inode*			(* _dirs_iterate)	(filesystem*, dentv*, const char*);
+	inode*			(* _files_iterate)	(filesystem*, dentv*, const char*);
+	inode*			(* _links_iterate)	(filesystem*, dentv*, const char*);
 	
 	int			(* _sync)		(filesystem* );
+	int			(* _flush)		(filesystem* );
+	int			(* _group_commit)	(filesystem* );
 
-	void			(* _safeopen)		(const char*, char*);
-	void			(* _safeclose)		();
+	void			(* _safeopen)		(filesystem*, char*);
+	void			(* _safeclose)		(filesystem*);
 	
 	void			(* _print_mem)		(void const*, size_t);
 	void			(* _debug_print)	();
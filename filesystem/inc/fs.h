@@ -3,6 +3,10 @@
 
 #include "_fs.h"
 
+/* An open filesystem. Each has its own file, caches and open files,
+ * so a process can have several open at once. */
+typedef filesystem fs_handle;
+
 typedef struct { 
 
 	/* Path utilities */
@@ -14,7 +18,7 @@ typedef struct {
 	char*		(* pathSkipLast)	(fs_path*);
 	char*		(* pathGetLast)		(fs_path*);
 	int		(* pathAppend)		(fs_path*, const char*);
-	char*		(* getAbsolutePathDV)	(dentv*, fs_path *);
+	char*		(* getAbsolutePathDV)	(fs_handle*, dentv*, fs_path *);
 	char*		(* getAbsolutePath)	(char* current_dir, char* next_dir);
 	char*		(* pathTrimSlashes)	(char*);
 	char*		(* strSkipFirst)	(char*);
@@ -22,27 +26,46 @@ typedef struct {
 	char*		(* trim)		(char*);
 	int		(* isNumeric)		(char*);
 
-	inode*		(* inodeLoad)		(inode_t);
-	void		(* inodeUnload)		(inode*);
-	void		(* destruct)		();
-	void		(* openfs)		();
-	void		(* mkfs)		();
-	int		(* mkdir)		(char*, char*);
-	int		(* rmdir)		(char*, char*);
-
-	inode*		(* stat)		(char*);
-	inode*		(* statI)		(inode_t);
-	int		(* open)		(char*, char*, char*);
-	int		(* close)		(fd_t);
-	dentv*		(* opendir)		(char*);
-	void		(* closedir)		(dentv*);
-	char*		(* read)		(fd_t, size_t);
-	size_t		(* write)		(fd_t, char*);
-	void		(* seek)		(fd_t, size_t);
-	int		(* link)		(char* from, char* to);
-	int		(* ulink)		(char*);
+	inode*		(* inodeLoad)		(fs_handle*, inode_t);
+	void		(* inodeUnload)		(fs_handle*, inode*);
+	void		(* destruct)		(fs_handle*);
+	fs_handle*	(* openfs)		(const char* fname);
+	fs_handle*	(* mkfs)		(const char* fname);
+	int		(* mkdir)		(fs_handle*, char*, char*);
+	int		(* rmdir)		(fs_handle*, char*, char*);
+
+	inode*		(* stat)		(fs_handle*, char*);
+	inode*		(* statI)		(fs_handle*, inode_t);
+	int		(* open)		(fs_handle*, char*, char*, char*);
+	int		(* close)		(fs_handle*, fd_t);
+	dentv*		(* opendir)		(fs_handle*, char*);
+	void		(* closedir)		(fs_handle*, dentv*);
+	char*		(* read)		(fs_handle*, fd_t, size_t);
+	size_t		(* write)		(fs_handle*, fd_t, char*);
+	void		(* seek)		(fs_handle*, fd_t, size_t);
+	int		(* punchHole)		(fs_handle*, fd_t, size_t, size_t);
+	int		(* truncate)		(fs_handle*, fd_t, size_t);
+	int		(* fallocate)		(fs_handle*, fd_t, size_t, size_t);
+	int		(* link)		(fs_handle*, char* from, char* to);
+	int		(* ulink)		(fs_handle*, char*);
+	int		(* rm)			(fs_handle*, char*, int);
+	size_t		(* reclaimStep)		(fs_handle*, size_t);
+	int		(* fsync)		(fs_handle*, fd_t);
+	int		(* syncfs)		(fs_handle*);
+	int		(* defrag)		(fs_handle*, char*, int, defrag_report*);
+	size_t		(* defragStep)		(fs_handle*, size_t, defrag_report*);
+	int		(* walk)		(fs_handle*, char*, uint, fs_visitor, void*);
+	int		(* readdirPlus)		(fs_handle*, char*, fs_visitor, void*);
+	fs_walk_entry*	(* readdirPlusList)	(fs_handle*, char*, size_t*);
+	int		(* compress)		(fs_handle*, char*, int);
+	int		(* dedup)		(fs_handle*, int);
+	void		(* dedupStats)		(fs_handle*, dedup_report*);
+	int		(* fsck)		(const char*, uint, int, fsck_report*);
+	int		(* importFiles)		(fs_handle*, fs_import_file*, size_t, import_report*);
 	
-	size_t		(* getNumUsedBlocks)	();
+	size_t		(* getNumUsedBlocks)	(fs_handle*);
+	size_t		(* getNumUsedInodes)	(fs_handle*);
+	void		(* getFreeExtents)	(fs_handle*, size_t*);
 
 } fs_public_interface;
 extern fs_public_interface const fs;
@@ -0,0 +1,20 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+/* A small LZ77 codec in the style of LZ4, for compressing file data.
+ * The output is a run of sequences, each some literal bytes and then a
+ * copy of earlier output; the last sequence has only literals. A sequence
+ * is a token byte (literal length in the high 4 bits, match length -
+ * LZ_MINMATCH in the low 4 bits, 15 meaning more length bytes follow),
+ * the literals, and the match offset in 2 bytes, least significant first. */
+
+#define LZ_MINMATCH 4				// Shortest match worth a copy
+#define LZ_HASHBITS 12				// The compressor remembers 2^LZ_HASHBITS earlier positions
+#define LZ_MAXOFFSET 65535			// Farthest back a match can be
+
+extern size_t	lz_compress	(const char* src, size_t n, char* dst, size_t cap);
+extern size_t	lz_decompress	(const char* src, size_t n, char* dst, size_t cap);
+
+#endif /* LZ_H */
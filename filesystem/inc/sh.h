@@ -1,10 +1,24 @@
 #include "fs.h"
 
+#define SH_IMAGE "fs"		// The file the shell keeps its filesystem in, in the current directory
+
 #define SH_BUFLEN 10+512*1024	// How many chars to accept per line from user
 #define SH_MAXFIELDS 8		// How many whitespace-separated fields to accept from user
 #define SH_MAXFIELDSIZE 512*512
 
-#define SH_MAXFSARGS 4
+#define SH_MAXFSARGS 5	// One more than the most fields a command takes
+
+#define SH_OUTBUFLEN 64*1024	// Size of the stdout buffer in batch modes
+
+#define SH_DEFRAGSTEP 8		// How many files a background defrag moves between commands
+#define SH_RECLAIMSTEP 256	// About how many blocks of removed files are freed between commands
+
+#define SH_WALKTHREADS 0	// Threads for tree, du and find. 0 for one per processor
+
+#define SH_IMPORTTHREADS 4			// Threads reading host files for import -r. They mostly wait on the disk
+#define SH_IMPORTBATCH 256			// Most files import -r writes in one commit
+#define SH_IMPORTBATCHBYTES (4*1024*1024)	// Most bytes of data import -r writes in one commit, unless one file is bigger
+#define SH_IMPORTQUEUEBYTES (32*1024*1024)	// Bytes read ahead of the filesystem by import -r before the readers wait
 
 typedef struct fs_args {
 	char fields[SH_MAXFSARGS][SH_MAXFIELDSIZE]; /* A struct for storing command arguments */
@@ -15,8 +29,49 @@ typedef struct fs_args {
 
 } fs_args;
 
+typedef struct sh_walk_list {		/* Entries found by a walk, kept per worker so the visitor needs no lock */
+	fs_walk_entry* entries[FS_WALK_MAXTHREADS];
+	size_t n[FS_WALK_MAXTHREADS];
+	size_t cap[FS_WALK_MAXTHREADS];
+	const char* pattern;		/* Only keep the names matching this, NULL for all */
+} sh_walk_list;
+
+typedef struct sh_du_totals {		/* What du adds up, per worker */
+	size_t bytes[FS_WALK_MAXTHREADS];
+	size_t blocks[FS_WALK_MAXTHREADS];
+	size_t nfiles[FS_WALK_MAXTHREADS];
+	size_t ndirs[FS_WALK_MAXTHREADS];
+	size_t nlinks[FS_WALK_MAXTHREADS];
+} sh_du_totals;
+
+typedef struct sh_import_item {		/* A host file or directory for import -r */
+	char* host;			/* Path on the host */
+	char* path;			/* Absolute path in the filesystem */
+	char* data;			/* A file's contents once read, NULL for a directory */
+	size_t len;			/* Bytes in data */
+	int isdir;
+	struct sh_import_item* next;
+} sh_import_item;
+
+#if !defined(_WIN64) && !defined(_WIN32)
+typedef struct sh_import_state {	/* Shared by the readers of import -r and the shell */
+	pthread_mutex_t lock;
+	pthread_cond_t changed;		/* Signalled when entries are added or taken */
+	sh_import_item* todo;		/* Host entries not read yet, a stack */
+	size_t nbusy;			/* Readers working on an entry */
+	sh_import_item* done;		/* Entries read, oldest first, for the filesystem */
+	sh_import_item* last;		/* The last of done */
+	size_t ndone;			/* Number of entries in done */
+	size_t nbytes;			/* Bytes of file data in done */
+	size_t nskipped;		/* Host entries not read: unreadable, or not a file or directory */
+} sh_import_state;
+#endif
+
 extern void		sh_traverse_files(dentv* dv, int depth);
 extern void		sh_traverse_links(dentv* dv, int depth);
+extern void		sh_print_file	(char* name, int depth);
+extern void		sh_print_link	(char* name, uint16_t mode, inode* dest_ino, int depth);
+extern void		sh_print_entry	(const fs_walk_entry* e, int depth);
 extern int		sh_getfsroot	();
 extern void		sh_openfs	();
 extern void		sh_mkfs		();
@@ -35,6 +90,24 @@ extern int		sh_ls		(char* path);
 extern int		sh_cat		(fs_args*);
 extern int		sh_cp		(char* src, char* dest);
 extern void		sh_tree		(char* name);
+extern int		sh_glob		(const char* pattern, const char* name);
+extern int		sh_walk_collect	(const fs_walk_entry* e, void* arg);
+extern int		sh_cmp_walk_order(const void* a, const void* b);
+extern fs_walk_entry*	sh_walk_sorted	(char* path, sh_walk_list* list, size_t* n);
+extern void		sh_walk_free	(sh_walk_list* list, fs_walk_entry* all, size_t n);
+extern int		sh_du_visit	(const fs_walk_entry* e, void* arg);
+extern int		sh_du		(char* path);
+extern int		sh_find		(fs_args* cmd);
 extern int		sh_import	(fs_args*);
+extern int		sh_import_tree	(char* hostdir, char* fsdir);
 extern int		sh_export	(fs_args*);
+extern int		sh_defrag	(fs_args*);
+extern void		sh_defrag_background	();
+extern int		sh_rm		(fs_args*);
+extern void		sh_reclaim_background	();
+extern int		sh_compress	(fs_args*);
+extern int		sh_dedup	(fs_args*);
+extern int		sh_stats	(fs_args*);
+extern int		sh_trace	(fs_args*);
 extern void		printFreeSpace	();
+extern void		sh_color	(const char* color);
@@ -0,0 +1,70 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Always-on operation counters and latency histograms.
+ * Each thread records into its own copy; stats_print and stats_json
+ * add the copies together. A thread's copy is kept in a running
+ * total once the thread exits. */
+
+#define STATS_SUBBITS 2				// Bits of each value kept below its leading bit: 4 buckets per power of two
+#define STATS_NBUCKETS (64 << STATS_SUBBITS)	// Enough buckets for any 64-bit latency in ns
+
+#if defined(_WIN64) || defined(_WIN32)
+#define STATS_THREAD __declspec(thread)
+#else
+#define STATS_THREAD __thread
+#endif
+
+typedef enum stat_op {			/* Timed operations, one histogram each */
+	ST_MKFS, ST_OPENFS, ST_MKDIR, ST_RMDIR, ST_STAT, ST_STATI,
+	ST_OPEN, ST_CLOSE, ST_OPENDIR, ST_CLOSEDIR, ST_READ, ST_WRITE, ST_SEEK,
+	ST_LINK, ST_ULINK, ST_FSYNC, ST_SYNCFS, ST_DEFRAG, ST_DEFRAGSTEP, ST_WALK, ST_READDIR, ST_COMPRESS, ST_DEDUP, ST_PUNCHHOLE, ST_TRUNCATE, ST_FALLOCATE, ST_RM, ST_RECLAIMSTEP, ST_FSCK, ST_IMPORT,
+	ST_READBLOCK, ST_WRITEBLOCK, ST_SYNC, ST_INODE_LOAD, ST_INODE_UNLOAD, ST_MBALLOC, ST_LOAD_DIR, ST_INODE_PREFETCH,
+	ST_NOPS
+} stat_op;
+
+typedef enum stat_counter {		/* Plain counters */
+	SC_BYTES_READ,			// Bytes read from the image
+	SC_BYTES_WRITTEN,		// Bytes written to the image
+	SC_ALLOC_SCANNED,		// Bitmap bits the allocators looked at
+	SC_ITABLE_HITS,			// Inode table lookups served from block_cache
+	SC_ITABLE_MISSES,		// Inode table lookups that read the block
+	SC_INODE_HITS,			// Inode loads served from attached_inodes
+	SC_INODE_MISSES,		// Inode loads that built the inode from its dinode
+	SC_DEDUP_HITS,			// Data blocks written that shared a block already on disk
+	SC_NCOUNTERS
+} stat_counter;
+
+typedef struct stats_hist {
+	uint64_t count;
+	uint64_t sum;			// Total ns
+	uint64_t max;			// Slowest, ns
+	uint64_t buckets[STATS_NBUCKETS];
+} stats_hist;
+
+typedef struct stats_thread {		/* One thread's numbers */
+	uint64_t counters[SC_NCOUNTERS];
+	stats_hist ops[ST_NOPS];
+	struct stats_thread* next;	// Next thread's numbers
+} stats_thread;
+
+extern STATS_THREAD stats_thread* stats_mine;
+
+extern uint64_t		stats_now	();
+extern stats_thread*	stats_register	();
+extern void		stats_record	(stat_op op, uint64_t start);
+extern void		stats_record_args(stat_op op, uint64_t start, long block, long inode);
+extern void		stats_reset	();
+extern void		stats_print	(FILE* out);
+extern void		stats_json	(FILE* out);
+
+/* Add @param n to counter @param c of the calling thread */
+#define stats_count(c, n) do { \
+		if (NULL == stats_mine) stats_register(); \
+		if (NULL != stats_mine) stats_mine->counters[c] += (n); \
+	} while (0)
+
+#endif /* STATS_H */
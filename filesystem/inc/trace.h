@@ -0,0 +1,28 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/* Event tracing into a ring buffer, dumped as Chrome trace JSON
+ * (chrome://tracing, ui.perfetto.dev). Events are recorded by
+ * stats_record_args when trace_on is set; when it is not, tracing
+ * costs one branch per timed operation. */
+
+#define TRACE_NEVENTS (1 << 16)			// Events kept. Older ones are overwritten.
+
+typedef struct trace_event {
+	const char* name;			// Operation
+	uint64_t start;				// ns, stats_now() clock
+	uint64_t dur;				// ns
+	long block;				// Block number, or -1
+	long inode;				// Inode number, or -1
+	unsigned int tid;			// Thread that ran it
+} trace_event;
+
+extern volatile int trace_on;
+
+extern void	trace_start	();
+extern int	trace_stop	(const char* path);
+extern void	trace_record	(const char* name, uint64_t start, uint64_t end, long block, long inode);
+
+#endif /* TRACE_H */
@@ -6,6 +6,8 @@
  * University of Tennessee, Knoxville
  */
 
+#define _POSIX_C_SOURCE 200809L	/* fileno, fdatasync, posix_fallocate */
+
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
@@ -14,9 +16,13 @@
 #include <math.h>
 
 #include "_fs.h"
+#include "lz.h"
 
 #if defined(_WIN64) || defined(_WIN32)
 #include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
 #endif
 
 /* Type-agnostic way to print the binary data of a struct */
@@ -28,20 +34,18 @@ char* fs_responses[6]		= {	"OK", "General Error", "Directory exists",
 					"An inode was not found on disk",
 					"Too few arguments" };
 
-const char* fname = "fs";		/* The name our filesystem will have on disk */
-block block_cache[MAXBLOCKS];		/* In-memory copies of blocks on disk */
-size_t stride;				/* The data field is smaller than BLKSIZE
+const size_t stride = sizeof(((struct block*)0)->data);
+					/* The data field is smaller than BLKSIZE
 					 * so our writes to disk are not BLKSIZE but rather 
 					 * BLKSIZE - sizeof(other fields in block struct) */
 block_t  rootblocks[] = { 0, 1, 2 };	/* Indices to the first blocks */
-FILE* fp = NULL;			/* Pointer to file storage */
-inode* attached_inodes[MAXBLOCKS];	/* inodes that are already loaded into memory */
+STATS_THREAD io_counts fs_io;		/* Disk traffic so far by the calling thread, on any image */
 
 /* Close the filesystem file if is was open */
-static void _safeclose() {
-	if (NULL != fp)
-		fclose(fp);
-	fp = NULL;
+static void _safeclose(filesystem* fs) {
+	if (NULL != fs->fp)
+		fclose(fs->fp);
+	fs->fp = NULL;
 }
 
 static int _isNumeric(char* str) {
@@ -55,12 +59,12 @@ static int _isNumeric(char* str) {
 }
 
 /* Open the filesystem file and check for NULL */
-static void _safeopen(const char* fname, char* mode) {
-	_safeclose();	/* Close whatever was already open */
+static void _safeopen(filesystem* fs, char* mode) {
+	_safeclose(fs);	/* Close whatever was already open */
 
-	fp = fopen(fname, mode);
-	if (NULL == fp) {
-		//printf("fopen: \"%s\" %s\n", fname, strerror(errno));
+	fs->fp = fopen(fs->fname, mode);
+	if (NULL == fs->fp) {
+		//printf("fopen: \"%s\" %s\n", fs->fname, strerror(errno));
 		return;
 	}
 }
@@ -68,2174 +72,6736 @@ static void _safeopen(const char* fname, char* mode) {
 /* If fields of an fs_path are { "a", "b", "c"},
  * Then the string representing the path is "/a/b/c" */
 static fs_path* _newPath() {
-	uint i = 0;
 	fs_path* path = (fs_path*)malloc(sizeof(fs_path));
+	if (NULL == path) return NULL;
 
-	for (i = 0; i < FS_MAXPATHFIELDS; i++) {
-		path->fields[i] = (char*)malloc(FS_NAMEMAXLEN);
-		memset(path->fields[i], 0, FS_NAMEMAXLEN);
-	}
-
+	path->fields = NULL;		/* Allocated as fields are added, see _pathGrow */
 	path->nfields = 0;
+	path->maxfields = 0;
 	path->firstField = 0;
 
 	return path;
 }
 
 static void _pathFree(fs_path* p) {
-	uint i;
+	size_t i;
 	if (NULL == p) return;
 
-	for (i = 0; i < FS_MAXPATHFIELDS; i++)
+	for (i = 0; i < p->maxfields; i++)
 		free(p->fields[i]);
+	free(p->fields);
 	free(p);
 }
 
+/* Make room for one more field in @param p */
+static int _pathGrow(fs_path* p) {
+	size_t i, cap;
+	char** grown;
+
+	if (p->nfields < p->maxfields) return FS_OK;
+
+	cap = p->maxfields ? 2*p->maxfields : FS_PATHFIELDS_MIN;
+	grown = (char**)realloc(p->fields, cap*sizeof(char*));
+	if (NULL == grown) return FS_ERR;
+	p->fields = grown;
+
+	for (i = p->maxfields; i < cap; i++) {
+		p->fields[i] = (char*)calloc(1, FS_NAMEMAXLEN);
+		if (NULL == p->fields[i]) break;
+	}
+	p->maxfields = i;
+	return p->nfields < p->maxfields ? FS_OK : FS_ERR;
+}
+
+/* Add the field of @param len chars at @param name to the end of @param p.
+ * Names longer than FS_NAMEMAXLEN-1 are cut short. */
+static int _pathPush(fs_path* p, const char* name, size_t len) {
+	if (FS_ERR == _pathGrow(p)) return FS_ERR;
+
+	len = min(len, FS_NAMEMAXLEN-1);
+	memcpy(p->fields[p->nfields], name, len);
+	p->fields[p->nfields][len] = '\0';
+	p->nfields++;
+	return FS_OK;
+}
+
 /* Split a string on delimiter(s) */
 static fs_path* _tokenize(const char* str, const char* delim) {
-	size_t i = 0;
-	char* next_field	= NULL;
+	const char* next_field = str;
 	size_t len;
-	char* str_cpy;
 	fs_path* path;
 
 	if (NULL == str || '\0' == str[0]) return NULL;
 
-	len = strlen(str);
-	str_cpy = (char*)malloc(sizeof(char) * len + 1);
 	path = _newPath();
-	
-	// Copy the input because strtok replaces delimieter with '\0'
-	strncpy(str_cpy, str, min(FS_NAMEMAXLEN-1, len+1));	
-	str_cpy[len] = '\0';
+	if (NULL == path) return NULL;
 
-	// Split the path on delim
-	next_field = strtok(str_cpy, delim);
-	while (NULL != next_field) {
-
-		i = path->nfields;
-		len = strlen(next_field);
-		
-		strncpy(path->fields[i], next_field, min(FS_NAMEMAXLEN-1, len+1));	
-		path->fields[i][len] = '\0';
-
-		if (path->nfields + 1 == FS_MAXPATHFIELDS)
-			break;
+	/* Take the fields straight from @param str, between runs of delimiters */
+	while ('\0' != *next_field) {
+		next_field += strspn(next_field, delim);
+		len = strcspn(next_field, delim);
+		if (0 == len) break;
 
-		next_field = strtok(NULL, delim);
-		path->nfields++;
+		if (FS_ERR == _pathPush(path, next_field, len)) {
+			_pathFree(path);
+			return NULL;
+		}
+		next_field += len;
 	}
 
-	free(str_cpy);
 	return path;
 }
 
-/* Synchronize on-disk copies of the free block map,
- * free inode map, and superblock within-memory copies */
-static int _sync(filesystem* fs) {
-	int status[4] = { 0 };
-	int i;
-
-	status[0] = _fs.writeblocks( &fs->fb_map,	&rootblocks[0],		1,			sizeof(map));		/* Write block map to disk */
-	status[1] = _fs.writeblocks( &fs->ino_map,	&rootblocks[1],		1,			sizeof(map));		/* Write inode map to disk */
-	status[2] = _fs.writeblocks( &fs->sb_i,	&rootblocks[2],		1,			sizeof(superblock_i));	/* Write superblock info to disk */
-	status[3] = _fs.writeblocks( &fs->sb,	fs->sb_i.blocks,	fs->sb_i.nblocks,	sizeof(superblock));	/* Write superblock to disk */
-
-	for (i = 0; i < 4; i++)
-		if (FS_ERR == status[i])
+/* Write the parts of @param source that changed since they were last
+ * written, according to the copy in @param ondisk, which is then updated.
+ * Arguments are as for writeblocks. */
+static int _sync_changed(filesystem* fs, void* source, void* ondisk, block_t* blocks, size_t numblocks, size_t type_size) {
+	size_t i;
+	size_t offset;
+	size_t copysize;
+	block_t j;
+
+	/* A whole block is written directly */
+	if (BLKSIZE == type_size) {
+		if (0 == memcmp(source, ondisk, type_size))
+			return FS_OK;
+		if (FS_ERR == _fs.writeblock(fs, blocks[0], type_size, source))
 			return FS_ERR;
-	return FS_OK;
-}
-
-/* Read from disk the inode to which @param num refers. */
-static inode* _inode_load(filesystem* fs, inode_t num) {
-	inode* ino = NULL;
-	inode* tmp_ino;
-	block_t first_block_num;
+		memcpy(ondisk, source, type_size);
+		return FS_OK;
+	}
 
-	if (NULL != attached_inodes[num])
-		return attached_inodes[num];
-	
-	/* Need to read disk block into tmp inode and copy into real inode 
-	 * to prevent old garbage from being read into volatile structures */
-	tmp_ino = NULL;
+	for (i = 0; i < numblocks; i++) {
+		j = blocks[i];
+		if (0 == j) break;
 
-	if (NULL == fs) return NULL;
-	if (MAXBLOCKS <= num) return NULL;	/* Sanity check */
+		offset = i*stride;
+		copysize = i+1 == numblocks ? type_size % stride : stride;	/* Last chunk may only be a partial block */
 
-	first_block_num = fs->sb.inode_first_blocks[num];
+		if (0 == memcmp(&((char*)source)[offset], &((char*)ondisk)[offset], copysize))
+			continue;	/* Clean */
 
-	if (0 == first_block_num)
-		return NULL;			/* An inode of 0 does not exist on disk */
+		fs->block_cache[j].num = j;
+		fs->block_cache[j].next = i+1 == numblocks ? 0 : blocks[i+1];
+		memcpy(fs->block_cache[j].data, &((char*)source)[offset], copysize);
 
-	ino = _fs._new_inode();
-	tmp_ino = _fs._new_inode();
-	
-	/* Load the block(s) for the inode itself */
-	if (FS_ERR == 
-		_fs.readirectblocks(	tmp_ino, &first_block_num,
-					sizeof(inode)/stride + 1,
-					sizeof(inode))	) 
-	{
-		/* If the disk read failed */
-		if (NULL != tmp_ino) {
-			_fs._free_inode(tmp_ino);
-			
-			if (NULL != ino)
-				_fs._free_inode(ino);
-		}
-		return NULL;
+		if (FS_ERR == _fs.writeblock(fs, j, BLKSIZE, &fs->block_cache[j]))
+			return FS_ERR;
+		memcpy(&((char*)ondisk)[offset], &((char*)source)[offset], copysize);
 	}
 
-	ino->num = tmp_ino->num;
-	ino->nblocks = tmp_ino->nblocks;
-	ino->ndatablocks = tmp_ino->ndatablocks;
-	ino->size = tmp_ino->size;
-	ino->nlinks = tmp_ino->nlinks;
-	ino->ninoblocks = tmp_ino->ninoblocks;
-	ino->mode = tmp_ino->mode;
-	ino->v_attached = 0;
-	
-	ino->data = tmp_ino->data;
-	memcpy(ino->blocks, tmp_ino->blocks, MAXFILEBLOCKS*sizeof(block_t));
-	
-	tmp_ino->ndatablocks = 0;
-	_fs._free_inode(tmp_ino);
-	
-	attached_inodes[num] = ino;
-	return ino;
+	return FS_OK;
 }
 
-/* Write an inode to disk and free its associated memory */
-static int _inode_unload(filesystem* fs, inode* ino) {
-	int retv = FS_OK;
-	
-	if (NULL == ino) return FS_ERR;
-		
-	if (FS_ERR == _fs.write_commit(fs, ino))
-		return FS_ERR;
-
-	if (ino->v_attached) {
-		if (FS_ERR == _fs._v_detach(fs, ino)) {
-			retv = FS_ERR;
-		}
-	}
+/* Synchronize on-disk copies of the free block map,
+ * free inode map, and superblock within-memory copies.
+ * Only the blocks that changed since the last sync are written. */
+static int __sync(filesystem* fs) {
+	int status[5] = { 0 };
+	int i;
 
-	attached_inodes[ino->num] = NULL;
-	_fs._free_inode(ino);
-	ino = NULL;
+	status[0] = _sync_changed(fs, &fs->fb_map,	&fs->ondisk.fb_map,	&rootblocks[0],		1,			sizeof(map));		/* Write block map to disk */
+	status[1] = _sync_changed(fs, &fs->ino_map,	&fs->ondisk.ino_map,	&rootblocks[1],		1,			sizeof(map));		/* Write inode map to disk */
+	status[2] = _sync_changed(fs, &fs->sb_i,	&fs->ondisk.sb_i,	&rootblocks[2],		1,			sizeof(superblock_i));	/* Write superblock info to disk */
+	status[3] = _sync_changed(fs, &fs->sb,	&fs->ondisk.sb,		fs->sb_i.blocks,	fs->sb_i.nblocks,	sizeof(superblock));	/* Write superblock to disk */
+	if (NULL != fs->dedup)
+		status[4] = _sync_changed(fs, fs->dedup, fs->ondisk.dedup, fs->sb_i.dedup_blocks, FS_DEDUPBLOCKS, sizeof(dedup_table));	/* Write dedup table to disk */
 
-	return retv;
+	for (i = 0; i < 5; i++)
+		if (FS_ERR == status[i])
+			return FS_ERR;
+	return FS_OK;
 }
 
-/* Free the index of an inode and its malloc'd memory
- * @param blk pointer to the block to free
- * Returns FS_OK on success, FS_ERR if the blockv*/
-static int _ifree(filesystem* fs, inode_t num) {
-	if (NULL == fs) return FS_ERR;
+/* __sync, timed for stats */
+static int _sync(filesystem* fs) {
+	uint64_t t;
+	int retv;
 
-	if (0x0 == fs->fb_map.data[num])
-		return FS_ERR;	/* Block already free */
+	/* A batch is synced once, at the end of its commit */
+	if (FS_BATCH_OFF != fs->batch.state) return FS_OK;
 
-	--fs->ino_map.data[num];
-	fs->sb.free_inodes_base = num;
+	t = stats_now();
+	retv = __sync(fs);
 
-	if (FS_ERR == _sync(fs))
-		return FS_ERR;
+	stats_record(ST_SYNC, t);
+	return retv;
+}
 
+/* Push everything written to the filesystem file through to the disk */
+static int _fdatasync(filesystem* fs) {
+	if (NULL == fs->fp) return FS_ERR;
+	if (0 != fflush(fs->fp)) return FS_ERR;
+#if defined(_WIN64) || defined(_WIN32)
+	if (0 != _commit(_fileno(fs->fp))) return FS_ERR;
+#else
+	if (0 != fdatasync(fileno(fs->fp))) return FS_ERR;
+#endif
 	return FS_OK;
 }
 
-/* Find an unused inode number and return it */
-static int _ialloc(filesystem *shfs) {
-	uint i, blockidx, blockval;
+/* Write all dirty state as one ordered sequence and make it durable.
+ * File data goes first, so no inode on disk points at unwritten blocks,
+ * then the inodes, then the maps and superblock, then one fdatasync. */
+static int _flush(filesystem* fs) {
+	inode_t i;
+	inode* ino;
+	int status = FS_OK;
 
-	for (i = shfs->sb.free_inodes_base; i < MAXINODES; i++)
-	{
-		blockidx = i/255;	/* max int value of char */
-		blockval = (int)shfs->ino_map.data[blockidx];
-		if (blockval < 255) {		// If this char is not full 
-			((shfs->ino_map).data)[blockidx]++;
-			shfs->sb.free_inodes_base++;
+	if (NULL == fs) return FS_ERR;
 
-			if (FS_ERR == _sync(shfs))
-				return FS_ERR;
+	/* Removed files are not written, and their space is free once this is done */
+	while (0 < _fs._reclaim_step(fs, MAXBLOCKS));
 
-			return shfs->sb.free_inodes_base;
-		}
-	}
-	return 0;
-}
+	for (i = 0; i < MAXINODES; i++) {
+		ino = fs->attached_inodes[i];
+		if (NULL == ino || FS_FILE != ino->mode) continue;
 
-/* Free the index of a block and its malloc'd memory
- * @param blk pointer to the block to free
- * Returns FS_OK on success, FS_ERR if the block
- * was already free */
-static int _bfree(filesystem* fs, block* blk) {
-	if (NULL == fs) return FS_ERR;
-	if (NULL == blk) return FS_ERR;
+		if (FS_ERR == _fs._inode_alloc_delayed(fs, ino) || FS_ERR == _fs._inode_commit_data(fs, ino))
+			status = FS_ERR;
+	}
 
-	if (0x0 == fs->fb_map.data[blk->num])
-		return FS_ERR;	/* Block already free */
+	for (i = 0; i < MAXINODES; i++) {
+		ino = fs->attached_inodes[i];
+		if (NULL == ino || !ino->dirty) continue;
 
-	--fs->fb_map.data[blk->num];
-	fs->sb.free_blocks_base = blk->num;
-	free(blk);
+		if (FS_ERR == _fs._inode_store(fs, ino))
+			status = FS_ERR;
+	}
 
 	if (FS_ERR == _sync(fs))
-		return FS_ERR;
+		status = FS_ERR;
+	if (FS_ERR == _fdatasync(fs))
+		status = FS_ERR;
 
-	return FS_OK;
+	return status;
 }
 
-/* Traverse the free block array and return a block 
- * whose field num is the index of the first free bock */
-static int __balloc(filesystem* shfs) {
-	size_t i, blockidx, blockval;
+/* Make all changes so far durable. A caller that arrives while a commit
+ * is in flight waits for it, and then either finds its changes already
+ * covered or runs one commit on behalf of everyone who queued meanwhile. */
+static int _group_commit(filesystem* fs) {
+	uint64_t ticket;
+	int status;
 
-	/* One char in the free block map represents 
-	 * 8 blocks (sizeof(char) == 1 byte == 8 bits) */
-	
-	for (i = shfs->sb.free_blocks_base; i < MAXBLOCKS; i++)
-	{
-		blockidx = i/255;	/* max int value of char */
-		blockval = (int)shfs->fb_map.data[blockidx];
-		if (blockval < 255) {		// If this char is not full 
-			((shfs->fb_map).data)[blockidx]++;
-			shfs->sb.free_blocks_base++;
+	if (NULL == fs) return FS_ERR;
 
-			if (FS_ERR == _sync(shfs))
-				return FS_ERR;
+#if defined(_WIN64) || defined(_WIN32)	/* No threads to group; commit right away */
+	ticket = ++fs->commit.requested;
+	status = _flush(fs);
+	fs->commit.completed = ticket;
+	return status;
+#else
+	pthread_mutex_lock(&fs->commit.lock);
+	ticket = ++fs->commit.requested;
 
-			return (int)shfs->sb.free_blocks_base;
-		}
+	while (fs->commit.running)
+		pthread_cond_wait(&fs->commit.done, &fs->commit.lock);
+
+	/* The commit we waited on started after we asked; our changes are in it */
+	if (fs->commit.completed >= ticket) {
+		status = fs->commit.status;
+		pthread_mutex_unlock(&fs->commit.lock);
+		return status;
 	}
-	return FS_ERR;
-}
 
-/* Allocate @param count blocks if possible. Store indices in @param blocks */
-static int _mballoc(filesystem* fs, const size_t count, block_t* bindices) {
-	size_t i;
-	int j;
+	/* Lead a commit for every request so far */
+	fs->commit.running = true;
+	ticket = fs->commit.requested;
+	pthread_mutex_unlock(&fs->commit.lock);
 
-	//if (NULL != ino) 
-	//	bindices = ino->blocks;
+	status = _flush(fs);
 
-	for (i = 0; i < count; i++) {	// Allocate free blocks
-		j = __balloc(fs);
-		if (FS_ERR == j) return FS_ERR;
-		bindices[i] = (block_t)j;
-	}
+	pthread_mutex_lock(&fs->commit.lock);
+	fs->commit.completed = ticket;
+	fs->commit.status = status;
+	fs->commit.running = false;
+	pthread_cond_broadcast(&fs->commit.done);
+	pthread_mutex_unlock(&fs->commit.lock);
 
-	return FS_OK;
+	return status;
+#endif
 }
 
-/* Create a and zero-out a new on-disk directory entry
- * @param alloc_inode specifies whether this directory
- * gets allocated an inode, else inode 0 is given.
- * @param name the new directory name.
- */
-static dent* _newd(filesystem* fs, const int alloc_inode, const char* name) {
-	dent* d = NULL;
-	d = (dent*)malloc(sizeof(dent));
-
-	if (alloc_inode)
-		d->ino = (inode_t)_ialloc(fs);
-	else d->ino = 0;
-
-	d->parent	= d->ino;
-	d->next		= d->ino;
-	d->prev		= d->ino;
-	d->head		= 0;
-	d->tail		= 0;
-	d->ndirs	= 0;
-	d->nfiles	= 0;
-	d->nlinks	= 0;
+/* Hash of a directory entry name. Never 0, which stands for not known yet. */
+static uint32_t _name_hash(const char* name) {
+	uint32_t h = 2166136261u;		/* FNV-1a */
 
-	memset(d->files, 0, sizeof(d->files));				// Zero-out
-	memset(d->links, 0, sizeof(d->links));				// Zero-out
+	while ('\0' != *name) {
+		h ^= (uint8_t)*name++;
+		h *= 16777619u;
+	}
+	return 0 == h ? 1 : h;
+}
 
-	// Copy name
-	strncpy(d->name, name, min(FS_NAMEMAXLEN-1, strlen(name)+1));
-	d->name[FS_NAMEMAXLEN-1] = '\0';
+/* Make room for @param n entries in @param nums, @param hashes and
+ * @param seqs, which have room for @param max. New slots are 0. */
+static int _dent_grow(inode_t** nums, uint32_t** hashes, uint32_t** seqs, size_t* max, size_t n) {
+	size_t cap;
+	void* grown;
+
+	if (n <= *max) return FS_OK;
+	for (cap = *max ? *max : FS_DIRENTS_MIN; cap < n; cap *= 2);
+
+	grown = realloc(*nums, cap*sizeof(inode_t));
+	if (NULL == grown) return FS_ERR;
+	*nums = (inode_t*)grown;
+	grown = realloc(*hashes, cap*sizeof(uint32_t));
+	if (NULL == grown) return FS_ERR;
+	*hashes = (uint32_t*)grown;
+	grown = realloc(*seqs, cap*sizeof(uint32_t));
+	if (NULL == grown) return FS_ERR;
+	*seqs = (uint32_t*)grown;
+
+	memset(&(*nums)[*max], 0, (cap - *max)*sizeof(inode_t));
+	memset(&(*hashes)[*max], 0, (cap - *max)*sizeof(uint32_t));
+	memset(&(*seqs)[*max], 0, (cap - *max)*sizeof(uint32_t));
+	*max = cap;
+	return FS_OK;
+}
 
-	return d;
+/* Make room for @param ndirs subdirectories, @param nfiles files and
+ * @param nlinks links in @param d */
+static int _dent_reserve(dent* d, size_t ndirs, size_t nfiles, size_t nlinks) {
+	if (FS_ERR == _dent_grow(&d->dirs, &d->dhash, &d->dseq, &d->maxdirs, ndirs) ||
+		FS_ERR == _dent_grow(&d->files, &d->fhash, &d->fseq, &d->maxfiles, nfiles) ||
+		FS_ERR == _dent_grow(&d->links, &d->lhash, &d->lseq, &d->maxlinks, nlinks))
+		return FS_ERR;
+	return FS_OK;
 }
 
-/* Create and zero-out an in-memory directory entry 
- * @param alloc_inode specifies whether this directory
- * gets allocated an inode, else inode 0 is given.
- * @param name the new directory name
- */
-static dentv* _newdv(filesystem* fs, const int alloc_inode, const char* name) {
-	dent*	d	= NULL;
-	dentv*	dv	= NULL;
+/* Drop the index of @param d. _dir_fit builds it again if it is needed. */
+static void _dent_index_drop(dent* d) {
+	free(d->index);
+	d->index = NULL;
+	d->nbuckets = 0;
+}
 
-	dv		= (dentv*)	malloc(sizeof(dentv));
-	dv->ino		= (inode*)	malloc(sizeof(inode));
+/* Free the entries of @param d */
+static void _dent_free(dent* d) {
+	free(d->dirs);
+	free(d->files);
+	free(d->links);
+	free(d->dhash);
+	free(d->fhash);
+	free(d->lhash);
+	free(d->dseq);
+	free(d->fseq);
+	free(d->lseq);
+	d->dirs = d->files = d->links = NULL;
+	d->dhash = d->fhash = d->lhash = NULL;
+	d->dseq = d->fseq = d->lseq = NULL;
+	d->maxdirs = d->maxfiles = d->maxlinks = 0;
+	_dent_index_drop(d);
+}
 
-	dv->files	= (inode**)	malloc(FS_MAXFILES*sizeof(inode*));
-	dv->links	= (inode**)	malloc(FS_MAXLINKS*sizeof(inode*));
+/* The entries of @param mode FS_DIR, FS_FILE or FS_LINK in @param d:
+ * their inodes, hashes and seqs. Returns where their count is. */
+static size_t* _dent_kind(dent* d, uint16_t mode, inode_t** nums, uint32_t** hashes, uint32_t** seqs) {
+	switch (mode) {
+		case FS_DIR:	*nums = d->dirs;  *hashes = d->dhash; *seqs = d->dseq; return &d->ndirs;
+		case FS_FILE:	*nums = d->files; *hashes = d->fhash; *seqs = d->fseq; return &d->nfiles;
+		default:	*nums = d->links; *hashes = d->lhash; *seqs = d->lseq; return &d->nlinks;
+	}
+}
 
-	memset(	dv->files, 0, FS_MAXFILES*sizeof(inode*));
-	memset(	dv->links, 0, FS_MAXLINKS*sizeof(inode*));
+/* Buckets the index of a directory of @param n entries is built with, about half full */
+static size_t _dent_nbuckets(size_t n) {
+	size_t nb = (2*n + FS_DIRSLOTS - 1) / FS_DIRSLOTS;
+	return 0 == nb ? 1 : nb;
+}
 
-	memset(	dv->ino->blocks, 0, sizeof(block_t)*MAXFILEBLOCKS);
-	memset(	dv->ino->directblocks, 0, sizeof(block_t)*NBLOCKS);
+/* Where in a table of @param nbuckets buckets an entry whose name
+ * hashes to @param hash is looked for first */
+static size_t _dent_home(uint32_t hash, size_t nbuckets) {
+	return (hash % nbuckets)*FS_DIRSLOTS + (hash / nbuckets) % FS_DIRSLOTS;
+}
 
-	dv->tail	= NULL;
-	dv->head	= NULL;
-	dv->parent	= NULL;
-	dv->next	= NULL;
-	dv->prev	= NULL;
+/* Put an entry in the first empty slot of its bucket in the table
+ * @param slots of @param nbuckets buckets. Returns the bucket, or -1
+ * if it is full. */
+static int _dent_slot_add(ddirent* slots, size_t nbuckets, uint32_t hash, uint32_t seq, inode_t num, uint16_t mode) {
+	size_t home = _dent_home(hash, nbuckets);
+	size_t base = home - home % FS_DIRSLOTS;
+	size_t j, s;
+
+	for (j = 0; j < FS_DIRSLOTS; j++) {
+		s = base + (home - base + j) % FS_DIRSLOTS;
+		if (0 != slots[s].ino) continue;
+
+		slots[s].hash = hash;
+		slots[s].seq = seq;
+		slots[s].ino = num;
+		slots[s].mode = mode;
+		return (int)(s / FS_DIRSLOTS);
+	}
+	return -1;
+}
 
-	dv->nfiles	= 0;
-	dv->ndirs	= 0;
-	dv->nlinks	= 0;
-	dv->ino->nlinks	= 0;
-	dv->ino->ninoblocks = (uint16_t) (sizeof(inode)/stride+1);	/* How many blocks the inode consumes */
-	dv->ino->ndatablocks=0;
-	dv->ino->nblocks= dv->ino->ninoblocks + dv->ino->ndatablocks;	/* How many blocks the inode data consumes */
-	dv->ino->size	= dv->ino->ninoblocks*BLKSIZE;
-	dv->ino->mode	= FS_DIR;
-	dv->ino->v_attached = 1;
+/* Take entry @param num of @param mode out of the table @param slots of
+ * @param nbuckets buckets. The entries after it in its bucket that would
+ * no longer be found past the gap move back into it. Returns the bucket,
+ * or -1 if the entry is not there. */
+static int _dent_slot_remove(ddirent* slots, size_t nbuckets, uint32_t hash, inode_t num, uint16_t mode) {
+	size_t home = _dent_home(hash, nbuckets);
+	size_t base = home - home % FS_DIRSLOTS;
+	size_t j, s, o, h, hole;
+
+	for (j = 0; j < FS_DIRSLOTS; j++) {
+		s = base + (home - base + j) % FS_DIRSLOTS;
+		if (0 == slots[s].ino) return -1;
+		if (num == slots[s].ino && mode == slots[s].mode) break;
+	}
+	if (FS_DIRSLOTS == j) return -1;
 
-	strncpy(dv->name, name, min(FS_NAMEMAXLEN-1, strlen(name)+1));
-	dv->name[FS_NAMEMAXLEN-1] = '\0';
+	hole = s - base;
+	memset(&slots[s], 0, sizeof(ddirent));
+	for (j = 1, o = (hole + 1) % FS_DIRSLOTS; j < FS_DIRSLOTS; j++, o = (o + 1) % FS_DIRSLOTS) {
+		if (0 == slots[base + o].ino) break;
 
-	d = _newd(fs, alloc_inode, name);
-	memcpy(&dv->ino->data.dir, d, sizeof(dent));
-	dv->ino->datav.dir = dv;
-	dv->ino->num = d->ino;
+		/* It stays if it is found from its home before reaching the gap */
+		h = _dent_home(slots[base + o].hash, nbuckets) - base;
+		if (hole <= o ? (hole < h && h <= o) : (hole < h || h <= o)) continue;
 
-	free(d);
-	return dv;
+		slots[base + hole] = slots[base + o];
+		memset(&slots[base + o], 0, sizeof(ddirent));
+		hole = o;
+	}
+	return (int)(base / FS_DIRSLOTS);
 }
 
-/* Create a new directory in the directory tree.
- * Sets up pointers (dentv) and indices (dent) for 
- * linked-list traversal. Writes new dent and
- * changed existing dents to disk. Calls _sync();
- */
-static dentv* _new_dir(filesystem *fs, dentv* parent, const char* name) {
-	dentv* dv = NULL;
-	inode* tail = NULL;
-	int makingRoot = 0;
+/* Put every entry of @param d in the empty table @param slots of
+ * @param nbuckets buckets. FS_ERR if a bucket overflows. */
+static int _dent_fill(dent* d, ddirent* slots, size_t nbuckets) {
+	static const uint16_t modes[3] = { FS_DIR, FS_FILE, FS_LINK };
+	inode_t* nums;
+	uint32_t* hashes;
+	uint32_t* seqs;
+	size_t i, k, n;
+
+	for (k = 0; k < 3; k++) {
+		n = *_dent_kind(d, modes[k], &nums, &hashes, &seqs);
+		for (i = 0; i < n; i++)
+			if (0 > _dent_slot_add(slots, nbuckets, hashes[i], seqs[i], nums[i], modes[k]))
+				return FS_ERR;
+	}
+	return FS_OK;
+}
 
-	/* We're making the root */
-	if (NULL == parent && !strcmp(name, "/")) 
-		makingRoot = 1;
+/* Build the index of @param d, all of whose hashes are known. A bucket
+ * that overflows makes it start again with twice the buckets. */
+static int _dent_index_build(dent* d) {
+	size_t nb = _dent_nbuckets(d->ndirs + d->nfiles + d->nlinks);
+	ddirent* slots;
 
-	/* Allocate a new inode number */
-	dv = _newdv(fs, true, name);
-	if (NULL == dv) return NULL;
+	_dent_index_drop(d);
+	for (;; nb *= 2) {
+		if (MAXFILEBLOCKS <= nb || UINT16_MAX < nb) return FS_ERR;
 
-	/* Allocate n blocks, tell us which we got */
-	if (FS_ERR == 
-		_mballoc(	fs, dv->ino->ninoblocks, 
-				dv->ino->blocks) ) 
-	{
-		free(dv);
-		return NULL;
+		slots = (ddirent*)calloc(nb*FS_DIRSLOTS, sizeof(ddirent));
+		if (NULL == slots) return FS_ERR;
+		if (FS_OK == _dent_fill(d, slots, nb)) break;
+		free(slots);
 	}
-		
-	fs->sb.inode_first_blocks[dv->ino->num] = dv->ino->blocks[0];
-	fs->sb.inode_block_counts[dv->ino->num] = dv->ino->nblocks;
+	d->index = slots;
+	d->nbuckets = nb;
+	return FS_OK;
+}
 
-	if (!makingRoot) {
-		if (NULL == parent) return NULL;
+/* Find the place *@param i among its kind of the next entry of @param mode
+ * in @param d whose name may hash to @param hash, going on from *@param step,
+ * which starts at 0. A directory with an index looks in one bucket; one
+ * without tries each entry whose hash is not known to differ. Returns
+ * false when there are no more. */
+static int _dent_next(dent* d, uint16_t mode, uint32_t hash, size_t* step, size_t* i) {
+	inode_t* nums;
+	uint32_t* hashes;
+	uint32_t* seqs;
+	size_t n = *_dent_kind(d, mode, &nums, &hashes, &seqs);
+	size_t home, base, lo, hi, mid;
+	const ddirent* e;
+
+	if (NULL == d->index) {
+		for (; *step < n; (*step)++)
+			if (0 == hashes[*step] || hash == hashes[*step]) {
+				*i = (*step)++;
+				return true;
+			}
+		return false;
+	}
 
-		/* If we need to load the tail (the last dir added to @param parent)*/
-		tail = parent->tail;	/* Try in memory */
-		if (NULL == tail || NULL == tail->datav.dir || !tail->v_attached) {
-			parent->ino->datav.dir->tail = 
-				_inode_load(fs, parent->ino->data.dir.tail); /* Try from disk */
-			tail = parent->ino->datav.dir->tail;
+	home = _dent_home(hash, d->nbuckets);
+	base = home - home % FS_DIRSLOTS;
+	while (*step < FS_DIRSLOTS) {
+		e = &d->index[base + (home - base + *step) % FS_DIRSLOTS];
+		if (0 == e->ino) break;
+		(*step)++;
+		if (hash != e->hash || mode != e->mode) continue;
+
+		/* The entries of a kind are in the order they were added */
+		for (lo = 0, hi = n; lo < hi; ) {
+			mid = (lo + hi) / 2;
+			if (seqs[mid] < e->seq) lo = mid + 1;
+			else hi = mid;
+		}
+		if (lo < n && e->ino == nums[lo]) {
+			*i = lo;
+			return true;
+		}
+	}
+	*step = FS_DIRSLOTS;
+	return false;
+}
 
-			if (NULL != tail)
-				tail->v_attached = 1;
+/* Make room for @param n inodes in @param v, which has room for @param max.
+ * New slots are NULL. */
+static int _dirv_grow(inode*** v, size_t* max, size_t n) {
+	size_t cap;
+	void* grown;
 
-		}
+	if (n <= *max) return FS_OK;
+	for (cap = *max ? *max : FS_DIRENTS_MIN; cap < n; cap *= 2);
 
-		/* Setup linked list pointers */
-		if (NULL == parent->head) { /* If it's the first entry here  */
+	grown = realloc(*v, cap*sizeof(inode*));
+	if (NULL == grown) return FS_ERR;
+	*v = (inode**)grown;
+	memset(&(*v)[*max], 0, (cap - *max)*sizeof(inode*));
+	*max = cap;
+	return FS_OK;
+}
 
-			parent->ino->data.dir.head = dv->ino->data.dir.ino;
-			dv->ino->data.dir.prev = dv->ino->data.dir.ino;
-			dv->ino->data.dir.next = dv->ino->data.dir.ino;
-			parent->ino->data.dir.tail = parent->ino->data.dir.head;
+/* Make room for @param ndirs subdirectories, @param nfiles files and
+ * @param nlinks links in directory @param dv, both in memory and in its
+ * dent. New slots of dv are NULL. */
+static int _dir_reserve(dentv* dv, size_t ndirs, size_t nfiles, size_t nlinks) {
+	if (FS_ERR == _dent_reserve(&dv->ino->data.dir, ndirs, nfiles, nlinks) ||
+		FS_ERR == _dirv_grow(&dv->dirs, &dv->maxdirs, ndirs) ||
+		FS_ERR == _dirv_grow(&dv->files, &dv->maxfiles, nfiles) ||
+		FS_ERR == _dirv_grow(&dv->links, &dv->maxlinks, nlinks))
+		return FS_ERR;
+	return FS_OK;
+}
 
-		} else {
+/* Add entry @param num of @param mode, whose name hashes to @param hash,
+ * at the end of its kind in directory @param ino, which has room for it.
+ * The index bucket it goes in is marked to be written. An index that
+ * would be more than three quarters full is dropped, for _dir_fit to
+ * build bigger. */
+static void _dir_add(inode* ino, uint16_t mode, inode_t num, uint32_t hash) {
+	dent* d = &ino->data.dir;
+	inode_t* nums;
+	uint32_t* hashes;
+	uint32_t* seqs;
+	size_t* n = _dent_kind(d, mode, &nums, &hashes, &seqs);
+	int b = -1;
+
+	nums[*n] = num;
+	hashes[*n] = hash;
+	seqs[*n] = d->nextseq++;
+	(*n)++;
+
+	if (NULL == d->index) return;
+	if (4*(d->ndirs + d->nfiles + d->nlinks) <= 3*d->nbuckets*FS_DIRSLOTS)
+		b = _dent_slot_add(d->index, d->nbuckets, hash, seqs[*n - 1], num, mode);
+	if (0 > b) _dent_index_drop(d);
+	else ino->dirtyblocks[1 + b] = true;
+}
 
-			dv->ino->data.dir.prev = parent->ino->data.dir.tail;
-			dv->ino->data.dir.next = parent->ino->data.dir.head;
+/* Bytes @param d takes on disk: a linear directory's header and entries,
+ * or a hashed one's header block and bucket blocks */
+static size_t _dent_disksize(dent* d) {
+	size_t n = d->ndirs + d->nfiles + d->nlinks;
 
-			if (NULL == tail) return NULL;
-			tail->data.dir.next = dv->ino->data.dir.ino;
-			parent->ino->data.dir.tail = dv->ino->data.dir.ino;
-			parent->head->data.dir.prev = dv->ino->data.dir.ino;
-		}
+	if (n <= FS_DIR_HASHMIN) return sizeof(ddent) + n*sizeof(inode_t);
+	return (1 + (NULL != d->index ? d->nbuckets : _dent_nbuckets(n)))*stride;
+}
 
-		parent->ndirs++;
-		parent->ino->data.dir.ndirs++;
+/* Write the header of @param d, of layout @param layout with @param nbuckets
+ * bucket blocks, to @param h */
+static void _dent_pack_header(dent* d, ddent* h, uint16_t layout, size_t nbuckets) {
+	memset(h, 0, sizeof(ddent));
+	h->ino = d->ino;
+	h->parent = d->parent;
+	h->layout = layout;
+	h->nbuckets = (uint16_t)nbuckets;
+	h->ndirs = (uint32_t)d->ndirs;
+	h->nfiles = (uint32_t)d->nfiles;
+	h->nlinks = (uint32_t)d->nlinks;
+	h->nextseq = d->nextseq;
+	memcpy(h->name, d->name, FS_NAMEMAXLEN);
+}
 
-		dv->parent = parent->ino;
-		dv->ino->data.dir.parent = parent->ino->num;
+/* Write @param d in its on-disk form to @param buf, @param nblocks blocks
+ * of stride bytes, zeroed. A hashed directory's buckets are built again
+ * from its entries, in the nblocks - 1 blocks after the header, and the
+ * hashes must all be known. FS_ERR if it does not fit. */
+static int _dent_pack(dent* d, char* buf, size_t nblocks) {
+	static const uint16_t modes[3] = { FS_DIR, FS_FILE, FS_LINK };
+	inode_t* nums = (inode_t*)&((ddent*)buf)[1];
+	inode_t* kind;
+	uint32_t* hashes;
+	uint32_t* seqs;
+	ddirent* slots;
+	size_t i, k, n, b;
+
+	if (d->ndirs + d->nfiles + d->nlinks <= FS_DIR_HASHMIN) {
+		if (sizeof(ddent) + (d->ndirs + d->nfiles + d->nlinks)*sizeof(inode_t) > nblocks*stride)
+			return FS_ERR;
 
-		/* Do the same setup for the in-memory version */
-		if (NULL == parent->head) {
-			parent->head = dv->ino;
-			dv->prev = dv->ino;
-			dv->next = dv->ino;
-			parent->tail = parent->head;
-		} else {
-			dv->prev = parent->tail;
-			dv->next = parent->head;
-			dv->prev->datav.dir->next = dv->ino;
-			parent->tail->datav.dir->next = dv->ino;	/* Updating the tail in-memory requires no disk write */
-			parent->tail = dv->ino;
-			parent->head->datav.dir->prev = parent->tail;
+		/* Subdirectories, files, then links, in FS_DIR, FS_FILE, FS_LINK order */
+		_dent_pack_header(d, (ddent*)buf, FS_DIR_LINEAR, 0);
+		for (k = 0; k < 3; k++) {
+			n = *_dent_kind(d, modes[k], &kind, &hashes, &seqs);
+			for (i = 0; i < n; i++)
+				*nums++ = kind[i];
 		}
-
-	} else {
-		/* Making root */
+		return FS_OK;
 	}
 
-	/* Update changes on disk */
-	if (!makingRoot) {
-		attached_inodes[parent->ino->num] = parent->ino;
-		_fs.writeblocks(parent->ino, parent->ino->blocks, parent->ino->ninoblocks, sizeof(inode));
-	}
-	_fs.writeblocks(dv->ino, dv->ino->blocks, dv->ino->ninoblocks, sizeof(inode));
-	if (NULL != tail) {
-		attached_inodes[tail->num] = tail;
-		_fs.writeblocks(tail, tail->blocks, tail->nblocks, sizeof(inode));
+	if (2 > nblocks) return FS_ERR;
+	slots = (ddirent*)calloc((nblocks - 1)*FS_DIRSLOTS, sizeof(ddirent));
+	if (NULL == slots) return FS_ERR;
+	if (FS_ERR == _dent_fill(d, slots, nblocks - 1)) {
+		free(slots);
+		return FS_ERR;
 	}
-	attached_inodes[dv->ino->num] = dv->ino;
-	
-	if (FS_ERR == _sync(fs))
-		return NULL;
 
-	return dv;
+	_dent_pack_header(d, (ddent*)buf, FS_DIR_HASHED, nblocks - 1);
+	for (b = 0; b + 1 < nblocks; b++)
+		memcpy(&buf[(b + 1)*stride], &slots[b*FS_DIRSLOTS], FS_DIRSLOTS*sizeof(ddirent));
+	free(slots);
+	return FS_OK;
 }
 
-static int _rmdir(filesystem* fs, dentv* dv) {
-	int onlysubdir = false;
+/* Order ddirents by seq */
+static int _cmp_ddirent_seq(const void* a, const void* b) {
+	uint32_t x = ((const ddirent*)a)->seq, y = ((const ddirent*)b)->seq;
 
-	if (NULL == dv) return FS_ERR;
+	return (x > y) - (x < y);
+}
 
-	/* Update parent head */
-	if (dv->parent->data.dir.head == dv->ino->num) {
+/* Fill @param d from its on-disk form in @param buf, @param len bytes.
+ * A hashed directory keeps its buckets as its index, and its entries
+ * are put back in the order they were added. */
+static int _dent_unpack(dent* d, const char* buf, size_t len) {
+	static const uint16_t modes[3] = { FS_DIR, FS_FILE, FS_LINK };
+	const ddent* h = (const ddent*)buf;
+	const inode_t* nums = (const inode_t*)&h[1];
+	ddirent* ents = NULL;
+	inode_t* kind;
+	uint32_t* hashes;
+	uint32_t* seqs;
+	size_t* count;
+	size_t i, k, n, b, m = 0;
+
+	memset(d, 0, sizeof(dent));
+	if (len < sizeof(ddent)) return FS_ERR;
+
+	n = (size_t)h->ndirs + h->nfiles + h->nlinks;
+	if (FS_DIR_LINEAR == h->layout && len < sizeof(ddent) + n*sizeof(inode_t))
+		return FS_ERR;
+	if (FS_DIR_HASHED == h->layout && (0 == h->nbuckets || len < (1 + (size_t)h->nbuckets)*stride ||
+		n > (size_t)h->nbuckets*FS_DIRSLOTS))
+		return FS_ERR;
+	if (FS_DIR_LINEAR != h->layout && FS_DIR_HASHED != h->layout)
+		return FS_ERR;
+
+	d->ino = h->ino;
+	d->parent = h->parent;
+	d->nextseq = h->nextseq;
+	memcpy(d->name, h->name, FS_NAMEMAXLEN);
+
+	if (FS_ERR == _dent_reserve(d, h->ndirs, h->nfiles, h->nlinks)) {
+		_dent_free(d);
+		return FS_ERR;
+	}
+
+	if (FS_DIR_LINEAR == h->layout) {
+		/* Only the inodes are kept. The order they are in is the order they were added. */
+		for (k = 0; k < 3; k++) {
+			count = _dent_kind(d, modes[k], &kind, &hashes, &seqs);
+			*count = 0 == k ? h->ndirs : 1 == k ? h->nfiles : h->nlinks;
+			for (i = 0; i < *count; i++, m++) {
+				kind[i] = nums[m];
+				seqs[i] = (uint32_t)m;
+			}
+		}
+		if (d->nextseq < n) d->nextseq = (uint32_t)n;
+		return FS_OK;
+	}
+
+	d->nbuckets = h->nbuckets;
+	d->index = (ddirent*)malloc(d->nbuckets*FS_DIRSLOTS*sizeof(ddirent));
+	ents = (ddirent*)malloc((n + 1)*sizeof(ddirent));
+	if (NULL == d->index || NULL == ents) {
+		free(ents);
+		_dent_free(d);
+		return FS_ERR;
+	}
+	for (b = 0; b < d->nbuckets; b++)
+		memcpy(&d->index[b*FS_DIRSLOTS], &buf[(b + 1)*stride], FS_DIRSLOTS*sizeof(ddirent));
+
+	for (i = 0; i < d->nbuckets*FS_DIRSLOTS && m <= n; i++)
+		if (0 != d->index[i].ino) ents[m++] = d->index[i];
+	if (m != n) {
+		free(ents);
+		_dent_free(d);
+		return FS_ERR;
+	}
+
+	/* Each kind in the order its entries were added */
+	qsort(ents, n, sizeof(ddirent), _cmp_ddirent_seq);
+	for (i = 0; i < n; i++) {
+		if (FS_DIR != ents[i].mode && FS_FILE != ents[i].mode && FS_LINK != ents[i].mode)
+			break;
+		count = _dent_kind(d, ents[i].mode, &kind, &hashes, &seqs);
+		if (*count == (FS_DIR == ents[i].mode ? h->ndirs : FS_FILE == ents[i].mode ? h->nfiles : h->nlinks))
+			break;		/* More of this kind than the header says */
+		kind[*count] = ents[i].ino;
+		hashes[*count] = ents[i].hash;
+		seqs[*count] = ents[i].seq;
+		(*count)++;
+		if (d->nextseq <= ents[i].seq) d->nextseq = ents[i].seq + 1;
+	}
+	free(ents);
+	if (i < n) {
+		_dent_free(d);
+		return FS_ERR;
+	}
+	return FS_OK;
+}
+
+/* Prefetch the entries of @param nums whose hash in @param hashes is
+ * @param hash or not known yet, the ones a lookup of a name with that
+ * hash would have to load. A @param hash of 0 takes only the unknown. */
+static void _prefetch_matching(filesystem* fs, const inode_t* nums, const uint32_t* hashes, size_t count, uint32_t hash) {
+	inode_t* cand;
+	size_t i, n;
+
+	if (2 > count) return;
+	cand = (inode_t*)malloc(count*sizeof(inode_t));
+	if (NULL == cand) return;
+
+	for (i = 0, n = 0; i < count; i++)
+		if (0 == hashes[i] || hash == hashes[i])
+			cand[n++] = nums[i];
+	_fs._inode_prefetch(fs, cand, n);
+	free(cand);
+}
+
+/* Give directory @param ino the data blocks its dent needs on disk,
+ * adding blocks at the end or giving back the ones it no longer uses.
+ * A directory about to be hashed gets the hashes of the names it
+ * does not know yet, and its index, all of which is to be written. */
+static int _dir_fit(filesystem* fs, inode* ino) {
+	dent* d = &ino->data.dir;
+	size_t i, need;
+	inode* child;
+
+	if (d->ndirs + d->nfiles + d->nlinks <= FS_DIR_HASHMIN) {
+		if (NULL != d->index) _dent_index_drop(d);
+	} else if (NULL == d->index) {
+		_prefetch_matching(fs, d->dirs, d->dhash, d->ndirs, 0);
+		_prefetch_matching(fs, d->files, d->fhash, d->nfiles, 0);
+		_prefetch_matching(fs, d->links, d->lhash, d->nlinks, 0);
+		for (i = 0; i < d->ndirs; i++) {
+			if (0 != d->dhash[i]) continue;
+			child = _fs._inode_load(fs, d->dirs[i]);
+			if (NULL == child) return FS_ERR;
+			d->dhash[i] = _name_hash(child->data.dir.name);
+		}
+		for (i = 0; i < d->nfiles; i++) {
+			if (0 != d->fhash[i]) continue;
+			child = _fs._inode_load(fs, d->files[i]);
+			if (NULL == child) return FS_ERR;
+			d->fhash[i] = _name_hash(child->data.file.name);
+		}
+		for (i = 0; i < d->nlinks; i++) {
+			if (0 != d->lhash[i]) continue;
+			child = _fs._inode_load(fs, d->links[i]);
+			if (NULL == child) return FS_ERR;
+			d->lhash[i] = _name_hash(child->data.link.name);
+		}
+		if (FS_ERR == _dent_index_build(d)) return FS_ERR;
+		memset(ino->dirtyblocks, true, 1 + d->nbuckets);
+	}
+
+	need = (_dent_disksize(d) + stride - 1) / stride;
+	if (MAXFILEBLOCKS < need) return FS_ERR;
+
+	if (need > ino->ndatablocks) {
+		if (FS_ERR == _fs._mballoc(fs, need - ino->ndatablocks, &ino->blocks[ino->ndatablocks]))
+			return FS_ERR;
+	} else if (need < ino->ndatablocks) {
+		_fs._mbfree(fs, ino->ndatablocks - need, &ino->blocks[need]);
+		memset(&ino->blocks[need], 0, (ino->ndatablocks - need)*sizeof(block_t));
+	} else return FS_OK;
+
+	ino->nblocks = ino->nblocks - ino->ndatablocks + need;
+	ino->ndatablocks = need;
+	ino->size = need*BLKSIZE;
+	return FS_OK;
+}
+
+/* Write block @param i of directory @param ino, @param data, stride bytes */
+static int _dir_write_block(filesystem* fs, inode* ino, size_t i, const void* data) {
+	block_t k = ino->blocks[i];
+
+	fs->block_cache[k].num = k;
+	fs->block_cache[k].next = i+1 < ino->ndatablocks ? ino->blocks[i+1] : 0;
+	memcpy(fs->block_cache[k].data, data, stride);
+	return _fs.writeblock(fs, k, BLKSIZE, &fs->block_cache[k]);
+}
+
+/* Write the dent of directory @param ino through its data blocks, which
+ * _dir_fit has sized for it. A linear directory is written whole. A hashed
+ * one writes its header and the buckets entries went in or out of. */
+static int _dir_write(filesystem* fs, inode* ino) {
+	dent* d = &ino->data.dir;
+	size_t i;
+	char* buf;
+	int retv = FS_OK;
+
+	if (_dent_disksize(d) > ino->ndatablocks*stride) return FS_ERR;
+
+	if (NULL == d->index) {
+		buf = (char*)calloc(ino->ndatablocks, stride);
+		if (NULL == buf) return FS_ERR;
+		retv = _dent_pack(d, buf, ino->ndatablocks);
+
+		for (i = 0; i < ino->ndatablocks && FS_OK == retv; i++)
+			retv = _dir_write_block(fs, ino, i, &buf[i*stride]);
+		free(buf);
+	} else {
+		buf = (char*)calloc(1, stride);
+		if (NULL == buf) return FS_ERR;
+		_dent_pack_header(d, (ddent*)buf, FS_DIR_HASHED, d->nbuckets);
+
+		retv = _dir_write_block(fs, ino, 0, buf);
+		for (i = 1; i < ino->ndatablocks && FS_OK == retv; i++)
+			if (ino->dirtyblocks[i])
+				retv = _dir_write_block(fs, ino, i, &d->index[(i - 1)*FS_DIRSLOTS]);
+		free(buf);
+	}
+
+	if (FS_OK == retv) memset(ino->dirtyblocks, false, ino->ndatablocks);
+	return retv;
+}
+
+/* Drop the blocks _inode_prefetch read ahead */
+static void _prefetch_done(filesystem* fs) {
+	free(fs->prefetch.blocks);
+	free(fs->prefetch.data);
+	fs->prefetch.blocks = NULL;
+	fs->prefetch.data = NULL;
+	fs->prefetch.n = 0;
+}
+
+/* The copy of block @param b that _inode_prefetch read ahead, NULL if none */
+static block* _prefetched(filesystem* fs, block_t b) {
+	size_t lo = 0, hi = fs->prefetch.n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (fs->prefetch.blocks[mid] < b) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo < fs->prefetch.n && b == fs->prefetch.blocks[lo] ? &fs->prefetch.data[lo] : NULL;
+}
+
+/* Read the dent of directory @param ino from its data blocks */
+static int _dir_read(filesystem* fs, inode* ino) {
+	size_t i;
+	block_t k;
+	block* pre;
+	char* buf;
+	int retv = FS_OK;
+
+	memset(&ino->data.dir, 0, sizeof(dent));
+	if (0 == ino->ndatablocks) return FS_ERR;
+
+	buf = (char*)malloc(ino->ndatablocks*stride);
+	if (NULL == buf) return FS_ERR;
+
+	for (i = 0; i < ino->ndatablocks && FS_OK == retv; i++) {
+		k = ino->blocks[i];
+		if (0 == k || MAXBLOCKS <= k) retv = FS_ERR;
+		else if (NULL != (pre = _prefetched(fs, k)))
+			memcpy(&buf[i*stride], pre->data, stride);
+		else if (FS_OK == (retv = _fs.readblock(fs, &fs->block_cache[k], k)))
+			memcpy(&buf[i*stride], fs->block_cache[k].data, stride);
+	}
+	if (FS_OK == retv)
+		retv = _dent_unpack(&ino->data.dir, buf, ino->ndatablocks*stride);
+
+	free(buf);
+	return retv;
+}
+
+/* Return the on-disk inode @param num in its inode table block.
+ * The table block is read into the block cache once and stays there. */
+static dinode* _itable_slot(filesystem* fs, inode_t num) {
+	block_t b;
+
+	if (NULL == fs) return NULL;
+	if (MAXINODES <= num) return NULL;	/* Sanity check */
+
+	b = fs->sb.inode_table[num / FS_INODES_PER_BLOCK];
+	if (0 == b) return NULL;		/* No inode table block for this inode yet */
+
+	if (!fs->block_cache_valid[b]) {
+		stats_count(SC_ITABLE_MISSES, 1);
+		if (FS_ERR == _fs.readblock(fs, &fs->block_cache[b], b))
+			return NULL;
+		fs->block_cache_valid[b] = true;
+	} else stats_count(SC_ITABLE_HITS, 1);
+
+	return &((dinode*)&fs->block_cache[b])[num % FS_INODES_PER_BLOCK];
+}
+
+/* Read from disk the inode to which @param num refers. */
+static inode* __inode_load(filesystem* fs, inode_t num) {
+	inode* ino = NULL;
+	dinode* di = NULL;
+	extent* ext = NULL;
+	extent xext[FS_NEXTENTS + FS_XEXTENTS];
+	size_t i, j, n;
+
+	if (NULL == fs) return NULL;
+	if (MAXBLOCKS <= num) return NULL;	/* Sanity check */
+
+	if (0 == fs->sb.inode_first_blocks[num])
+		return NULL;			/* The inode does not exist on disk */
+
+	di = _itable_slot(fs, num);
+	if (NULL == di || num != di->num)
+		return NULL;
+
+	ino = _fs._new_inode();
+
+	ino->num = di->num;
+	ino->ndatablocks = di->ndatablocks;
+	ino->xblock = di->xblock;
+	ino->nblocks = ino->ndatablocks - di->nholes + (0 != ino->xblock);
+	ino->size = di->size;
+	ino->nlinks = di->nlinks;
+	ino->mode = di->mode;
+	ino->flags = di->flags;
+	ino->v_attached = 0;
+	ino->dirty = false;
+
+	/* Stored compressed: the extents are of the frames, not the data blocks */
+	if (ino->flags & FS_ZSTORED) {
+		ino->nzblocks = di->ndatablocks;
+		ino->ndatablocks = di->nzdata;
+		ino->nzdata = di->nzdata;
+		ino->zblocks = (block_t*)calloc(MAXFILEBLOCKS + 1, sizeof(block_t));
+		if (NULL == ino->zblocks || ino->nzblocks > MAXFILEBLOCKS + 1) {
+			_fs._free_inode(ino);
+			return NULL;
+		}
+	}
+
+	/* Expand the extents into the list of data blocks */
+	if (0 == di->nextents)
+		memcpy(ino->idata, di->u.idata, FS_INLINEDATA);
+	else {
+		ext = di->u.ext;
+		if (di->nextents > FS_NEXTENTS) {
+			memcpy(xext, di->u.ext, FS_NEXTENTS*sizeof(extent));
+			if (FS_ERR == _fs.readblock(fs, &xext[FS_NEXTENTS], ino->xblock)) {
+				_fs._free_inode(ino);
+				return NULL;
+			}
+			ext = xext;
+		}
+
+		if (ino->flags & FS_ZSTORED)
+			for (i = 0, n = 0; i < di->nextents; i++)
+				for (j = 0; j < ext[i].len && n < ino->nzblocks; j++)
+					ino->zblocks[n++] = (block_t)(ext[i].start + j);
+		else
+			for (i = 0, n = 0; i < di->nextents; i++)
+				for (j = 0; j < ext[i].len && n < MAXFILEBLOCKS; j++)
+					ino->blocks[n++] = 0 == ext[i].start ? 0 : (block_t)(ext[i].start + j);
+	}
+
+	switch (ino->mode) {
+		case FS_FILE:
+		{
+			ino->data.file.ino = ino->num;
+			ino->data.file.parent = di->parent;
+			memcpy(ino->data.file.name, di->name, FS_NAMEMAXLEN);
+			break;
+		}
+		case FS_DIR:
+		{
+			/* The directory contents are in its data blocks */
+			if (FS_ERR == _dir_read(fs, ino)) {
+				_fs._free_inode(ino);
+				return NULL;
+			}
+			break;
+		}
+		case FS_LINK:
+		{
+			ino->data.link.ino = ino->num;
+			ino->data.link.parent = di->parent;
+			ino->data.link.dest = di->dest;
+			ino->data.link.mode = di->destmode;
+			memcpy(ino->data.link.name, di->name, FS_NAMEMAXLEN);
+			break;
+		}
+	}
+
+	fs->attached_inodes[num] = ino;
+	return ino;
+}
+
+/* The inode numbered @param num, from memory if it is attached, 
+ * else read from disk. Counted and timed for stats. */
+static inode* _inode_load(filesystem* fs, inode_t num) {
+	uint64_t t;
+	inode* ino;
+
+	if (MAXBLOCKS <= num) return NULL;	/* Sanity check */
+
+	if (NULL != fs->attached_inodes[num]) {
+		stats_count(SC_INODE_HITS, 1);
+		return fs->attached_inodes[num];
+	}
+	stats_count(SC_INODE_MISSES, 1);
+
+	t = stats_now();
+	ino = __inode_load(fs, num);
+	stats_record_args(ST_INODE_LOAD, t, -1, (long)num);
+	return ino;
+}
+
+/* Sort the keys and block numbers of _inode_prefetch */
+static int _cmp_prefetch_key(const void* a, const void* b) {
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Read ahead, in block order, the data blocks of the directories among
+ * the @param nkeys inodes of _inode_prefetch, whose table blocks are in
+ * block_cache by now, into fs->prefetch. Directories whose extents spill
+ * out of the dinode are left to be read as they load. */
+static void _prefetch_dents(filesystem* fs, const uint32_t* keys, size_t nkeys) {
+	uint32_t* found = NULL;
+	size_t i, j, e, n = 0, max = 0;
+	inode_t num;
+	dinode* di;
+	void* grown;
+
+	for (i = 0; i < nkeys; i++) {
+		num = (inode_t)(keys[i] & 0xffff);
+		if (!fs->block_cache_valid[keys[i] >> 16]) continue;
+		di = &((dinode*)&fs->block_cache[keys[i] >> 16])[num % FS_INODES_PER_BLOCK];
+		if (num != di->num || FS_DIR != di->mode || (di->flags & FS_ZSTORED) || FS_NEXTENTS < di->nextents)
+			continue;
+
+		for (e = 0; e < di->nextents; e++)
+			for (j = 0; j < di->u.ext[e].len && 0 != di->u.ext[e].start; j++) {
+				if (n == max) {
+					max = 0 == max ? 64 : 2*max;
+					grown = realloc(found, max*sizeof(uint32_t));
+					if (NULL == grown) {
+						free(found);
+						return;
+					}
+					found = (uint32_t*)grown;
+				}
+				found[n++] = di->u.ext[e].start + (uint32_t)j;
+			}
+	}
+	if (0 == n) return;
+
+	qsort(found, n, sizeof(uint32_t), _cmp_prefetch_key);
+	fs->prefetch.blocks = (block_t*)malloc(n*sizeof(block_t));
+	fs->prefetch.data = (block*)malloc(n*sizeof(block));
+	if (NULL == fs->prefetch.blocks || NULL == fs->prefetch.data) {
+		free(found);
+		_prefetch_done(fs);
+		return;
+	}
+	for (i = 0, j = 0; i < n; i++)
+		if (MAXBLOCKS > found[i] && (0 == j || fs->prefetch.blocks[j-1] != found[i]))
+			fs->prefetch.blocks[j++] = (block_t)found[i];
+	free(found);
+	n = j;
+
+	/* A run of neighbouring blocks in one read */
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && fs->prefetch.blocks[j] == fs->prefetch.blocks[j-1] + 1; j++);
+		if (FS_ERR == _fs.readrun(fs, &fs->prefetch.data[i], fs->prefetch.blocks[i], j - i)) {
+			_prefetch_done(fs);
+			return;
+		}
+	}
+	fs->prefetch.n = n;
+}
+
+/* Load the @param n inodes @param nums that are not in memory yet. Their
+ * inode table blocks that are not in block_cache are read first, together
+ * and in block order, a run of neighbouring blocks in one read; then the
+ * inodes are built from them in the same order. Looking through many
+ * siblings then costs one burst of reads rather than a read per inode.
+ * Returns how many inodes were loaded. */
+static size_t _inode_prefetch(filesystem* fs, const inode_t* nums, size_t n) {
+	uint64_t t;
+	uint32_t* keys;
+	size_t i, j, k, nkeys = 0, nloaded = 0;
+	block_t b, first, last;
+
+	if (NULL == fs || NULL == nums || 2 > n) return 0;
+
+	keys = (uint32_t*)malloc(n*sizeof(uint32_t));
+	if (NULL == keys) return 0;
+
+	t = stats_now();
+	for (i = 0; i < n; i++) {
+		if (MAXINODES <= nums[i] || NULL != fs->attached_inodes[nums[i]]) continue;
+		b = fs->sb.inode_first_blocks[nums[i]];
+		if (0 == b) continue;
+		keys[nkeys++] = (uint32_t)b << 16 | nums[i];
+	}
+	qsort(keys, nkeys, sizeof(uint32_t), _cmp_prefetch_key);
+
+	/* Read the table blocks not cached yet, a run of neighbours at a time */
+	for (i = 0; i < nkeys; i = j) {
+		first = last = (block_t)(keys[i] >> 16);
+		for (j = i + 1; j < nkeys; j++) {
+			b = (block_t)(keys[j] >> 16);
+			if (b == last) continue;
+			if (fs->block_cache_valid[first] || b != last + 1 || fs->block_cache_valid[b]) break;
+			last = b;
+		}
+		if (fs->block_cache_valid[first]) continue;
+
+		if (FS_ERR == _fs.readrun(fs, &fs->block_cache[first], first, (size_t)(last - first) + 1))
+			continue;
+		stats_count(SC_ITABLE_MISSES, (uint64_t)(last - first) + 1);
+		for (k = first; k <= last; k++)
+			fs->block_cache_valid[k] = true;
+	}
+
+	_prefetch_dents(fs, keys, nkeys);
+	for (i = 0; i < nkeys; i++)
+		if (NULL != _inode_load(fs, (inode_t)(keys[i] & 0xffff)))
+			nloaded++;
+	_prefetch_done(fs);
+
+	stats_record_args(ST_INODE_PREFETCH, t, -1, (long)nloaded);
+	free(keys);
+	return nloaded;
+}
+
+/* Write an inode to its slot in the inode table. The data blocks are 
+ * stored as extents; those that do not fit in the dinode spill into an
+ * overflow block. A directory's dent is written to its data blocks.
+ * While a batch is open the inode is only marked, and written once at
+ * the commit however often it changed. */
+static int _inode_store(filesystem* fs, inode* ino) {
+	dinode* di = NULL;
+	extent ext[MAXFILEBLOCKS + 1];
+	block_t* blocks;
+	size_t i, n, nholes, nextents = 0;
+	block_t tblock;
+	int b;
+
+	if (NULL == fs || NULL == ino) return FS_ERR;
+
+	if (FS_BATCH_OPEN == fs->batch.state) {
+		if (!fs->batch.held[ino->num]) {
+			fs->batch.held[ino->num] = true;
+			fs->batch.inodes[fs->batch.n++] = ino->num;
+		}
+		ino->dirty = true;
+		return FS_OK;
+	}
+
+	/* A directory's blocks follow the size of its dent */
+	if (FS_DIR == ino->mode && FS_ERR == _dir_fit(fs, ino))
+		return FS_ERR;
+
+	di = _itable_slot(fs, ino->num);
+	if (NULL == di) return FS_ERR;
+
+	/* Coalesce the data blocks, or the blocks of the frames, into runs.
+	 * Holes make runs of their own, starting at block 0. Blocks still
+	 * buffered in memory have no place on disk yet and are stored as holes. */
+	blocks = ino->flags & FS_ZSTORED ? ino->zblocks : ino->blocks;
+	n = ino->flags & FS_ZSTORED ? ino->nzblocks : ino->ndatablocks;
+	for (i = 0, nholes = 0; i < n; i++) {
+		nholes += 0 == blocks[i];
+		if (nextents > 0 && 
+			(0 == blocks[i] ? 0 == ext[nextents-1].start :
+			 0 != ext[nextents-1].start && ext[nextents-1].start + ext[nextents-1].len == blocks[i]) &&
+			ext[nextents-1].len < UINT16_MAX) 
+		{
+			ext[nextents-1].len++;
+			continue;
+		}
+		ext[nextents].start = blocks[i];
+		ext[nextents].len = 1;
+		nextents++;
+	}
+
+	/* Get a block for the extents that do not fit in the dinode */
+	if (nextents > FS_NEXTENTS && 0 == ino->xblock) {
+		b = _fs.__balloc(fs);
+		if (FS_ERR == b) return FS_ERR;
+		ino->xblock = (block_t)b;
+		ino->nblocks++;
+	}
+
+	/* Give back the overflow block once the extents fit in the dinode again */
+	else if (nextents <= FS_NEXTENTS && 0 != ino->xblock) {
+		_fs._mbfree(fs, 1, &ino->xblock);
+		ino->xblock = 0;
+		ino->nblocks--;
+	}
+
+	memset(di, 0, sizeof(dinode));
+	di->num = ino->num;
+	di->mode = ino->mode;
+	di->nlinks = (uint16_t)ino->nlinks;
+	di->size = (uint32_t)ino->size;
+	di->ndatablocks = (uint16_t)i;
+	di->nextents = (uint16_t)nextents;
+	di->xblock = ino->xblock;
+	di->flags = ino->flags;
+	di->nholes = (uint16_t)nholes;
+	if (ino->flags & FS_ZSTORED)
+		di->nzdata = (uint16_t)ino->nzdata;
+
+	if (0 == nextents)
+		memcpy(di->u.idata, ino->idata, FS_INLINEDATA);
+	else
+		memcpy(di->u.ext, ext, min(nextents, FS_NEXTENTS)*sizeof(extent));
+
+	switch (ino->mode) {
+		case FS_FILE:
+		{
+			di->parent = ino->data.file.parent;
+			memcpy(di->name, ino->data.file.name, FS_NAMEMAXLEN);
+			break;
+		}
+		case FS_DIR:
+		{
+			di->parent = ino->data.dir.parent;
+			memcpy(di->name, ino->data.dir.name, FS_NAMEMAXLEN);
+			break;
+		}
+		case FS_LINK:
+		{
+			di->parent = ino->data.link.parent;
+			di->dest = ino->data.link.dest;
+			di->destmode = ino->data.link.mode;
+			memcpy(di->name, ino->data.link.name, FS_NAMEMAXLEN);
+			break;
+		}
+	}
+
+	fs->sb.inode_block_counts[ino->num] = ino->nblocks;
+
+	/* A batch writes each table block once, after all its inodes */
+	tblock = fs->sb.inode_table[ino->num / FS_INODES_PER_BLOCK];
+	if (FS_BATCH_COMMIT == fs->batch.state)
+		fs->batch.tables[ino->num / FS_INODES_PER_BLOCK] = true;
+	else if (FS_ERR == _fs.writeblock(fs, tblock, BLKSIZE, &fs->block_cache[tblock]))
+		return FS_ERR;
+
+	if (nextents > FS_NEXTENTS) {
+		extent xext[FS_XEXTENTS];
+
+		memset(xext, 0, sizeof(xext));
+		memcpy(xext, &ext[FS_NEXTENTS], (nextents - FS_NEXTENTS)*sizeof(extent));
+		if (FS_ERR == _fs.writeblock(fs, ino->xblock, BLKSIZE, xext))
+			return FS_ERR;
+	}
+
+	if (FS_DIR == ino->mode && FS_ERR == _dir_write(fs, ino))
+		return FS_ERR;
+
+	/* Frames replaced by _zfile_pack are free once the dinode no longer names them */
+	if (0 != ino->nzfreed) {
+		_fs._mbfree(fs, ino->nzfreed, ino->zfreed);
+		ino->nzfreed = 0;
+	}
+
+	ino->dirty = false;
+	return FS_OK;
+}
+
+/* Clear what points at @param ino in memory: its slot in the parent's dentv
+ * and the links loaded against it. Those are found again from disk on demand */
+static void _inode_drop_refs(filesystem* fs, inode* ino) {
+	inode* parent = NULL;
+	inode* l;
+	size_t i;
+
+	if (FS_FILE == ino->mode) parent = fs->attached_inodes[ino->data.file.parent];
+	else if (FS_DIR == ino->mode) parent = fs->attached_inodes[ino->data.dir.parent];
+
+	if (NULL != parent && parent != ino && FS_DIR == parent->mode && NULL != parent->datav.dir) {
+		for (i = 0; FS_FILE == ino->mode && i < parent->datav.dir->nfiles; i++)
+			if (ino == parent->datav.dir->files[i]) parent->datav.dir->files[i] = NULL;
+		for (i = 0; FS_DIR == ino->mode && i < parent->datav.dir->ndirs; i++)
+			if (ino == parent->datav.dir->dirs[i]) parent->datav.dir->dirs[i] = NULL;
+	}
+
+	if (0 < ino->nlinks)
+		for (i = 0; i < MAXINODES; i++) {
+			l = fs->attached_inodes[i];
+			if (NULL != l && l != ino && FS_LINK == l->mode && l->v_attached &&
+				NULL != l->datav.link && ino == l->datav.link->dest)
+				_fs._unload_link(l);
+		}
+}
+
+/* Write an inode to disk and free its associated memory */
+static int __inode_unload(filesystem* fs, inode* ino) {
+	int retv = FS_OK;
+	
+	if (NULL == ino) return FS_ERR;
+		
+	if (FS_ERR == _fs.write_commit(fs, ino))
+		return FS_ERR;
+
+	if (ino->v_attached) {
+		if (FS_ERR == _fs._v_detach(fs, ino)) {
+			retv = FS_ERR;
+		}
+	}
+
+	_inode_drop_refs(fs, ino);
+	fs->attached_inodes[ino->num] = NULL;
+	_fs._free_inode(ino);
+	ino = NULL;
+
+	return retv;
+}
+
+/* __inode_unload, timed for stats */
+static int _inode_unload(filesystem* fs, inode* ino) {
+	uint64_t t = stats_now();
+	int retv = __inode_unload(fs, ino);
+
+	stats_record(ST_INODE_UNLOAD, t);
+	return retv;
+}
+
+/* Bit @param i of the free block or free inode map. Set means in use. */
+static int _map_test(map* m, size_t i)		{ return (m->data[i/8] >> (i%8)) & 1; }
+static void _map_set(map* m, size_t i)		{ m->data[i/8] |= (char)(1 << (i%8)); }
+static void _map_clear(map* m, size_t i)	{ m->data[i/8] &= (char)~(1 << (i%8)); }
+
+/* The end of the run of free blocks that starts at @param i */
+static size_t _free_run_end(map* m, size_t i) {
+	while (i < MAXBLOCKS) {
+		if (0 == i%8 && 0 == m->data[i/8]) {	/* Skip a whole free byte */
+			i += 8;
+			continue;
+		}
+		if (_map_test(m, i)) break;
+		i++;
+	}
+	return i;
+}
+
+/* The start of the run of free blocks that ends just before @param i */
+static size_t _free_run_start(map* m, size_t i) {
+	while (i > 0) {
+		if (0 == i%8 && 0 == m->data[i/8 - 1]) {
+			i -= 8;
+			continue;
+		}
+		if (_map_test(m, i-1)) break;
+		i--;
+	}
+	return i;
+}
+
+/* Size class of a free extent of @param len blocks: floor(log2(len)) */
+static size_t _size_class(size_t len) {
+	size_t k = 0;
+
+	while (len >>= 1)
+		k++;
+	return k < FS_NFREECLASSES ? k : FS_NFREECLASSES - 1;
+}
+
+/* Add @param delta to the count of free extents of @param len blocks */
+static void _free_extents_add(filesystem* fs, size_t len, int delta) {
+	if (0 == len) return;
+	fs->sb.free_extents[_size_class(len)] += delta;
+}
+
+/* Mark the @param count free blocks from @param start used, keeping 
+ * the free block count and free extent histogram up to date. */
+static void _map_alloc_range(filesystem* fs, size_t start, size_t count) {
+	size_t i, a, b;
+
+	/* Split the free run [a, b) around the allocated range */
+	a = _free_run_start(&fs->fb_map, start);
+	b = _free_run_end(&fs->fb_map, start);
+	_free_extents_add(fs, b - a, -1);
+	_free_extents_add(fs, start - a, 1);
+	_free_extents_add(fs, b - start - count, 1);
+
+	for (i = start; i < start + count; i++) {
+		_map_set(&fs->fb_map, i);
+		fs->block_cache_valid[i] = false;
+	}
+	fs->sb.nfree_blocks -= count;
+
+	if (start == fs->sb.free_blocks_base)
+		fs->sb.free_blocks_base = start + count;
+}
+
+/* Mark the @param count used blocks from @param start free, keeping 
+ * the free block count and free extent histogram up to date. */
+static void _map_free_range(filesystem* fs, size_t start, size_t count) {
+	size_t i, a, b;
+
+	for (i = start; i < start + count; i++) {
+		_map_clear(&fs->fb_map, i);
+		fs->block_cache_valid[i] = false;
+	}
+	fs->sb.nfree_blocks += count;
+
+	/* Merge with the free runs on either side into [a, b) */
+	a = _free_run_start(&fs->fb_map, start);
+	b = _free_run_end(&fs->fb_map, start);
+	_free_extents_add(fs, start - a, -1);
+	_free_extents_add(fs, b - start - count, -1);
+	_free_extents_add(fs, b - a, 1);
+
+	if (start < fs->sb.free_blocks_base)
+		fs->sb.free_blocks_base = start;
+}
+
+/* Free the index of an inode and clear its slot in the inode table in
+ * memory. The table block is not written here; see _ifree.
+ * @param num the inode number to free
+ * Returns FS_OK on success, FS_ERR if the inode
+ * was already free */
+static int __ifree(filesystem* fs, inode_t num) {
+	dinode* di = NULL;
+
+	if (NULL == fs) return FS_ERR;
+	if (MAXINODES <= num) return FS_ERR;	/* Sanity check */
+
+	if (!_map_test(&fs->ino_map, num))
+		return FS_ERR;	/* Inode already free */
+
+	_map_clear(&fs->ino_map, num);
+	fs->sb.nfree_inodes++;
+	if (num < fs->sb.free_inodes_base)
+		fs->sb.free_inodes_base = num;
+
+	/* Clear the slot in the inode table */
+	di = _itable_slot(fs, num);
+	if (NULL != di)
+		memset(di, 0, sizeof(dinode));
+	fs->sb.inode_first_blocks[num] = 0;
+	fs->sb.inode_block_counts[num] = 0;
+
+	return FS_OK;
+}
+
+/* __ifree, with the inode table block written and synced
+ * @param num the inode number to free
+ * Returns FS_OK on success, FS_ERR if the inode
+ * was already free */
+static int _ifree(filesystem* fs, inode_t num) {
+	block_t tblock;
+
+	if (FS_ERR == __ifree(fs, num))
+		return FS_ERR;
+
+	tblock = fs->sb.inode_table[num / FS_INODES_PER_BLOCK];
+	if (0 != tblock)
+		_fs.writeblock(fs, tblock, BLKSIZE, &fs->block_cache[tblock]);
+
+	if (FS_ERR == _sync(fs))
+		return FS_ERR;
+
+	return FS_OK;
+}
+
+/* Find an unused inode number and return it. 
+ * Allocates a block of the inode table the first time
+ * an inode number in that block is handed out. */
+static int _ialloc(filesystem *shfs) {
+	inode_t num;
+	int tblock;
+
+	while (0 == shfs->sb.nfree_inodes && 0 < _fs._reclaim_step(shfs, MAXBLOCKS));
+	if (0 == shfs->sb.nfree_inodes) return 0;	/* Full */
+
+	for (num = (inode_t)shfs->sb.free_inodes_base; num < MAXINODES; num++)
+	{
+		if (_map_test(&shfs->ino_map, num))
+			continue;
+		stats_count(SC_ALLOC_SCANNED, num - shfs->sb.free_inodes_base + 1);
+
+		_map_set(&shfs->ino_map, num);
+		shfs->sb.nfree_inodes--;
+		shfs->sb.free_inodes_base = num + 1;
+
+		if (0 == shfs->sb.inode_table[num / FS_INODES_PER_BLOCK]) {
+			tblock = _fs.__balloc(shfs);
+			if (FS_ERR == tblock)
+				return 0;
+
+			/* A fresh table block has no inodes in it */
+			memset(&shfs->block_cache[tblock], 0, BLKSIZE);
+			shfs->block_cache_valid[tblock] = true;
+			shfs->sb.inode_table[num / FS_INODES_PER_BLOCK] = (block_t)tblock;
+		}
+		shfs->sb.inode_first_blocks[num] = shfs->sb.inode_table[num / FS_INODES_PER_BLOCK];
+
+		if (FS_ERR == _sync(shfs))
+			return FS_ERR;
+
+		return num;
+	}
+	return 0;
+}
+
+/* Free the index of a block and its malloc'd memory
+ * @param blk pointer to the block to free
+ * Returns FS_OK on success, FS_ERR if the block
+ * was already free */
+static int _bfree(filesystem* fs, block* blk) {
+	if (NULL == fs) return FS_ERR;
+	if (NULL == blk) return FS_ERR;
+
+	if (FS_ERR == _fs._mbfree(fs, 1, &blk->num))
+		return FS_ERR;	/* Block already free */
+	free(blk);
+
+	if (FS_ERR == _sync(fs))
+		return FS_ERR;
+
+	return FS_OK;
+}
+
+/* The 128-bit MurmurHash3 of the @param len bytes at @param data */
+static uint64_t _rotl64(uint64_t x, int r)	{ return (x << r) | (x >> (64 - r)); }
+static uint64_t _fmix64(uint64_t k) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+static fingerprint _block_hash(const char* data, size_t len) {
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	uint64_t h1 = 0, h2 = 0, k1, k2;
+	char tail[16];
+	size_t i;
+	fingerprint fp;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		memcpy(&k1, &data[i], 8);
+		memcpy(&k2, &data[i + 8], 8);
+
+		k1 *= c1; k1 = _rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = _rotl64(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+		k2 *= c2; k2 = _rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = _rotl64(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+	}
+
+	/* The last bytes, padded with zeros */
+	if (i < len) {
+		memset(tail, 0, sizeof(tail));
+		memcpy(tail, &data[i], len - i);
+		memcpy(&k1, tail, 8);
+		memcpy(&k2, &tail[8], 8);
+
+		k2 *= c2; k2 = _rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		k1 *= c1; k1 = _rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+
+	h1 ^= len;
+	h2 ^= len;
+	h1 += h2;
+	h2 += h1;
+	h1 = _fmix64(h1);
+	h2 = _fmix64(h2);
+	fp.lo = h1 + h2;
+	fp.hi = h2 + fp.lo;
+	return fp;
+}
+
+/* The block in the dedup index holding data with fingerprint @param fp, 0 if none */
+static block_t _dedup_find(filesystem* fs, fingerprint fp) {
+	block_t b;
+
+	for (b = fs->dedup_buckets[fp.lo % FS_DEDUPBUCKETS]; 0 != b; b = fs->dedup_chain[b])
+		if (fs->dedup->fps[b].lo == fp.lo && fs->dedup->fps[b].hi == fp.hi)
+			return b;
+	return 0;
+}
+
+/* Chain block @param b into the bucket of its fingerprint */
+static void _dedup_link(filesystem* fs, block_t b) {
+	size_t k = fs->dedup->fps[b].lo % FS_DEDUPBUCKETS;
+
+	fs->dedup_chain[b] = fs->dedup_buckets[k];
+	fs->dedup_buckets[k] = b;
+}
+
+/* Put block @param b, which holds data with fingerprint @param fp and is
+ * one file data block, into the dedup index */
+static void _dedup_add(filesystem* fs, block_t b, fingerprint fp) {
+	fs->dedup->refs[b] = 1;
+	fs->dedup->fps[b] = fp;
+	_dedup_link(fs, b);
+}
+
+/* Take block @param b out of the dedup index */
+static void _dedup_remove(filesystem* fs, block_t b) {
+	block_t* p = &fs->dedup_buckets[fs->dedup->fps[b].lo % FS_DEDUPBUCKETS];
+
+	while (0 != *p && b != *p)
+		p = &fs->dedup_chain[*p];
+	if (0 != *p)
+		*p = fs->dedup_chain[b];
+
+	fs->dedup_chain[b] = 0;
+	fs->dedup->refs[b] = 0;
+	memset(&fs->dedup->fps[b], 0, sizeof(fingerprint));
+}
+
+/* Drop a reference to block @param b. Returns true if it was the last
+ * one, or the block was not shared, so that the block may be freed. */
+static int _dedup_unref(filesystem* fs, block_t b) {
+	if (NULL == fs->dedup || 0 == fs->dedup->refs[b]) return true;
+	if (--fs->dedup->refs[b] > 0) return false;
+
+	_dedup_remove(fs, b);
+	return true;
+}
+
+/* Free the @param count blocks whose indices are in @param bindices.
+ * Zero indices are skipped. As with _mballoc, the caller _syncs.
+ * A block files share is only freed with its last reference.
+ * Returns FS_ERR if any of them was already free. */
+static int _mbfree(filesystem* fs, const size_t count, block_t* bindices) {
+	size_t i, j;
+	int status = FS_OK;
+
+	if (NULL == fs) return FS_ERR;
+
+	for (i = 0; i < count; i = j) {
+		j = i + 1;
+
+		if (0 == bindices[i]) continue;
+		if (MAXBLOCKS <= bindices[i] || !_map_test(&fs->fb_map, bindices[i])) {
+			status = FS_ERR;
+			continue;
+		}
+		if (!_dedup_unref(fs, bindices[i]))
+			continue;		/* Still shared */
+
+		/* Free runs of consecutive blocks together */
+		while (j < count && bindices[j] == bindices[j-1] + 1 && _map_test(&fs->fb_map, bindices[j]) &&
+			(NULL == fs->dedup || fs->dedup->refs[bindices[j]] <= 1))
+			_dedup_unref(fs, bindices[j++]);
+		_map_free_range(fs, bindices[i], j - i);
+	}
+
+	return status;
+}
+
+/* Traverse the free block map and return the index of the first free
+ * block. The block map is not written out here; callers _sync 
+ * once they are done allocating. */
+static int __balloc(filesystem* shfs) {
+	size_t i;
+
+	if (0 == shfs->sb.nfree_blocks) return FS_ERR;	/* Full */
+
+	for (i = shfs->sb.free_blocks_base; i < MAXBLOCKS; i++)
+	{
+		if (_map_test(&shfs->fb_map, i))
+			continue;
+
+		stats_count(SC_ALLOC_SCANNED, i - shfs->sb.free_blocks_base + 1);
+		_map_alloc_range(shfs, i, 1);
+		return (int)i;
+	}
+	return FS_ERR;
+}
+
+/* Find the first run of @param count free blocks, without allocating it.
+ * Returns the index of its first block, or 0 if there is no such run. */
+static block_t _find_free_run(filesystem* fs, const size_t count) {
+	size_t i, k, run = 0;
+
+	if (0 == count || count > fs->sb.nfree_blocks) return 0;
+
+	/* Is there a free extent in a size class that could hold it ? */
+	for (k = _size_class(count); k < FS_NFREECLASSES && 0 == fs->sb.free_extents[k]; k++);
+	if (FS_NFREECLASSES == k) return 0;
+
+	for (i = fs->sb.free_blocks_base; i < MAXBLOCKS; i++) {
+		if (_map_test(&fs->fb_map, i)) {
+			run = 0;
+			continue;
+		}
+		if (++run == count)
+			break;
+	}
+	stats_count(SC_ALLOC_SCANNED, min(i + 1, (size_t)MAXBLOCKS) - fs->sb.free_blocks_base);
+
+	return MAXBLOCKS == i ? 0 : (block_t)(i + 1 - count);
+}
+
+/* Allocate @param count blocks if possible. Store indices in @param blocks.
+ * The blocks are contiguous when there is a free run long enough. */
+static int __mballoc(filesystem* fs, const size_t count, block_t* bindices) {
+	size_t i;
+	block_t start;
+	int j;
+
+	if (count > fs->sb.nfree_blocks) return FS_ERR;	/* Will not fit */
+
+	start = _find_free_run(fs, count);
+	if (0 != start) {
+		_map_alloc_range(fs, start, count);
+		for (i = 0; i < count; i++)
+			bindices[i] = (block_t)(start + i);
+		return FS_OK;
+	}
+
+	for (i = 0; i < count; i++) {	// Allocate free blocks one at a time
+		j = __balloc(fs);
+		if (FS_ERR == j) return FS_ERR;
+		bindices[i] = (block_t)j;
+	}
+
+	return FS_OK;
+}
+
+/* __mballoc, timed for stats */
+static int _mballoc(filesystem* fs, const size_t count, block_t* bindices) {
+	uint64_t t = stats_now();
+	int retv = __mballoc(fs, count, bindices);
+
+	stats_record(ST_MBALLOC, t);
+	return retv;
+}
+
+/* Create a and zero-out a new on-disk directory entry
+ * @param alloc_inode specifies whether this directory
+ * gets allocated an inode, else inode 0 is given.
+ * @param name the new directory name.
+ */
+static dent* _newd(filesystem* fs, const int alloc_inode, const char* name) {
+	dent* d = NULL;
+	d = (dent*)malloc(sizeof(dent));
+
+	if (alloc_inode)
+		d->ino = (inode_t)_ialloc(fs);
+	else d->ino = 0;
+
+	d->parent	= d->ino;
+	d->ndirs	= 0;
+	d->nfiles	= 0;
+	d->nlinks	= 0;
+
+	d->dirs		= NULL;						// Allocated as entries are added
+	d->files	= NULL;
+	d->links	= NULL;
+	d->dhash	= NULL;
+	d->fhash	= NULL;
+	d->lhash	= NULL;
+	d->dseq		= NULL;
+	d->fseq		= NULL;
+	d->lseq		= NULL;
+	d->maxdirs	= 0;
+	d->maxfiles	= 0;
+	d->maxlinks	= 0;
+	d->nextseq	= 0;
+	d->index	= NULL;						// Built by _dir_fit once it is hashed
+	d->nbuckets	= 0;
+
+	// Copy name
+	strncpy(d->name, name, min(FS_NAMEMAXLEN-1, strlen(name)+1));
+	d->name[FS_NAMEMAXLEN-1] = '\0';
+
+	return d;
+}
+
+/* Create and zero-out an in-memory directory entry 
+ * @param alloc_inode specifies whether this directory
+ * gets allocated an inode, else inode 0 is given.
+ * @param name the new directory name
+ */
+static dentv* _newdv(filesystem* fs, const int alloc_inode, const char* name) {
+	dent*	d	= NULL;
+	dentv*	dv	= NULL;
+
+	dv		= (dentv*)	malloc(sizeof(dentv));
+	dv->ino		= _fs._new_inode();
+
+	dv->dirs	= NULL;						/* Allocated as entries are added */
+	dv->files	= NULL;
+	dv->links	= NULL;
+	dv->maxdirs	= 0;
+	dv->maxfiles	= 0;
+	dv->maxlinks	= 0;
+
+	memset(	dv->ino->blocks, 0, sizeof(block_t)*MAXFILEBLOCKS);
+
+	dv->parent	= NULL;
+
+	dv->nfiles	= 0;
+	dv->ndirs	= 0;
+	dv->nlinks	= 0;
+	dv->ino->nlinks	= 0;
+	dv->ino->ndatablocks=0;
+	dv->ino->nblocks= dv->ino->ndatablocks;				/* How many blocks the inode data consumes */
+	dv->ino->size	= BLKSIZE;					/* The dent gets one data block */
+	dv->ino->mode	= FS_DIR;
+	dv->ino->v_attached = 1;
+
+	strncpy(dv->name, name, min(FS_NAMEMAXLEN-1, strlen(name)+1));
+	dv->name[FS_NAMEMAXLEN-1] = '\0';
+
+	d = _newd(fs, alloc_inode, name);
+	memcpy(&dv->ino->data.dir, d, sizeof(dent));
+	dv->ino->datav.dir = dv;
+	dv->ino->num = d->ino;
+
+	free(d);
+	return dv;
+}
+
+/* Create a new directory in the directory tree.
+ * It goes at the end of its parent's subdirectories, so only the
+ * parent and the new directory are written. Calls _sync();
+ */
+static dentv* _new_dir(filesystem *fs, dentv* parent, const char* name) {
+	dentv* dv = NULL;
+	int makingRoot = 0;
+
+	/* We're making the root */
+	if (NULL == parent && !strcmp(name, "/")) 
+		makingRoot = 1;
+
+	/* Allocate a new inode number */
+	dv = _newdv(fs, true, name);
+	if (NULL == dv) return NULL;
+
+	/* Allocate the data block for the directory contents */
+	if (FS_ERR == _mballoc(fs, 1, dv->ino->blocks)) {
+		free(dv);
+		return NULL;
+	}
+	dv->ino->ndatablocks = 1;
+	dv->ino->nblocks = 1;
+	fs->sb.inode_block_counts[dv->ino->num] = dv->ino->nblocks;
+
+	if (!makingRoot) {
+		if (NULL == parent) return NULL;
+
+		if (FS_ERR == _dir_reserve(parent, parent->ndirs+1, parent->nfiles, parent->nlinks))
+			return NULL;
+
+		parent->dirs[parent->ndirs++] = dv->ino;
+		_dir_add(parent->ino, FS_DIR, dv->ino->num, _name_hash(dv->ino->data.dir.name));
+
+		dv->parent = parent->ino;
+		dv->ino->data.dir.parent = parent->ino->num;
+	}
+
+	/* Update changes on disk */
+	if (!makingRoot) {
+		fs->attached_inodes[parent->ino->num] = parent->ino;
+		_inode_store(fs, parent->ino);
+	}
+	_inode_store(fs, dv->ino);
+	fs->attached_inodes[dv->ino->num] = dv->ino;
+	
+	if (FS_ERR == _sync(fs))
+		return NULL;
+
+	return dv;
+}
+
+/* Take the entry @param num, of @param mode FS_DIR, FS_FILE or FS_LINK,
+ * out of directory @param parent, in memory and in its dent, and close
+ * up the gap. The index bucket it was in is marked to be written; an
+ * index left less than an eighth full is dropped, for _dir_fit to build
+ * smaller. Nothing else changes, and nothing is written. */
+static int _dir_remove(filesystem* fs, inode* parent, uint16_t mode, inode_t num) {
+	dent* d;
+	dentv* pv;
+	inode_t* nums;
+	uint32_t* hashes;
+	uint32_t* seqs;
+	inode** loaded;
+	size_t i, n;
+	int b;
+
+	if (NULL == parent || FS_DIR != parent->mode || FS_ERR == _fs._v_attach(fs, parent))
+		return FS_ERR;
+	d = &parent->data.dir;
+	pv = parent->datav.dir;
+
+	n = *_dent_kind(d, mode, &nums, &hashes, &seqs);
+	loaded = FS_DIR == mode ? pv->dirs : FS_FILE == mode ? pv->files : pv->links;
+
+	for (i = 0; i < n && num != nums[i]; i++);
+	if (n == i) return FS_ERR;	/* Not in this directory */
+
+	if (NULL != d->index) {
+		b = _dent_slot_remove(d->index, d->nbuckets, hashes[i], num, mode);
+		if (0 > b) _dent_index_drop(d);
+		else parent->dirtyblocks[1 + b] = true;
+	}
+
+	memmove(&nums[i], &nums[i+1], (n-i-1)*sizeof(inode_t));
+	memmove(&hashes[i], &hashes[i+1], (n-i-1)*sizeof(uint32_t));
+	memmove(&seqs[i], &seqs[i+1], (n-i-1)*sizeof(uint32_t));
+	memmove(&loaded[i], &loaded[i+1], (n-i-1)*sizeof(inode*));
+	nums[n-1] = 0;
+	hashes[n-1] = 0;
+	seqs[n-1] = 0;
+	loaded[n-1] = NULL;
+
+	switch (mode) {
+		case FS_DIR:	d->ndirs--;  pv->ndirs--;  break;
+		case FS_FILE:	d->nfiles--; pv->nfiles--; break;
+		default:	d->nlinks--; pv->nlinks--; break;
+	}
+	if (NULL != d->index && 1 < d->nbuckets &&
+		8*(d->ndirs + d->nfiles + d->nlinks) < d->nbuckets*FS_DIRSLOTS)
+		_dent_index_drop(d);
+	parent->dirty = true;
+	return FS_OK;
+}
+
+/* Remove directory @param dv from its parent. Only the parent is written. */
+static int _rmdir(filesystem* fs, dentv* dv) {
+	if (NULL == dv || NULL == dv->parent) return FS_ERR;
+
+	if (FS_ERR == _dir_remove(fs, dv->parent, FS_DIR, dv->ino->num))
+		return FS_ERR;
+
+	_fs._lookup_forget(fs);		/* Paths may name this directory */
+
+	/* Update changes on disk */
+	_inode_store(fs, dv->parent);
+	_fs._unload_dir(fs, dv->ino);
+	
+	if (FS_ERR == _sync(fs))
+		return FS_ERR;
+
+	return FS_OK;
+}
+
+/* Create an on-disk file */
+static file* _newf(filesystem* fs, const int alloc_inode, const char* name) {
+	file* f = NULL;
+	f = (file*)malloc(sizeof(file));
+
+	if (alloc_inode)
+		f->ino = (inode_t)_ialloc(fs);
+	else f->ino = 0;
+
+	// Copy name
+	strncpy(f->name, name, min(FS_NAMEMAXLEN-1, strlen(name)+1));
+	f->name[FS_NAMEMAXLEN-1] = '\0';
+
+	return f;
+}
+
+/* Create an in-memory file */
+static filev* _newfv(filesystem* fs, const int alloc_inode, const char* name) {
+	file*	f	= NULL;
+	filev*	fv	= NULL;
+
+	fv = (filev*)malloc(sizeof(filev));
+	fv->ino = _fs._new_inode();
+
+	memset(	fv->ino->blocks, 0, sizeof(block_t)*MAXFILEBLOCKS);
+
+	fv->ino->nlinks	= 0;
+	fv->ino->ndatablocks=0;
+	fv->ino->nblocks= fv->ino->ndatablocks;				/* How many blocks the inode data consumes */
+	fv->ino->size	= 0;						/* Empty, and inline until it outgrows FS_INLINEDATA */
+	fv->ino->mode = FS_FILE;
+	fv->ino->v_attached = true;
+	fv->ino->datav.file = fv;
+
+	strncpy(fv->name, name, min(FS_NAMEMAXLEN-1, strlen(name)+1));
+	fv->name[FS_NAMEMAXLEN-1] = '\0';
+	fv->seek_pos = 0;
+
+	f = _newf(fs, alloc_inode, name);
+	memcpy(&fv->ino->data.file, f, sizeof(file));
+	fv->ino->num = f->ino;
+	free(f);
+
+	return fv;
+}
+
+/* Create a new file of @param name in the given directory @parent */
+static filev* _new_file(filesystem* fs, dentv* parent, const char* name) {
+	filev* fv = NULL;
+
+	/* Allocate a new inode number */
+	fv = _newfv(fs, true, name);
+	if (NULL == fv) return NULL;
+	
+	fv->parent = parent->ino;
+	fv->ino->data.file.parent = parent->ino->num;
+	if (fs->sb_i.flags & FS_ZVOLUME)
+		fv->ino->flags = FS_ZFILE;
+	
+	if (FS_ERR == _dir_reserve(parent, parent->ndirs, parent->nfiles+1, parent->nlinks))
+		return NULL;
+
+	parent->files[parent->nfiles++] = fv->ino;
+	_dir_add(parent->ino, FS_FILE, fv->ino->num, _name_hash(fv->ino->data.file.name));
+	
+	_inode_store(fs, parent->ino);
+	_inode_store(fs, fv->ino);
+	fs->attached_inodes[fv->ino->num] = fv->ino;
+	
+	if (FS_ERR == _fs._sync(fs)) {
+		return NULL;
+	}
+
+	return fv;
+}
+
+/* Create an on-disk link */
+static hlink* _newl(filesystem* fs, const int alloc_inode, const char* name) {
+	hlink* h = NULL;
+
+	h = (hlink*)malloc(sizeof(hlink));
+	if (alloc_inode) {
+		h->ino = (inode_t)_ialloc(fs);
+	} else {
+		h->ino = 0;
+	}
+	
+	// Copy name
+	strncpy(h->name, name, min(FS_NAMEMAXLEN-1, strlen(name)+1));
+	h->name[FS_NAMEMAXLEN-1] = '\0';
+		
+	return h;
+}
+
+/* Create an in-memory link */
+static hlinkv* _newlv(filesystem*fs, int alloc_inode, const char* name) {
+	hlink* h = NULL;
+	hlinkv* hv = NULL;
+
+	hv = (hlinkv*)malloc(sizeof(hlinkv));
+	hv->ino = _fs._new_inode();
+	
+	memset(hv->ino->blocks, 0, sizeof(block_t)*MAXFILEBLOCKS);
+	
+	hv->ino->nlinks	= 0;
+	hv->ino->ndatablocks=0;
+	hv->ino->nblocks= hv->ino->ndatablocks;				/* How many blocks the inode data consumes */
+	hv->ino->size	= 0;
+	hv->ino->mode = FS_LINK;
+	hv->ino->v_attached = true;
+	hv->ino->datav.link = hv;
+	
+	strncpy(hv->name, name, min(FS_NAMEMAXLEN-1, strlen(name)+1));
+	hv->name[FS_NAMEMAXLEN-1] = '\0';
+	
+	h = _newl(fs, alloc_inode, name);
+	memcpy(&hv->ino->data.link, h, sizeof(hlink));
+	hv->ino->num = h->ino;
+	free(h);
+	
+	return hv;
+}
+
+/* Create a new link */
+static hlinkv* _new_link(filesystem* fs, dentv* parent, inode* src_ino, const char* name) {
+	hlinkv* lv = NULL;
+		
+	lv = _newlv(fs, true, name);
+	lv->dest = src_ino;
+	lv->ino->data.link.dest = src_ino->num;
+	
+	/* Allocate a new inode number */
+	if (NULL == lv) return NULL;
+	
+	lv->ino->data.link.mode = src_ino->mode;
+
+	lv->parent = parent->ino;
+	lv->ino->data.link.parent = parent->ino->num;
+	
+	if (FS_ERR == _dir_reserve(parent, parent->ndirs, parent->nfiles, parent->nlinks+1))
+		return NULL;
+
+	parent->links[parent->nlinks++] = lv->ino;
+	_dir_add(parent->ino, FS_LINK, lv->ino->num, _name_hash(lv->ino->data.link.name));
+	src_ino->nlinks++;
+	parent->ino->dirty = true;
+	src_ino->dirty = true;
+	fs->attached_inodes[lv->ino->num] = lv->ino;
+	
+	_fs.write_commit(fs, lv->ino);
+	_fs.write_commit(fs, parent->ino);
+	_fs.write_commit(fs, src_ino);
+
+	return lv;
+}
+
+static int _rmlink(filesystem* fs, hlinkv* hv) {
+	size_t i = 0;
+	inode* parent;
+	inode* dest;
+	inode_t num;
+	
+	if (NULL == hv) return FS_ERR;
+	if (NULL == hv->parent) return FS_ERR;
+	
+	hv->ino->datav.link->dest->nlinks--;
+	hv->ino->datav.link->dest->dirty = true;
+	hv->parent->dirty = true;
+
+	_fs._lookup_forget(fs);		/* Paths may lead through this link */
+	
+	/* Find the matching link in the parent */
+	for (i = 0; i < hv->parent->datav.dir->nlinks; i++) {
+		
+		/* If we have a match */
+		if (hv->ino->num == hv->parent->datav.dir->links[i]->num) {
+			
+			/* Remove the link, closing up the list */
+			if (FS_ERR == _dir_remove(fs, hv->parent, FS_LINK, hv->ino->num))
+				return FS_ERR;
+			
+			/* Unloading frees hv */
+			parent = hv->parent;
+			dest = hv->dest;
+			num = hv->ino->num;
+			_fs._inode_unload(fs, hv->ino);
+			
+			hv = NULL;
+			
+			/* The link's inode goes once nothing on disk lists it */
+			if (FS_ERR == _inode_store(fs, parent) || FS_ERR == _inode_store(fs, dest) ||
+				FS_ERR == _ifree(fs, num))
+				return FS_ERR;
+
+			break;
+		}
+	}
+	
+	return FS_OK;
+}
+
+/* Queue the removed inode @param num for _reclaim_step to free */
+static int _reclaim_queue(filesystem* fs, inode_t num) {
+	if (NULL == fs->reclaim.queue) {
+		fs->reclaim.queue = (inode_t*)malloc(MAXINODES*sizeof(inode_t));
+		if (NULL == fs->reclaim.queue) return FS_ERR;
+		fs->reclaim.first = 0;
+		fs->reclaim.nqueued = 0;
+	}
+	if (MAXINODES == fs->reclaim.nqueued) return FS_ERR;	/* Cannot happen: each inode is queued once */
+
+	fs->reclaim.queue[(fs->reclaim.first + fs->reclaim.nqueued++) % MAXINODES] = num;
+	return FS_OK;
+}
+
+/* Remove the file, link or directory @param ino from its directory.
+ * Only the entry goes now. The inode, and for a directory everything
+ * below it, is queued, and _reclaim_step frees the space later, so
+ * removing a big file or a whole tree takes as long as an empty file. */
+static int _rm(filesystem* fs, inode* ino) {
+	inode* parent;
+
+	if (NULL == fs || NULL == ino) return FS_ERR;
+	if (fs->sb.root == ino->num) return FS_ERR;
+
+	/* On disk before the entry goes, so _open finds what a crash leaves undone */
+	if (!(fs->sb_i.flags & FS_RECLAIMING)) {
+		fs->sb_i.flags |= FS_RECLAIMING;
+		if (FS_ERR == _sync(fs)) return FS_ERR;
+	}
+
+	if (FS_DIR == ino->mode) {
+		if (FS_ERR == _fs._v_attach(fs, ino) || FS_ERR == _rmdir(fs, ino->datav.dir))
+			return FS_ERR;
+		return _reclaim_queue(fs, ino->num);
+	}
+
+	parent = _inode_load(fs, FS_FILE == ino->mode ? ino->data.file.parent : ino->data.link.parent);
+	if (FS_ERR == _dir_remove(fs, parent, ino->mode, ino->num))
+		return FS_ERR;
+	if (FS_LINK == ino->mode)
+		_fs._lookup_forget(fs);		/* Paths may lead through this link */
+
+	if (FS_ERR == _inode_store(fs, parent) || FS_ERR == _reclaim_queue(fs, ino->num))
+		return FS_ERR;
+
+	return _sync(fs);
+}
+
+static inode* _new_inode() {
+	uint i, j, k;
+	inode* ino = NULL;
+
+	ino = (inode*)malloc(sizeof(inode));
+	memset(&ino->data, 0, sizeof(ino->data));
+	memset(ino->idata, 0, FS_INLINEDATA);
+	memset(ino->dirtyblocks, 0, MAXFILEBLOCKS);
+	memset(ino->blocks, 0, sizeof(ino->blocks));
+	ino->dirty = true;			/* Not on disk yet */
+	ino->datav.dir = NULL;			/* Nothing in memory yet */
+	ino->v_attached = false;
+
+	ino->flags = 0;
+	ino->zblocks = NULL;
+	ino->nzblocks = 0;
+	ino->zframes = NULL;
+	ino->nzdata = 0;
+	ino->zfreed = NULL;
+	ino->nzfreed = 0;
+	ino->xblock = 0;
+
+	for (i = 0; i < MAXBLOCKS_DIRECT; i++)
+		ino->directblocks[i] = NULL;
+	
+	ino->ib1 = (iblock1*)malloc(sizeof(iblock1));
+
+	for (i = 0; i < MAXBLOCKS_DIRECT; i++)
+		ino->ib1->blocks[i] = NULL;
+	
+	ino->ib2 = (iblock2*)malloc(sizeof(iblock2));
+	for (i = 0; i < NIBLOCKS; i++) {
+		ino->ib2->iblocks[i] = (iblock1*)malloc(sizeof(iblock1));
+		
+		for (j = 0; j < MAXBLOCKS_DIRECT; j++)
+			ino->ib2->iblocks[i]->blocks[j] = NULL;
+	}
+
+	ino->ib3 = (iblock3*)malloc(sizeof(iblock3));
+	for (i = 0; i < NIBLOCKS; i++) {
+		ino->ib3->iblocks[i] = (iblock2*)malloc(sizeof(iblock2));
+
+		for (j = 0; j < NIBLOCKS; j++) {
+			ino->ib3->iblocks[i]->iblocks[j] = (iblock1*)malloc(sizeof(iblock1));
+			
+			for (k = 0; k < MAXBLOCKS_DIRECT; k++)
+				ino->ib3->iblocks[i]->iblocks[j]->blocks[k] = NULL;
+		}
+	}
+
+	return ino;
+}
+
+/* Free the inode @param ino and everything it holds in memory */
+static void _free_inode(inode* ino) {
+	block** slot;
+	size_t n;
+	uint i, j;
+
+	if (NULL == ino) return;
+
+	if (FS_DIR == ino->mode)
+		_dent_free(&ino->data.dir);
+
+	free(ino->zblocks);
+	free(ino->zframes);
+	free(ino->zfreed);
+
+	/* The data blocks it still holds in memory, then the tables that point at them */
+	for (n = 0; n < MAXFILEBLOCKS; n++)
+		if (NULL != (slot = _fs._inode_block_slot(ino, n)))
+			free(*slot);
+
+	for (i = 0; i < NIBLOCKS; i++) {
+		free(ino->ib2->iblocks[i]);
+		for (j = 0; j < NIBLOCKS; j++)
+			free(ino->ib3->iblocks[i]->iblocks[j]);
+		free(ino->ib3->iblocks[i]);
+	}
+	free(ino->ib1);
+	free(ino->ib2);
+	free(ino->ib3);
+	free(ino);
+}
+
+/* Get an unallocated file descriptor */
+static int _get_fd(filesystem* fs) {
+	uint i;
+
+	for (i = fs->first_free_fd; i < FS_MAXOPENFILES; i++){
+		if (false == fs->allocated_fds[i]) {
+			fs->allocated_fds[i] = true;
+			fs->first_free_fd = i+1;
+			return i;
+		}
+	}
+
+	return FS_ERR;
+}
+
+/* Free an allocated file descriptor */
+static int _free_fd(filesystem* fs, int fd) {
+	if (false == fs->allocated_fds[fd])	/* fd was already free */
+		return FS_ERR;
+
+	fs->allocated_fds[fd] = false;
+	fs->fds[fd] = NULL;
+	fs->first_free_fd = fd;
+
+	return FS_OK;
+}
+
+/* Convert an inode to an in-memory directory */
+static dentv *_ino_to_dv(filesystem* fs, inode* ino) {
+	dentv *dv;
+	int reused = false;
+
+	if (NULL == ino) return NULL;
+
+	/* Refresh the directory's dentv in place if it already has one */
+	if (ino->v_attached && NULL != ino->datav.dir && ino == ino->datav.dir->ino) {
+		dv = ino->datav.dir;
+		reused = true;
+	} else {
+		dv = _newdv(fs, false, ino->data.dir.name);
+		if (NULL == dv) return NULL;
+	}
+
+	if (ino->num != ino->data.dir.parent)
+		dv->parent	= _inode_load(fs, ino->data.dir.parent);
+	else	dv->parent	= ino;
+
+	if (NULL == dv->parent) {
+		if (!reused) free(dv);
+		return NULL;
+	}
+
+	if (!reused) _fs._free_inode(dv->ino);
+
+	dv->ino			= ino;
+	dv->ino->datav.dir	= dv;
+
+	dv->ndirs		= dv->ino->data.dir.ndirs;
+	dv->nfiles		= dv->ino->data.dir.nfiles;
+	dv->nlinks		= dv->ino->data.dir.nlinks;
+
+	if (FS_ERR == _dir_reserve(dv, dv->ndirs, dv->nfiles, dv->nlinks)) {
+		if (!reused) free(dv);
+		return NULL;
+	}
+
+	dv->ino->v_attached	= true;
+
+	return dv;
+}
+
+/* Convert an inode to an in-memory file */
+static filev* _ino_to_fv(filesystem* fs, inode* ino) {
+	filev* fv = NULL;
+	if (NULL == ino) return NULL;
+
+	(void)fs;
+
+	/* The inode is already in memory: only the filev is new */
+	fv = (filev*)malloc(sizeof(filev));
+	if (NULL == fv) return NULL;
+
+	strncpy(fv->name, ino->data.file.name, FS_NAMEMAXLEN-1);
+	fv->name[FS_NAMEMAXLEN-1] = '\0';
+	fv->parent		= NULL;
+	fv->seek_pos		= 0;
+	fv->ino			= ino;
+	fv->ino->datav.file	= fv;
+	fv->ino->v_attached	= true;
+	fv->ino->mode		= FS_FILE;
+	fv->mode		= FS_READ;
+	return fv;
+}
+
+static hlinkv* _ino_to_lv(filesystem* shfs, inode* ino) {
+	hlinkv* lv = NULL;
+	if (NULL == ino) return NULL;
+	
+	lv = _newlv(shfs, false, ino->data.link.name);
+	if (NULL == lv) return NULL;
+	
+	_fs._free_inode(lv->ino);		/* Made by _newlv; @param ino replaces it */
+	lv->ino			= ino;
+	lv->ino->datav.link	= lv;
+	lv->ino->v_attached	= true;
+	lv->ino->mode		= FS_LINK;
+	return lv;
+}
+
+static hlinkv* _load_link(filesystem* fs, /* dentv* parent, */ inode_t num) {
+	inode* ino = _inode_load(fs, num);
+	hlinkv* lv = NULL;
+	filev* fv = NULL;
+	dentv* dv = NULL;
+	
+	if (NULL == ino) return NULL;
+	ino->datav.link = _ino_to_lv(fs, ino);
+	
+//	if (NULL == parent) {
+//		dentv* parent = _fs._load_dir(fs, ino->data.link.parent);
+//		ino->datav.file->parent	= parent->ino;
+//	}
+	
+	if (FS_FILE == ino->data.link.mode) {
+		fv = _fs._load_file(fs, ino->data.link.dest);
+		if (NULL == fv) {		/* Removed since the link was made */
+			_fs._unload_link(ino);
+			return NULL;
+		}
+		ino->datav.link->dest = fv->ino;
+	}
+	
+	else if (FS_DIR == ino->data.link.mode) {
+		dv = _fs._load_dir(fs, ino->data.link.dest);
+		if (NULL == dv) {
+			_fs._unload_link(ino);
+			return NULL;
+		}
+		ino->datav.link->dest = dv->ino;
+	}
+	
+	else if (FS_LINK == ino->data.link.mode) {
+		if (ino->data.link.dest != ino->num) {	/* Don't link a link to itself */
+			lv = _fs._load_link(fs, ino->data.link.dest);
+			ino->datav.link->dest = lv->ino;
+		}
+	}
+	
+	return ino->datav.link;
+}
+
+/* Free the memory allocated to an in-memory file structure */
+static int _unload_link(/* filesystem* fs, */ inode* ino) {
+//	int status1;
+	
+	free(ino->datav.file);
+	ino->datav.file = NULL;
+	ino->v_attached = false;
+	
+//	status1 = _inode_unload(fs, ino);
+//	if (FS_ERR == status1)
+//		return FS_ERR;
+	return FS_OK;
+}
+
+/* Given an inode number, load the corresponding file structure. 
+ * Wrap it in an inode which contains the in-memory version of the file */
+static filev* _load_file(filesystem* fs, /* dentv* parent, */ inode_t num) {
+	inode* ino = _inode_load(fs, num);
+	if (NULL == ino) return NULL;
+
+	/* Already in memory: keep its seek position and mode */
+	if (ino->v_attached && NULL != ino->datav.file)
+		return ino->datav.file;
+	
+	ino->datav.file = _ino_to_fv(fs, ino);
+	
+//	if (NULL == parent) {
+//		dentv* thisparent = _fs._load_dir(fs, ino->data.file.parent);
+//		ino->datav.file->parent	= thisparent->ino;
+//	}
+	
+	return ino->datav.file;
+}
+
+/* Free the memory allocated to an in-memory file structure */
+static int _unload_file(/*filesystem* fs, */ inode* ino) {
+//	int status1;
+
+	free(ino->datav.file);
+	ino->datav.file = NULL;
+	ino->v_attached = false;
+
+//	status1 = _inode_unload(fs, ino);
+//	if (FS_ERR == status1)
+//		return FS_ERR;
+	return FS_OK;
+}
+
+/* Given an inode number, load the corresponding dent
+ * Return a dentv whose field data.dir contains it. */
+static dentv* __load_dir(filesystem* fs, inode_t num) {
+	dentv *dv;
+	uint i;
+	inode* ino;
+	
+	
+	ino = _inode_load(fs, num);
+	if (NULL == ino) return NULL;
+
+	dv = _ino_to_dv(fs, ino);
+	if (NULL == dv) {
+		free(ino);
+		return NULL;
+	}
+
+	/* Only the parent is attached. Nothing is loaded for the siblings */
+	if (NULL != dv->parent && !dv->parent->v_attached) {
+		dv->parent->datav.dir = _ino_to_dv(fs, dv->parent);
+		dv->parent->v_attached = true;
+	}
+
+	if (NULL != dv->parent && NULL == dv->parent->datav.dir) {
+		free(dv);
+		return NULL;
+	}
+
+	/* Subdirectories and files are loaded as they are looked up. Keep the ones already in memory. */
+	for (i = 0; i < dv->ndirs; i++)
+		dv->dirs[i] = fs->attached_inodes[dv->ino->data.dir.dirs[i]];
+
+	for (i = 0; i < dv->nfiles; i++)
+		dv->files[i] = fs->attached_inodes[dv->ino->data.dir.files[i]];
+	
+	_fs._inode_prefetch(fs, dv->ino->data.dir.links, dv->nlinks);
+	for (i = 0; i < dv->nlinks; i++) {
+		hlinkv* lv = _load_link(fs, /*dv,*/ dv->ino->data.dir.links[i]);
+		dv->links[i] = NULL != lv ? lv->ino : _inode_load(fs, dv->ino->data.dir.links[i]);
+	}
+	
+	return dv;
+}
+
+/* __load_dir, timed for stats */
+static dentv* _load_dir(filesystem* fs, inode_t num) {
+	uint64_t t = stats_now();
+	dentv* dv = __load_dir(fs, num);
+	stats_record_args(ST_LOAD_DIR, t, -1, (long)num);
+	return dv;
+}
+
+/* Free the memory occupied by a dentv*/
+static int _unload_dir(filesystem* fs, inode* ino) {
+	size_t i;
+	int status1, status2;
+	dentv* dv = NULL;
+
+	if (FS_DIR != ino->mode) return FS_ERR;
+
+	dv = ino->datav.dir;
+	ino->v_attached = false;
+
+	status1 = _fs._sync(fs);
+	status2 = ino->dirty ? _inode_store(fs, ino) : FS_OK;
+	
+	if (FS_ERR == status1 || FS_ERR == status2)
+		return FS_ERR;
+
+	if (NULL != dv) {
+		/* Subdirectories keep their own dentvs: they only point at this inode */
+		for (i = 0; i < dv->nfiles; i++)
+			if (NULL != dv->files[i])
+				_unload_file(dv->files[i]);
+		
+		for (i = 0; i < dv->nlinks; i++)
+			_unload_link(dv->links[i]);
+		
+		free(dv->dirs);
+		free(dv->files);
+		free(dv->links);
+		free(ino->datav.dir);
+		ino->datav.dir = NULL;
+	}
+	
+//	_inode_unload(fs, ino);
+
+	return FS_OK;
+}
+
+/* Load a volatile structure from disk and put it in an inode*/
+static int _v_attach(filesystem* fs, inode* ino) {
+	if (NULL == ino) return FS_ERR;
+
+	if (fs->sb.root == ino->num) {
+		ino->datav.dir = ino->datav.dir;
+		return FS_OK;
+	}
+	
+	if (!ino->v_attached) {
+		switch (ino->mode) {
+
+			case FS_DIR:
+			{
+				ino->datav.dir = _load_dir(fs, ino->num);
+				break;
+			}
+			case FS_FILE:
+			{
+				ino->datav.file = _load_file(fs, ino->num);
+				break;
+			}
+			case FS_LINK:
+			{
+				ino->datav.link = _load_link(fs, ino->num);
+				break;
+			}
+		}
+
+		if (NULL == ino->datav.dir) return FS_ERR;
+		ino->v_attached = true;
+	}
+	return FS_OK;
+}
+
+/* Write the data in an inode disk and free the in-memory data */
+static int _v_detach(filesystem* fs, inode* ino) {
+	if (NULL == ino) return FS_ERR;
+	
+	if (ino->v_attached) {
+		switch (ino->mode) {
+			
+			case FS_DIR:
+			{
+				_unload_dir(fs, ino);
+				break;
+			}
+			case FS_FILE:
+			{
+				_unload_file(ino);
+				break;
+			}
+			case FS_LINK:
+			{
+				_unload_link(ino);
+				break;
+			}
+		}
+		ino->v_attached = false;
+	}
+
+	return FS_OK;
+}
+
+/* Find the subdirectory @param name of @param dv. Only the matching
+ * subdirectory is loaded; the others are skipped by the hash of their
+ * name, or compared by their inodes. A hashed directory looks only in
+ * the bucket of its index the name goes in. */
+static inode* _dirs_iterate(filesystem* fs, dentv* dv, const char* name) {
+	size_t i, step = 0;
+	dent* d = &dv->ino->data.dir;
+	uint32_t hash = _name_hash(name);
+	inode* sub;
+	dentv* match;
+
+	if (NULL == d->index) _prefetch_matching(fs, d->dirs, d->dhash, dv->ndirs, hash);
+	while (_dent_next(d, FS_DIR, hash, &step, &i)) {			// For each subdirectory the name may be
+		sub = _fs._inode_load(fs, d->dirs[i]);
+		if (NULL == sub || FS_DIR != sub->mode) continue;
+		d->dhash[i] = _name_hash(sub->data.dir.name);
+
+		if (!strcmp(sub->data.dir.name, name)) {			// If we have a matching directory name
+			match = _fs._load_dir(fs, d->dirs[i]);
+			if (NULL == match) return NULL;
+			dv->dirs[i] = match->ino;
+			return match->ino;
+		}
+	}
+	return NULL;
+}
+
+static inode* _files_iterate(filesystem* fs, dentv* dv, const char* name) {
+	size_t i, step = 0;
+	dent* d = &dv->ino->data.dir;
+	uint32_t hash = _name_hash(name);
+	
+	if (NULL == d->index) _prefetch_matching(fs, d->files, d->fhash, dv->nfiles, hash);
+
+	/* Iterate over files */
+	while (_dent_next(d, FS_FILE, hash, &step, &i)) {				// For each file the name may be
+		filev* fv;
+
+		fv = _load_file(fs, /*dv,*/ d->files[i]);
+		if (NULL == fv) continue;
+		d->fhash[i] = _name_hash(fv->name);
+		
+		if (!strcmp(fv->name, name)) {
+			dv->files[i] = fv->ino;
+			
+			if (!dv->files[i]->v_attached) {				// Load the file from disk if not already in memory
+				if (FS_ERR == _v_attach(fs, dv->files[i]))
+					break;
+			}
+			return dv->files[i];
+		}
+		//else _unload_file(fs, fv->ino);					/* Hack: not freeing, unloading, closing anything */
+	}
+	return NULL;									/* No matching inode found */
+}
+
+static inode* _links_iterate(filesystem* fs, dentv* dv, const char* name) {
+	size_t i, step = 0;
+	dent* d = &dv->ino->data.dir;
+	uint32_t hash = _name_hash(name);
+
+	/* Iterate over links */
+	while (_dent_next(d, FS_LINK, hash, &step, &i)) {				// For each link the name may be
+		if (!strcmp(dv->links[i]->data.link.name, name)) {
+			
+			if (!dv->links[i]->v_attached) {				// Load the file from disk if not already in memory
+				if (FS_ERR == _v_attach(fs, dv->links[i]))
+					break;
+			}
+			dv->links[i]->datav.link->parent = dv->ino; /* Hack */
+			return dv->links[i];
+		}
+	}
+	return NULL;									/* No matching inode found */
+	
+}
+
+/* Forget the directories _lookup remembers. Called when a directory or link is removed. */
+static void _lookup_forget(filesystem* fs) {
+	size_t i;
+
+	for (i = 0; i < FS_LOOKUPCACHE; i++) {
+		free(fs->lookup.path[i]);
+		fs->lookup.path[i] = NULL;
+	}
+	fs->lookup.next = 0;
+}
+
+/* Remember that the first @param len chars of @param path name directory @param num */
+static void _lookup_remember(filesystem* fs, const char* path, size_t len, inode_t num) {
+	size_t i;
+	char* key;
+
+	for (i = 0; i < FS_LOOKUPCACHE; i++)
+		if (NULL != fs->lookup.path[i] && len == fs->lookup.len[i] &&
+			0 == strncmp(fs->lookup.path[i], path, len))
+			return;
+
+	key = (char*)malloc(len + 1);
+	if (NULL == key) return;
+	memcpy(key, path, len);
+	key[len] = '\0';
+
+	i = fs->lookup.next;
+	free(fs->lookup.path[i]);
+	fs->lookup.path[i] = key;
+	fs->lookup.len[i] = len;
+	fs->lookup.num[i] = num;
+	fs->lookup.next = (i + 1) % FS_LOOKUPCACHE;
+}
+
+/* Get the inode of a directory, link, or file, at the end of @param path,
+ * e.g. "/bob/dylan/is/old". The fields are taken one at a time straight
+ * from the string. The walk starts from the deepest directory on the path
+ * that an earlier lookup remembered, else from the root. "." and ".." are
+ * followed. Return the inode at the end of this path or NULL if not found.
+ */
+static inode* _lookup(filesystem* fs, const char* path) {
+	dentv* dv;
+	inode* ino = NULL;
+	const char* field;
+	char name[FS_NAMEMAXLEN];
+	size_t i, len, best = 0, dirlen = 0;
+	int slot = -1;
+	inode_t dirnum = 0;
+
+	if (NULL == fs || NULL == fs->root || NULL == path) return NULL;
+
+	/* Start from the deepest remembered ancestor */
+	for (i = 0; i < FS_LOOKUPCACHE; i++) {
+		len = fs->lookup.len[i];
+		if (NULL == fs->lookup.path[i] || len <= best) continue;
+		if (0 != strncmp(fs->lookup.path[i], path, len)) continue;
+		if ('/' != path[len] && '\0' != path[len]) continue;
+		best = len;
+		slot = (int)i;
+	}
+	if (-1 != slot) {
+		ino = _fs._inode_load(fs, fs->lookup.num[slot]);
+		if (NULL == ino || FS_DIR != ino->mode) {
+			ino = NULL;
+			best = 0;
+		}
+	}
+	if (NULL == ino) ino = fs->root->ino;
+
+	field = &path[best];
+	while (true) {
+		field += strspn(field, "/");
+		len = strcspn(field, "/");
+		if (0 == len) break;
+		if (FS_NAMEMAXLEN <= len) return NULL;
+
+		/* Only directories have fields below them. Links to them are followed. */
+		for (i = 0; FS_LINK == ino->mode && i < FS_MAXLINKDEPTH; i++) {
+			ino = _fs._inode_load(fs, ino->data.link.dest);
+			if (NULL == ino) return NULL;
+		}
+		if (FS_DIR != ino->mode) return NULL;
+		dv = ino->datav.dir;
+		if (NULL == dv || !ino->v_attached) dv = _fs._load_dir(fs, ino->num);
+		if (NULL == dv) return NULL;
+
+		memcpy(name, field, len);
+		name[len] = '\0';
+		field += len;
+
+		if (!strcmp(name, "."))
+			continue;
+		else if (!strcmp(name, ".."))
+			ino = _fs._inode_load(fs, dv->ino->data.dir.parent);
+		else {
+			ino = _fs._dirs_iterate(fs, dv, name);
+			if (NULL == ino) ino = _fs._files_iterate(fs, dv, name);
+			if (NULL == ino) ino = _fs._links_iterate(fs, dv, name);
+		}
+		if (NULL == ino) return NULL;
+
+		if (FS_DIR == ino->mode) {
+			dirlen = (size_t)(field - path);
+			dirnum = ino->num;
+		}
+	}
+
+	/* Remember the deepest directory reached for the next lookup */
+	if (dirlen > best)
+		_lookup_remember(fs, path, dirlen, dirnum);
+
+	/* Directories come back attached, as files and links do */
+	if (FS_DIR == ino->mode && (NULL == ino->datav.dir || !ino->v_attached)) {
+		dv = _fs._load_dir(fs, ino->num);
+		if (NULL == dv) return NULL;
+		ino = dv->ino;
+	}
+
+	return ino;
+}
+
+/* Return the given string less the first character */
+static char* _strSkipFirst(char* str) {
+	return &str[1];
+}
+
+/* Return the given string less the last character */
+static char* _strSkipLast(char* str) {
+	size_t len;
+	if (NULL == str || '\0' == str[0]) 
+		return NULL;
+
+	len = strlen(str);
+	str[len - 1] = '\0';
+	return str;
+}
+
+/* Trim the leading and trailing white space from a string. 
+ * The string is shifted into the first position so that free()
+ * still works. http://stackoverflow.com/a/122974/472308 */
+static char* _trim(char *str)
+{
+	size_t len = 0;
+	char *frontp = str - 1;
+	char *endp = NULL;
+
+	if( str == NULL )
+		return NULL;
+
+	if( str[0] == '\0' )
+		return str;
+
+	len = strlen(str);
+	endp = str + len;
+
+	/* Move the front and back pointers to address
+	* the first non-whitespace characters from
+	* each end.
+	*/
+	while( isspace(*(++frontp)) );
+	while( isspace(*(--endp)) && endp != frontp );
+
+	if( str + len - 1 != endp )
+		*(endp + 1) = '\0';
+	else if( frontp != str &&  endp == frontp )
+		*str = '\0';
+
+	/* Shift the string so that it starts at str so
+	* that if it's dynamically allocated, we can
+	* still free it on the returned pointer.  Note
+	* the reuse of endp to mean the front of the
+	* string buffer now.
+	*/
+	endp = str;
+	if( frontp != str )
+	{
+		while( *frontp ) *endp++ = *frontp++;
+		*endp = '\0';
+	}
+
+
+	return str;
+}
+/* Remove leading and final forward slashes from a string
+ * if they exist */
+static char* _pathTrimSlashes(char* path) {
+	size_t len;
+	if (NULL == path || '\0' == path[0]) 
+		return NULL;
+
+	if ('/' == path[0])		
+		path = _strSkipFirst(path);	/* Remove leading forward slash */
+	
+	len = strlen(path);
+	
+	if (0 == len) return path;
+	
+	if ('/' == path[len - 1])	
+		path = _strSkipLast(path);	/* Remove trailing forward slash */
+
+	return path;
+}
+
+/* Split a string on "/" and handle . and .. operators */
+static fs_path* _pathFromString(const char* str) {
+	size_t i, n = 0;
+	char* field;
+	fs_path *p  = NULL;
+	if (NULL == str || 0 == strlen(str)) return NULL;
+	
+	p = _tokenize(str, "/");
+	if (NULL == p) return NULL;
+	
+	/* Keep the fields that remain in the first n, moving pointers rather than names */
+	for (i = 0; i < p->nfields; i++) {
+		if (!strcmp(p->fields[i], ".")) continue;
+
+		if (!strcmp(p->fields[i], "..")) {
+			if (0 == n) {		/* Can't go above the root */
+				_pathFree(p);
+				return NULL;
+			}
+			n--;
+			continue;
+		}
+
+		field = p->fields[n];
+		p->fields[n++] = p->fields[i];
+		p->fields[i] = field;
+	}
+	p->nfields = n;
+
+	return p;
+}
+
+/* Return an absolute path */
+static char* _stringFromPath(fs_path* p) {
+	size_t i, len = 1;
+	char* path;
+	char* end;
+	
+	if (NULL == p) return NULL;
+
+	for (i = p->firstField; i < p->nfields; i++)
+		len += strlen(p->fields[i]) + 1;
+
+	path = (char*)malloc(len + 1);
+	if (NULL == path) return NULL;
+
+	end = path;
+	*end++ = '/';
+	for (i = p->firstField; i < p->nfields; i++) {
+		len = strlen(p->fields[i]);
+		memcpy(end, p->fields[i], len);
+		end += len;
+		*end++ = '/';
+	}
+	*end = '\0';
+
+	return path;
+}
+
+/* Get the path minus the last field, e.g. "a/b" from "a/b/c" */
+static char* _pathSkipLast(fs_path* p) {
+	char* path;
+
+	if (NULL == p) return NULL;
+	if (0 == p->nfields) {
+		char* ret = (char*)malloc(1);
+		ret[0] = '\0';
+		return ret;
+	}
+
+	if (!strcmp(p->fields[0], "/"))
+		return p->fields[0];
+
+	p->nfields--;
+	path = _stringFromPath(p);
+	p->nfields++;
+
+	return path;
+}
+
+/* Get the last field in the path, e.g. "c" from "a/b/c" */
+static char* _pathGetLast(fs_path* p) {
+	char* p_str;
+
+	if (NULL == p) return NULL;
+
+	p->firstField = p->nfields - 1;
+	p_str = _stringFromPath(p);
+	p->firstField = 0;
+
+	p_str = _pathTrimSlashes(p_str);
+
+	return p_str;
+}
+
+/* Append the "/"-separated fields of @param appendage to a path structure */
+static int _pathAppend(fs_path* p, const char* appendage) {
+	const char* next_field = appendage;
+	size_t len;
+	int appended = false;
+	
+	if (	NULL == p || 
+		NULL == appendage || 
+		'\0' == appendage[0]	) 
+	{ return FS_ERR; }
+
+	while ('\0' != *next_field) {
+		next_field += strspn(next_field, "/");
+		len = strcspn(next_field, "/");
+		if (0 == len) break;
+
+		if (FS_ERR == _pathPush(p, next_field, len))
+			return FS_ERR;
+		next_field += len;
+		appended = true;
+	}
+
+	return appended ? FS_OK : FS_ERR;	/* Nothing but "/" */
+}
+
+static char* _getAbsolutePath(char* current_dir, char* path) {
+	fs_path* p = NULL;
+	char* abs_path = NULL;
+	char* path_tmp;
+	size_t dlen;
+
+	if ('/' == path[0]) {	/* Path is already absolute*/
+		p = _pathFromString(path);
+		abs_path = _stringFromPath(p);
+	} else {
+		dlen = strlen(current_dir);
+		path_tmp = (char*)malloc(dlen + strlen(path) + 2);
+		if (NULL == path_tmp) return NULL;
+
+		memcpy(path_tmp, current_dir, dlen);
+		path_tmp[dlen] = '/';
+		strcpy(&path_tmp[dlen+1], path);
+
+		p = _pathFromString(path_tmp);
+		abs_path = _stringFromPath(p);
+		free(path_tmp);
+	}
+	_pathFree(p);
+	return abs_path;
+}
+
+/* Walk a directory up to the root, then append the dir names from the root back down */
+static char* _getAbsolutePathDV(filesystem* shfs, dentv* dv, fs_path *p) {
+	dentv** chain = NULL;		/* dv and its ancestors below the root */
+	int* didAttach = NULL;		/* Whether we attached the parent of chain[i] */
+	size_t i, n = 0, max = 0;
+	void* grown;
+	char* path = NULL;
+
+	if (NULL == dv || NULL == dv->parent) return NULL;
+
+	if (!strcmp(dv->name, "/"))	/* Stop at root or we will loop forever */
+		return "/";
+
+	while (NULL != dv && NULL != dv->parent && strcmp(dv->name, "/")) {
+		if (n == max) {
+			max = max ? 2*max : FS_PATHFIELDS_MIN;
+			grown = realloc(chain, max*sizeof(dentv*));
+			if (NULL == grown) break;
+			chain = (dentv**)grown;
+			grown = realloc(didAttach, max*sizeof(int));
+			if (NULL == grown) break;
+			didAttach = (int*)grown;
+		}
+
+		chain[n] = dv;
+		didAttach[n] = false;
+		if (!dv->parent->v_attached) {
+			_v_attach(shfs, dv->parent);
+			didAttach[n] = true;
+		}
+		dv = dv->parent->datav.dir;
+		n++;
+	}
+
+	/* Only a chain that reached the root makes a path */
+	if (NULL != dv && !strcmp(dv->name, "/")) {
+		for (i = n; i > 0; i--)
+			_pathAppend(p, chain[i-1]->name);
+		path = _stringFromPath(p);
+	}
+
+	for (i = 0; i < n; i++)
+		if (didAttach[i])
+			_v_detach(shfs, chain[i]->parent);
+
+	free(chain);
+	free(didAttach);
+	return path;
+}
+
+/* A special version of mkdir that makes the root dir
+ * @param newfs if true, load a preexisting root dir
+ * Else make a new root dir */
+static dentv* _mkroot(filesystem *fs, int newfs) {
+	dentv* dv = NULL;
+	
+	if (newfs) {
+		dv = _new_dir(fs, NULL, "/");
+		if (NULL == dv) return NULL;
+
+		dv->parent	= dv->ino;
+		dv->ino->data.dir.parent = dv->ino->num;
+
+		fs->sb.root = dv->ino->num;
+	}
+	else {
+		dv = _load_dir(fs, fs->sb.root);
+		if (NULL == dv) return NULL;
+	}
+
+	return dv;
+}
+
+/* malloc memory for a block, zero-out its fields
+ * Returns the allocated block */
+static block* _newBlock() {
+	block* b = (block*)malloc(sizeof(block));
+	memset(b->data, 0, sizeof(b->data));	// Zero-out
+	b->next = 0;
+	b->num = 0;
+
+	return b;
+}
+
+/* Preallocate a contiguous file. Differs across platforms 
+ * Note: this does NOT set the file to the given size. The OS
+ * attempts to "preallocate" the contiguousspace in its filesystem blocks,
+ * but the file will not appear to be of that size. 
+ * Therefore, this offers merely a performance benefit.
+ * Returns FS_OK on success, FS_ERR on failure. */
+static int _prealloc(filesystem* fs) {
+	int status;
+#if defined(_WIN64) || defined(_WIN32)	// Have to put declaration here.
+	LARGE_INTEGER offset;		// because Visual C compiler is OLD school
+#endif
+
+	_safeopen(fs, "wb");
+	if (NULL == fs->fp) return FS_ERR;		
+
+#if defined(_WIN64) || defined(_WIN32)
+	offset.QuadPart = BLKSIZE*MAXBLOCKS;
+	status = SetFilePointerEx(fs->fp, offset, NULL, FILE_BEGIN);
+	SetEndOfFile(fs->fp);
+#elif __APPLE__	/* __MACH__ also works */
+	fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, BLKSIZE*MAXBLOCKS, 0};
+	status = fcntl(fileno(fs->fp), F_PREALLOCATE, &store);
+#elif __unix__
+	status = posix_fallocate(fileno(fs->fp), 0, BLKSIZE*MAXBLOCKS);
+#endif
+
+	_safeclose(fs);
+
+	if (status < 0) { 
+		perror("allocation error");
+		return status;
+	}
+
+	return FS_OK;
+}
+
+/* Zero-out the on-disk file 
+ * Returns FS_OK on success, FS_ERR on failure */
+static int _zero(filesystem* fs) {
+	int i;
+	_safeopen(fs, "rb+");
+	if (NULL == fs->fp) return FS_ERR;
+
+	for (i = 0; i < MAXBLOCKS; i++) {
+		block* newBlock = _newBlock();
+		char temp[128];
+		sprintf(temp, "%d", i);
+		memcpy(newBlock->data, temp, strlen(temp));
 		
-		/* If the head is the only subdir */
-		if (dv->parent->data.dir.head == dv->ino->data.dir.next) {
-			onlysubdir = true;
-			dv->parent->data.dir.head = 0;
-			dv->parent->datav.dir->head = NULL;
+		if (0 != fseek(fs->fp, BLKSIZE*i, SEEK_SET)) {
+			free(newBlock);
+			return FS_ERR;
 		}
-		else {
-			dv->parent->data.dir.head = dv->ino->data.dir.next;
-			dv->parent->datav.dir->head = dv->ino->datav.dir->next;
+		fputs(newBlock->data, fs->fp);
+		free(newBlock);
+	}
+	_safeclose(fs);
+	return FS_OK;
+}
+
+/* Drop the inode @param ino from memory without writing anything */
+static void _inode_evict(filesystem* fs, inode* ino) {
+	if (FS_DIR == ino->mode && NULL != ino->datav.dir) {
+		free(ino->datav.dir->dirs);
+		free(ino->datav.dir->files);
+		free(ino->datav.dir->links);
+	}
+	free(ino->datav.dir);		/* Whichever of dentv, filev or hlinkv it is */
+	fs->attached_inodes[ino->num] = NULL;
+	_free_inode(ino);
+}
+
+/* Free a filesystem and everything it holds in memory, and close its file.
+ * Only the space of removed files is freed on disk; flush it first to
+ * keep its other changes. */
+static void _release(filesystem* fs) {
+	size_t i;
+
+	if (NULL == fs) return;
+
+	/* Nothing else would free the space of removed files */
+	while (0 < _fs._reclaim_step(fs, MAXBLOCKS));
+
+	for (i = 0; NULL != fs->attached_inodes && i < MAXINODES; i++)
+		if (NULL != fs->attached_inodes[i])
+			_inode_evict(fs, fs->attached_inodes[i]);
+
+	_lookup_forget(fs);
+	free(fs->defrag.queue);
+	free(fs->reclaim.queue);
+	free(fs->dedup);
+	free(fs->ondisk.dedup);
+	free(fs->dedup_buckets);
+	free(fs->dedup_chain);
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_destroy(&fs->commit.lock);
+	pthread_cond_destroy(&fs->commit.done);
+#endif
+	_safeclose(fs);
+	free(fs->fname);
+	free(fs->block_cache);
+	free(fs->block_cache_valid);
+	free(fs->attached_inodes);
+	free(fs);
+}
+
+/* Create a new filesystem kept in the file @param fname. @param newfs
+ * specifies if we open a file on disk or create a new one (overwriting
+ * the previous)
+ * Returns a pointer to the allocated filesystem */
+static filesystem* _init(const char* fname, int newfs) {
+	filesystem *fs = NULL;
+	size_t i;
+
+	if (NULL == fname || '\0' == fname[0]) return NULL;
+
+	fs = (filesystem*)calloc(1, sizeof(filesystem));
+	if (NULL == fs) return NULL;
+
+	/* Memory for the block cache is only taken as blocks are used */
+	fs->fname		= (char*)malloc(strlen(fname) + 1);
+	fs->block_cache		= (block*)calloc(MAXBLOCKS, sizeof(block));
+	fs->block_cache_valid	= (uint8_t*)calloc(MAXBLOCKS, sizeof(uint8_t));
+	fs->attached_inodes	= (inode**)calloc(MAXINODES, sizeof(inode*));
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_init(&fs->commit.lock, NULL);
+	pthread_cond_init(&fs->commit.done, NULL);
+#endif
+
+	if (NULL == fs->fname || NULL == fs->block_cache || NULL == fs->block_cache_valid || NULL == fs->attached_inodes) {
+		_release(fs);
+		return NULL;
+	}
+	strcpy(fs->fname, fname);
+
+	if (newfs) {
+		int err1, err2;
+
+		err1 = _prealloc(fs);		/* Make a contiguous file on disk (performance enhancement) */
+		err2 = _zero(fs);		/* Zero-out all filesystem blocks */
+
+		if (FS_ERR == err1 || FS_ERR == err2) {
+			_release(fs);
+			return NULL;
+		}
+	}
+
+	_safeopen(fs, "rb+");	/* Test if file exists */
+	if (NULL == fs->fp) {
+		_release(fs);
+		return NULL;
+	}
+
+	/* Zero-out fields */
+	memset( &fs->fb_map, 0,			sizeof(map));
+	memset( &fs->ino_map, 0,		sizeof(map));
+	memset( &fs->sb_i.blocks, 0,		SUPERBLOCK_MAXBLOCKS*sizeof(block_t));
+	memset( &fs->sb.inode_first_blocks, 0,	sizeof(fs->sb.inode_first_blocks));
+	memset( &fs->sb.inode_block_counts, 0,	sizeof(fs->sb.inode_block_counts));
+	memset( &fs->sb.inode_table, 0,		sizeof(fs->sb.inode_table));
+	memset( &fs->allocated_fds, 0,		FS_MAXOPENFILES*sizeof(fd_t));
+	memset( &fs->fds, 0,			FS_MAXOPENFILES*sizeof(filev*));
+
+	memset( &fs->ondisk, 0,			sizeof(fs->ondisk));	/* A new image is all zeros */
+
+	memset( &fs->defrag, 0,			sizeof(fs->defrag));
+	memset( &fs->lookup, 0,			sizeof(fs->lookup));
+
+	fs->commit.requested = 0;
+	fs->commit.completed = 0;
+	fs->commit.running = false;
+	fs->commit.status = FS_OK;
+	
+	for (i = 0; i < 5; i++)
+		_map_set(&fs->fb_map, i);				/* First five blocks reserved */
+	_map_set(&fs->ino_map, 0);					/* Inode 0 means "none" */
+	_map_set(&fs->ino_map, 1);
+	fs->sb.free_blocks_base	= 5;					/* Start allocating from 6th block */
+	fs->sb.free_inodes_base	= 2;					/* Start allocating from 3rd inode */
+	fs->sb.nfree_blocks	= MAXBLOCKS - 5;
+	fs->sb.nfree_inodes	= MAXINODES - 2;
+	memset( &fs->sb.free_extents, 0,	sizeof(fs->sb.free_extents));
+	_free_extents_add(fs, MAXBLOCKS - 5, 1);			/* Everything else is one free run */
+	fs->nreserved_blocks	= 0;
+	fs->sb.root		= 0;
+	fs->sb_i.magic		= FS_MAGIC;
+	fs->sb_i.nblocks	= sizeof(superblock)/stride + 1; 	/* How many free blocks needed for superblock */
+	fs->first_free_fd = 0;
+
+	if (newfs) {
+		_mballoc(fs, fs->sb_i.nblocks, fs->sb_i.blocks);		/* Allocate n blocks, tell us which we got */
+		fs->root = _mkroot(fs, newfs);				/* Setup root dir */
+
+		if (NULL == fs->root) {
+			_release(fs);
+			return NULL;
+		}
+	}
+	return fs;
+}
+
+/* Return the address of the pointer to data block @param n of an inode.
+ * Data blocks are numbered across the direct, singly, doubly, and triply
+ * indirected block pointers in that order. Returns NULL past the last one. */
+static block** _inode_block_slot(inode* ino, size_t n) {
+	if (NULL == ino) return NULL;
+
+	if (n < MAXBLOCKS_DIRECT)
+		return &ino->directblocks[n];
+	n -= MAXBLOCKS_DIRECT;
+
+	if (n < MAXBLOCKS_IB1)
+		return &ino->ib1->blocks[n];
+	n -= MAXBLOCKS_IB1;
+
+	if (n < MAXBLOCKS_IB2)
+		return &ino->ib2->iblocks[n / NBLOCKS_IBLOCK]->blocks[n % NBLOCKS_IBLOCK];
+	n -= MAXBLOCKS_IB2;
+
+	if (n < MAXBLOCKS_IB3)
+		return &ino->ib3->iblocks[n / MAXBLOCKS_IB2]->iblocks[(n % MAXBLOCKS_IB2) / NBLOCKS_IBLOCK]->blocks[n % NBLOCKS_IBLOCK];
+
+	return NULL;
+}
+
+/* Whether data block @param n of an inode is a hole: it has no block on
+ * disk and is not in memory either, and reads as zeros. A file stored
+ * compressed has none; its data blocks are all in frames. */
+static int _inode_hole(inode* ino, size_t n) {
+	block** slot;
+
+	if (NULL == ino || (ino->flags & FS_ZSTORED)) return false;
+
+	slot = _inode_block_slot(ino, n);
+	return NULL != slot && NULL == *slot && 0 == ino->blocks[n];
+}
+
+/* Fill the input @param data into the blocks pointed to by
+ * @param ino. Start at @param seek_pos. Spill into Indirect block pointers, 
+ * doubly-indirected block pointers, and triply-indirected block 
+ * pointers as needed. Files no bigger than FS_INLINEDATA are kept
+ * in the inode and get no data blocks at all.
+ * The data only goes to the in-memory blocks; new blocks get their
+ * place on disk when the file is flushed (see _inode_alloc_delayed).
+ */
+static int _inode_fill_blocks_from_data(filesystem* fs, inode* ino, size_t seek_pos, char* data) {
+	size_t write_cnt = 0;		/* Number of bytes written */
+	size_t write_increment;		/* Number of bytes written to the current block */
+	size_t slen;			/* Size in bytes of the input data */
+	size_t nblocks_needed;		/* Number of data blocks the file needs after this write */
+	
+	block_t blk;			/* First block to begin writing at */
+	size_t offset;			/* Byte offset in first block to begin writing at */
+	block** slot;			/* The data block being written to */
+	size_t i, nkeep;
+
+	if (NULL == data) return FS_ERR;
+
+	slen = strlen(data);
+
+	/* Small file: store it inline */
+	if (0 == ino->ndatablocks && seek_pos + slen <= FS_INLINEDATA) {
+		memcpy(&ino->idata[seek_pos], data, slen);
+		if (ino->size < seek_pos + slen)
+			ino->size = seek_pos + slen;
+		ino->dirty = true;
+		return FS_OK;
+	}
+
+	offset = seek_pos % stride;
+	blk = (block_t) (seek_pos / stride);
+
+	/* Add buffers for the blocks this write runs into. The blocks a write
+	 * past the end skips over are left as holes, but an inline file's
+	 * first block takes what the file held. */
+	nblocks_needed = (seek_pos + slen + stride - 1) / stride;
+	if (nblocks_needed > MAXFILEBLOCKS) return FS_ERR;	/* File would be too big */
+	if (nblocks_needed > ino->ndatablocks) {
+		nkeep = 0 == ino->ndatablocks && 0 != ino->size ? 1 : ino->ndatablocks;
+
+		if (blk > nkeep && !(ino->flags & FS_ZSTORED)) {
+			if (FS_ERR == _fs._inode_extend_datablocks(fs, ino, nkeep - ino->ndatablocks))
+				return FS_ERR;
+
+			for (i = ino->ndatablocks; i < blk; i++) {
+				ino->blocks[i] = 0;
+				ino->dirtyblocks[i] = false;
+			}
+			ino->ndatablocks = blk;
+			ino->dirty = true;
+		}
+
+		if (FS_ERR == _fs._inode_extend_datablocks(fs, ino, nblocks_needed - ino->ndatablocks))
+			return FS_ERR;
+	}
+
+	while (write_cnt < slen) {
+		slot = _inode_block_slot(ino, blk);
+		if (NULL == slot) return FS_ERR;	/* Out of blocks */
+
+		if (NULL == *slot && (ino->flags & FS_ZSTORED)) {	/* In a frame not read in yet */
+			if (FS_ERR == _fs._zframe_load(fs, ino, blk / FS_ZFRAME))
+				return FS_ERR;
+		}
+		else if (NULL == *slot && 0 == ino->blocks[blk]) {	/* A hole: it gets a block of its own */
+			if (fs->nreserved_blocks + 1 > fs->sb.nfree_blocks)
+				return FS_ERR;		/* Would not fit on disk */
+			*slot = _newBlock();
+			ino->nblocks++;
+			ino->dirty = true;
+			fs->nreserved_blocks++;
+		}
+		else if (NULL == *slot) {		/* On disk but not read in yet */
+			*slot = _newBlock();
+			_fs.readblock(fs, *slot, ino->blocks[blk]);
+		}
+
+		write_increment = min(stride - offset, slen - write_cnt);
+		memcpy(&(*slot)->data[offset], &data[write_cnt], write_increment);
+		write_cnt += write_increment;
+		ino->dirtyblocks[blk] = true;
+
+		/* Going to the next block. Reset byte offset to 0. */
+		offset = 0;
+		blk++;
+	}
+
+	/* A write inside the file leaves its end where it was */
+	if (ino->size < write_cnt + seek_pos) {
+		ino->size = write_cnt + seek_pos;
+		ino->dirty = true;
+	}
+	return FS_OK;
+}
+
+/* Read data from blocks on disk into the blocks and iblocks of an inode.
+ * Only blocks that are not in memory yet are read. */
+static int _inode_fill_blocks_from_disk(filesystem* fs, inode* ino) {
+	block_t blk = 0;
+	block** slot;
+
+	size_t nblocks_read = 0;
+	
+	if (NULL == ino) return FS_ERR;
+
+	/* Stored compressed: the frames are read and decompressed whole */
+	if (ino->flags & FS_ZSTORED) {
+		for (nblocks_read = 0; nblocks_read < ino->ndatablocks; nblocks_read += FS_ZFRAME)
+			if (FS_ERR == _fs._zframe_load(fs, ino, nblocks_read / FS_ZFRAME))
+				return FS_ERR;
+		return FS_OK;
+	}
+
+	while (nblocks_read < ino->ndatablocks) {
+		blk = (block_t)nblocks_read;
+
+		slot = _inode_block_slot(ino, nblocks_read);
+		if (NULL == slot) return FS_ERR;
+
+		/* Blocks already in memory may hold writes not yet on disk. Holes stay holes */
+		if (NULL == *slot && 0 != ino->blocks[blk]) {
+			*slot = _newBlock();
+			_fs.readblock(fs, *slot, ino->blocks[blk]);
+		}
+		nblocks_read += 1;
+	}
+
+	return FS_OK;
+}
+
+/* Add @param count data blocks to an inode. They are only buffered in 
+ * memory; _inode_alloc_delayed gives them a place on disk when the file 
+ * is flushed. An inline file moves its contents into its first data block. */
+static int _inode_extend_datablocks(filesystem* fs, inode* ino, size_t count) {
+	size_t i;
+	block** slot;
+
+	if (NULL == fs || NULL == ino) return FS_ERR;
+	if (0 == count) return FS_OK;
+	if (ino->ndatablocks + count > MAXFILEBLOCKS) return FS_ERR;	/* File would be too big */
+
+	/* Short of space: free what removed files still hold first */
+	while (fs->nreserved_blocks + count > fs->sb.nfree_blocks && 0 < _fs._reclaim_step(fs, MAXBLOCKS));
+	if (fs->nreserved_blocks + count > fs->sb.nfree_blocks) return FS_ERR;	/* Would not fit on disk */
+
+	for (i = ino->ndatablocks; i < ino->ndatablocks + count; i++) {
+		slot = _inode_block_slot(ino, i);
+
+		*slot = _newBlock();
+		ino->blocks[i] = 0;		/* Not allocated yet */
+		ino->dirtyblocks[i] = true;
+	}
+
+	/* The file outgrew its inode */
+	if (0 == ino->ndatablocks) {
+		slot = _inode_block_slot(ino, 0);
+		memcpy((*slot)->data, ino->idata, min(ino->size, FS_INLINEDATA));
+		memset(ino->idata, 0, FS_INLINEDATA);
+	}
+	
+	ino->nblocks += count;
+	ino->ndatablocks += count;
+	ino->dirty = true;
+	fs->nreserved_blocks += count;		/* Held for these blocks until they are allocated */
+
+	return FS_OK;
+}
+
+/* Look the dirty data blocks of a file up in the dedup index, if @param fps
+ * is not NULL. A block whose data is on disk already becomes that block,
+ * and need not be written. Else its fingerprint goes in @param fps, for
+ * the block to go into the index once it has a place. A block other files
+ * share and that was written to is set to 0, to get a block of its own. */
+static void _dedup_inode(filesystem* fs, inode* ino, fingerprint* fps) {
+	size_t i;
+	block** slot;
+	block_t b, m;
+
+	if (NULL == fs->dedup) return;
+
+	for (i = 0; i < ino->ndatablocks; i++) {
+		if (!ino->dirtyblocks[i]) continue;
+		slot = _inode_block_slot(ino, i);
+		if (NULL == slot || NULL == *slot) continue;
+
+		b = ino->blocks[i];
+		if (NULL != fps) {
+			fps[i] = _block_hash((*slot)->data, stride);
+			m = _dedup_find(fs, fps[i]);
+
+			if (0 != m && b == m) {		/* Written back as it was */
+				ino->dirtyblocks[i] = false;
+				continue;
+			}
+			if (0 != m && fs->dedup->refs[m] < UINT16_MAX) {
+				if (0 != b) _mbfree(fs, 1, &b);
+				fs->dedup->refs[m]++;
+				ino->blocks[i] = m;
+				ino->dirtyblocks[i] = false;
+				ino->dirty = true;
+				stats_count(SC_DEDUP_HITS, 1);
+				continue;
+			}
+		}
+		if (0 == b) continue;			/* Placed with the buffered blocks */
+
+		if (fs->dedup->refs[b] > 1) {
+			fs->dedup->refs[b]--;
+			ino->blocks[i] = 0;
+			ino->dirty = true;
+			continue;
+		}
+
+		/* Written in place: the block's fingerprint changes */
+		if (0 != fs->dedup->refs[b])
+			_dedup_remove(fs, b);
+		if (NULL != fps)
+			_dedup_add(fs, b, fps[i]);
+	}
+}
+
+/* Allocate @param count blocks for a file's buffered data. During a batch
+ * commit they are the next blocks of those allocated for the whole batch,
+ * so the files of the batch lie one after another. */
+static int _batch_mballoc(filesystem* fs, size_t count, block_t* bindices) {
+	if (fs->batch.npool - fs->batch.next < count)
+		return _fs._mballoc(fs, count, bindices);
+
+	memcpy(bindices, &fs->batch.pool[fs->batch.next], count*sizeof(block_t));
+	fs->batch.next += count;
+	return FS_OK;
+}
+
+/* Give the data blocks an inode has buffered in memory a place on disk.
+ * They are allocated together, as one extent, right before they are written.
+ * Holes get no block.
+ * A file to be compressed instead has its frames rewritten (see _zfile_pack),
+ * once it has FS_ZMINBLOCKS data blocks. */
+static int _inode_alloc_delayed(filesystem* fs, inode* ino) {
+	size_t i, k, first, nbuffered = 0, nnew = 0;
+	block_t newblocks[MAXFILEBLOCKS];
+	fingerprint* fps = NULL;
+	block** slot;
+
+	if (NULL == fs || NULL == ino) return FS_ERR;
+
+	if (ino->flags & FS_ZSTORED)
+		return _fs._zfile_pack(fs, ino);
+
+	if ((ino->flags & FS_ZFILE) && ino->ndatablocks >= FS_ZMINBLOCKS) {
+		if (FS_ERR == _inode_fill_blocks_from_disk(fs, ino))
+			return FS_ERR;
+
+		ino->zblocks = (block_t*)calloc(MAXFILEBLOCKS + 1, sizeof(block_t));
+		ino->zframes = (zframe*)calloc(FS_MAXZFRAMES, sizeof(zframe));
+		if (NULL == ino->zblocks || NULL == ino->zframes) {
+			free(ino->zblocks);
+			free(ino->zframes);
+			ino->zblocks = NULL;
+			ino->zframes = NULL;
+			return FS_ERR;
+		}
+
+		/* Frames hold every data block, so holes are filled in with zeros,
+		 * held for like buffered blocks */
+		for (i = 0; i < ino->ndatablocks; i++) {
+			if (!_inode_hole(ino, i)) continue;
+			*_inode_block_slot(ino, i) = _newBlock();
+			ino->nblocks++;
+			fs->nreserved_blocks++;
+		}
+
+		/* No frames on disk yet. The blocks that have a place are given up by
+		 * the packing, and the buffered ones give back what is held for them */
+		for (i = 0, ino->nzdata = ino->ndatablocks; i < ino->ndatablocks; i++)
+			ino->nzdata -= 0 == ino->blocks[i];
+		ino->nzblocks = 0;
+		ino->flags |= FS_ZSTORED;
+		memset(ino->dirtyblocks, true, ino->ndatablocks);
+
+		if (FS_OK == _fs._zfile_pack(fs, ino))
+			return FS_OK;
+
+		/* Stay as it was */
+		free(ino->zblocks);
+		free(ino->zframes);
+		ino->zblocks = NULL;
+		ino->zframes = NULL;
+		ino->nzdata = 0;
+		ino->flags &= ~FS_ZSTORED;
+		return FS_ERR;
+	}
+
+	/* The first buffered block, and what is held for the buffered blocks */
+	for (i = 0, first = ino->ndatablocks; i < ino->ndatablocks; i++) {
+		if (0 != ino->blocks[i] || _inode_hole(ino, i)) continue;
+		first = min(first, i);
+		nbuffered++;
+	}
+
+	/* Blocks whose data is on disk already share that block. Those that
+	 * share a block with other files and were written to get one of their own. */
+	if (NULL != fs->dedup) {
+		if (fs->sb_i.flags & FS_DDVOLUME) {
+			fps = (fingerprint*)malloc(ino->ndatablocks*sizeof(fingerprint));
+			if (NULL == fps) return FS_ERR;
 		}
+		_dedup_inode(fs, ino, fps);
+	}
+
+	for (i = 0; i < ino->ndatablocks; i++)
+		nnew += 0 == ino->blocks[i] && !_inode_hole(ino, i);
+	if (0 == nbuffered && 0 == nnew) {
+		free(fps);
+		return FS_OK;			/* Nothing buffered */
 	}
 
-	/* Update parent tail */
-	if (dv->parent->data.dir.tail == dv->ino->num) {
-		if (!onlysubdir) {	// If it's the only subdir, the tail == the head, 
-					// which we already set to null above, so skip this
-			dv->parent->data.dir.tail = dv->ino->data.dir.prev;
-			dv->parent->datav.dir->tail = dv->ino->datav.dir->prev;
-		}
+	if (0 != nnew && FS_ERR == _batch_mballoc(fs, nnew, newblocks)) {
+		free(fps);
+		return FS_ERR;
 	}
+	fs->nreserved_blocks -= min(fs->nreserved_blocks, nbuffered);
 
-	dv->prev->datav.dir->next = dv->next;
-	dv->next->datav.dir->prev = dv->prev;
+	for (i = 0, k = 0; i < ino->ndatablocks && k < nnew; i++) {
+		if (0 != ino->blocks[i] || _inode_hole(ino, i)) continue;
 
-	dv->prev->data.dir.next = dv->ino->data.dir.next;
-	dv->next->data.dir.prev = dv->ino->data.dir.prev;
+		ino->blocks[i] = newblocks[k++];
+		if (NULL != fps)
+			_dedup_add(fs, ino->blocks[i], fps[i]);
+	}
+	free(fps);
 
-	dv->parent->datav.dir->ndirs--;
-	dv->parent->data.dir.ndirs--;
+	/* Number the new blocks and chain them on from the previous last block */
+	for (i = 0; i < ino->ndatablocks; i++) {
+		if (!ino->dirtyblocks[i] && i + 1 != first) continue;
 
-	/* Update changes on disk */
-	_fs.writeblocks(dv->parent, dv->parent->blocks, dv->parent->ninoblocks, sizeof(inode));
-	_fs.writeblocks(dv->prev, dv->prev->blocks, dv->prev->ninoblocks, sizeof(inode));
-	_fs.writeblocks(dv->next, dv->next->blocks, dv->next->ninoblocks, sizeof(inode));
-	_fs._unload_dir(fs, dv->ino);
-	
-	if (FS_ERR == _sync(fs))
-		return FS_ERR;
+		slot = _inode_block_slot(ino, i);
+		if (NULL == slot || NULL == *slot) continue;
+
+		(*slot)->num = ino->blocks[i];
+		(*slot)->next = i+1 < ino->ndatablocks ? ino->blocks[i+1] : 0;
+		ino->dirtyblocks[i] = true;	/* The previous last block gets a new next */
+	}
+	ino->dirty = true;
 
 	return FS_OK;
 }
 
-/* Create an on-disk file */
-static file* _newf(filesystem* fs, const int alloc_inode, const char* name) {
-	file* f = NULL;
-	f = (file*)malloc(sizeof(file));
+/* Read up to @param len bytes of an inode's data, starting at @param seek_pos.
+ * The blocks read from must be in memory (see _inode_fill_blocks_from_disk).
+ * Holes read as zeros. */
+static char* _inode_read_data(inode* ino, size_t seek_pos, size_t len) {
+	size_t read_cnt = 0;
+	size_t cpysize;
+	
+	block_t blk;			/* First block to begin reading at */
+	size_t offset;			/* Byte offset in first block to begin reading at */
+	block** slot;			/* The data block being read from */
+	
+	char* output = NULL;
+	
+	if (NULL == ino) return NULL;
 
-	if (alloc_inode)
-		f->ino = (inode_t)_ialloc(fs);
-	else f->ino = 0;
+	output = (char*)calloc(len + 1, sizeof(char));
+	if (NULL == output) return NULL;
 
-	// Copy name
-	strncpy(f->name, name, min(FS_NAMEMAXLEN-1, strlen(name)+1));
-	f->name[FS_NAMEMAXLEN-1] = '\0';
+	if (seek_pos >= ino->size)
+		return output;		/* Nothing past the end of the file */
+	len = min(len, ino->size - seek_pos);
 
-	return f;
+	/* Inline file: the data is in the inode */
+	if (0 == ino->ndatablocks) {
+		memcpy(output, &ino->idata[seek_pos], min(len, FS_INLINEDATA - seek_pos));
+		return output;
+	}
+
+	offset = seek_pos % stride;
+	blk = (block_t)(seek_pos / stride);
+
+	while (read_cnt < len && blk < ino->ndatablocks) {
+		slot = _inode_block_slot(ino, blk);
+		if (NULL == slot || (NULL == *slot && !_inode_hole(ino, blk))) break;
+
+		cpysize = min(stride - offset, len - read_cnt);
+		if (NULL != *slot)
+			memcpy(&output[read_cnt], &(*slot)->data[offset], cpysize);
+		read_cnt += cpysize;
+
+		offset = 0;
+		blk++;
+	}
+
+	return output;
 }
 
-/* Create an in-memory file */
-static filev* _newfv(filesystem* fs, const int alloc_inode, const char* name) {
-	file*	f	= NULL;
-	filev*	fv	= NULL;
+/* Order data block indices by where the blocks are on disk */
+static STATS_THREAD block_t* _sort_blocks;
+static int _cmp_by_disk_block(const void* a, const void* b) {
+	block_t x = _sort_blocks[*(const size_t*)a];
+	block_t y = _sort_blocks[*(const size_t*)b];
 
-	fv = (filev*)malloc(sizeof(filev));
-	fv->ino = _fs._new_inode();
+	return (x > y) - (x < y);
+}
 
-	memset(	fv->ino->blocks, 0, sizeof(block_t)*MAXFILEBLOCKS);
+/* Write the dirty data blocks of an inode to disk, in the order they
+ * are on disk. Blocks that follow each other on disk are written 
+ * together with a single write. Clean blocks are not written. */
+static int _inode_commit_data(filesystem* fs, inode* ino) {
+	size_t order[MAXFILEBLOCKS];	/* Indices of the dirty blocks */
+	size_t ndirty = 0;
+	size_t i, j, k;
+	block** slot;
+	block* run;
+	int status = FS_OK;
+	
+	if (NULL == ino) return FS_ERR;
 
-	fv->ino->nlinks	= 0;
-	fv->ino->ninoblocks = (uint16_t) (sizeof(inode)/stride+1);	/* How many blocks the inode consumes */
-	fv->ino->ndatablocks=0;
-	fv->ino->nblocks= fv->ino->ninoblocks + fv->ino->ndatablocks;	/* How many blocks the inode data consumes */
-	fv->ino->size	= fv->ino->ninoblocks*BLKSIZE;
-	fv->ino->mode = FS_FILE;
-	fv->ino->v_attached = true;
-	fv->ino->datav.file = fv;
+	for (i = 0; i < ino->ndatablocks; i++) {
+		slot = _inode_block_slot(ino, i);
+		if (NULL == slot) break;
 
-	strncpy(fv->name, name, min(FS_NAMEMAXLEN-1, strlen(name)+1));
-	fv->name[FS_NAMEMAXLEN-1] = '\0';
-	fv->seek_pos = 0;
+		/* Blocks not yet allocated are written once they are */
+		if (ino->dirtyblocks[i] && NULL != *slot && 0 != ino->blocks[i])
+			order[ndirty++] = i;
+	}
+	if (0 == ndirty) return FS_OK;
 
-	f = _newf(fs, alloc_inode, name);
-	memcpy(&fv->ino->data.file, f, sizeof(file));
-	fv->ino->num = f->ino;
-	free(f);
+	_sort_blocks = ino->blocks;
+	qsort(order, ndirty, sizeof(size_t), _cmp_by_disk_block);
 
-	if (FS_ERR == _mballoc(fs, fv->ino->ninoblocks, fv->ino->blocks))
-		return NULL;
+	for (i = 0; i < ndirty; i = j) {
 
-	return fv;
-}
+		/* Find the end of the run of dirty blocks that follow each other on disk */
+		for (j = i + 1; j < ndirty; j++)
+			if (ino->blocks[order[j]] != ino->blocks[order[j-1]] + 1)
+				break;
 
-/* Create a new file of @param name in the given directory @parent */
-static filev* _new_file(filesystem* fs, dentv* parent, const char* name) {
-	filev* fv = NULL;
+		run = (block*)malloc((j - i)*sizeof(block));
+		if (NULL == run) return FS_ERR;
 
-	/* Allocate a new inode number */
-	fv = _newfv(fs, true, name);
-	if (NULL == fv) return NULL;
-	
-	fv->parent = parent->ino;
-	fv->ino->data.file.parent = parent->ino->num;
-	
-	parent->files[parent->nfiles] = fv->ino;
-	parent->ino->data.dir.files[parent->ino->data.dir.nfiles] = fv->ino->num;
-	
-	parent->nfiles++;
-	parent->ino->data.dir.nfiles++;
-	
-	_fs.writeblocks(parent->ino, parent->ino->blocks, parent->ino->ninoblocks, sizeof(inode));
-	fs->sb.inode_first_blocks[fv->ino->num] = fv->ino->blocks[0];
-	
-	if (FS_ERR == _fs._sync(fs)) {
-		return NULL;
+		for (k = i; k < j; k++)
+			memcpy(&run[k - i], *_inode_block_slot(ino, order[k]), sizeof(block));
+
+		if (FS_ERR == _fs.writeblock(fs, ino->blocks[order[i]], (j - i)*BLKSIZE, run))
+			status = FS_ERR;
+		else for (k = i; k < j; k++)
+			ino->dirtyblocks[order[k]] = false;
+
+		free(run);
 	}
 
-	return fv;
+	return status;
 }
 
-/* Create an on-disk link */
-static hlink* _newl(filesystem* fs, const int alloc_inode, const char* name) {
-	hlink* h = NULL;
+/* Punch a hole of @param len bytes at @param off in a file. The data
+ * blocks the hole covers whole become holes and give their blocks back;
+ * the parts of blocks at either end are zeroed. The size does not change.
+ * An inline file, or one stored compressed, has the range zeroed instead,
+ * which compresses to next to nothing. The inode no longer names the
+ * blocks by the time they are freed. */
+static int _punch_hole(filesystem* fs, inode* ino, size_t off, size_t len) {
+	size_t i, start, end, nfreed = 0;
+	block_t freed[MAXFILEBLOCKS];
+	block** slot;
+
+	if (NULL == fs || NULL == ino || FS_FILE != ino->mode) return FS_ERR;
+	if (off >= ino->size || 0 == len) return FS_OK;
+	end = len > ino->size - off ? ino->size : off + len;
+
+	if (0 == ino->ndatablocks) {
+		memset(&ino->idata[off], 0, end - off);
+		ino->dirty = true;
+		return _fs.write_commit(fs, ino);
+	}
 
-	h = (hlink*)malloc(sizeof(hlink));
-	if (alloc_inode) {
-		h->ino = (inode_t)_ialloc(fs);
-	} else {
-		h->ino = 0;
+	for (i = off / stride; i < ino->ndatablocks && i*stride < end; i++) {
+		if (_inode_hole(ino, i)) continue;	/* Zeros already */
+		slot = _inode_block_slot(ino, i);
+
+		/* All of the block, or all of it up to the end of the file */
+		start = off > i*stride ? off : i*stride;
+		if (start == i*stride && (end >= (i + 1)*stride || end == ino->size) &&
+			!(ino->flags & FS_ZSTORED)) {
+			if (0 != ino->blocks[i])
+				freed[nfreed++] = ino->blocks[i];
+			else		/* Buffered: what is held for it goes back */
+				fs->nreserved_blocks -= min(fs->nreserved_blocks, 1);
+
+			free(*slot);
+			*slot = NULL;
+			ino->blocks[i] = 0;
+			ino->dirtyblocks[i] = false;
+			ino->nblocks--;
+			ino->dirty = true;
+			continue;
+		}
+
+		if (NULL == *slot && (ino->flags & FS_ZSTORED)) {
+			if (FS_ERR == _fs._zframe_load(fs, ino, i / FS_ZFRAME))
+				return FS_ERR;
+		}
+		else if (NULL == *slot) {
+			*slot = _newBlock();
+			if (FS_ERR == _fs.readblock(fs, *slot, ino->blocks[i]))
+				return FS_ERR;
+		}
+		memset(&(*slot)->data[start - i*stride], 0, min(end, (i + 1)*stride) - start);
+		ino->dirtyblocks[i] = true;
 	}
-	
-	// Copy name
-	strncpy(h->name, name, min(FS_NAMEMAXLEN-1, strlen(name)+1));
-	h->name[FS_NAMEMAXLEN-1] = '\0';
-		
-	return h;
-}
 
-/* Create an in-memory link */
-static hlinkv* _newlv(filesystem*fs, int alloc_inode, const char* name) {
-	hlink* h = NULL;
-	hlinkv* hv = NULL;
+	if (FS_ERR == _fs.write_commit(fs, ino))
+		return FS_ERR;
 
-	hv = (hlinkv*)malloc(sizeof(hlinkv));
-	hv->ino = _fs._new_inode();
-	
-	memset(hv->ino->blocks, 0, sizeof(block_t)*MAXFILEBLOCKS);
-	
-	hv->ino->nlinks	= 0;
-	hv->ino->ninoblocks = (uint16_t) (sizeof(inode)/stride+1);	/* How many blocks the inode consumes */
-	hv->ino->ndatablocks=0;
-	hv->ino->nblocks= hv->ino->ninoblocks + hv->ino->ndatablocks;	/* How many blocks the inode data consumes */
-	hv->ino->size	= hv->ino->ninoblocks*BLKSIZE;
-	hv->ino->mode = FS_LINK;
-	hv->ino->v_attached = true;
-	hv->ino->datav.link = hv;
-	
-	strncpy(hv->name, name, min(FS_NAMEMAXLEN-1, strlen(name)+1));
-	hv->name[FS_NAMEMAXLEN-1] = '\0';
-	
-	h = _newl(fs, alloc_inode, name);
-	memcpy(&hv->ino->data.link, h, sizeof(hlink));
-	hv->ino->num = h->ino;
-	free(h);
-	
-	if (FS_ERR == _mballoc(fs, hv->ino->ninoblocks, hv->ino->blocks))
-		return NULL;
-	return hv;
+	if (0 == nfreed) return FS_OK;
+	_fs._mbfree(fs, nfreed, freed);
+	return _sync(fs);
 }
 
-/* Create a new link */
-static hlinkv* _new_link(filesystem* fs, dentv* parent, inode* src_ino, const char* name) {
-	hlinkv* lv = NULL;
-		
-	lv = _newlv(fs, true, name);
-	lv->dest = src_ino;
-	lv->ino->data.link.dest = src_ino->num;
-	
-	/* Allocate a new inode number */
-	if (NULL == lv) return NULL;
-	
-	lv->ino->data.link.mode = src_ino->mode;
+/* Cut a file down, or grow it, to @param len bytes, without committing it.
+ * The blocks of the data blocks past the new end go in @param freed, to be
+ * freed once the inode no longer names them, and what is left of the last
+ * block past the end is zeroed. A file grows with holes, or with buffered
+ * blocks if it is stored compressed. */
+static int _inode_resize(filesystem* fs, inode* ino, size_t len, block_t* freed, size_t* nfreed) {
+	size_t i, n, keep, cut;
+	block_t* zfreed;
+	block** slot;
+
+	if ((ino->flags & FS_ZSTORED) && FS_ERR == _inode_fill_blocks_from_disk(fs, ino))
+		return FS_ERR;
 
-	lv->parent = parent->ino;
-	lv->ino->data.link.parent = parent->ino->num;
-	
-	parent->links[parent->nlinks++] = lv->ino;
-	parent->ino->data.dir.links[parent->ino->data.dir.nlinks++] = lv->ino->num;
-	src_ino->nlinks++;
-	
-	fs->sb.inode_first_blocks[lv->ino->num] = lv->ino->blocks[0];
-	
-	_fs.write_commit(fs, lv->ino);
-	_fs.write_commit(fs, parent->ino);
-	_fs.write_commit(fs, src_ino);
+	/* First down to the smaller of the two sizes, so no old data shows if it grows */
+	cut = min(len, ino->size);
+	keep = (cut + stride - 1) / stride;
+	n = (len + stride - 1) / stride;
+	if (n > MAXFILEBLOCKS) return FS_ERR;	/* File would be too big */
+
+	for (i = keep; i < ino->ndatablocks; i++) {
+		if (_inode_hole(ino, i)) continue;
+		slot = _inode_block_slot(ino, i);
+
+		if (0 != ino->blocks[i])
+			freed[(*nfreed)++] = ino->blocks[i];
+		else if (!(ino->flags & FS_ZSTORED) || i >= ino->nzdata)	/* Buffered */
+			fs->nreserved_blocks -= min(fs->nreserved_blocks, 1);
+
+		free(*slot);
+		*slot = NULL;
+		ino->blocks[i] = 0;
+		ino->dirtyblocks[i] = false;
+		if (!(ino->flags & FS_ZSTORED)) ino->nblocks--;
+	}
+	if (keep < ino->ndatablocks) {
+		ino->ndatablocks = keep;
+		ino->dirty = true;
+	}
 
-	return lv;
-}
+	if (0 == ino->ndatablocks)
+		memset(&ino->idata[min(cut, FS_INLINEDATA)], 0, FS_INLINEDATA - min(cut, FS_INLINEDATA));
+	else if (0 != cut % stride && !_inode_hole(ino, keep - 1)) {
+		slot = _inode_block_slot(ino, keep - 1);
+		if (NULL == *slot) {
+			*slot = _newBlock();
+			if (FS_ERR == _fs.readblock(fs, *slot, ino->blocks[keep - 1]))
+				return FS_ERR;
+		}
+		memset(&(*slot)->data[cut % stride], 0, stride - cut % stride);
+		ino->dirtyblocks[keep - 1] = true;
+	}
 
-static int _rmlink(filesystem* fs, hlinkv* hv) {
-	size_t i = 0;
-	size_t j = 0;
-	
-	if (NULL == hv) return FS_ERR;
-	if (NULL == hv->parent) return FS_ERR;
-	
-	hv->ino->datav.link->dest->nlinks--;
-	
-	/* Find the matching link in the parent */
-	for (i = 0; i < hv->parent->datav.dir->nlinks; i++) {
-		
-		/* If we have a match */
-		if (hv->ino->num == hv->parent->datav.dir->links[i]->num) {
-			
-			/* Coalesce links in the list to fill the emptied spot */
-			for (j = i; j < hv->parent->datav.dir->nlinks-1; i++) {
-				hv->parent->datav.dir->links[i] = hv->parent->datav.dir->links[i+1];
-				hv->parent->data.dir.links[i] = hv->parent->data.dir.links[i+1];
-			}
-			/* Last entry now empty */
-			hv->parent->data.dir.links[i] = 0;
-			hv->parent->datav.dir->links[i] = NULL;
-			
-			/* Remove the link */
-			hv->parent->datav.dir->nlinks--;
-			hv->parent->data.dir.nlinks--;
-			
-			_fs._inode_unload(fs, hv->ino);
-			
-			hv = NULL;
-			
-			break;
+	if (ino->flags & FS_ZSTORED) {
+		ino->nzdata = min(ino->nzdata, ino->ndatablocks);
+
+		/* A frame cut short is written again */
+		if (0 != ino->ndatablocks)
+			ino->dirtyblocks[ino->ndatablocks - 1] = true;
+
+		/* Nothing left to compress: the frames go once the inode is stored */
+		else {
+			zfreed = (block_t*)realloc(ino->zfreed, (ino->nzfreed + ino->nzblocks)*sizeof(block_t));
+			if (NULL == zfreed) return FS_ERR;
+			memcpy(&zfreed[ino->nzfreed], ino->zblocks, ino->nzblocks*sizeof(block_t));
+			ino->zfreed = zfreed;
+			ino->nzfreed += ino->nzblocks;
+
+			free(ino->zblocks);
+			free(ino->zframes);
+			ino->zblocks = NULL;
+			ino->zframes = NULL;
+			ino->nzblocks = 0;
+			ino->flags &= ~FS_ZSTORED;
+			ino->nblocks = 0 != ino->xblock;
 		}
 	}
-	
+
+	/* Then up to the new size */
+	if (n > ino->ndatablocks && (ino->flags & FS_ZSTORED)) {
+		if (FS_ERR == _fs._inode_extend_datablocks(fs, ino, n - ino->ndatablocks))
+			return FS_ERR;
+	}
+	else if (n > ino->ndatablocks && len > FS_INLINEDATA) {
+		if (0 == ino->ndatablocks && 0 != cut &&
+			FS_ERR == _fs._inode_extend_datablocks(fs, ino, 1))
+			return FS_ERR;		/* The first block takes what the file held */
+
+		for (i = ino->ndatablocks; i < n; i++) {
+			ino->blocks[i] = 0;
+			ino->dirtyblocks[i] = false;
+		}
+		ino->ndatablocks = n;
+	}
+
+	if (ino->size != len) {
+		ino->size = len;
+		ino->dirty = true;
+	}
 	return FS_OK;
 }
 
-static inode* _new_inode() {
-	uint i, j, k;
-	inode* ino = NULL;
+/* Cut a file down, or grow it, to @param len bytes. The blocks past the
+ * new end are freed together, after the inode is stored without them. */
+static int _truncate(filesystem* fs, inode* ino, size_t len) {
+	block_t freed[MAXFILEBLOCKS];
+	size_t nfreed = 0;
 
-	ino = (inode*)malloc(sizeof(inode));
+	if (NULL == fs || NULL == ino || FS_FILE != ino->mode) return FS_ERR;
 
-	for (i = 0; i < MAXBLOCKS_DIRECT; i++)
-		ino->directblocks[i] = NULL;
-	
-	ino->ib1 = (iblock1*)malloc(sizeof(iblock1));
+	if (FS_ERR == _inode_resize(fs, ino, len, freed, &nfreed) ||
+		FS_ERR == _fs.write_commit(fs, ino))
+		return FS_ERR;
 
-	for (i = 0; i < MAXBLOCKS_DIRECT; i++)
-		ino->ib1->blocks[i] = NULL;
-	
-	ino->ib2 = (iblock2*)malloc(sizeof(iblock2));
-	for (i = 0; i < NIBLOCKS; i++) {
-		ino->ib2->iblocks[i] = (iblock1*)malloc(sizeof(iblock1));
-		
-		for (j = 0; j < MAXBLOCKS_DIRECT; j++)
-			ino->ib2->iblocks[i]->blocks[j] = NULL;
-	}
+	if (0 == nfreed) return FS_OK;
+	_fs._mbfree(fs, nfreed, freed);
+	return _sync(fs);
+}
 
-	ino->ib3 = (iblock3*)malloc(sizeof(iblock3));
-	for (i = 0; i < NIBLOCKS; i++) {
-		ino->ib3->iblocks[i] = (iblock2*)malloc(sizeof(iblock2));
+/* Give the @param len bytes at @param off of a file blocks on disk now,
+ * together, so writes there later need not allocate. The holes and the
+ * data blocks past the end in the range get one run of new blocks, which
+ * is zeroed on disk with one write and kept in memory. The file grows
+ * if the range goes past its end. A file stored compressed only grows:
+ * its frames get new blocks whenever they are written. */
+static int _fallocate(filesystem* fs, inode* ino, size_t off, size_t len) {
+	size_t i, j, k, n, end, nnew = 0;
+	size_t todo[MAXFILEBLOCKS];	/* The data blocks to get blocks */
+	block_t newblocks[MAXFILEBLOCKS];
+	block_t freed[MAXFILEBLOCKS];
+	size_t nfreed = 0;
+	block** slot;
+	block* buf;
+	int status = FS_OK;
+
+	if (NULL == fs || NULL == ino || FS_FILE != ino->mode) return FS_ERR;
+	if (0 == len) return FS_OK;
+
+	end = off + len;
+	n = (end + stride - 1) / stride;
+	if (n > MAXFILEBLOCKS) return FS_ERR;	/* File would be too big */
+
+	if (end > ino->size && FS_ERR == _inode_resize(fs, ino, end, freed, &nfreed))
+		return FS_ERR;
 
-		for (j = 0; j < NIBLOCKS; j++) {
-			ino->ib3->iblocks[i]->iblocks[j] = (iblock1*)malloc(sizeof(iblock1));
-			
-			for (k = 0; k < MAXBLOCKS_DIRECT; k++)
-				ino->ib3->iblocks[i]->iblocks[j]->blocks[k] = NULL;
+	for (i = off / stride; i < n && i < ino->ndatablocks; i++)
+		if (_inode_hole(ino, i)) todo[nnew++] = i;
+
+	if (0 == nnew)
+		status = _fs.write_commit(fs, ino);
+	else if (fs->nreserved_blocks + nnew > fs->sb.nfree_blocks)
+		status = FS_ERR;		/* Would not fit on disk */
+	else if (FS_ERR == _fs._mballoc(fs, nnew, newblocks))
+		status = FS_ERR;
+	else {
+		buf = (block*)calloc(nnew, sizeof(block));
+		if (NULL == buf) {
+			_fs._mbfree(fs, nnew, newblocks);
+			return FS_ERR;
+		}
+		for (k = 0; k < nnew; k++) {
+			buf[k].num = newblocks[k];
+			buf[k].next = k+1 < nnew ? newblocks[k+1] : 0;
+		}
+
+		/* The blocks are zeroed on disk before the inode names them */
+		for (k = 0; k < nnew && FS_OK == status; k = j) {
+			for (j = k + 1; j < nnew && newblocks[j] == newblocks[j-1] + 1; j++);
+			status = _fs.writeblock(fs, newblocks[k], (j - k)*BLKSIZE, &buf[k]);
 		}
+		if (FS_ERR == status) {
+			_fs._mbfree(fs, nnew, newblocks);
+			free(buf);
+			return FS_ERR;
+		}
+
+		for (k = 0; k < nnew; k++) {
+			slot = _inode_block_slot(ino, todo[k]);
+			*slot = _newBlock();
+			memcpy(*slot, &buf[k], sizeof(block));
+			ino->blocks[todo[k]] = newblocks[k];
+			ino->dirtyblocks[todo[k]] = false;
+		}
+		free(buf);
+
+		ino->nblocks += nnew;
+		ino->dirty = true;
+		status = _fs.write_commit(fs, ino);
 	}
 
-	return ino;
+	if (0 != nfreed) {
+		_fs._mbfree(fs, nfreed, freed);
+		if (FS_ERR == _sync(fs)) status = FS_ERR;
+	}
+	return status;
 }
 
-static void _free_inode(inode* ino) {
-	uint i, j, k;
-	uint blks_freed = 0;
-	uint stop = false;
-
-	if (NULL == ino) return;
+/* Read the frame table of a file stored compressed, if it is not in memory yet */
+static int _zfile_table(filesystem* fs, inode* ino) {
+	block blk;
 
-	for (i = 0; i < MAXBLOCKS_DIRECT; i++) {
-		if (blks_freed >= ino->ndatablocks) {
-			stop = true;
-			break;
-		}
-		if (stop) break;
+	if (NULL != ino->zframes) return FS_OK;
+	if (0 == ino->nzblocks) return FS_ERR;
 
-		if (!ino->directblocks[i])
-			continue;
+	ino->zframes = (zframe*)calloc(FS_MAXZFRAMES, sizeof(zframe));
+	if (NULL == ino->zframes) return FS_ERR;
 
-//		free(ino->directblocks[i]);
-		ino->directblocks[i] = NULL;
-		
-		++blks_freed;
+	if (FS_ERR == _fs.readblock(fs, &blk, ino->zblocks[0])) {
+		free(ino->zframes);
+		ino->zframes = NULL;
+		return FS_ERR;
 	}
+	memcpy(ino->zframes, blk.data, FS_MAXZFRAMES*sizeof(zframe));
 
-	if (ino->ib1) {
-		for (i = 0; i < NBLOCKS_IBLOCK; i++) {
-			if (blks_freed >= ino->ndatablocks) {
-				stop = true;
-				break;
-			}
-			if (stop) break;
+	return FS_OK;
+}
 
-			if (!ino->ib1->blocks[i])
-				continue;
+/* Read frame @param f of a file stored compressed and decompress it into
+ * the data blocks of the frame that are not in memory yet. Those that are
+ * may hold writes not yet on disk and are left as they are. */
+static int _zframe_load(filesystem* fs, inode* ino, size_t f) {
+	size_t first = f*FS_ZFRAME;
+	size_t i, j, k, n, pos;
+	block** slot;
+	block* buf;
+	char* z;
+	char* data;
+	int status = FS_OK;
+
+	if (NULL == fs || NULL == ino) return FS_ERR;
+	if (!(ino->flags & FS_ZSTORED) || first >= ino->nzdata) return FS_OK;	/* Nothing on disk */
+
+	n = min((size_t)FS_ZFRAME, ino->nzdata - first);
+	for (i = first; i < first + n && NULL != *_inode_block_slot(ino, i); i++);
+	if (i == first + n) return FS_OK;	/* All in memory */
+
+	if (FS_ERR == _zfile_table(fs, ino)) return FS_ERR;
+
+	/* The frame's blocks follow the table and the frames before it */
+	for (pos = 1, i = 0; i < f; i++)
+		pos += ino->zframes[i].nblocks;
+	k = ino->zframes[f].nblocks;
+	if (0 == k || pos + k > ino->nzblocks || ino->zframes[f].len > k*stride) return FS_ERR;
+	if (0 == ino->zframes[f].len && k != n) return FS_ERR;
+
+	buf = (block*)malloc(k*sizeof(block));
+	z = (char*)malloc(k*stride);
+	data = 0 == ino->zframes[f].len ? z : (char*)malloc(n*stride);
+	if (NULL == buf || NULL == z || NULL == data) {
+		if (data != z) free(data);
+		free(z);
+		free(buf);
+		return FS_ERR;
+	}
 
-//			free(ino->ib1->blocks[i]);
-			ino->ib1->blocks[i] = NULL;
-			
-			++blks_freed;
-		}
-//		free(ino->ib1);
-		ino->ib1 = NULL;
+	/* Read the frame a run of contiguous blocks at a time */
+	for (i = 0; i < k && FS_OK == status; i = j) {
+		for (j = i + 1; j < k && ino->zblocks[pos+j] == ino->zblocks[pos+j-1] + 1; j++);
+		status = _fs.readrun(fs, &buf[i], ino->zblocks[pos+i], j - i);
 	}
+	for (i = 0; i < k; i++)
+		memcpy(&z[i*stride], buf[i].data, stride);
 
-	if (ino->ib2) {
-		for (i = 0; i < NIBLOCKS; i++) {
-			if (stop) break;
+	if (FS_OK == status && 0 != ino->zframes[f].len &&
+		n*stride != lz_decompress(z, ino->zframes[f].len, data, n*stride))
+		status = FS_ERR;		/* Corrupt frame */
 
-			if (!ino->ib2->iblocks[i]) 
-				continue;
+	for (i = 0; i < n && FS_OK == status; i++) {
+		slot = _inode_block_slot(ino, first + i);
+		if (NULL != *slot) continue;
 
-			for (j = 0; j < NBLOCKS_IBLOCK; j++) {	
-				if (blks_freed >= ino->ndatablocks) {
-					stop = true;
-					break;
-				}
-				if (!ino->ib2->iblocks[i])
-					continue;
+		*slot = _newBlock();
+		memcpy((*slot)->data, &data[i*stride], stride);
+	}
 
-//				free(ino->ib2->iblocks[i]->blocks[j]);
-				ino->ib2->iblocks[i]->blocks[j] = NULL;
-				
-				++blks_freed;
-			}
+	if (data != z) free(data);
+	free(z);
+	free(buf);
+	return status;
+}
 
-//			free(ino->ib2->iblocks[i]);
-			ino->ib2->iblocks[i] = NULL;
-		}
-//		free(ino->ib2);
-		ino->ib2 = NULL;
+/* Write the frames of a file stored compressed that have changed since
+ * they were last written, each to new blocks, compressed if that saves a
+ * block and else as they are. Then write a new frame table. The blocks of
+ * the old frames are freed once the inode no longer names them (see
+ * _inode_store), so the file on disk is always whole. */
+static int _zfile_pack(filesystem* fs, inode* ino) {
+	size_t nframes, f, i, j, k, n, first;
+	size_t pos = 1, npos = 1;		/* Next frame block of the old and the new frames */
+	size_t oldk, len, nfreed, nfresh = 0;
+	int dirty, b, status = FS_OK;
+	block_t* zblocks = NULL;
+	block_t* freed = NULL;
+	block_t fresh[MAXFILEBLOCKS + 1];	/* Blocks allocated here, given back if it fails */
+	zframe* frames = NULL;
+	block* buf = NULL;
+	char* data = NULL;
+	char* z = NULL;
+
+	if (NULL == fs || NULL == ino || !(ino->flags & FS_ZSTORED)) return FS_ERR;
+
+	for (i = 0; i < ino->ndatablocks && !ino->dirtyblocks[i]; i++);
+	if (i == ino->ndatablocks && ino->nzdata == ino->ndatablocks)
+		return FS_OK;			/* Nothing changed */
+
+	if (FS_ERR == _zfile_table(fs, ino)) return FS_ERR;
+
+	nfreed = ino->nzfreed;
+	zblocks = (block_t*)calloc(MAXFILEBLOCKS + 1, sizeof(block_t));
+	freed = (block_t*)malloc((nfreed + ino->nzblocks + MAXFILEBLOCKS)*sizeof(block_t));
+	frames = (zframe*)calloc(FS_MAXZFRAMES, sizeof(zframe));
+	buf = (block*)malloc(FS_ZFRAME*sizeof(block));
+	data = (char*)malloc(FS_ZFRAME*stride);
+	z = (char*)malloc(FS_ZFRAME*stride);
+	status = NULL == zblocks || NULL == freed || NULL == frames ||
+		NULL == buf || NULL == data || NULL == z ? FS_ERR : FS_OK;
+
+	/* Blocks an earlier pack gave up that were not freed yet */
+	if (FS_OK == status && 0 != nfreed)
+		memcpy(freed, ino->zfreed, nfreed*sizeof(block_t));
+
+	if (FS_OK == status) {
+		b = _fs.__balloc(fs);
+		if (FS_ERR == b) status = FS_ERR;
+		else zblocks[0] = fresh[nfresh++] = (block_t)b;
 	}
 
-	if (ino->ib3) {
-		for (i = 0; i < NIBLOCKS; i++) {
-			if (stop) break;
+	nframes = (ino->ndatablocks + FS_ZFRAME - 1) / FS_ZFRAME;
+	for (f = 0; f < nframes && FS_OK == status; f++) {
+		first = f*FS_ZFRAME;
+		n = min((size_t)FS_ZFRAME, ino->ndatablocks - first);
+		oldk = first < ino->nzdata ? ino->zframes[f].nblocks : 0;
+
+		for (dirty = false, i = first; i < first + n; i++)
+			dirty |= ino->dirtyblocks[i];
+
+		/* Unchanged: keep its blocks */
+		if (!dirty) {
+			memcpy(&zblocks[npos], &ino->zblocks[pos], oldk*sizeof(block_t));
+			frames[f] = ino->zframes[f];
+			pos += oldk;
+			npos += oldk;
+			continue;
+		}
 
-			if(!ino->ib3->iblocks[i])
-				continue;
+		if (FS_ERR == _zframe_load(fs, ino, f)) {
+			status = FS_ERR;
+			break;
+		}
+		for (i = 0; i < n; i++)
+			memcpy(&data[i*stride], (*_inode_block_slot(ino, first + i))->data, stride);
 
-			for (j = 0; j < NIBLOCKS; j++) {
-				if (stop) break;
+		/* Compressed only if it takes fewer blocks */
+		len = lz_compress(data, n*stride, z, (n - 1)*stride);
+		k = 0 != len ? (len + stride - 1) / stride : n;
+		if (0 == len) memcpy(z, data, n*stride);
 
-				if (!ino->ib3->iblocks[i]->iblocks[j])
-					continue;
+		if (FS_ERR == _fs._mballoc(fs, k, &zblocks[npos])) {
+			status = FS_ERR;
+			break;
+		}
+		memcpy(&fresh[nfresh], &zblocks[npos], k*sizeof(block_t));
+		nfresh += k;
 
-				for (k = 0; k < NBLOCKS_IBLOCK; k++) {
-					if (blks_freed >= ino->ndatablocks) {
-						stop = true;
-						break;
-					}
-					
-					if (!ino->ib3->iblocks[i]->iblocks[j]->blocks[k])
-						continue;
-					
-//					free(ino->ib3->iblocks[i]->iblocks[j]->blocks[k]);
-					ino->ib3->iblocks[i]->iblocks[j]->blocks[k] = NULL;
-					
-					++blks_freed;
-				}
+		for (i = 0; i < k; i++) {
+			buf[i].num = zblocks[npos+i];
+			buf[i].next = i+1 < k ? zblocks[npos+i+1] : 0;
+			memcpy(buf[i].data, &z[i*stride], stride);
+		}
 
-//				free(ino->ib3->iblocks[i]->iblocks[j]);
-				ino->ib3->iblocks[i]->iblocks[j] = NULL;
-			}
-//			free(ino->ib3->iblocks[i]);
-			ino->ib3->iblocks[i] = NULL;
+		/* Blocks that follow each other on disk are written together */
+		for (i = 0; i < k && FS_OK == status; i = j) {
+			for (j = i + 1; j < k && zblocks[npos+j] == zblocks[npos+j-1] + 1; j++);
+			status = _fs.writeblock(fs, zblocks[npos+i], (j - i)*BLKSIZE, &buf[i]);
 		}
-//		free(ino->ib3);
-		ino->ib3 = NULL;
+
+		memcpy(&freed[nfreed], &ino->zblocks[pos], oldk*sizeof(block_t));
+		nfreed += oldk;
+		pos += oldk;
+
+		frames[f].nblocks = (uint16_t)k;
+		frames[f].len = (uint32_t)len;
+		npos += k;
 	}
-//	free(ino);
-	ino = NULL;
-}
 
-/* Get an unallocated file descriptor */
-static int _get_fd(filesystem* fs) {
-	uint i;
+	if (FS_OK == status) {
+		block tbl;
 
-	for (i = fs->first_free_fd; i < FS_MAXOPENFILES; i++){
-		if (false == fs->allocated_fds[i]) {
-			fs->allocated_fds[i] = true;
-			fs->first_free_fd = i+1;
-			return i;
+		memset(&tbl, 0, sizeof(block));
+		tbl.num = zblocks[0];
+		tbl.next = npos > 1 ? zblocks[1] : 0;
+		memcpy(tbl.data, frames, FS_MAXZFRAMES*sizeof(zframe));
+		status = _fs.writeblock(fs, zblocks[0], BLKSIZE, &tbl);
+	}
+
+	if (FS_ERR == status) {
+		_fs._mbfree(fs, nfresh, fresh);
+		free(zblocks);
+		free(freed);
+		free(frames);
+	}
+	else {
+		/* The old table and any old frames past the new ones */
+		if (0 != ino->nzblocks) {
+			freed[nfreed++] = ino->zblocks[0];
+			for (; pos < ino->nzblocks; pos++)
+				freed[nfreed++] = ino->zblocks[pos];
+		}
+
+		/* The blocks the data had before it was stored compressed */
+		for (i = 0; i < ino->ndatablocks; i++) {
+			if (0 == ino->blocks[i]) continue;
+			freed[nfreed++] = ino->blocks[i];
+			ino->blocks[i] = 0;
 		}
+
+		fs->nreserved_blocks -= min(fs->nreserved_blocks, ino->ndatablocks - ino->nzdata);
+		memset(ino->dirtyblocks, false, ino->ndatablocks);
+
+		free(ino->zblocks);
+		free(ino->zframes);
+		free(ino->zfreed);
+		ino->zblocks = zblocks;
+		ino->nzblocks = npos;
+		ino->zframes = frames;
+		ino->nzdata = ino->ndatablocks;
+		ino->zfreed = freed;
+		ino->nzfreed = nfreed;
+		ino->nblocks = ino->nzblocks + (0 != ino->xblock);
+		ino->dirty = true;
 	}
 
-	return FS_ERR;
+	free(buf);
+	free(data);
+	free(z);
+	return status;
 }
 
-/* Free an allocated file descriptor */
-static int _free_fd(filesystem* fs, int fd) {
-	if (false == fs->allocated_fds[fd])	/* fd was already free */
+/* Store a compressed file as it is again, in data blocks of its own */
+static int _zfile_unpack(filesystem* fs, inode* ino) {
+	block_t* oldblocks;
+	size_t nold;
+
+	if (NULL == fs || NULL == ino) return FS_ERR;
+	if (!(ino->flags & FS_ZSTORED)) return FS_OK;
+
+	if (FS_ERR == _inode_fill_blocks_from_disk(fs, ino)) return FS_ERR;
+	if (fs->nreserved_blocks + ino->nzdata > fs->sb.nfree_blocks) return FS_ERR;	/* Would not fit on disk */
+
+	/* Every data block is then buffered, as if just written */
+	fs->nreserved_blocks += ino->nzdata;
+	oldblocks = ino->zblocks;
+	nold = ino->nzblocks;
+	free(ino->zframes);
+	ino->zblocks = NULL;
+	ino->nzblocks = 0;
+	ino->zframes = NULL;
+	ino->nzdata = 0;
+	ino->flags &= ~FS_ZSTORED;
+	memset(ino->dirtyblocks, true, ino->ndatablocks);
+	ino->nblocks = ino->ndatablocks + (0 != ino->xblock);
+	ino->dirty = true;
+
+	/* The data is on disk before the inode points at it */
+	if (FS_ERR == _inode_alloc_delayed(fs, ino) || FS_ERR == _inode_commit_data(fs, ino) ||
+		FS_ERR == _inode_store(fs, ino) || FS_ERR == _fdatasync(fs)) {
+		free(oldblocks);
 		return FS_ERR;
+	}
 
-	fs->allocated_fds[fd] = false;
-	fs->fds[fd] = NULL;
-	fs->first_free_fd = fd;
-
-	return FS_OK;
+	_fs._mbfree(fs, nold, oldblocks);
+	free(oldblocks);
+	return _sync(fs);
 }
 
-/* Convert an inode to an in-memory directory */
-static dentv *_ino_to_dv(filesystem* fs, inode* ino) {
-	dentv *dv;
+/* Turn compression of a file on or off. A file that is on is stored
+ * compressed when it is next committed; one that is off is stored as it
+ * is right away. */
+static int _compress(filesystem* fs, inode* ino, int on) {
+	if (NULL == fs || NULL == ino || FS_FILE != ino->mode) return FS_ERR;
 
-	if (NULL == ino) return NULL;
+	if (on) {
+		ino->flags |= FS_ZFILE;
+		ino->dirty = true;
+		return _fs.write_commit(fs, ino);
+	}
 
-	dv = _newdv(fs, false, ino->data.dir.name);
-	if (NULL == dv) return NULL;
+	ino->flags &= ~FS_ZFILE;
+	if (ino->flags & FS_ZSTORED)
+		return _zfile_unpack(fs, ino);
 
-	dv->head		= _inode_load(fs, ino->data.dir.head);
+	ino->dirty = true;
+	return _fs.write_commit(fs, ino);
+}
 
-	if (ino->data.dir.head != ino->data.dir.tail)
-		dv->tail	= _inode_load(fs, ino->data.dir.tail);
-	else	dv->tail	= dv->head;
+/* Read the dedup table, if dedup was ever turned on, and index it */
+static int _dedup_load(filesystem* fs) {
+	size_t b;
 
-	if (ino->num != ino->data.dir.parent)
-		dv->parent	= _inode_load(fs, ino->data.dir.parent);
-	else	dv->parent	= ino;
+	if (0 == fs->sb_i.dedup_blocks[0]) return FS_OK;
 
-	if (ino->num != ino->data.dir.next)
-		dv->next	= _inode_load(fs, ino->data.dir.next);
-	else	dv->next	=ino;
+	fs->dedup = (dedup_table*)malloc(sizeof(dedup_table));
+	fs->ondisk.dedup = (dedup_table*)malloc(sizeof(dedup_table));
+	fs->dedup_buckets = (block_t*)calloc(FS_DEDUPBUCKETS, sizeof(block_t));
+	fs->dedup_chain = (block_t*)calloc(MAXBLOCKS, sizeof(block_t));
+	if (NULL == fs->dedup || NULL == fs->ondisk.dedup || NULL == fs->dedup_buckets || NULL == fs->dedup_chain)
+		return FS_ERR;
 
-	if (ino->num != ino->data.dir.prev)
-		dv->prev	= _inode_load(fs, ino->data.dir.prev);
-	else	dv->prev	= ino;
+	if (FS_ERR == _fs.readirectblocks(fs, fs->dedup, fs->sb_i.dedup_blocks, FS_DEDUPBLOCKS, sizeof(dedup_table)))
+		return FS_ERR;
+	memcpy(fs->ondisk.dedup, fs->dedup, sizeof(dedup_table));
 
-	if (	NULL == dv->parent	|| 
-		NULL == dv->next	|| 
-		NULL == dv->prev	) {
+	for (b = 0; b < MAXBLOCKS; b++)
+		if (0 != fs->dedup->refs[b])
+			_dedup_link(fs, (block_t)b);
 
-		free(dv);
-		return NULL;
-	}
+	return FS_OK;
+}
 
-	free(dv->ino);
+/* Turn sharing of blocks that hold the same data on or off. The first
+ * time it is turned on, the dedup table gets its blocks. Once it has them
+ * it is kept up to date even while sharing is off, as blocks may still be
+ * shared. Only data written while it is on is shared. */
+static int _dedup(filesystem* fs, int on) {
+	if (NULL == fs) return FS_ERR;
 
-	dv->ino			= ino;
-	dv->ino->datav.dir	= dv;
+	if (on && NULL == fs->dedup) {
+		fs->dedup = (dedup_table*)calloc(1, sizeof(dedup_table));
+		fs->ondisk.dedup = (dedup_table*)calloc(1, sizeof(dedup_table));
+		fs->dedup_buckets = (block_t*)calloc(FS_DEDUPBUCKETS, sizeof(block_t));
+		fs->dedup_chain = (block_t*)calloc(MAXBLOCKS, sizeof(block_t));
 
-	dv->ndirs		= dv->ino->data.dir.ndirs;
-	dv->nfiles		= dv->ino->data.dir.nfiles;
-	dv->nlinks		= dv->ino->data.dir.nlinks;
+		if (NULL == fs->dedup || NULL == fs->ondisk.dedup || NULL == fs->dedup_buckets || NULL == fs->dedup_chain ||
+			FS_ERR == _fs._mballoc(fs, FS_DEDUPBLOCKS, fs->sb_i.dedup_blocks) ||
+			FS_ERR == _fs.writeblocks(fs, fs->dedup, fs->sb_i.dedup_blocks, FS_DEDUPBLOCKS, sizeof(dedup_table)))
+		{
+			free(fs->dedup);
+			free(fs->ondisk.dedup);
+			free(fs->dedup_buckets);
+			free(fs->dedup_chain);
+			fs->dedup = fs->ondisk.dedup = NULL;
+			fs->dedup_buckets = fs->dedup_chain = NULL;
+			memset(fs->sb_i.dedup_blocks, 0, sizeof(fs->sb_i.dedup_blocks));
+			return FS_ERR;
+		}
+	}
 
-	dv->ino->v_attached	= true;
+	if (on) fs->sb_i.flags |= FS_DDVOLUME;
+	else fs->sb_i.flags &= ~FS_DDVOLUME;
 
-	return dv;
+	return _sync(fs);
 }
 
-/* Convert an inode to an in-memory file */
-static filev* _ino_to_fv(filesystem* fs, inode* ino) {
-	filev* fv = NULL;
-	if (NULL == ino) return NULL;
+/* Sum up the dedup table in @param report */
+static void _dedup_report(filesystem* fs, dedup_report* report) {
+	size_t b;
 
-	fv = _newfv(fs, false, ino->data.file.name);
-	if (NULL == fv) return NULL;
+	memset(report, 0, sizeof(dedup_report));
+	if (NULL == fs) return;
 
-	fv->ino			= ino;
-	fv->ino->datav.file	= fv;
-	fv->ino->v_attached	= true;
-	fv->ino->mode		= FS_FILE;
-	fv->mode		= FS_READ;
-	return fv;
-}
+	report->on = 0 != (fs->sb_i.flags & FS_DDVOLUME);
+	for (b = 0; NULL != fs->dedup && b < MAXBLOCKS; b++) {
+		if (0 == fs->dedup->refs[b]) continue;
 
-static hlinkv* _ino_to_lv(filesystem* shfs, inode* ino) {
-	hlinkv* lv = NULL;
-	if (NULL == ino) return NULL;
-	
-	lv = _newlv(shfs, false, ino->data.link.name);
-	if (NULL == lv) return NULL;
-	
-	lv->ino			= ino;
-	lv->ino->datav.link	= lv;
-	lv->ino->v_attached	= true;
-	lv->ino->mode		= FS_LINK;
-	return lv;
+		report->nindexed++;
+		report->nshared += fs->dedup->refs[b] > 1;
+		report->nrefs += fs->dedup->refs[b];
+	}
+	report->nsaved = report->nrefs - report->nindexed;
 }
 
-static hlinkv* _load_link(filesystem* fs, /* dentv* parent, */ inode_t num) {
-	inode* ino = _inode_load(fs, num);
-	hlinkv* lv = NULL;
-	filev* fv = NULL;
-	dentv* dv = NULL;
-	
-	ino->datav.link = _ino_to_lv(fs, ino);
-	
-//	if (NULL == parent) {
-//		dentv* parent = _fs._load_dir(fs, ino->data.link.parent);
-//		ino->datav.file->parent	= parent->ino;
-//	}
-	
-	if (FS_FILE == ino->data.link.mode) {
-		fv = _fs._load_file(fs, ino->data.link.dest);
-		ino->datav.link->dest = fv->ino;
+/* Count the extents of an inode's data: runs of blocks that follow 
+ * each other on disk. Blocks not yet allocated count as one run.
+ * Holes are left out; the blocks either side may still be one run. */
+static size_t _inode_nextents(inode* ino) {
+	size_t i, n = 0;
+	block_t prev = 0;
+	int any = false;
+
+	if (NULL == ino) return 0;
+
+	/* Stored compressed: the runs of the table and frame blocks */
+	if (ino->flags & FS_ZSTORED) {
+		for (i = 0; i < ino->nzblocks; i++)
+			n += 0 == i || ino->zblocks[i] != ino->zblocks[i-1] + 1;
+		return n;
 	}
-	
-	else if (FS_DIR == ino->data.link.mode) {
-		dv = _fs._load_dir(fs, ino->data.link.dest);
-		ino->datav.link->dest = dv->ino;
+
+	for (i = 0; i < ino->ndatablocks; i++) {
+		if (_inode_hole(ino, i))
+			continue;
+		if (!any)
+			n++;
+		else if (0 == ino->blocks[i])
+			n += (0 != prev);
+		else if (ino->blocks[i] != prev + 1)
+			n++;
+		prev = ino->blocks[i];
+		any = true;
 	}
-	
-	else if (FS_LINK == ino->data.link.mode) {
-		if (ino->data.link.dest != ino->num) {	/* Don't link a link to itself */
-			lv = _fs._load_link(fs, ino->data.link.dest);
-			ino->datav.link->dest = lv->ino;
+	return n;
+}
+
+/* Move the data blocks of a file into one contiguous run, if there is
+ * a free run long enough. The new copy is on disk before the inode is
+ * repointed at it, and the old blocks are freed only after that.
+ * Holes stay holes. */
+static int _defrag_inode(filesystem* fs, inode* ino, defrag_report* report) {
+	size_t i, j, n, before;
+	int shared;
+	block_t newblocks[MAXFILEBLOCKS];
+	block_t oldblocks[MAXFILEBLOCKS];
+	size_t pos[MAXFILEBLOCKS];		/* The data blocks that are not holes */
+	block** slot;
+	block* buf;
+
+	if (NULL == fs || NULL == ino || NULL == report) return FS_ERR;
+	if (FS_FILE != ino->mode) return FS_ERR;
+
+	for (i = 0, n = 0; i < ino->ndatablocks; i++)
+		if (!_inode_hole(ino, i)) pos[n++] = i;
+	before = _inode_nextents(ino);
+
+	report->nfiles++;
+	report->extents_before += before;
+
+	/* Blocks other files share stay where they are */
+	for (i = 0, shared = false; NULL != fs->dedup && i < n; i++)
+		shared |= fs->dedup->refs[ino->blocks[pos[i]]] > 1;
+
+	/* Nothing to gain, or no room to do better. Compressed files are left where they are. */
+	if (before <= 1 || shared || (ino->flags & FS_ZSTORED) || 0 == _find_free_run(fs, n)) {
+		report->extents_after += before;
+		return FS_OK;
+	}
+
+	buf = (block*)malloc(n*sizeof(block));
+	if (NULL == buf) return FS_ERR;
+
+	/* Gather the data: from memory where it is loaded, else from disk a run at a time */
+	for (i = 0; i < n; i = j) {
+		slot = _inode_block_slot(ino, pos[i]);
+		if (NULL != *slot) {
+			memcpy(&buf[i], *slot, sizeof(block));
+			j = i + 1;
+			continue;
+		}
+
+		for (j = i + 1; j < n; j++) {
+			slot = _inode_block_slot(ino, pos[j]);
+			if (NULL != *slot || ino->blocks[pos[j]] != ino->blocks[pos[j-1]] + 1)
+				break;
+		}
+		if (FS_ERR == _fs.readrun(fs, &buf[i], ino->blocks[pos[i]], j - i)) {
+			free(buf);
+			return FS_ERR;
 		}
 	}
-	
-	return ino->datav.link;
-}
 
-/* Free the memory allocated to an in-memory file structure */
-static int _unload_link(/* filesystem* fs, */ inode* ino) {
-//	int status1;
-	
-	free(ino->datav.file);
-	ino->datav.file = NULL;
-	ino->v_attached = false;
-	
-//	status1 = _inode_unload(fs, ino);
-//	if (FS_ERR == status1)
-//		return FS_ERR;
-	return FS_OK;
-}
+	if (FS_ERR == _fs._mballoc(fs, n, newblocks)) {
+		free(buf);
+		return FS_ERR;
+	}
 
-/* Given an inode number, load the corresponding file structure. 
- * Wrap it in an inode which contains the in-memory version of the file */
-static filev* _load_file(filesystem* fs, /* dentv* parent, */ inode_t num) {
-	inode* ino = _inode_load(fs, num);
-	
-	ino->datav.file = _ino_to_fv(fs, ino);
+	for (i = 0; i < n; i++) {
+		buf[i].num = newblocks[i];
+		buf[i].next = i+1 < n ? newblocks[i+1] : 0;
+	}
 
-	if (NULL != attached_inodes[num])
-		return attached_inodes[num]->datav.file;
-	
-//	if (NULL == parent) {
-//		dentv* thisparent = _fs._load_dir(fs, ino->data.file.parent);
-//		ino->datav.file->parent	= thisparent->ino;
-//	}
-	
-	return ino->datav.file;
-}
+	/* Write the new copy with one write, and make it durable along with the block map */
+	if (FS_ERR == _fs.writeblock(fs, newblocks[0], n*BLKSIZE, buf) || 
+		FS_ERR == _sync(fs) || FS_ERR == _fdatasync(fs)) {
+		_fs._mbfree(fs, n, newblocks);
+		free(buf);
+		return FS_ERR;
+	}
+	free(buf);
 
-/* Free the memory allocated to an in-memory file structure */
-static int _unload_file(/*filesystem* fs, */ inode* ino) {
-//	int status1;
+	/* Repoint the inode. Writing its inode table block is the switch-over. */
+	for (i = 0; i < n; i++) {
+		oldblocks[i] = ino->blocks[pos[i]];
+		ino->blocks[pos[i]] = newblocks[i];
 
-	free(ino->datav.file);
-	ino->datav.file = NULL;
-	ino->v_attached = false;
+		slot = _inode_block_slot(ino, pos[i]);
+		if (NULL != *slot) {
+			(*slot)->num = newblocks[i];
+			(*slot)->next = i+1 < n ? newblocks[i+1] : 0;
+		}
+		ino->dirtyblocks[pos[i]] = false;	/* Its data is in the new copy */
+	}
+
+	ino->dirty = true;
+	if (FS_ERR == _inode_store(fs, ino) || FS_ERR == _fdatasync(fs))
+		return FS_ERR;
+
+	/* The dedup index follows the blocks. Only now may the old blocks be reused */
+	for (i = 0; NULL != fs->dedup && i < n; i++) {
+		if (0 == fs->dedup->refs[oldblocks[i]]) continue;
+		_dedup_add(fs, newblocks[i], fs->dedup->fps[oldblocks[i]]);
+		_dedup_remove(fs, oldblocks[i]);
+	}
+	_fs._mbfree(fs, n, oldblocks);
+	if (FS_ERR == _sync(fs))
+		return FS_ERR;
+
+	report->nmoved++;
+	report->nblocks += n;
+	report->extents_after += 1;
 
-//	status1 = _inode_unload(fs, ino);
-//	if (FS_ERR == status1)
-//		return FS_ERR;
 	return FS_OK;
 }
 
-/* Given an inode number, load the corresponding dent
- * Return a dentv whose field data.dir contains it. */
-static dentv* _load_dir(filesystem* fs, inode_t num) {
-	dentv *dv;
-	uint i;
+/* Queue for defragmentation the file @param num, or every file at or 
+ * below it if it is a directory. */
+static int _defrag_collect(filesystem* fs, inode_t num) {
+	size_t i;
 	inode* ino;
-	
-	
-	ino = _inode_load(fs, num);
-	if (NULL == ino) return NULL;
 
-	dv = _ino_to_dv(fs, ino);
-	if (NULL == dv) {
-		free(ino);
-		return NULL;
-	}
+	ino = _inode_load(fs, num);
+	if (NULL == ino) return FS_ERR;
 
-	if (NULL != dv->head)	{
-		if (!dv->head->v_attached) {
-			dv->head->datav.dir = _ino_to_dv(fs, dv->head);
-			dv->head->v_attached = true;
-		}
-	}
-	if (NULL != dv->tail)	{
-		if (!dv->tail->v_attached) {
-			dv->tail->datav.dir = _ino_to_dv(fs, dv->tail);
-			dv->tail->v_attached = true;
-		}
-	}
-	if (NULL != dv->parent) {
-		if (!dv->parent->v_attached) {
-//			if (fs->sb.root == dv->parent->num)
-//				dv->parent->datav.dir = dv->parent->datav.dir;
-//			else
-				dv->parent->datav.dir = _ino_to_dv(fs, dv->parent);
-			dv->parent->v_attached = true;
-		}
-//		_fs._v_attach(fs, dv->parent);
-	}
-	if (NULL != dv->next)	{
-		if (!dv->next->v_attached) {
-			dv->next->datav.dir = _ino_to_dv(fs, dv->next);
-			dv->next->v_attached = true;
+	switch (ino->mode) {
+		case FS_FILE:
+		{
+			if (fs->defrag.nqueued < MAXINODES)
+				fs->defrag.queue[fs->defrag.nqueued++] = num;
+			break;
 		}
-	}
-	if (NULL != dv->prev)	{
-		if (!dv->prev->v_attached) {
-			dv->prev->datav.dir = _ino_to_dv(fs, dv->prev);
-			dv->prev->v_attached = true;
+		case FS_DIR:
+		{
+			for (i = 0; i < ino->data.dir.nfiles; i++)
+				if (fs->defrag.nqueued < MAXINODES)
+					fs->defrag.queue[fs->defrag.nqueued++] = ino->data.dir.files[i];
+
+			for (i = 0; i < ino->data.dir.ndirs; i++)
+				_defrag_collect(fs, ino->data.dir.dirs[i]);
+			break;
 		}
 	}
 
-	if (	(NULL != dv->parent && NULL == dv->parent->datav.dir)	||
-		(NULL != dv->next && NULL == dv->next->datav.dir)	||
-		(NULL != dv->prev && NULL == dv->prev->datav.dir)	) {
+	return FS_OK;
+}
 
-		free(dv);
-		return NULL;
-	}
+/* Begin defragmenting the file or directory tree at inode @param num.
+ * The work itself is done by _defrag_step. */
+static int _defrag_start(filesystem* fs, inode_t num) {
+	if (NULL == fs) return FS_ERR;
+	if (NULL != fs->defrag.queue) return FS_ERR;	/* Already running */
 
-	for (i = 0; i < dv->nfiles; i++) {
-		filev* fv = _load_file(fs, /*dv,*/ dv->ino->data.dir.files[i]);
-		dv->files[i] = fv->ino;
-	}
-	
-	for (i = 0; i < dv->nlinks; i++) {
-		hlinkv* lv = _load_link(fs, /*dv,*/ dv->ino->data.dir.links[i]);
-		dv->links[i] = lv->ino;
-	}
-	
-	return dv;
+	fs->defrag.queue = (inode_t*)malloc(MAXINODES*sizeof(inode_t));
+	if (NULL == fs->defrag.queue) return FS_ERR;
+
+	fs->defrag.nqueued = 0;
+	fs->defrag.next = 0;
+	memset(&fs->defrag.report, 0, sizeof(defrag_report));
+
+	return _defrag_collect(fs, num);
 }
 
-/* Free the memory occupied by a dentv*/
-static int _unload_dir(filesystem* fs, inode* ino) {
-	size_t i;
-	int status1, status2;
-	dentv* dv = NULL;
-	inode* iterator;
-	inode* next;
+/* Defragment up to @param nfiles of the queued files.
+ * Returns how many are left. The report stays in fs->defrag.report. */
+static size_t _defrag_step(filesystem* fs, size_t nfiles) {
+	size_t done = 0;
+	inode_t num;
+	inode* ino;
+	int was_loaded;
+
+	if (NULL == fs || NULL == fs->defrag.queue) return 0;
+
+	while (done < nfiles && fs->defrag.next < fs->defrag.nqueued) {
+		num = fs->defrag.queue[fs->defrag.next++];
+
+		was_loaded = NULL != fs->attached_inodes[num];
+		ino = _inode_load(fs, num);
+		if (NULL == ino || FS_FILE != ino->mode)
+			continue;	/* Gone since it was queued */
+
+		_defrag_inode(fs, ino, &fs->defrag.report);
+		done++;
+
+		/* Do not leave behind inodes that were only loaded for this */
+		if (!was_loaded)
+			_inode_unload(fs, ino);
+	}
 
-	if (FS_DIR != ino->mode) return FS_ERR;
+	if (fs->defrag.next < fs->defrag.nqueued)
+		return fs->defrag.nqueued - fs->defrag.next;
 
-	dv = ino->datav.dir;
-	ino->v_attached = false;
+	free(fs->defrag.queue);
+	fs->defrag.queue = NULL;
+	return 0;
+}
 
-	status1 = _fs._sync(fs);
-	status2 = _fs.writeblocks(ino, ino->blocks, ino->nblocks, sizeof(inode));
-	
-	if (FS_ERR == status1 || FS_ERR == status2)
+/* A directory a walk has found but not yet read */
+typedef struct walk_task {
+	inode_t num;				/* Directory inode */
+	dent* d;				/* Its dent, read when it was found */
+	char* path;				/* Its absolute path */
+	uint depth;				/* Its depth. Its entries are one deeper */
+	uint* order;				/* Its position, order[0..depth-1] */
+} walk_task;
+
+/* One worker's tasks. The owner pushes and pops at the bottom, 
+ * so it goes depth first; thieves take from the top. */
+typedef struct walk_deque {
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_t lock;
+#endif
+	walk_task* tasks;
+	size_t top, bottom, cap;
+} walk_deque;
+
+typedef struct walk_state {
+	filesystem* fs;
+	fs_visitor visit;
+	void* arg;
+	uint nworkers;
+	walk_deque deques[FS_WALK_MAXTHREADS];
+	io_counts io[FS_WALK_MAXTHREADS];	/* Disk reads of each worker, added to fs_io when done */
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_t lock;
+	pthread_cond_t wake;			/* Signalled when a task is queued or the last one finishes */
+#endif
+	size_t pending;				/* Tasks queued or being worked on */
+	size_t queued;				/* Tasks queued */
+	int status;				/* FS_ERR once a read failed or the visitor stopped the walk */
+} walk_state;
+
+typedef struct walk_worker {
+	walk_state* ws;
+	uint id;
+	block blk;				/* Scratch block for dents */
+	block_t tblock;				/* Inode table block in itable, 0 if none */
+	block itable;				/* The last inode table block read on its own */
+	dinode mem;				/* A loaded inode, in its on-disk form */
+} walk_worker;
+
+/* Read @param count blocks from @param b. Reads of different workers do not
+ * share a file position, so they can be in flight at the same time. */
+static int _walk_read(walk_worker* w, void* dest, block_t b, size_t count) {
+	filesystem* fs = w->ws->fs;
+	uint64_t t = stats_now();
+
+	if (NULL == fs->fp) return FS_ERR;
+#if defined(_WIN64) || defined(_WIN32)
+	if (FS_ERR == _fs.readrun(fs, dest, b, count)) return FS_ERR;
+#else
+	if ((ssize_t)(count*BLKSIZE) != pread(fileno(fs->fp), dest, count*BLKSIZE, (off_t)b*BLKSIZE))
 		return FS_ERR;
+#endif
+	w->ws->io[w->id].nreads++;
+	w->ws->io[w->id].blocks_read += count;
+	stats_count(SC_BYTES_READ, count*BLKSIZE);
+	stats_record_args(ST_READBLOCK, t, (long)b, -1);
+	return FS_OK;
+}
 
-	if (NULL != dv) {
-		/* Free the whole subtree under this directory */
-		iterator = dv->head;
-		next = dv->head;
-		while (NULL != next) {
-			if (NULL != iterator->datav.dir)
-				next = iterator->datav.dir->next;
-			else next = NULL;
-			if (iterator->v_attached)
-				_unload_dir(fs, iterator);
-		}
+/* Push @param task on the bottom of worker @param w's deque */
+static int _walk_push(walk_worker* w, walk_task* task) {
+	walk_state* ws = w->ws;
+	walk_deque* q = &ws->deques[w->id];
+	walk_task* grown;
+	int retv = FS_OK;
 
-		for (i = 0; i < dv->nfiles; i++)
-			_unload_file(dv->files[i]);
-		
-		for (i = 0; i < dv->nlinks; i++)
-			_unload_link(dv->links[i]);
-		
-		free(ino->datav.dir);
-		ino->datav.dir = NULL;
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_lock(&q->lock);
+#endif
+	if (q->bottom == q->cap) {
+		grown = (walk_task*)realloc(q->tasks, (q->cap ? 2*q->cap : 64)*sizeof(walk_task));
+		if (NULL == grown) retv = FS_ERR;
+		else {
+			q->tasks = grown;
+			q->cap = q->cap ? 2*q->cap : 64;
+		}
 	}
-	
-//	_inode_unload(fs, ino);
+	if (FS_OK == retv) q->tasks[q->bottom++] = *task;
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_unlock(&q->lock);
+#endif
+	if (FS_ERR == retv) return FS_ERR;
 
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_lock(&ws->lock);
+#endif
+	ws->pending++;
+	ws->queued++;
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_cond_signal(&ws->wake);
+	pthread_mutex_unlock(&ws->lock);
+#endif
 	return FS_OK;
 }
 
-/* Load a volatile structure from disk and put it in an inode*/
-static int _v_attach(filesystem* fs, inode* ino) {
-	if (NULL == ino) return FS_ERR;
+/* Take a task from deque @param victim, from the bottom if it is the 
+ * caller's own and from the top otherwise. Returns false if it was empty. */
+static int _walk_take(walk_worker* w, uint victim, walk_task* task) {
+	walk_state* ws = w->ws;
+	walk_deque* q = &ws->deques[victim];
+	int found = false;
 
-	if (fs->sb.root == ino->num) {
-		ino->datav.dir = ino->datav.dir;
-		return FS_OK;
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_lock(&q->lock);
+#endif
+	if (q->top < q->bottom) {
+		*task = victim == w->id ? q->tasks[--q->bottom] : q->tasks[q->top++];
+		if (q->top == q->bottom) q->top = q->bottom = 0;
+		found = true;
 	}
-	
-	if (!ino->v_attached) {
-		switch (ino->mode) {
-
-			case FS_DIR:
-			{
-				ino->datav.dir = _load_dir(fs, ino->num);
-				break;
-			}
-			case FS_FILE:
-			{
-				ino->datav.file = _load_file(fs, ino->num);
-				break;
-			}
-			case FS_LINK:
-			{
-				ino->datav.link = _load_link(fs, ino->num);
-				break;
-			}
-		}
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_unlock(&q->lock);
+#endif
+	if (!found) return false;
 
-		if (NULL == ino->datav.dir) return FS_ERR;
-		ino->v_attached = true;
-	}
-	return FS_OK;
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_lock(&ws->lock);
+#endif
+	ws->queued--;
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_unlock(&ws->lock);
+#endif
+	return true;
 }
 
-/* Write the data in an inode disk and free the in-memory data */
-static int _v_detach(filesystem* fs, inode* ino) {
-	if (NULL == ino) return FS_ERR;
-	
-	if (ino->v_attached) {
+/* The inode @param num in its on-disk form. A loaded inode is taken from
+ * memory, as it may have changes not written yet. Else inode table blocks
+ * are taken from @param batch, @param nbatch blocks sorted by number, if
+ * they are there, else read one at a time. */
+static dinode* _walk_dinode(walk_worker* w, inode_t num, block_t* batch, block* batchdata, size_t nbatch) {
+	filesystem* fs = w->ws->fs;
+	block_t b;
+	block* tb = NULL;
+	size_t lo = 0, hi = nbatch, mid;
+	dinode* di;
+	inode* ino;
+
+	if (MAXINODES <= num) return NULL;
+
+	ino = fs->attached_inodes[num];
+	if (NULL != ino) {
+		di = &w->mem;
+		memset(di, 0, sizeof(dinode));
+		di->num = ino->num;
+		di->mode = ino->mode;
+		di->nlinks = (uint16_t)ino->nlinks;
+		di->size = (uint32_t)ino->size;
+		/* Blocks still buffered count, holes do not: nblocks has it so */
+		di->ndatablocks = (uint16_t)ino->nblocks;
 		switch (ino->mode) {
-			
-			case FS_DIR:
-			{
-				_unload_dir(fs, ino);
-				break;
-			}
 			case FS_FILE:
-			{
-				_unload_file(ino);
+				di->parent = ino->data.file.parent;
+				memcpy(di->name, ino->data.file.name, FS_NAMEMAXLEN);
+				break;
+			case FS_DIR:
+				di->parent = ino->data.dir.parent;
+				memcpy(di->name, ino->data.dir.name, FS_NAMEMAXLEN);
 				break;
-			}
 			case FS_LINK:
-			{
-				_unload_link(ino);
+				di->parent = ino->data.link.parent;
+				di->dest = ino->data.link.dest;
+				di->destmode = ino->data.link.mode;
+				memcpy(di->name, ino->data.link.name, FS_NAMEMAXLEN);
 				break;
-			}
 		}
-		ino->v_attached = false;
+		return di;
 	}
 
-	return FS_OK;
-}
+	if (0 == fs->sb.inode_first_blocks[num]) return NULL;
 
-/* Get the inode of a directory, link, or file, at the end of a path.
- * Follow an array of cstrings which are the fields of a path, e.g. input of 
- * { "bob", "dylan", "is", "old" } represents path "/bob/dylan/is/old"
- * 
- * @param dir The root of the tree to traverse.
- * @param depth The depth of the path
- * @param path The fields of the path
- * Return the inode at the end of this path or NULL if not found.
- */ 
-static inode* _stat_recurse(filesystem* fs, dentv* dv, size_t current_depth, size_t max_depth, fs_path* p) {
-	uint i;											// Declarations go here to satisfy Visual C compiler
-	dentv* iterator;
-	inode *tmp;
-	
-	if (NULL == dv) return NULL;
+	b = fs->sb.inode_table[num / FS_INODES_PER_BLOCK];
+	if (0 == b) return NULL;
 
-	/* Recurse into subdirectories if there are any */
-	if (NULL != dv->head) {
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (batch[mid] < b) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo < nbatch && batch[lo] == b) tb = &batchdata[lo];
 
-		dentv* head = _fs._load_dir(fs, dv->head->num);
+	if (NULL == tb) {
+		if (w->tblock != b) {
+			w->tblock = 0;
+			if (FS_ERR == _walk_read(w, &w->itable, b, 1)) return NULL;
+			w->tblock = b;
+		}
+		tb = &w->itable;
+	}
 
-		if (NULL != head) {
+	di = &((dinode*)tb)[num % FS_INODES_PER_BLOCK];
+	return num == di->num ? di : NULL;
+}
 
-			iterator = head;
-			
-			/* For each subdirectory */
-			for (i = 0; i < dv->ndirs; i++)
-			{
-				size_t next_ino;
-				
-				if (NULL == iterator) break;					// This happens if there are no subdirs
-
-				if (!strcmp(iterator->name, p->fields[current_depth])) {	// If we have a matching directory name
-					if (max_depth == current_depth)				// If we can't go any deeper
-						return iterator->ino;				// Return the inode of the matching dir
-					
-					else return _stat_recurse(fs, iterator,			// Else recurse into subdir
-						current_depth + 1, max_depth, p); 
-				}
+/* Read the dent of the directory whose on-disk inode is @param di,
+ * or copy it if the directory is loaded */
+static dent* _walk_dent(walk_worker* w, dinode* di) {
+	inode* ino = w->ws->fs->attached_inodes[di->num];
+	extent* ext = di->u.ext;
+	extent xext[FS_NEXTENTS + FS_XEXTENTS];
+	block* blks = NULL;
+	char* buf = NULL;
+	dent* d = NULL;
+	size_t i, n = 0;
+	int ok;
 
-				if (NULL == iterator->next) break;				// Return if we have iterated over all subdirs
+	if (FS_DIR != di->mode) return NULL;
 
-				next_ino = iterator->next->num;
-//				_fs._unload_dir(fs, iterator->ino);
-				iterator = _fs._load_dir(fs, (inode_t)next_ino);
-			}
+	if (NULL != ino) {
+		dent* src = &ino->data.dir;
+
+		d = (dent*)malloc(sizeof(dent));
+		if (NULL == d) return NULL;
+		memset(d, 0, sizeof(dent));
+		if (FS_ERR == _dent_reserve(d, src->ndirs, src->nfiles, src->nlinks)) {
+			_dent_free(d);
+			free(d);
+			return NULL;
 		}
+		d->ino = src->ino;
+		d->parent = src->parent;
+		memcpy(d->name, src->name, FS_NAMEMAXLEN);
+		d->ndirs = src->ndirs;
+		d->nfiles = src->nfiles;
+		d->nlinks = src->nlinks;
+		/* Kinds with no entries have no arrays to copy */
+		if (0 < d->ndirs) memcpy(d->dirs, src->dirs, d->ndirs*sizeof(inode_t));
+		if (0 < d->nfiles) memcpy(d->files, src->files, d->nfiles*sizeof(inode_t));
+		if (0 < d->nlinks) memcpy(d->links, src->links, d->nlinks*sizeof(inode_t));
+		return d;
 	}
 
-	tmp = _fs._files_iterate(fs, dv, p, current_depth);
-	if (tmp) return tmp;
-	
-	return _fs._links_iterate(fs, dv, p, current_depth);
-}
+	if (0 == di->nextents) return NULL;
 
-static inode* _files_iterate(filesystem* fs, dentv* dv, fs_path* p, size_t current_depth) {
-	int i;
-	
-	/* Iterate over files */
-	for (i = 0; i < (int)dv->nfiles; i++) {						// For each file at this level
-		
-		filev* fv = _load_file(fs, /*dv,*/ dv->ino->data.dir.files[i]);
-		
-		if (!strcmp(fv->name, p->fields[current_depth])) {
-			dv->files[i] = fv->ino;
-			
-			if (!dv->files[i]->v_attached) {				// Load the file from disk if not already in memory
-				if (FS_ERR == _v_attach(fs, dv->files[i]))
-					break;
-			}
-			return dv->files[i];
-		}
-		//else _unload_file(fs, fv->ino);					/* Hack: not freeing, unloading, closing anything */
+	if (di->nextents > FS_NEXTENTS) {
+		if (FS_ERR == _walk_read(w, &w->blk, di->xblock, 1)) return NULL;
+		memcpy(xext, di->u.ext, FS_NEXTENTS*sizeof(extent));
+		memcpy(&xext[FS_NEXTENTS], &w->blk, FS_XEXTENTS*sizeof(extent));
+		ext = xext;
 	}
-	return NULL;									/* No matching inode found */
-}
 
-static inode* _links_iterate(filesystem* fs, dentv* dv, fs_path* p, size_t current_depth) {
-	int i;
-	
-	/* Iterate over links */
-	for (i = 0; i < (int)dv->nlinks; i++) {						// For each link at this level
-		if (!strcmp(dv->links[i]->data.link.name, p->fields[current_depth])) {
-			
-			if (!dv->links[i]->v_attached) {				// Load the file from disk if not already in memory
-				if (FS_ERR == _v_attach(fs, dv->links[i]))
-					break;
-			}
-			dv->links[i]->datav.link->parent = dv->ino; /* Hack */
-			return dv->links[i];
-		}
-	}
-	return NULL;									/* No matching inode found */
-	
-}
+	/* Small directories take the one scratch block */
+	if (1 == di->ndatablocks) blks = &w->blk;
+	else blks = (block*)malloc(di->ndatablocks*sizeof(block));
+	buf = (char*)malloc(di->ndatablocks*stride);
+	d = (dent*)malloc(sizeof(dent));
+	ok = NULL != blks && NULL != buf && NULL != d;
 
-/* Return the given string less the first character */
-static char* _strSkipFirst(char* str) {
-	return &str[1];
-}
+	for (i = 0; ok && i < di->nextents && n < di->ndatablocks; i++) {
+		size_t len = min((size_t)ext[i].len, di->ndatablocks - n);
+		ok = FS_OK == _walk_read(w, &blks[n], ext[i].start, len);
+		n += len;
+	}
 
-/* Return the given string less the last character */
-static char* _strSkipLast(char* str) {
-	size_t len;
-	if (NULL == str || '\0' == str[0]) 
-		return NULL;
+	if (ok && n == di->ndatablocks) {
+		for (i = 0; i < n; i++)
+			memcpy(&buf[i*stride], blks[i].data, stride);
+		ok = FS_OK == _dent_unpack(d, buf, n*stride);
+	} else ok = false;
 
-	len = strlen(str);
-	str[len - 1] = '\0';
-	return str;
+	if (blks != &w->blk) free(blks);
+	free(buf);
+	if (!ok) {
+		free(d);
+		d = NULL;
+	}
+	return d;
 }
 
-/* Trim the leading and trailing white space from a string. 
- * The string is shifted into the first position so that free()
- * still works. http://stackoverflow.com/a/122974/472308 */
-static char* _trim(char *str)
-{
-	size_t len = 0;
-	char *frontp = str - 1;
-	char *endp = NULL;
-
-	if( str == NULL )
-		return NULL;
+/* Free a dent read by _walk_dent */
+static void _walk_dent_free(dent* d) {
+	if (NULL == d) return;
+	_dent_free(d);
+	free(d);
+}
 
-	if( str[0] == '\0' )
-		return str;
+/* Sort inode table block numbers */
+static int _cmp_block_t(const void* a, const void* b) {
+	return (int)*(const block_t*)a - (int)*(const block_t*)b;
+}
 
-	len = strlen(str);
-	endp = str + len;
+/* Tell the visitor about the entry @param di found in directory @param task,
+ * at position @param pos among its siblings. Returns the visitor's answer. */
+static int _walk_visit(walk_worker* w, walk_task* task, dinode* di, uint pos, char** path, uint** order) {
+	walk_state* ws = w->ws;
+	fs_walk_entry e;
+	size_t plen = strlen(task->path), nlen = strnlen(di->name, FS_NAMEMAXLEN);
+	int slash = 0 == plen || '/' != task->path[plen-1];
+
+	*path = (char*)malloc(plen + slash + nlen + 1);
+	*order = (uint*)malloc((task->depth + 1)*sizeof(uint));
+	if (NULL == *path || NULL == *order) return FS_ERR;
+
+	memcpy(*path, task->path, plen);
+	if (slash) (*path)[plen] = '/';
+	memcpy(*path + plen + slash, di->name, nlen);
+	(*path)[plen + slash + nlen] = '\0';
+
+	if (task->depth) memcpy(*order, task->order, task->depth*sizeof(uint));
+	(*order)[task->depth] = pos;
+
+	e.path = *path;
+	e.name = *path + plen + slash;
+	e.num = di->num;
+	e.parent = task->num;
+	e.mode = di->mode;
+	e.dest = FS_LINK == di->mode ? di->dest : 0;
+	e.destmode = FS_LINK == di->mode ? di->destmode : 0;
+	e.size = di->size;
+	e.nlinks = di->nlinks;
+	e.nblocks = (size_t)di->ndatablocks - di->nholes + (0 != di->xblock);
+	e.depth = task->depth + 1;
+	e.order = *order;
+	e.worker = w->id;
+
+	return ws->visit(&e, ws->arg);
+}
 
-	/* Move the front and back pointers to address
-	* the first non-whitespace characters from
-	* each end.
-	*/
-	while( isspace(*(++frontp)) );
-	while( isspace(*(--endp)) && endp != frontp );
+/* Read the directory of @param task, tell the visitor about its entries
+ * and queue its subdirectories. The inode table blocks of all its entries
+ * are read first, in block order and merged into runs. */
+static int _walk_dir(walk_worker* w, walk_task* task) {
+	walk_state* ws = w->ws;
+	filesystem* fs = ws->fs;
+	dent* d = task->d;
+	size_t i, j, n, nbatch = 0;
+	block_t* batch = NULL;
+	block* batchdata = NULL;
+	dinode* di;
+	inode_t c;
+	walk_task sub;
+	char* path;
+	uint* order;
+	uint pos = 0;
+	int v, retv = FS_OK;
+
+	n = d->ndirs + d->nfiles + d->nlinks;
+	if (n > 0) {
+		batch = (block_t*)malloc(n*sizeof(block_t));
+		if (NULL == batch) return FS_ERR;
+
+		for (i = 0; i < n; i++) {
+			c = i < d->ndirs ? d->dirs[i] : i < d->ndirs + d->nfiles ? d->files[i - d->ndirs] : d->links[i - d->ndirs - d->nfiles];
+			if (MAXINODES > c && 0 != fs->sb.inode_table[c / FS_INODES_PER_BLOCK])
+				batch[nbatch++] = fs->sb.inode_table[c / FS_INODES_PER_BLOCK];
+		}
+		qsort(batch, nbatch, sizeof(block_t), _cmp_block_t);
+		for (i = 0, j = 0; i < nbatch; i++)
+			if (0 == j || batch[j-1] != batch[i]) batch[j++] = batch[i];
+		nbatch = j;
+
+		batchdata = (block*)malloc(nbatch*sizeof(block));
+		if (NULL == batchdata) {
+			free(batch);
+			return FS_ERR;
+		}
+		for (i = 0; i < nbatch; i = j) {
+			for (j = i + 1; j < nbatch && batch[j] == batch[j-1] + 1; j++);
+			if (FS_ERR == _walk_read(w, &batchdata[i], batch[i], j - i)) {
+				retv = FS_ERR;
+				break;
+			}
+		}
+	}
 
-	if( str + len - 1 != endp )
-		*(endp + 1) = '\0';
-	else if( frontp != str &&  endp == frontp )
-		*str = '\0';
+	for (i = 0; FS_OK == retv && i < d->ndirs; i++) {
+		c = d->dirs[i];
+		di = _walk_dinode(w, c, batch, batchdata, nbatch);
+		if (NULL == di || FS_DIR != di->mode) continue;
+
+		path = NULL;
+		order = NULL;
+		v = _walk_visit(w, task, di, pos++, &path, &order);
+
+		/* A pruned directory is not read at all */
+		sub.d = NULL;
+		if (FS_ERR == v) retv = FS_ERR;
+		else if (FS_WALK_PRUNE != v) {
+			sub.d = _walk_dent(w, di);
+			if (NULL == sub.d) retv = FS_ERR;
+			else {
+				sub.num = c;
+				sub.path = path;
+				sub.depth = task->depth + 1;
+				sub.order = order;
+
+				if (FS_ERR == _walk_push(w, &sub)) retv = FS_ERR;
+				else {
+					sub.d = NULL;	/* The task has them now */
+					path = NULL;
+					order = NULL;
+				}
+			}
+		}
 
-	/* Shift the string so that it starts at str so
-	* that if it's dynamically allocated, we can
-	* still free it on the returned pointer.  Note
-	* the reuse of endp to mean the front of the
-	* string buffer now.
-	*/
-	endp = str;
-	if( frontp != str )
-	{
-		while( *frontp ) *endp++ = *frontp++;
-		*endp = '\0';
+		_walk_dent_free(sub.d);
+		free(path);
+		free(order);
 	}
+	pos = (uint)d->ndirs;
 
+	for (i = 0; FS_OK == retv && i < d->nfiles + d->nlinks; i++) {
+		c = i < d->nfiles ? d->files[i] : d->links[i - d->nfiles];
+		if (i == d->nfiles) pos = (uint)(d->ndirs + d->nfiles);
 
-	return str;
-}
-/* Remove leading and final forward slashes from a string
- * if they exist */
-static char* _pathTrimSlashes(char* path) {
-	size_t len;
-	if (NULL == path || '\0' == path[0]) 
-		return NULL;
+		di = _walk_dinode(w, c, batch, batchdata, nbatch);
+		if (NULL == di) continue;
 
-	if ('/' == path[0])		
-		path = _strSkipFirst(path);	/* Remove leading forward slash */
-	
-	len = strlen(path);
-	
-	if (0 == len) return path;
-	
-	if ('/' == path[len - 1])	
-		path = _strSkipLast(path);	/* Remove trailing forward slash */
+		path = NULL;
+		order = NULL;
+		if (FS_ERR == _walk_visit(w, task, di, pos++, &path, &order))
+			retv = FS_ERR;
+		free(path);
+		free(order);
+	}
 
-	return path;
+	free(batch);
+	free(batchdata);
+	return retv;
 }
 
-/* Split a string on "/" and handle . and .. operators */
-static fs_path* _pathFromString(const char* str) {
-	int i, j;
-	fs_path *p  = NULL;
-	if (NULL == str || 0 == strlen(str)) return NULL;
-	
-	p = _tokenize(str, "/");
-	if (NULL == p) return NULL;
-	
-	for (i = (int)p->nfields - 1 ; i > -1; i--) {
-		if (strlen(p->fields[i]) > 0 && '.' == p->fields[i][0]) {
-			
-			/* Handle the ".." path operator */
-			if (strlen(p->fields[i]) > 1 && '.' == p->fields[i][1]) {
-				if (0 == i) return NULL;	/* Can't start an abs path with '..' */
-				
-				j = i;
-				while ((int)p->nfields > j) { // If there is a next field
-					
-					strncpy(p->fields[j-1], p->fields[j+1], strlen(p->fields[j+1]));
-					p->fields[j-1][strlen(p->fields[j+1])] = '\0';
-						       
-					++j;
-				}
-				p->fields[p->nfields-1][0] = '\0';
-				p->fields[p->nfields-2][0] = '\0';
-				p->nfields -= 2;
-			}
-			
-			/* Handle the "." path operator */
-			else {
-				j = i;
-				while ((int)p->nfields > j+1) { // If there is a next field
-					strncpy(p->fields[j], p->fields[j+1], strlen(p->fields[j]));
-					++j;
-				}
-				p->fields[p->nfields-1][0] = '\0';
-				p->nfields--;
+/* Take tasks from the worker's own deque, or steal them from the others,
+ * until there are none left anywhere */
+static void* _walk_worker(void* arg) {
+	walk_worker* w = (walk_worker*)arg;
+	walk_state* ws = w->ws;
+	walk_task task;
+	uint k;
+	int found, status;
+
+	for (;;) {
+		found = _walk_take(w, w->id, &task);
+		for (k = 1; !found && k < ws->nworkers; k++)
+			found = _walk_take(w, (w->id + k) % ws->nworkers, &task);
+
+		if (found) {
+			/* Once the walk has failed, the rest of the tasks are only dropped */
+			status = FS_ERR == ws->status ? FS_ERR : _walk_dir(w, &task);
+
+			_walk_dent_free(task.d);
+			free(task.path);
+			free(task.order);
+
+#if !defined(_WIN64) && !defined(_WIN32)
+			pthread_mutex_lock(&ws->lock);
+#endif
+			if (FS_ERR == status) ws->status = FS_ERR;
+			if (0 == --ws->pending) {
+#if !defined(_WIN64) && !defined(_WIN32)
+				pthread_cond_broadcast(&ws->wake);
+#endif
 			}
+#if !defined(_WIN64) && !defined(_WIN32)
+			pthread_mutex_unlock(&ws->lock);
+#endif
+			continue;
 		}
-	}
 
-	
-	return p;
+#if defined(_WIN64) || defined(_WIN32)
+		break;
+#else
+		/* Nothing to take. Sleep until something is queued, or stop if nothing is left to do */
+		pthread_mutex_lock(&ws->lock);
+		while (0 < ws->pending && 0 == ws->queued)
+			pthread_cond_wait(&ws->wake, &ws->lock);
+		found = 0 == ws->pending;
+		pthread_mutex_unlock(&ws->lock);
+		if (found) break;
+#endif
+	}
+	return NULL;
 }
 
-/* Return an absolute path */
-static char* _stringFromPath(fs_path* p) {
-	size_t i;
-	char* path;
-	
-	if (NULL == p) return NULL;
+/* Visit every entry below the directory at inode @param num, whose path
+ * is @param path, calling @param visit for each on @param nthreads worker 
+ * threads, or one per processor if 0. The walk reads the image directly,
+ * but takes loaded inodes and directories from memory, so nothing needs
+ * to be written out first. */
+static int _walk(filesystem* fs, inode_t num, const char* path, uint nthreads, fs_visitor visit, void* arg) {
+	walk_state* ws;
+	walk_worker* workers;
+	walk_task task;
+	dinode* di;
+	uint k;
+	int retv;
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_t threads[FS_WALK_MAXTHREADS];
+	uint nstarted = 1;
+#endif
 
-	path = (char*)malloc(FS_MAXPATHLEN);
-	memset(path, 0, FS_MAXPATHLEN);
+	if (NULL == fs || NULL == path || NULL == visit) return FS_ERR;
 
-	strcat(path, "/");
+	/* Workers read the image on their own; let them see what stdio still holds */
+	if (0 != fflush(fs->fp))
+		return FS_ERR;
 
-	for (i = p->firstField; i < min(p->nfields, FS_MAXPATHFIELDS); i++) {
-		strcat(path, p->fields[i]);
-		strcat(path, "/");
+#if defined(_WIN64) || defined(_WIN32)
+	nthreads = 1;				/* No worker threads */
+#else
+	if (0 == nthreads) {
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpus > 0 ? (uint)ncpus : 1;
 	}
+#endif
+	if (FS_WALK_MAXTHREADS < nthreads) nthreads = FS_WALK_MAXTHREADS;
 
-	path[FS_NAMEMAXLEN] = '\0';
-	return path;
-}
+	ws = (walk_state*)calloc(1, sizeof(walk_state));
+	workers = (walk_worker*)calloc(nthreads, sizeof(walk_worker));
+	if (NULL == ws || NULL == workers) {
+		free(ws);
+		free(workers);
+		return FS_ERR;
+	}
 
-/* Get the path minus the last field, e.g. "a/b" from "a/b/c" */
-static char* _pathSkipLast(fs_path* p) {
-	char* path;
+	ws->fs = fs;
+	ws->visit = visit;
+	ws->arg = arg;
+	ws->nworkers = nthreads;
+	ws->status = FS_OK;
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_init(&ws->lock, NULL);
+	pthread_cond_init(&ws->wake, NULL);
+	for (k = 0; k < nthreads; k++)
+		pthread_mutex_init(&ws->deques[k].lock, NULL);
+#endif
+	for (k = 0; k < nthreads; k++) {
+		workers[k].ws = ws;
+		workers[k].id = k;
+	}
 
-	if (NULL == p) return NULL;
-	if (0 == p->nfields) {
-		char* ret = (char*)malloc(1);
-		ret[0] = '\0';
-		return ret;
+	/* The start directory is the first task */
+	task.num = num;
+	task.path = (char*)malloc(strlen(path) + 1);
+	task.depth = 0;
+	task.order = NULL;
+	di = _walk_dinode(&workers[0], num, NULL, NULL, 0);
+	task.d = NULL == di ? NULL : _walk_dent(&workers[0], di);
+	if (NULL != task.path) strcpy(task.path, path);
+
+	if (NULL == task.path || NULL == task.d || FS_ERR == _walk_push(&workers[0], &task)) {
+		free(task.path);
+		_walk_dent_free(task.d);
+		ws->status = FS_ERR;
+	} else {
+#if !defined(_WIN64) && !defined(_WIN32)
+		/* Workers that would not start leave their deques empty; the others steal around them */
+		for (; nstarted < nthreads; nstarted++)
+			if (0 != pthread_create(&threads[nstarted], NULL, _walk_worker, &workers[nstarted]))
+				break;
+#endif
+		_walk_worker(&workers[0]);
+#if !defined(_WIN64) && !defined(_WIN32)
+		for (k = 1; k < nstarted; k++)
+			pthread_join(threads[k], NULL);
+#endif
 	}
 
-	if (!strcmp(p->fields[0], "/"))
-		return p->fields[0];
+	for (k = 0; k < nthreads; k++) {
+		fs_io.nreads += ws->io[k].nreads;
+		fs_io.blocks_read += ws->io[k].blocks_read;
+		free(ws->deques[k].tasks);
+#if !defined(_WIN64) && !defined(_WIN32)
+		pthread_mutex_destroy(&ws->deques[k].lock);
+#endif
+	}
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_destroy(&ws->lock);
+	pthread_cond_destroy(&ws->wake);
+#endif
 
-	p->nfields--;
-	path = _stringFromPath(p);
-	p->nfields++;
+	retv = ws->status;
+	free(ws);
+	free(workers);
+	return retv;
+}
 
-	return path;
+typedef struct readdir_state {		/* What _readdir_plus passes the entries to */
+	fs_visitor visit;
+	void* arg;
+	fs_walk_entry* entries;			/* Or, for _readdir_list, where it keeps them */
+	size_t n, cap;
+	size_t nchars;				/* Length of their paths, terminators included */
+} readdir_state;
+
+/* Pass an entry on to the caller's visitor, and go no deeper */
+static int _readdir_visit(const fs_walk_entry* e, void* arg) {
+	readdir_state* rs = (readdir_state*)arg;
+	return FS_ERR == rs->visit(e, rs->arg) ? FS_ERR : FS_WALK_PRUNE;
 }
 
-/* Get the last field in the path, e.g. "c" from "a/b/c" */
-static char* _pathGetLast(fs_path* p) {
-	char* p_str;
+/* Call @param visit for each entry of the directory at inode @param num, 
+ * whose path is @param path: subdirectories, then files, then links. 
+ * The entries come from the dent and from one sorted, batched read of 
+ * their inode table blocks, instead of a load per entry. */
+static int _readdir_plus(filesystem* fs, inode_t num, const char* path, fs_visitor visit, void* arg) {
+	readdir_state rs;
 
-	if (NULL == p) return NULL;
+	if (NULL == visit) return FS_ERR;
 
-	p->firstField = p->nfields - 1;
-	p_str = _stringFromPath(p);
-	p->firstField = 0;
+	rs.visit = visit;
+	rs.arg = arg;
+	return _walk(fs, num, path, 1, _readdir_visit, &rs);
+}
 
-	p_str = _pathTrimSlashes(p_str);
+/* Keep a copy of an entry for _readdir_list */
+static int _readdir_keep(const fs_walk_entry* e, void* arg) {
+	readdir_state* rs = (readdir_state*)arg;
+	fs_walk_entry* grown;
+	char* path;
 
-	return p_str;
-}
+	if (rs->n == rs->cap) {
+		grown = (fs_walk_entry*)realloc(rs->entries, (rs->cap ? 2*rs->cap : 64)*sizeof(fs_walk_entry));
+		if (NULL == grown) return FS_ERR;
+		rs->entries = grown;
+		rs->cap = rs->cap ? 2*rs->cap : 64;
+	}
 
-/* Append a path element to a path structure*/
-static int _pathAppend(fs_path* p, const char* appendage) {
-	size_t len;
-	char* cpy;
-	char* cpy_free_ptr;
-	
-	if (	NULL == p || 
-		NULL == appendage || 
-		'\0' == appendage[0]	) 
-	{ return FS_ERR; }
+	path = (char*)malloc(strlen(e->path) + 1);
+	if (NULL == path) return FS_ERR;
+	strcpy(path, e->path);
 
-	if (FS_MAXPATHFIELDS == p->nfields)
-		return FS_ERR;
+	rs->entries[rs->n] = *e;
+	rs->entries[rs->n].path = path;
+	rs->entries[rs->n].name = path + (e->name - e->path);
+	rs->entries[rs->n].order = NULL;
+	rs->n++;
+	rs->nchars += strlen(path) + 1;
+	return FS_OK;
+}
 
-	len = strlen(appendage);
-	cpy_free_ptr = (char*)malloc(len+1);
-	cpy = cpy_free_ptr;
+/* The entries of the directory at inode @param num, as _readdir_plus finds 
+ * them, in one allocation with their paths; free() it when done. 
+ * Their number goes in @param n. The order keys are NULL. */
+static fs_walk_entry* _readdir_list(filesystem* fs, inode_t num, const char* path, size_t* n) {
+	readdir_state rs;
+	fs_walk_entry* list = NULL;
+	char* chars;
+	size_t i;
+	int status;
 
-	strncpy(cpy, appendage, min(len, FS_MAXPATHLEN));
-	cpy[len] = '\0';
+	memset(&rs, 0, sizeof(readdir_state));
+	status = _readdir_plus(fs, num, path, _readdir_keep, &rs);
 
-	cpy = _pathTrimSlashes(cpy);
+	if (FS_ERR != status)
+		list = (fs_walk_entry*)malloc(rs.n*sizeof(fs_walk_entry) + rs.nchars + 1);
 
-	if (0 == strlen(cpy) || !strcmp("/", cpy)){ 	/* Skip empty string and "/" */
-		free(cpy_free_ptr);
-		return FS_ERR;
+	if (NULL != list) {
+		chars = (char*)&list[rs.n];
+		for (i = 0; i < rs.n; i++) {
+			list[i] = rs.entries[i];
+			strcpy(chars, rs.entries[i].path);
+			list[i].path = chars;
+			list[i].name = chars + (rs.entries[i].name - rs.entries[i].path);
+			chars += strlen(chars) + 1;
+		}
 	}
 
-	strncpy(	p->fields[p->nfields], 
-			cpy, 
-			min(FS_MAXPATHLEN, strlen(cpy))	);
+	for (i = 0; i < rs.n; i++)
+		free((char*)rs.entries[i].path);
+	free(rs.entries);
 
-	free(cpy_free_ptr);
-	p->nfields++;
-	return FS_OK;
+	*n = NULL == list ? 0 : rs.n;
+	return list;
 }
 
-static char* _getAbsolutePath(char* current_dir, char* path) {
-	fs_path* p = NULL;
-	char* abs_path = NULL;
-	char path_tmp[FS_MAXPATHLEN];
+/* Put in @param blocks, from @param n on, every block on disk the removed
+ * inode @param ino has, and give back what was reserved for its buffered
+ * blocks. A directory's entries are queued to be freed after it. */
+static size_t _reclaim_inode(filesystem* fs, inode* ino, block_t* blocks, size_t n) {
+	size_t i;
 
-	memset(path_tmp, 0, FS_MAXPATHLEN);
-	
-	if ('/' == path[0]) {	/* Path is already absolute*/
-		p = _pathFromString(path);
-		abs_path = _stringFromPath(p);
-	} else {
-		strcat(path_tmp, current_dir);
-		strcat(path_tmp, path);
-		p = _pathFromString(path_tmp);
-		abs_path = _stringFromPath(p);
+	for (i = 0; i < ino->ndatablocks; i++) {
+		if (_inode_hole(ino, i)) continue;
+
+		if (0 != ino->blocks[i])
+			blocks[n++] = ino->blocks[i];
+		else if (!(ino->flags & FS_ZSTORED) || i >= ino->nzdata)	/* Buffered */
+			fs->nreserved_blocks -= min(fs->nreserved_blocks, 1);
 	}
-	_pathFree(p);
-	return abs_path;
+	for (i = 0; i < ino->nzblocks; i++)
+		blocks[n++] = ino->zblocks[i];
+	for (i = 0; i < ino->nzfreed; i++)
+		blocks[n++] = ino->zfreed[i];
+	if (0 != ino->xblock)
+		blocks[n++] = ino->xblock;
+
+	if (FS_DIR == ino->mode) {
+		for (i = 0; i < ino->data.dir.nfiles; i++)
+			_reclaim_queue(fs, ino->data.dir.files[i]);
+		for (i = 0; i < ino->data.dir.nlinks; i++)
+			_reclaim_queue(fs, ino->data.dir.links[i]);
+
+		for (i = 0; i < ino->data.dir.ndirs; i++)
+			_reclaim_queue(fs, ino->data.dir.dirs[i]);
+	}
+	return n;
 }
 
-/* Traverse a directory up to the root, append dir ames while recursing back down*/
-static char* _getAbsolutePathDV(filesystem* shfs, dentv* dv, fs_path *p) {
-	int didAttach = 0;
-	if (NULL == dv || NULL == dv->parent) return NULL;
-
-	if (!strcmp(dv->name, "/"))	/* Stop at root or we will loop forever */
-		return "/";
+/* Free the space of the removed inodes _rm queued, up to about
+ * @param nblocks blocks of it and at least one inode. The blocks are
+ * sorted and freed together, the inode table slots cleared, and it all
+ * goes to disk with one _sync. Returns how many inodes are left. */
+static size_t _reclaim_step(filesystem* fs, size_t nblocks) {
+	uint8_t tables[MAXINODES/FS_INODES_PER_BLOCK];	/* Inode table blocks to write */
+	block_t* blocks = NULL;
+	block_t* grown;
+	size_t i, n = 0, max = 0, done = 0, need;
+	inode_t num;
+	inode* ino;
+	inode* dest;
+	block_t tblock;
+
+	if (NULL == fs || NULL == fs->reclaim.queue) return 0;
+
+	memset(tables, 0, sizeof(tables));
+
+	while (0 < fs->reclaim.nqueued && done < nblocks) {
+		num = fs->reclaim.queue[fs->reclaim.first];
+		fs->reclaim.first = (fs->reclaim.first + 1) % MAXINODES;
+		fs->reclaim.nqueued--;
+
+		ino = _inode_load(fs, num);
+		if (NULL == ino) continue;	/* Gone already */
+
+		need = n + ino->ndatablocks + ino->nzblocks + ino->nzfreed + 1;
+		if (need > max) {
+			max = 2*max > need ? 2*max : need;
+			grown = (block_t*)realloc(blocks, max*sizeof(block_t));
+			if (NULL == grown) {
+				/* Put it back for next time */
+				fs->reclaim.first = (fs->reclaim.first + MAXINODES - 1) % MAXINODES;
+				fs->reclaim.queue[fs->reclaim.first] = num;
+				fs->reclaim.nqueued++;
+				break;
+			}
+			blocks = grown;
+		}
 
-	if (!dv->parent->v_attached) {
-//		return NULL;
-		_v_attach(shfs, dv->parent);
-		didAttach = 1;
-	}
+		i = n;
+		n = _reclaim_inode(fs, ino, blocks, n);
+		done += 1 + n - i;
 
-	_getAbsolutePathDV(shfs, dv->parent->datav.dir, p);
-	_pathAppend(p, dv->name);
+		/* A link no longer counts towards its destination */
+		if (FS_LINK == ino->mode) {
+			dest = _inode_load(fs, ino->data.link.dest);
+			if (NULL != dest && 0 < dest->nlinks) {
+				dest->nlinks--;
+				_inode_store(fs, dest);
+			}
+		}
 
-	if (didAttach)
-		_v_detach(shfs, dv->parent);
-	
-	return _stringFromPath(p);
-}
+		/* rm refuses anything with links to it, and trees holding any,
+		 * so only pointers in memory are left to clear */
+		_inode_drop_refs(fs, ino);
 
-/* A special version of mkdir that makes the root dir
- * @param newfs if true, load a preexisting root dir
- * Else make a new root dir */
-static dentv* _mkroot(filesystem *fs, int newfs) {
-	dentv* dv = NULL;
-	
-	if (newfs) {
-		dv = _new_dir(fs, NULL, "/");
-		if (NULL == dv) return NULL;
+		__ifree(fs, num);
+		tables[num / FS_INODES_PER_BLOCK] = true;
+		_inode_evict(fs, ino);
+	}
 
-		dv->parent	= dv->ino;
-		dv->next	= dv->ino;
-		dv->prev	= dv->ino;
+	if (0 < n) {
+		qsort(blocks, n, sizeof(block_t), _cmp_block_t);
+		_fs._mbfree(fs, n, blocks);
+	}
+	free(blocks);
 
-		dv->ino->data.dir.parent = dv->ino->num;
-		dv->ino->data.dir.next = dv->ino->num;
-		dv->ino->data.dir.prev = dv->ino->num;
+	if (0 == fs->reclaim.nqueued)
+		fs->sb_i.flags &= ~FS_RECLAIMING;	/* Goes to disk with the last of it */
 
-		fs->sb.root = dv->ino->num;
-	}
-	else {
-		dv = _load_dir(fs, fs->sb.root);
-		if (NULL == dv) return NULL;
+	for (i = 0; i < MAXINODES/FS_INODES_PER_BLOCK; i++) {
+		tblock = fs->sb.inode_table[i];
+		if (tables[i] && 0 != tblock)
+			_fs.writeblock(fs, tblock, BLKSIZE, &fs->block_cache[tblock]);
 	}
+	_sync(fs);
 
-	return dv;
-}
-
-/* malloc memory for a block, zero-out its fields
- * Returns the allocated block */
-static block* _newBlock() {
-	block* b = (block*)malloc(sizeof(block));
-	memset(b->data, 0, sizeof(b->data));	// Zero-out
-	b->next = 0;
-	b->num = 0;
+	if (0 < fs->reclaim.nqueued)
+		return fs->reclaim.nqueued;
 
-	return b;
+	free(fs->reclaim.queue);
+	fs->reclaim.queue = NULL;
+	return 0;
 }
 
-/* Preallocate a contiguous file. Differs across platforms 
- * Note: this does NOT set the file to the given size. The OS
- * attempts to "preallocate" the contiguousspace in its filesystem blocks,
- * but the file will not appear to be of that size. 
- * Therefore, this offers merely a performance benefit.
- * Returns FS_OK on success, FS_ERR on failure. */
-static int _prealloc() {
-	int status;
-#if defined(_WIN64) || defined(_WIN32)	// Have to put declaration here.
-	LARGE_INTEGER offset;		// because Visual C compiler is OLD school
-#endif
+/* Queue again the removals a crash left undone. The filesystem was left
+ * with FS_RECLAIMING set, so inodes may be in use that no directory under
+ * the root lists. Those that no such directory lists either are queued;
+ * _reclaim_step finds the rest through them. */
+static int _reclaim_replay(filesystem* fs) {
+	uint8_t* seen = NULL;		/* 1 under the root, 2 listed by a removed directory */
+	inode_t* stack = NULL;
+	size_t i, j, n = 0;
+	inode_t num;
+	inode* ino;
+	dent* d;
+	int was_loaded;
+	int retv = FS_OK;
 
-	_safeopen(fname, "wb");
-	if (NULL == fp) return FS_ERR;		
+	seen = (uint8_t*)calloc(MAXINODES, 1);
+	stack = (inode_t*)malloc(MAXINODES*sizeof(inode_t));
+	if (NULL == seen || NULL == stack) {
+		free(seen);
+		free(stack);
+		return FS_ERR;
+	}
 
-#if defined(_WIN64) || defined(_WIN32)
-	offset.QuadPart = BLKSIZE*MAXBLOCKS;
-	status = SetFilePointerEx(fp, offset, NULL, FILE_BEGIN);
-	SetEndOfFile(fp);
-#elif __APPLE__	/* __MACH__ also works */
-	fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, BLKSIZE*MAXBLOCKS, 0};
-	status = fcntl(fileno(fp), F_PREALLOCATE, &store);
-#elif __unix__
-	status = posix_fallocate(fp, 0, BLKSIZE*MAXBLOCKS);
-#endif
+	/* Everything under the root. Each directory is stacked once. */
+	seen[fs->sb.root] = 1;
+	stack[n++] = fs->sb.root;
+	while (0 < n) {
+		num = stack[--n];
+		was_loaded = NULL != fs->attached_inodes[num];
+		ino = _inode_load(fs, num);
+		if (NULL == ino || FS_DIR != ino->mode) continue;
+
+		d = &ino->data.dir;
+		for (i = 0; i < d->nfiles; i++)
+			if (MAXINODES > d->files[i]) seen[d->files[i]] = 1;
+		for (i = 0; i < d->nlinks; i++)
+			if (MAXINODES > d->links[i]) seen[d->links[i]] = 1;
+		for (i = 0; i < d->ndirs; i++)
+			if (MAXINODES > d->dirs[i] && !seen[d->dirs[i]]) {
+				seen[d->dirs[i]] = 1;
+				stack[n++] = d->dirs[i];
+			}
+		if (!was_loaded && !ino->dirty) _inode_evict(fs, ino);
+	}
+
+	/* What the removed directories list goes with them */
+	for (i = 2; i < MAXINODES; i++) {
+		if (seen[i] || !_map_test(&fs->ino_map, i)) continue;
+		was_loaded = NULL != fs->attached_inodes[i];
+		ino = _inode_load(fs, (inode_t)i);
+		if (NULL == ino || FS_DIR != ino->mode) continue;
+
+		d = &ino->data.dir;
+		for (j = 0; j < d->nfiles; j++)
+			if (MAXINODES > d->files[j]) seen[d->files[j]] = 2;
+		for (j = 0; j < d->nlinks; j++)
+			if (MAXINODES > d->links[j]) seen[d->links[j]] = 2;
+		for (j = 0; j < d->ndirs; j++)
+			if (MAXINODES > d->dirs[j]) seen[d->dirs[j]] = 2;
+		if (!was_loaded && !ino->dirty) _inode_evict(fs, ino);
+	}
 
-	_safeclose();
+	for (i = 2; i < MAXINODES && FS_OK == retv; i++)
+		if (!seen[i] && _map_test(&fs->ino_map, i))
+			retv = _reclaim_queue(fs, (inode_t)i);
 
-	if (status < 0) { 
-		perror("allocation error");
-		return status;
+	/* Nothing was left to do */
+	if (FS_OK == retv && 0 == fs->reclaim.nqueued) {
+		fs->sb_i.flags &= ~FS_RECLAIMING;
+		retv = _sync(fs);
 	}
 
-	return FS_OK;
+	free(seen);
+	free(stack);
+	return retv;
 }
 
-/* Zero-out the on-disk file 
- * Returns FS_OK on success, FS_ERR on failure */
-static int _zero() {
-	int i;
-	_safeopen(fname, "rb+");
-	if (NULL == fp) return FS_ERR;
+/* The directory at the absolute @param path, made along with any missing
+ * above it. Fails if something other than a directory is in the way. */
+static dentv* _import_dir(filesystem* fs, const char* path, import_report* report) {
+	inode* ino;
+	dentv* dv;
+	const char* field;
+	char name[FS_NAMEMAXLEN];
+	size_t len;
 
-	for (i = 0; i < MAXBLOCKS; i++) {
-		block* newBlock = _newBlock();
-		char temp[128];
-		sprintf(temp, "%d", i);
-		memcpy(newBlock->data, temp, strlen(temp));
-		
-		if (0 != fseek(fp, BLKSIZE*i, SEEK_SET)) {
-			free(newBlock);
-			return FS_ERR;
+	ino = _lookup(fs, path);
+	if (NULL != ino)
+		return FS_DIR == ino->mode ? ino->datav.dir : NULL;
+
+	dv = fs->root;
+	for (field = path; ; field += len) {
+		field += strspn(field, "/");
+		len = strcspn(field, "/");
+		if (0 == len) break;
+		if (FS_NAMEMAXLEN <= len) return NULL;
+
+		memcpy(name, field, len);
+		name[len] = '\0';
+
+		ino = _dirs_iterate(fs, dv, name);
+		if (NULL != ino) {
+			dv = ino->datav.dir;
+			if (NULL == dv || !ino->v_attached) dv = _load_dir(fs, ino->num);
+			if (NULL == dv) return NULL;
+			continue;
 		}
-		fputs(newBlock->data, fp);
-		free(newBlock);
+
+		if (!strcmp(name, ".") || !strcmp(name, "..") ||
+			NULL != _files_iterate(fs, dv, name) || NULL != _links_iterate(fs, dv, name))
+			return NULL;
+
+		dv = _new_dir(fs, dv, name);
+		if (NULL == dv) return NULL;
+		report->ndirs++;
 	}
-	_safeclose();
-	return FS_OK;
+	return dv;
 }
 
-/* Create a new filesystem. @param newfs specifies if we 
- * open a file on disk or create a new one (overwriting
- * the previous)
- * Returns a pointer to the allocated filesystem */
-static filesystem* _init(int newfs) {
-	filesystem *fs = NULL;
-
-	stride = sizeof(((struct block*)0)->data);
-	if (0 == stride) return NULL;
+/* Create the file @param f, its directory first if it is missing. Returns
+ * the new file's inode, or NULL after saying why it was not created. */
+static inode* _import_file(filesystem* fs, fs_import_file* f, import_report* report) {
+	char* slash;
+	char* name;
+	dentv* dv;
+	filev* fv;
+	size_t len;
 
-	if (newfs) {
-		int err1, err2;
+	slash = strrchr(f->path, '/');
+	if (NULL == slash) {
+		printf("import: \"%s\" is not an absolute path.\n", f->path);
+		return NULL;
+	}
+	name = slash + 1;
+	len = strlen(name);
+	if (0 == len || FS_NAMEMAXLEN <= len || !strcmp(name, ".") || !strcmp(name, "..")) {
+		printf("import: \"%s\" is not a name a file can have.\n", f->path);
+		return NULL;
+	}
 
-		_safeclose();
-		err1 = _prealloc();		/* Make a contiguous file on disk (performance enhancement) */
-		err2 = _zero();		/* Zero-out all filesystem blocks */
+	/* Files mostly come a directory at a time, so the lookup is cached */
+	*slash = '\0';
+	dv = _import_dir(fs, slash == f->path ? "/" : f->path, report);
+	*slash = '/';
+	if (NULL == dv) {
+		printf("import: no directory for \"%s\".\n", f->path);
+		return NULL;
+	}
 
-		if (FS_ERR == err1 || FS_ERR == err2) return NULL;
+	if (NULL != _dirs_iterate(fs, dv, name) || NULL != _files_iterate(fs, dv, name) ||
+		NULL != _links_iterate(fs, dv, name)) {
+		printf("import: \"%s\" exists.\n", f->path);
+		return NULL;
 	}
 
-	_safeopen(fname, "rb+");	/* Test if file exists */
-	if (NULL == fp) return NULL;
+	len = strlen(f->data);
+	if ((len + stride - 1) / stride > MAXFILEBLOCKS) {
+		printf("import: \"%s\" is too big, %lu bytes.\n", f->path, (unsigned long)len);
+		return NULL;
+	}
 
-	fs = (filesystem*)malloc(sizeof(filesystem));
+	fv = _new_file(fs, dv, name);
+	if (NULL == fv) {
+		printf("import: could not create \"%s\".\n", f->path);
+		return NULL;
+	}
 
-	/* Zero-out fields */
-	memset( &fs->fb_map, 0,			sizeof(map));
-	memset( &fs->ino_map, 0,		sizeof(map));
-	memset( &fs->sb_i.blocks, 0,		SUPERBLOCK_MAXBLOCKS*sizeof(block_t));
-	memset( &fs->sb.inode_first_blocks, 0,	MAXBLOCKS*sizeof(block_t));
-	memset( &fs->sb.inode_block_counts, 0,	MAXBLOCKS*sizeof(uint));
-	memset( &fs->allocated_fds, 0,		FS_MAXOPENFILES*sizeof(fd_t));
-	memset( &fs->fds, 0,			FS_MAXOPENFILES*sizeof(filev*));
+	/* Buffered in memory until the commit, like a write */
+	if (0 < len && FS_ERR == _inode_fill_blocks_from_data(fs, fv->ino, 0, f->data)) {
+		printf("import: not enough space for \"%s\", %lu bytes. It is left empty.\n", f->path, (unsigned long)len);
+		return fv->ino;
+	}
 
-	memset(attached_inodes, 0, MAXBLOCKS*sizeof(inode*));
-	
-	fs->fb_map.data[0]	= 0x04;					/* First four blocks reserved */
-	fs->sb.free_blocks_base	= 4;					/* Start allocating from 5th block */
-	fs->sb.free_inodes_base	= 1;					/* Start allocating from 2nd inode */
-	fs->sb.root		= 0;
-	fs->sb_i.nblocks	= sizeof(superblock)/stride + 1; 	/* How many free blocks needed for superblock */
-	fs->first_free_fd = 0;
+	report->nfiles++;
+	report->nbytes += len;
+	return fv->ino;
+}
 
-	if (newfs) {
-		_mballoc(fs, fs->sb_i.nblocks, fs->sb_i.blocks);		/* Allocate n blocks, tell us which we got */
-		fs->root = _mkroot(fs, newfs);				/* Setup root dir */
+/* Create the @param n files and directories @param files, and the
+ * directories above them that are missing, and write them in one commit.
+ * Until the commit nothing is written: inodes are only marked, and file
+ * data is buffered. Then the data of all the files is allocated together,
+ * in the order the files came, so it lies in one run where there is room,
+ * and written; each inode, directory and inode table block is written
+ * once; and one _sync ends the commit. The new files are closed after.
+ * What was done is added to @param report. Returns FS_ERR if the commit
+ * could not be written, else FS_OK, even if some entries failed. */
+static int _import(filesystem* fs, fs_import_file* files, size_t n, import_report* report) {
+	inode_t* created = NULL;
+	size_t ncreated = 0;
+	size_t i, j, k, nbuffered;
+	inode* ino;
+	inode* parent;
+	dentv* pv;
+	block_t tblock;
+	int status = FS_OK;
+
+	if (NULL == fs || NULL == fs->root || NULL == files || NULL == report) return FS_ERR;
+	if (FS_BATCH_OFF != fs->batch.state) return FS_ERR;
+
+	created = (inode_t*)malloc((n + 1)*sizeof(inode_t));
+	fs->batch.inodes = (inode_t*)malloc(MAXINODES*sizeof(inode_t));
+	fs->batch.held = (uint8_t*)calloc(MAXINODES, sizeof(uint8_t));
+	if (NULL == created || NULL == fs->batch.inodes || NULL == fs->batch.held) {
+		free(created);
+		free(fs->batch.inodes);
+		free(fs->batch.held);
+		fs->batch.inodes = NULL;
+		fs->batch.held = NULL;
+		return FS_ERR;
+	}
+	fs->batch.n = 0;
+	memset(fs->batch.tables, 0, sizeof(fs->batch.tables));
+	fs->batch.state = FS_BATCH_OPEN;
 
-		if (NULL == fs->root) {
-			free(fs);
-			return NULL;
+	for (i = 0; i < n; i++) {
+		if (NULL == files[i].path) {
+			report->nfailed++;
+			continue;
 		}
-	}
-	return fs;
-}
 
-/* Fill the input @param data into the blocks pointed to by
- * @param ino. Start at @param seek_pos. Spill into Indirect block pointers, 
- * doubly-indirected block pointers, and triply-indirected block 
- * pointers as needed.
- */
-static int _inode_fill_blocks_from_data(filesystem* fs, inode* ino, size_t seek_pos, char* data) {
-	size_t write_cnt = 0;		/* Number of bytes written */
-	size_t blocks_written = 0;	/* Number of blocks filled */
-	uint indirection = DIRECT;	/* Which kind of blocks we are writing to (direct, indirect)*/
-	size_t slen;			/* Size in bytes of the input data */
-	
-	block_t blk;			/* First block to begin writing at */
-	size_t offset;			/* Byte offset in first block to begin writing at */
+		if (NULL == files[i].data) {
+			if (NULL == _import_dir(fs, files[i].path, report)) {
+				printf("import: could not make the directory \"%s\".\n", files[i].path);
+				report->nfailed++;
+			}
+			continue;
+		}
 
-	size_t ib1 = 0;
-	size_t ib2 = 0;
-	size_t db = 0;
-	size_t i = 0;
+		k = report->nfiles;
+		ino = _import_file(fs, &files[i], report);
+		if (NULL != ino) created[ncreated++] = ino->num;
+		if (k == report->nfiles) report->nfailed++;
+	}
 
-	if (NULL == data) return FS_ERR;
+	fs->batch.state = FS_BATCH_COMMIT;
 
-	slen = strlen(data);
-	offset = seek_pos % stride;
-	blk = (block_t) (seek_pos / stride);
+	/* One allocation for the buffered data of the files. Those to be
+	 * compressed are packed into frames of their own instead. */
+	for (i = 0, nbuffered = 0; i < fs->batch.n; i++) {
+		ino = fs->attached_inodes[fs->batch.inodes[i]];
+		if (NULL == ino || FS_FILE != ino->mode || (ino->flags & FS_ZSTORED) ||
+			((ino->flags & FS_ZFILE) && ino->ndatablocks >= FS_ZMINBLOCKS))
+			continue;
 
-	while (write_cnt < slen) {
+		for (j = 0; j < ino->ndatablocks; j++)
+			nbuffered += 0 == ino->blocks[j] && !_inode_hole(ino, j);
+	}
 
-		size_t write_increment = min(stride - offset, slen - write_cnt);
+	fs->batch.pool = 0 < nbuffered ? (block_t*)malloc(nbuffered*sizeof(block_t)) : NULL;
+	fs->batch.npool = 0;
+	fs->batch.next = 0;
+	if (NULL != fs->batch.pool && FS_OK == _mballoc(fs, nbuffered, fs->batch.pool))
+		fs->batch.npool = nbuffered;
 
-		if	(blk < MAXBLOCKS_DIRECT)					indirection = DIRECT;
-		else if (blk < MAXBLOCKS_DIRECT + MAXBLOCKS_IB1)			indirection = INDIRECT1;
-		else if (blk < MAXBLOCKS_DIRECT + MAXBLOCKS_IB1 + MAXBLOCKS_IB2)	indirection = INDIRECT2;
-		else if (blk < MAXFILEBLOCKS)						indirection = INDIRECT3;
-		else									return FS_ERR;
+	/* The data, before the inodes that point at it */
+	for (i = 0; i < fs->batch.n; i++) {
+		ino = fs->attached_inodes[fs->batch.inodes[i]];
+		if (NULL == ino || FS_FILE != ino->mode) continue;
 
-		switch (indirection)
-		{
-			case DIRECT:		// Start filling in direct blocks
-			{
-				db = blk;
-				if (blocks_written >= ino->ndatablocks) {
-					_fs._inode_extend_datablocks(fs, ino, ino->directblocks);
-				}
-				memcpy(&ino->directblocks[db]->data[offset], &data[write_cnt], write_increment);
-				break;
-			}
-			case INDIRECT1:		// If we used up all the direct blocks, start using singly indirected blocks
-			{
-				db = blk - MAXBLOCKS_DIRECT;
-				if (blocks_written >= ino->ndatablocks) {
-					_fs._inode_extend_datablocks(fs, ino, ino->ib1->blocks);
-					ino->directblocks[MAXBLOCKS_DIRECT-1]->next = ino->ib1->blocks[0]->num;
-				}
-				memcpy(&ino->ib1->blocks[db]->data[offset], &data[write_cnt], write_increment);
-				break;
-			}
-			case INDIRECT2:		// If we used up all the singly indirected blocks, start using doubly indirected blocks
-			{
-				i = blk - MAXBLOCKS_DIRECT - MAXBLOCKS_IB1;
-				ib1 = i / MAXBLOCKS_IB1;
-				db = i - MAXBLOCKS_IB1*ib1;
+		if (FS_ERR == _inode_alloc_delayed(fs, ino) || FS_ERR == _inode_commit_data(fs, ino))
+			status = FS_ERR;
+	}
 
-				if (blocks_written >= ino->ndatablocks){
-					_fs._inode_extend_datablocks(fs, ino, ino->ib2->iblocks[ib1]->blocks);
-					ino->ib1->blocks[MAXBLOCKS_DIRECT-1]->next = ino->ib2->iblocks[ib1]->blocks[0]->num;
-				}
-				memcpy(&ino->ib2->iblocks[ib1]->blocks[db]->data[offset], &data[write_cnt], write_increment);
-				break;
-			}
-			case INDIRECT3: // If we used up all the doubly indirected blocks, start using triply indirected blocks
-			{
-				i = blk - MAXBLOCKS_DIRECT - MAXBLOCKS_IB1 - MAXBLOCKS_IB2;
-				ib2 = i / MAXBLOCKS_IB2;
-				ib1 = ib2 / MAXBLOCKS_IB1;
-				db = i - MAXBLOCKS_IB1*ib1 - MAXBLOCKS_IB2*ib2;
-
-				if (blocks_written >= ino->ndatablocks) {
-					_fs._inode_extend_datablocks(fs, ino, ino->ib3->iblocks[ib2]->iblocks[ib1]->blocks);
-					ino->ib2->iblocks[ib1]->blocks[MAXBLOCKS_DIRECT-1]->next = ino->ib3->iblocks[ib2]->iblocks[ib1]->blocks[0]->num;
-				}
-				memcpy(&ino->ib3->iblocks[ib2]->iblocks[ib1]->blocks[db]->data[offset], &data[write_cnt], write_increment);
+	/* Blocks that turned out to be shared with others already on disk */
+	if (fs->batch.next < fs->batch.npool)
+		_mbfree(fs, fs->batch.npool - fs->batch.next, &fs->batch.pool[fs->batch.next]);
+	free(fs->batch.pool);
+	fs->batch.pool = NULL;
+	fs->batch.npool = 0;
+	fs->batch.next = 0;
+
+	for (i = 0; i < fs->batch.n; i++) {
+		ino = fs->attached_inodes[fs->batch.inodes[i]];
+		if (NULL != ino && ino->dirty && FS_ERR == _inode_store(fs, ino))
+			status = FS_ERR;
+	}
+
+	/* The inode table blocks, a run of neighbours at a time */
+	for (i = 0; i < MAXINODES/FS_INODES_PER_BLOCK; i += k) {
+		tblock = fs->sb.inode_table[i];
+		k = 1;
+		if (!fs->batch.tables[i] || 0 == tblock) continue;
+
+		while (i + k < MAXINODES/FS_INODES_PER_BLOCK && fs->batch.tables[i + k] &&
+			fs->sb.inode_table[i + k] == tblock + k)
+			k++;
+		if (FS_ERR == _fs.writeblock(fs, tblock, k*BLKSIZE, &fs->block_cache[tblock]))
+			status = FS_ERR;
+	}
+
+	/* Close the new files. Their directories stay loaded. */
+	for (i = 0; i < ncreated; i++) {
+		ino = fs->attached_inodes[created[i]];
+		if (NULL == ino) continue;
+
+		parent = fs->attached_inodes[ino->data.file.parent];
+		pv = NULL == parent ? NULL : parent->datav.dir;
+		for (j = NULL == pv ? 0 : pv->nfiles; j > 0; j--)
+			if (ino == pv->files[j-1]) {
+				pv->files[j-1] = NULL;
 				break;
 			}
-			default: return FS_ERR;	/* Out of blocks */
-		}
-
-		/* Going to the next block. Reset byte offset to 0. */
-		offset++;
-		write_cnt++;
-		if (blk < (seek_pos + write_cnt) / stride) {
-			offset = 0;
-			blocks_written++;
-			blk++;
-		}
+		_inode_unload(fs, ino);
 	}
 
-	ino->size = write_cnt + seek_pos;
+	fs->batch.state = FS_BATCH_OFF;
+	free(fs->batch.inodes);
+	free(fs->batch.held);
+	fs->batch.inodes = NULL;
+	fs->batch.held = NULL;
+	fs->batch.n = 0;
+	free(created);
+
+	if (FS_ERR == _sync(fs))
+		status = FS_ERR;
+	report->ncommits++;
+
+	return status;
+}
+
+/* What fsck makes of an inode number */
+enum { FSCK_FREE, FSCK_GOOD, FSCK_BAD };
+
+/* Problems with one inode, found by the worker that checked it */
+#define FSCK_NOTINMAP	0x1			/* Has an inode, but is free in the inode map */
+#define FSCK_NOSLOT	0x2			/* Used in the inode map, but its table slot holds no inode */
+#define FSCK_TABLE	0x4			/* inode_first_blocks does not name its inode table block */
+#define FSCK_EXTENTS	0x8			/* Its extents are not a list of blocks it could have */
+#define FSCK_COUNT	0x10			/* inode_block_counts is wrong */
+#define FSCK_DENT	0x20			/* A directory whose dent cannot be read */
+
+/* Count a problem and describe it on the report's log */
+#define FSCK_PROBLEM(ck, fixed, ...) do { \
+		(ck)->report->nproblems++; \
+		if (fixed) (ck)->report->nrepaired++; \
+		if (fixed) (ck)->nfixed++; \
+		if (NULL != (ck)->report->log) { \
+			fprintf((ck)->report->log, __VA_ARGS__); \
+			fputs((fixed) ? ": repaired\n" : "\n", (ck)->report->log); \
+		} \
+	} while (0)
+
+typedef struct fsck_entry {			/* A directory entry, as fsck found it */
+	inode_t dir;
+	inode_t num;
+	uint16_t mode;				/* FS_DIR, FS_FILE or FS_LINK, by the run of the dent it is in */
+	uint16_t drop;				/* Is it to be taken out of the directory ? true : false */
+} fsck_entry;
+
+typedef struct fsck_worker {
+	struct fsck_state* ck;
+	uint id;
+	uint8_t* claims;			/* MAXBLOCKS. Times the inodes this worker checked use each block, at most 255 */
+	fsck_entry* ents;			/* Entries of the directories this worker checked, by directory */
+	size_t nents, maxents;
+	int status;				/* FS_ERR once a read failed or memory ran out */
+	io_counts io;				/* Disk reads, added to fs_io when done */
+} fsck_worker;
+
+typedef struct fsck_state {
+	filesystem* fs;				/* The image, read into fs->block_cache */
+	fsck_report* report;
+	int repair;
+	size_t nfixed;				/* Repairs made by this pass */
+	uint nworkers;
+	fsck_worker workers[FS_FSCK_MAXTHREADS];
+	size_t* batches;			/* First block and length of each read, in pairs */
+	size_t nbatches;
+	uint8_t* have;				/* MAXBLOCKS. Is the block in block_cache ? true : false */
+	uint8_t* dirty;				/* MAXBLOCKS. Was the block changed by a repair ? true : false */
+	uint8_t* meta;				/* MAXBLOCKS. Times the maps, superblock, dedup table and inode table use each block */
+	uint8_t* state;				/* MAXINODES. FSCK_FREE, FSCK_GOOD or FSCK_BAD */
+	uint16_t* problems;			/* MAXINODES. FSCK_ problems of each inode */
+	inode_t* dparent;			/* MAXINODES. The parent the dent of each directory names */
+} fsck_state;
+
+/* Read @param count blocks from @param b into block_cache. Reads of
+ * different workers do not share a file position, so they can be in
+ * flight at the same time. */
+static int _fsck_pread(fsck_worker* w, block_t b, size_t count) {
+	filesystem* fs = w->ck->fs;
+	uint64_t t = stats_now();
+
+#if defined(_WIN64) || defined(_WIN32)
+	if (FS_ERR == _fs.readrun(fs, &fs->block_cache[b], b, count)) return FS_ERR;
+#else
+	if ((ssize_t)(count*BLKSIZE) != pread(fileno(fs->fp), &fs->block_cache[b], count*BLKSIZE, (off_t)b*BLKSIZE))
+		return FS_ERR;
+#endif
+	w->io.nreads++;
+	w->io.blocks_read += count;
+	stats_count(SC_BYTES_READ, count*BLKSIZE);
+	stats_record_args(ST_READBLOCK, t, (long)b, -1);
 	return FS_OK;
 }
 
-/* Read data from blocks on disk into the blocks and iblocks of an inode */
-static int _inode_fill_blocks_from_disk(inode* ino) {
-	block_t blk = 0;
-	size_t ib1 = 0;
-	size_t ib2 = 0;
-	size_t db = 0;
-	size_t i = 0;
-	uint indirection = DIRECT;
+/* Run @param fn on every worker, each on a thread of its own but the first */
+static void _fsck_run(fsck_state* ck, void* (* fn)(void*)) {
+	uint k;
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_t threads[FS_FSCK_MAXTHREADS];
+	uint nstarted;
 
-	size_t nblocks_read = 0;
-	
-	if (NULL == ino) return FS_ERR;
+	/* A worker that would not start has its share done by the first */
+	for (nstarted = 1; nstarted < ck->nworkers; nstarted++)
+		if (0 != pthread_create(&threads[nstarted], NULL, fn, &ck->workers[nstarted]))
+			break;
+	fn(&ck->workers[0]);
+	for (k = 1; k < nstarted; k++)
+		pthread_join(threads[k], NULL);
+	for (k = nstarted; k < ck->nworkers; k++)
+		fn(&ck->workers[k]);
+#else
+	for (k = 0; k < ck->nworkers; k++)
+		fn(&ck->workers[k]);
+#endif
+}
 
-	while (nblocks_read < ino->ndatablocks) {
-		blk = (block_t)(ino->ninoblocks + nblocks_read);
+/* Read the batches of _fsck_read whose index is this worker's id, modulo the number of workers */
+static void* _fsck_reader(void* arg) {
+	fsck_worker* w = (fsck_worker*)arg;
+	fsck_state* ck = w->ck;
+	size_t i, k;
 
-		if	(blk < ino->ninoblocks + MAXBLOCKS_DIRECT)			indirection = DIRECT;
-		else if (blk < ino->ninoblocks + MAXBLOCKS_DIRECT + MAXBLOCKS_IB1)	indirection = INDIRECT1;
-		else if (blk < ino->ninoblocks + MAXBLOCKS_DIRECT + MAXBLOCKS_IB1 + MAXBLOCKS_IB2) indirection = INDIRECT2;
-		else if (blk < ino->ninoblocks + MAXFILEBLOCKS)				indirection = INDIRECT3;
-		else return FS_ERR;
+	for (i = w->id; i < ck->nbatches && FS_OK == w->status; i += ck->nworkers) {
+		if (FS_ERR == _fsck_pread(w, (block_t)ck->batches[2*i], ck->batches[2*i+1])) {
+			w->status = FS_ERR;
+			break;
+		}
+		for (k = 0; k < ck->batches[2*i+1]; k++)
+			ck->have[ck->batches[2*i] + k] = true;
+	}
+	return NULL;
+}
 
-		switch (indirection) {
+/* Read the @param n blocks @param want that are not in block_cache yet.
+ * They are sorted, and those at most FS_FSCK_GAP blocks apart read in one
+ * batch of up to FS_FSCK_BATCH blocks, with the blocks between them. The
+ * batches are shared out among the workers. */
+static int _fsck_read(fsck_state* ck, block_t* want, size_t n) {
+	size_t i, end, nb = 0;
+	uint k;
 
-			case DIRECT:
-			{
-				db = blk - ino->ninoblocks;
-				if (NULL == ino->directblocks[db]) {
-					ino->directblocks[db] = _newBlock();
-					ino->directblocks[db]->num = ino->blocks[blk];
-					
-					if (blk+1 < (block_t)ino->nblocks)
-						ino->directblocks[db]->next = ino->blocks[blk+1];
-				}
-				_fs.readblock(ino->directblocks[db], ino->blocks[blk]);
-				break;
-			}
-			case INDIRECT1:
-			{
-				db = blk - ino->ninoblocks - MAXBLOCKS_DIRECT;
-				if (NULL == ino->ib1->blocks[db]) {
-					ino->ib1->blocks[db] = _newBlock();
-					ino->ib1->blocks[db]->num = ino->blocks[blk];
-					
-					if (blk+1 < (block_t)ino->nblocks)
-						ino->ib1->blocks[db]->next = ino->blocks[blk+1];
-					
-					ino->directblocks[MAXBLOCKS_DIRECT-1]->next = ino->ib1->blocks[0]->num;
-				}
-				_fs.readblock(ino->ib1->blocks[db], ino->blocks[blk]);
-				break;
-			}
-			case INDIRECT2:
-			{
-				i = blk - ino->ninoblocks  - MAXBLOCKS_DIRECT - MAXBLOCKS_IB1;
-				ib1 = i / MAXBLOCKS_IB1;
-				db = i - MAXBLOCKS_IB1*ib1;
-				if (NULL == ino->ib2->iblocks[ib1]->blocks[db]) {
-					ino->ib2->iblocks[ib1]->blocks[db] = _newBlock();
-					ino->ib2->iblocks[ib1]->blocks[db]->num = ino->blocks[blk];
-					
-					if (blk+1 < (block_t)ino->nblocks)
-						ino->ib2->iblocks[ib1]->blocks[db]->next = ino->blocks[blk+1];
-					
-					ino->ib1->blocks[MAXBLOCKS_DIRECT-1]->next = ino->ib2->iblocks[ib1]->blocks[0]->num;
-				}
-				_fs.readblock(ino->ib2->iblocks[ib1]->blocks[db], ino->blocks[blk]);
-				break;
-			}
-			case INDIRECT3:
-			{
-				i = blk - ino->ninoblocks  - MAXBLOCKS_DIRECT - MAXBLOCKS_IB1 - MAXBLOCKS_IB2;
-				ib2 = i / MAXBLOCKS_IB2;
-				ib1 = ib2 / MAXBLOCKS_IB1;
-				db = i - MAXBLOCKS_IB1*ib1 - MAXBLOCKS_IB2*ib2;
-				if (NULL == ino->ib3->iblocks[ib2]->iblocks[ib1]->blocks[db])  {
-					ino->ib3->iblocks[ib2]->iblocks[ib1]->blocks[db] = _newBlock();
-					ino->ib3->iblocks[ib2]->iblocks[ib1]->blocks[db]->num = ino->blocks[blk];
-					
-					if (blk+1 < (block_t)ino->nblocks)
-						ino->ib3->iblocks[ib2]->iblocks[ib1]->blocks[db]->next = ino->blocks[blk+1];
-					
-					ino->ib2->iblocks[ib1]->blocks[MAXBLOCKS_DIRECT-1]->next = ino->ib3->iblocks[ib2]->iblocks[ib1]->blocks[0]->num;
-				}
-				_fs.readblock(ino->ib3->iblocks[ib2]->iblocks[ib1]->blocks[db], ino->blocks[blk]);
-				break;
+	if (0 == n) return FS_OK;
+	ck->batches = (size_t*)malloc(2*n*sizeof(size_t));
+	if (NULL == ck->batches) return FS_ERR;
+
+	qsort(want, n, sizeof(block_t), _cmp_block_t);
+	for (i = 0; i < n; i++) {
+		if (MAXBLOCKS <= want[i] || ck->have[want[i]]) continue;
+		if (nb > 0) {
+			end = ck->batches[2*nb-2] + ck->batches[2*nb-1];
+			if (want[i] < end) continue;
+			if (want[i] - end <= FS_FSCK_GAP && want[i] + 1 - ck->batches[2*nb-2] <= FS_FSCK_BATCH) {
+				ck->batches[2*nb-1] = want[i] + 1 - ck->batches[2*nb-2];
+				continue;
 			}
-			default: return FS_ERR;
 		}
-		nblocks_read += 1;
+		ck->batches[2*nb] = want[i];
+		ck->batches[2*nb+1] = 1;
+		nb++;
 	}
+	ck->nbatches = nb;
+
+	_fsck_run(ck, _fsck_reader);
+	free(ck->batches);
+	ck->batches = NULL;
 
+	for (k = 0; k < ck->nworkers; k++)
+		if (FS_ERR == ck->workers[k].status) return FS_ERR;
 	return FS_OK;
 }
 
-static int _inode_extend_datablocks(filesystem* fs, inode* ino, block** directblocks) {
+/* Copy out of block_cache a structure of @param size bytes kept in
+ * @param numblocks @param blocks, the way readirectblocks reads it */
+static void _fsck_gather(fsck_state* ck, void* dest, const block_t* blocks, size_t numblocks, size_t size) {
 	size_t i;
 
-	if (NULL != ino) {
+	for (i = 0; i < numblocks && 0 != blocks[i]; i++)
+		memcpy(&((char*)dest)[i*stride], ck->fs->block_cache[blocks[i]].data, i+1 == numblocks ? size % stride : stride);
+}
 
-		if (FS_ERR == _mballoc(fs, MAXBLOCKS_DIRECT, &ino->blocks[ino->nblocks]))
-			return FS_ERR; /* Failed */
+/* The inode table slot of @param num in block_cache, NULL if its table block is not there */
+static dinode* _fsck_dinode(fsck_state* ck, inode_t num) {
+	block_t b = ck->fs->sb.inode_table[num / FS_INODES_PER_BLOCK];
 
-		/* Allocate memory for the direct blocks */
-		for (i = 0; i < MAXBLOCKS_DIRECT; i++) {
-			directblocks[i] = (block*)malloc(sizeof(block));
-			memset(directblocks[i], 0, BLKSIZE);
-		}
+	if (MAXINODES <= num || 0 == b || MAXBLOCKS <= b || !ck->have[b]) return NULL;
+	return &((dinode*)&ck->fs->block_cache[b])[num % FS_INODES_PER_BLOCK];
+}
 
-		for (i = 0; i < MAXBLOCKS_DIRECT; i++)
-		{
-			directblocks[i]->num = ino->blocks[i + ino->nblocks];
+/* The extents of @param di, with those past FS_NEXTENTS copied into
+ * @param xext from its overflow block. NULL if they cannot be had. */
+static const extent* _fsck_extents(fsck_state* ck, const dinode* di, extent* xext) {
+	if (di->nextents <= FS_NEXTENTS) return di->u.ext;
+	if (FS_NEXTENTS + FS_XEXTENTS < di->nextents || 0 == di->xblock || MAXBLOCKS <= di->xblock || !ck->have[di->xblock])
+		return NULL;
 
-			if (i+1 < MAXBLOCKS_DIRECT)
-				directblocks[i]->next = ino->blocks[i+1 + ino->nblocks];
+	memcpy(xext, di->u.ext, FS_NEXTENTS*sizeof(extent));
+	memcpy(&xext[FS_NEXTENTS], &ck->fs->block_cache[di->xblock], FS_XEXTENTS*sizeof(extent));
+	return xext;
+}
+
+/* List in @param blocks the data blocks of directory @param di, at most
+ * MAXFILEBLOCKS. Returns how many, 0 if they cannot be had. */
+static size_t _fsck_dir_blocks(fsck_state* ck, const dinode* di, block_t* blocks) {
+	extent xext[FS_NEXTENTS + FS_XEXTENTS];
+	const extent* ext = _fsck_extents(ck, di, xext);
+	size_t i, j, n = 0;
+
+	if (NULL == ext || 0 == di->ndatablocks || MAXFILEBLOCKS < di->ndatablocks || 0 != di->nholes) return 0;
+
+	for (i = 0; i < di->nextents && n < di->ndatablocks; i++)
+		for (j = 0; j < ext[i].len && n < di->ndatablocks; j++) {
+			if (0 == ext[i].start || MAXBLOCKS <= (size_t)ext[i].start + j) return 0;
+			blocks[n++] = (block_t)(ext[i].start + j);
 		}
-		
-		ino->nblocks += MAXBLOCKS_DIRECT;
-		ino->ndatablocks += MAXBLOCKS_DIRECT;
+	return n == di->ndatablocks ? n : 0;
+}
 
-		_fs.writeblocks(ino, ino->blocks, ino->ninoblocks, sizeof(inode));
+/* Read the dent of directory @param di out of block_cache into @param d */
+static int _fsck_dent(fsck_state* ck, const dinode* di, dent* d) {
+	block_t blocks[MAXFILEBLOCKS];
+	size_t i, n = _fsck_dir_blocks(ck, di, blocks);
+	char* buf;
+	int retv;
+
+	memset(d, 0, sizeof(dent));
+	if (0 == n) return FS_ERR;
+	for (i = 0; i < n; i++)
+		if (!ck->have[blocks[i]]) return FS_ERR;
+
+	buf = (char*)malloc(n*stride);
+	if (NULL == buf) return FS_ERR;
+	for (i = 0; i < n; i++)
+		memcpy(&buf[i*stride], ck->fs->block_cache[blocks[i]].data, stride);
+	retv = _dent_unpack(d, buf, n*stride);
+	free(buf);
+	return retv;
+}
 
-		fs->sb.inode_block_counts[ino->num] = ino->nblocks;
+/* Put the dent @param d of directory @param di back into its data blocks in block_cache */
+static int _fsck_dent_write(fsck_state* ck, const dinode* di, dent* d) {
+	block_t blocks[MAXFILEBLOCKS];
+	size_t i, n = _fsck_dir_blocks(ck, di, blocks);
+	block* blk;
+	char* buf;
+
+	if (0 == n) return FS_ERR;
+	buf = (char*)calloc(n, stride);
+	if (NULL == buf) return FS_ERR;
+	if (FS_ERR == _dent_pack(d, buf, n)) {
+		free(buf);
+		return FS_ERR;
+	}
 
-		if (FS_ERR == _fs._sync(fs))
-			return FS_ERR;
+	for (i = 0; i < n; i++) {
+		blk = &ck->fs->block_cache[blocks[i]];
+		blk->num = blocks[i];
+		blk->next = i+1 < n ? blocks[i+1] : 0;
+		memcpy(blk->data, &buf[i*stride], stride);
+		ck->dirty[blocks[i]] = true;
 	}
+	free(buf);
 	return FS_OK;
 }
 
-/* Read the string data from an array of direct blocks */
-static size_t _inode_read_direct_blocks(char* buf, block** blocks, size_t offset) {
-	uint i;
-	size_t read_cnt = 0;
-	size_t cpysize = 0;
-	size_t len;
-	
-	if (NULL == blocks) return 0;
-	
-	for (i = 0; i < MAXBLOCKS_DIRECT; i++) {
+static void _fsck_claim(fsck_worker* w, block_t b) {
+	if (w->claims[b] < UINT8_MAX) w->claims[b]++;
+}
 
-		if (NULL == blocks[i])
-			return read_cnt;
+/* Check inode @param num against the maps and superblock, and its
+ * extents and dent. Problems are kept in ck->problems for the merge. */
+static void _fsck_inode(fsck_worker* w, inode_t num) {
+	fsck_state* ck = w->ck;
+	filesystem* fs = ck->fs;
+	extent xext[FS_NEXTENTS + FS_XEXTENTS];
+	const extent* ext;
+	dinode* di;
+	dent d;
+	size_t i, j, k, total = 0, holes = 0;
+	const inode_t* kinds[3];
+	size_t counts[3];
+	int inmap = _map_test(&fs->ino_map, num);
+	void* grown;
+
+	ck->state[num] = FSCK_FREE;
+	if (!inmap && 0 == fs->sb.inode_first_blocks[num]) return;
+
+	ck->state[num] = FSCK_BAD;
+	di = _fsck_dinode(ck, num);
+	if (NULL == di || num != di->num || FS_LINK < di->mode) {
+		if (inmap) ck->problems[num] |= FSCK_NOSLOT;
+		return;
+	}
+	if (!inmap) ck->problems[num] |= FSCK_NOTINMAP;
+	if (fs->sb.inode_first_blocks[num] != fs->sb.inode_table[num / FS_INODES_PER_BLOCK])
+		ck->problems[num] |= FSCK_TABLE;
+
+	/* The extents must add up and stay inside the image */
+	ext = _fsck_extents(ck, di, xext);
+	if (0 == di->nextents)
+		ext = 0 == di->ndatablocks && 0 == di->xblock && di->size <= FS_INLINEDATA ? di->u.ext : NULL;
+	else if (di->nextents <= FS_NEXTENTS && 0 != di->xblock)
+		ext = NULL;
+	for (i = 0; NULL != ext && i < di->nextents; i++) {
+		total += ext[i].len;
+		if (0 == ext[i].start) holes += ext[i].len;
+		else if (MAXBLOCKS < (size_t)ext[i].start + ext[i].len) ext = NULL;
+	}
+	for (i = 0; NULL != ext && i < di->nextents; i++)	/* Nor take the place of metadata */
+		for (j = 0; NULL != ext && 0 != ext[i].start && j < ext[i].len; j++)
+			if (ck->meta[ext[i].start + j]) ext = NULL;
+	if (NULL == ext || total != di->ndatablocks || holes != di->nholes || (0 != di->xblock && ck->meta[di->xblock])) {
+		ck->problems[num] |= FSCK_EXTENTS;
+		return;
+	}
 
-//		printf("i, offset: %d, %zu \n", i, offset);
-//		printf("%s\n", &blocks[i]->data[offset]);
-//		fflush(stdout);
-		len = strlen(&blocks[i]->data[offset]);
-		cpysize = min(stride, len);
+	if (FS_DIR == di->mode) {
+		if (FS_ERR == _fsck_dent(ck, di, &d) || num != d.ino) {
+			_dent_free(&d);
+			ck->problems[num] |= FSCK_DENT;
+			return;
+		}
+		ck->dparent[num] = d.parent;
+
+		kinds[0] = d.dirs;	counts[0] = d.ndirs;
+		kinds[1] = d.files;	counts[1] = d.nfiles;
+		kinds[2] = d.links;	counts[2] = d.nlinks;
+		for (k = 0; k < 3; k++)
+			for (i = 0; i < counts[k]; i++) {
+				if (w->nents == w->maxents) {
+					w->maxents = 0 == w->maxents ? 256 : 2*w->maxents;
+					grown = realloc(w->ents, w->maxents*sizeof(fsck_entry));
+					if (NULL == grown) {
+						w->status = FS_ERR;
+						_dent_free(&d);
+						return;
+					}
+					w->ents = (fsck_entry*)grown;
+				}
+				w->ents[w->nents].dir = num;
+				w->ents[w->nents].num = kinds[k][i];
+				w->ents[w->nents].mode = 0 == k ? FS_DIR : 1 == k ? FS_FILE : FS_LINK;
+				w->ents[w->nents].drop = false;
+				w->nents++;
+			}
+		_dent_free(&d);
+	}
 
-		memcpy(&buf[read_cnt], &blocks[i]->data[offset], cpysize);
-		
-		read_cnt += cpysize;
+	ck->state[num] = FSCK_GOOD;
+	if ((size_t)(di->ndatablocks - di->nholes + (0 != di->xblock)) != fs->sb.inode_block_counts[num])
+		ck->problems[num] |= FSCK_COUNT;
 
-		if (cpysize < stride) break;
+	/* The blocks it uses */
+	if (0 != di->xblock) _fsck_claim(w, di->xblock);
+	for (i = 0; i < di->nextents; i++)
+		for (j = 0; 0 != ext[i].start && j < ext[i].len; j++)
+			_fsck_claim(w, (block_t)(ext[i].start + j));
+}
+
+/* Check this worker's share of the inode numbers */
+static void* _fsck_checker(void* arg) {
+	fsck_worker* w = (fsck_worker*)arg;
+	size_t num, first, last;
+
+	first = (size_t)MAXINODES * w->id / w->ck->nworkers;
+	last = (size_t)MAXINODES * (w->id + 1) / w->ck->nworkers;
+	for (num = first < 2 ? 2 : first; num < last && FS_OK == w->status; num++)	/* 0 and 1 are never inodes */
+		_fsck_inode(w, (inode_t)num);
+	return NULL;
+}
+
+/* Read the metadata of the image into block_cache: the maps, the
+ * superblock and dedup table, the inode table, then the extent overflow
+ * blocks and directory blocks the inodes name. Each step is one round
+ * of batched reads. */
+static int _fsck_load(fsck_state* ck) {
+	filesystem* fs = ck->fs;
+	block_t* want;
+	block_t blocks[MAXFILEBLOCKS];
+	block_t first[5] = { 0, 1, 2, 3, 4 };
+	size_t i, k, n = 0, nb;
+	dinode* di;
+	int retv = FS_ERR;
+
+	memset(ck->have, 0, MAXBLOCKS);
+	want = (block_t*)malloc(MAXBLOCKS*sizeof(block_t));
+	if (NULL == want) return FS_ERR;
+
+	/* Maps and superblock_i */
+	if (FS_ERR == _fsck_read(ck, first, 5)) goto done;
+	memcpy(&fs->fb_map, &fs->block_cache[0], sizeof(map));
+	memcpy(&fs->ino_map, &fs->block_cache[1], sizeof(map));
+	memset(&fs->sb_i, 0, sizeof(superblock_i));
+	_fsck_gather(ck, &fs->sb_i, &first[2], 1, sizeof(superblock_i));
+
+	if (FS_MAGIC != fs->sb_i.magic) {
+		FSCK_PROBLEM(ck, false, "not a filesystem of this format: magic number %08x", fs->sb_i.magic);
+		goto done;
+	}
+	if (sizeof(superblock)/stride + 1 != fs->sb_i.nblocks) {
+		FSCK_PROBLEM(ck, false, "the superblock takes %zu blocks, not %zu", fs->sb_i.nblocks, sizeof(superblock)/stride + 1);
+		goto done;
+	}
+	for (i = 0; i < fs->sb_i.nblocks; i++)
+		if (5 > fs->sb_i.blocks[i] || MAXBLOCKS <= fs->sb_i.blocks[i]) {
+			FSCK_PROBLEM(ck, false, "superblock block %zu is %u, outside the image", i, fs->sb_i.blocks[i]);
+			goto done;
+		}
 
-		offset = 0; /* Only applies to first read */
+	for (i = 0; 0 != fs->sb_i.dedup_blocks[0] && i < FS_DEDUPBLOCKS; i++)
+		if (5 > fs->sb_i.dedup_blocks[i] || MAXBLOCKS <= fs->sb_i.dedup_blocks[i]) {
+			FSCK_PROBLEM(ck, false, "dedup table block %zu is %u, outside the image", i, fs->sb_i.dedup_blocks[i]);
+			goto done;
+		}
+
+	/* Superblock and dedup table */
+	for (i = 0; i < fs->sb_i.nblocks; i++)
+		want[n++] = fs->sb_i.blocks[i];
+	for (i = 0; 0 != fs->sb_i.dedup_blocks[0] && i < FS_DEDUPBLOCKS; i++)
+		want[n++] = fs->sb_i.dedup_blocks[i];
+	if (FS_ERR == _fsck_read(ck, want, n)) goto done;
+	_fsck_gather(ck, &fs->sb, fs->sb_i.blocks, fs->sb_i.nblocks, sizeof(superblock));
+	if (0 != fs->sb_i.dedup_blocks[0]) {
+		if (NULL == fs->dedup) fs->dedup = (dedup_table*)malloc(sizeof(dedup_table));
+		if (NULL == fs->ondisk.dedup) fs->ondisk.dedup = (dedup_table*)malloc(sizeof(dedup_table));
+		if (NULL == fs->dedup || NULL == fs->ondisk.dedup) goto done;
+		_fsck_gather(ck, fs->dedup, fs->sb_i.dedup_blocks, FS_DEDUPBLOCKS, sizeof(dedup_table));
 	}
 
-	buf[read_cnt] = '\0'; /* Null terminator*/
+	/* What is on disk now, so that repairs write only what they change */
+	memcpy(&fs->ondisk.fb_map, &fs->fb_map, sizeof(map));
+	memcpy(&fs->ondisk.ino_map, &fs->ino_map, sizeof(map));
+	memcpy(&fs->ondisk.sb_i, &fs->sb_i, sizeof(superblock_i));
+	memcpy(&fs->ondisk.sb, &fs->sb, sizeof(superblock));
+	if (NULL != fs->dedup) memcpy(fs->ondisk.dedup, fs->dedup, sizeof(dedup_table));
+
+	/* Inode table */
+	for (i = 0, n = 0; i < MAXINODES/FS_INODES_PER_BLOCK; i++)
+		if (0 != fs->sb.inode_table[i]) want[n++] = fs->sb.inode_table[i];
+	if (FS_ERR == _fsck_read(ck, want, n)) goto done;
+
+	/* The blocks the metadata takes, which no inode may use */
+	memset(ck->meta, 0, MAXBLOCKS);
+	for (i = 0; i < 5; i++) ck->meta[i]++;
+	for (i = 0; i < fs->sb_i.nblocks; i++) ck->meta[fs->sb_i.blocks[i]]++;
+	for (i = 0; 0 != fs->sb_i.dedup_blocks[0] && i < FS_DEDUPBLOCKS; i++)
+		ck->meta[fs->sb_i.dedup_blocks[i]]++;
+	for (i = 0; i < MAXINODES/FS_INODES_PER_BLOCK; i++)
+		if (0 != fs->sb.inode_table[i] && MAXBLOCKS > fs->sb.inode_table[i]) ck->meta[fs->sb.inode_table[i]]++;
+
+	/* Extent overflow blocks, then directory blocks */
+	for (k = 0; k < 2; k++) {
+		for (i = 2, n = 0; i < MAXINODES; i++) {
+			di = _fsck_dinode(ck, (inode_t)i);
+			if (NULL == di || i != di->num || FS_NEXTENTS + FS_XEXTENTS < di->nextents) continue;
+
+			if (0 == k && FS_NEXTENTS < di->nextents && 0 != di->xblock && MAXBLOCKS > di->xblock)
+				want[n++] = di->xblock;
+			if (1 == k && FS_DIR == di->mode)
+				for (nb = _fsck_dir_blocks(ck, di, blocks); nb > 0 && n < MAXBLOCKS; )
+					want[n++] = blocks[--nb];
+		}
+		if (FS_ERR == _fsck_read(ck, want, n)) goto done;
+	}
+	retv = FS_OK;
 
-	return read_cnt;
+done:
+	free(want);
+	return retv;
 }
 
-/* Read the string data from the direct and indirect blocks of an inode */
-static char* _inode_read_data(inode* ino, size_t seek_pos, size_t len) {
-	size_t max_seek = 0;
-	size_t read_cnt = 0;
-	size_t last_read_count;
-	
-	size_t ib1 = 0;
-	size_t ib2 = 0;
-	size_t i = 0;
-	
-	block_t blk;			/* First block to begin writing at */
-	size_t offset;			/* Byte offset in first block to begin writing at */
-	uint indirection = DIRECT;
-	
-	char* buf = NULL;
-	char* output = NULL;
-	
-	if (NULL == ino) return NULL;
+/* Free inode @param num to put it right: its number, its table slot if it
+ * has one, and the blocks @param used counts for it if it was checked */
+static void _fsck_free_inode(fsck_state* ck, inode_t num, uint16_t* used) {
+	filesystem* fs = ck->fs;
+	dinode* di = _fsck_dinode(ck, num);
+	extent xext[FS_NEXTENTS + FS_XEXTENTS];
+	const extent* ext;
+	size_t i, j;
+
+	if (FSCK_GOOD == ck->state[num] && NULL != (ext = _fsck_extents(ck, di, xext))) {
+		if (0 != di->xblock) used[di->xblock]--;
+		for (i = 0; i < di->nextents; i++)
+			for (j = 0; 0 != ext[i].start && j < ext[i].len; j++)
+				used[ext[i].start + j]--;
+	}
+	ck->state[num] = FSCK_FREE;
+
+	_map_clear(&fs->ino_map, num);
+	fs->sb.inode_first_blocks[num] = 0;
+	fs->sb.inode_block_counts[num] = 0;
+	if (NULL != di && num == di->num) {
+		memset(di, 0, sizeof(dinode));
+		ck->dirty[fs->sb.inode_table[num / FS_INODES_PER_BLOCK]] = true;
+	}
+}
 
-	max_seek = ino->size;
-	
-	buf = (char*)calloc((len%stride)*BLKSIZE, sizeof(char));
+/* Report the blocks from @param first to @param last, which have the
+ * same problem @param what, as one problem for each block */
+static void _fsck_block_run(fsck_state* ck, size_t first, size_t last, const char* what) {
+	if (first == last)
+		FSCK_PROBLEM(ck, ck->repair, "block %zu %s", first, what);
+	else	FSCK_PROBLEM(ck, ck->repair, "blocks %zu to %zu %s", first, last, what);
 
-	offset = seek_pos % stride;
-	blk = (block_t)(seek_pos / stride);
+	ck->report->nproblems += last - first;
+	if (ck->repair) ck->report->nrepaired += last - first;
+}
 
-	while (read_cnt < len) {
-		last_read_count = read_cnt;
-		if (seek_pos >= max_seek)
-			break; /* Next read would go out-of-bounds */
+/* Put together what the workers found about the inodes, and check the
+ * directory tree, the link counts, the block map and the free counts.
+ * Each problem is put right in memory as it is found, in a check too, so
+ * what follows from it is not counted again and a check counts what a
+ * repair would. Only a repair writes the changes out. */
+static int _fsck_merge(fsck_state* ck) {
+	static const char* modes[3] = { "file", "directory", "link" };
+	filesystem* fs = ck->fs;
+	fsck_entry* ents = NULL;
+	size_t* efirst = NULL;
+	uint16_t* used = NULL;
+	uint16_t* nlinks = NULL;
+	uint8_t* reach = NULL;
+	uint8_t* rewrite = NULL;
+	inode_t* queue = NULL;
+	size_t i, j, k, n = 0, nq = 0, run;
+	size_t nfree, free_extents[FS_NFREECLASSES];
+	dinode* di;
+	dinode* ci;
+	dent d;
+	int retv = FS_ERR, inmap, isused;
+	inode_t root = fs->sb.root;
+
+	for (k = 0; k < ck->nworkers; k++)
+		n += ck->workers[k].nents;
+	ents = (fsck_entry*)malloc((n + 1)*sizeof(fsck_entry));
+	efirst = (size_t*)malloc((MAXINODES + 1)*sizeof(size_t));
+	used = (uint16_t*)calloc(MAXBLOCKS, sizeof(uint16_t));
+	nlinks = (uint16_t*)calloc(MAXINODES, sizeof(uint16_t));
+	reach = (uint8_t*)calloc(MAXINODES, 1);
+	rewrite = (uint8_t*)calloc(MAXINODES, 1);
+	queue = (inode_t*)malloc(MAXINODES*sizeof(inode_t));
+	if (NULL == ents || NULL == efirst || NULL == used || NULL == nlinks || NULL == reach || NULL == rewrite || NULL == queue)
+		goto done;
+
+	/* The workers' entries, by directory as each worker had a run of inode numbers */
+	for (k = 0, n = 0; k < ck->nworkers; k++) {
+		if (0 < ck->workers[k].nents)
+			memcpy(&ents[n], ck->workers[k].ents, ck->workers[k].nents*sizeof(fsck_entry));
+		n += ck->workers[k].nents;
+	}
+	for (i = 0, j = 0; i <= MAXINODES; i++) {
+		while (j < n && ents[j].dir < i) j++;
+		efirst[i] = j;
+	}
 
-		if (seek_pos + read_cnt >= max_seek) {
-			break;
-		}
-		
-		if	(blk < MAXBLOCKS_DIRECT)					indirection = DIRECT;
-		else if (blk < MAXBLOCKS_DIRECT + MAXBLOCKS_IB1)			indirection = INDIRECT1;
-		else if (blk < MAXBLOCKS_DIRECT + MAXBLOCKS_IB1 + MAXBLOCKS_IB2)	indirection = INDIRECT2;
-		else if (blk < MAXFILEBLOCKS)						indirection = INDIRECT3;
-		else break;
+	/* Every entry must be an inode of its kind, in one directory only, that names it as its parent */
+	for (i = 0; i < n; i++) {
+		fsck_entry* e = &ents[i];
 
-		switch (indirection) {
-			
-			case DIRECT:
-			{
-				read_cnt += _inode_read_direct_blocks(&buf[read_cnt], ino->directblocks, offset);
-				break;
-			}
-			case INDIRECT1:
-			{
-				read_cnt += _inode_read_direct_blocks(&buf[read_cnt], ino->ib1->blocks, offset);
-				break;
+		if (MAXINODES <= e->num || FSCK_GOOD != ck->state[e->num]) {
+			FSCK_PROBLEM(ck, ck->repair, "directory %u has an entry for inode %u, which is not in use", e->dir, e->num);
+			e->drop = true;
+			rewrite[e->dir] = true;
+			continue;
+		}
+		ci = _fsck_dinode(ck, e->num);
+		if (ci->mode != e->mode) {
+			FSCK_PROBLEM(ck, ck->repair, "directory %u has inode %u as a %s, but it is a %s", e->dir, e->num, modes[e->mode], modes[ci->mode]);
+			e->drop = true;
+		} else if (e->num == root) {
+			FSCK_PROBLEM(ck, ck->repair, "directory %u has the root directory in it", e->dir);
+			e->drop = true;
+		} else if (0 != nlinks[e->num]) {
+			FSCK_PROBLEM(ck, ck->repair, "inode %u is in directory %u, and in another", e->num, e->dir);
+			e->drop = true;
+		}
+		if (e->drop) {
+			rewrite[e->dir] = true;
+			continue;
+		}
+		nlinks[e->num] = 1;		/* Only counts entries here */
+
+		if (e->dir != ci->parent || (FS_DIR == ci->mode && e->dir != ck->dparent[e->num])) {
+			FSCK_PROBLEM(ck, ck->repair, "inode %u is in directory %u, but its parent is %u", e->num, e->dir,
+				FS_DIR == ci->mode && e->dir == ci->parent ? ck->dparent[e->num] : ci->parent);
+			ci->parent = e->dir;
+			ck->dirty[fs->sb.inode_table[e->num / FS_INODES_PER_BLOCK]] = true;
+			if (FS_DIR == ci->mode) {
+				ck->dparent[e->num] = e->dir;
+				rewrite[e->num] = true;
 			}
-			case INDIRECT2:
-			{
-				i = blk - MAXBLOCKS_DIRECT - MAXBLOCKS_IB1;
-				ib1 = i / MAXBLOCKS_IB1;
-				read_cnt += _inode_read_direct_blocks(&buf[read_cnt], ino->ib2->iblocks[ib1]->blocks, offset);
-				break;
+		}
+	}
+	memset(nlinks, 0, MAXINODES*sizeof(uint16_t));
+
+	/* Everything in use must be in the tree under the root */
+	if (MAXINODES <= root || FSCK_GOOD != ck->state[root] || FS_DIR != _fsck_dinode(ck, root)->mode) {
+		FSCK_PROBLEM(ck, false, "the root directory, inode %u, is missing", root);
+		goto done;
+	}
+	if (root != ck->dparent[root]) {
+		FSCK_PROBLEM(ck, ck->repair, "the root directory's parent is %u, not itself", ck->dparent[root]);
+		ck->dparent[root] = root;
+		_fsck_dinode(ck, root)->parent = root;
+		ck->dirty[fs->sb.inode_table[root / FS_INODES_PER_BLOCK]] = true;
+		rewrite[root] = true;
+	}
+	reach[root] = true;
+	queue[nq++] = root;
+	for (k = 0; k < nq; k++)
+		for (i = efirst[queue[k]]; i < efirst[queue[k] + 1]; i++)
+			if (!ents[i].drop && !reach[ents[i].num]) {
+				reach[ents[i].num] = true;
+				if (FS_DIR == ents[i].mode) queue[nq++] = ents[i].num;
 			}
-			case INDIRECT3:
-			{
-				i = blk - MAXBLOCKS_DIRECT - MAXBLOCKS_IB1 - MAXBLOCKS_IB2;
-				ib2 = i / MAXBLOCKS_IB2;
-				ib1 = ib2 / MAXBLOCKS_IB1;
-				read_cnt += _inode_read_direct_blocks(&buf[read_cnt], ino->ib3->iblocks[ib2]->iblocks[ib1]->blocks, offset);
-				break;
+
+	/* Links to each inode in the tree */
+	for (i = 2; i < MAXINODES; i++) {
+		if (!reach[i] || FSCK_GOOD != ck->state[i]) continue;
+		di = _fsck_dinode(ck, (inode_t)i);
+		if (FS_LINK != di->mode || MAXINODES <= di->dest || !reach[di->dest]) continue;
+		if (di->destmode == _fsck_dinode(ck, di->dest)->mode) nlinks[di->dest]++;
+	}
+
+	/* The blocks in use: the metadata's, then the inodes' */
+	for (i = 0; i < MAXBLOCKS; i++)
+		used[i] = ck->meta[i];
+	for (k = 0; k < ck->nworkers; k++)
+		for (i = 0; i < MAXBLOCKS; i++)
+			used[i] += ck->workers[k].claims[i];
+
+
+	/* The problems of each inode */
+	for (i = 2; i < MAXINODES; i++) {
+		di = _fsck_dinode(ck, (inode_t)i);
+
+		if (ck->problems[i] & FSCK_NOSLOT)
+			FSCK_PROBLEM(ck, ck->repair, "inode %zu is used in the inode map, but there is no inode", i);
+		if (ck->problems[i] & FSCK_EXTENTS)
+			FSCK_PROBLEM(ck, ck->repair, "inode %zu has bad extents", i);
+		if (ck->problems[i] & FSCK_DENT)
+			FSCK_PROBLEM(ck, ck->repair, "directory %zu cannot be read", i);
+		if (FSCK_BAD == ck->state[i]) {
+			_fsck_free_inode(ck, (inode_t)i, used);
+			continue;
+		}
+		if (FSCK_FREE == ck->state[i]) continue;
+
+		if (!reach[i]) {
+			FSCK_PROBLEM(ck, ck->repair, "inode %zu is in no directory under the root", i);
+			_fsck_free_inode(ck, (inode_t)i, used);
+			continue;
+		}
+		if (ck->problems[i] & FSCK_NOTINMAP) {
+			FSCK_PROBLEM(ck, ck->repair, "inode %zu is free in the inode map", i);
+			_map_set(&fs->ino_map, i);
+		}
+		if (ck->problems[i] & FSCK_TABLE) {
+			FSCK_PROBLEM(ck, ck->repair, "inode %zu has the wrong inode table block", i);
+			fs->sb.inode_first_blocks[i] = fs->sb.inode_table[i / FS_INODES_PER_BLOCK];
+		}
+		if (ck->problems[i] & FSCK_COUNT) {
+			run = di->ndatablocks - di->nholes + (0 != di->xblock);
+			FSCK_PROBLEM(ck, ck->repair, "inode %zu has %zu blocks, but the superblock counts %zu", i, run, fs->sb.inode_block_counts[i]);
+			fs->sb.inode_block_counts[i] = run;
+		}
+		if (nlinks[i] != di->nlinks) {
+			FSCK_PROBLEM(ck, ck->repair, "inode %zu has %u links to it, but counts %u", i, nlinks[i], di->nlinks);
+			di->nlinks = nlinks[i];
+			ck->dirty[fs->sb.inode_table[i / FS_INODES_PER_BLOCK]] = true;
+		}
+		ck->report->ninodes++;
+	}
+
+	/* Take the entries found wanting out of their directories */
+	for (i = 2; ck->repair && i < MAXINODES; i++) {
+		if (!rewrite[i] || FSCK_GOOD != ck->state[i]) continue;
+		di = _fsck_dinode(ck, (inode_t)i);
+		if (FS_ERR == _fsck_dent(ck, di, &d)) goto done;
+
+		/* Its entries are in ents in the order the dent has them */
+		for (k = 0, j = efirst[i]; k < 3; k++) {
+			inode_t* nums = 0 == k ? d.dirs : 1 == k ? d.files : d.links;
+			uint32_t* hashes = 0 == k ? d.dhash : 1 == k ? d.fhash : d.lhash;
+			uint32_t* seqs = 0 == k ? d.dseq : 1 == k ? d.fseq : d.lseq;
+			size_t* count = 0 == k ? &d.ndirs : 1 == k ? &d.nfiles : &d.nlinks;
+			size_t kept = 0;
+
+			for (run = 0; run < *count && j < efirst[i + 1]; run++, j++) {
+				if (ents[j].drop) continue;
+				nums[kept] = nums[run];
+				hashes[kept] = hashes[run];
+				seqs[kept] = seqs[run];
+				kept++;
 			}
-			default: break;
+			*count = kept;
 		}
-		
-		if (read_cnt == last_read_count)
-			break;
-		
-		/* Going to the next chunk of direct blocks */
-		if (blk < (read_cnt + offset) / stride) {
-			offset = 0;
-			blk += MAXBLOCKS_DIRECT;
+		d.parent = ck->dparent[i];
+		retv = _fsck_dent_write(ck, di, &d);
+		_dent_free(&d);
+		if (FS_ERR == retv) goto done;
+		retv = FS_ERR;
+	}
+
+	for (i = 0; i < MAXBLOCKS; i++) {
+		if (NULL != fs->dedup && 0 != fs->dedup->refs[i] && used[i] != fs->dedup->refs[i]) {
+			FSCK_PROBLEM(ck, ck->repair, "block %zu is used %u times, but the dedup table counts %u", i, used[i], fs->dedup->refs[i]);
+			fs->dedup->refs[i] = used[i];
+		} else if (1 < used[i] && (NULL == fs->dedup || 0 == fs->dedup->refs[i]))
+			FSCK_PROBLEM(ck, false, "block %zu is used %u times", i, used[i]);
+	}
+
+	/* The block map must say which blocks are used. Runs of blocks with the same problem are told together. */
+	for (i = 0; i < MAXBLOCKS; i = j) {
+		inmap = _map_test(&fs->fb_map, i);
+		isused = 0 != used[i];
+		for (j = i + 1; j < MAXBLOCKS && inmap == _map_test(&fs->fb_map, j) && isused == (0 != used[j]); j++);
+		if (inmap == isused) continue;
+
+		_fsck_block_run(ck, i, j - 1, isused ? "in use, but free in the block map" : "used in the block map, but in use by nothing");
+		for (k = i; k < j; k++) {
+			if (isused) _map_set(&fs->fb_map, k);
+			else _map_clear(&fs->fb_map, k);
 		}
-		else offset += read_cnt;
 	}
 
-	/* We may have read more than asked for; return just the part asked for */
-	output = (char*)malloc(len + 1);
-	
-	memcpy(output, buf, len);
-	output[len] = '\0';
-	
-	free(buf);
-	return output;
+	/* The free counts */
+	memset(free_extents, 0, sizeof(free_extents));
+	for (i = 0, nfree = 0, run = 0; i <= MAXBLOCKS; i++) {
+		if (i < MAXBLOCKS && !_map_test(&fs->fb_map, i)) {
+			nfree++;
+			run++;
+			continue;
+		}
+		if (0 < run) free_extents[_size_class(run)]++;
+		run = 0;
+	}
+	ck->report->nblocks = MAXBLOCKS - nfree;
+	if (nfree != fs->sb.nfree_blocks) {
+		FSCK_PROBLEM(ck, ck->repair, "%zu blocks are free, but the superblock counts %zu", nfree, fs->sb.nfree_blocks);
+		fs->sb.nfree_blocks = nfree;
+	}
+	if (0 != memcmp(free_extents, fs->sb.free_extents, sizeof(free_extents))) {
+		FSCK_PROBLEM(ck, ck->repair, "the superblock's counts of free extents are wrong");
+		memcpy(fs->sb.free_extents, free_extents, sizeof(free_extents));
+	}
+	for (i = 0; i < MAXBLOCKS && _map_test(&fs->fb_map, i); i++);
+	if (i < fs->sb.free_blocks_base) {
+		FSCK_PROBLEM(ck, ck->repair, "block %zu is free, but the superblock has no free blocks before %zu", i, fs->sb.free_blocks_base);
+		fs->sb.free_blocks_base = i;
+	}
+
+	for (i = 0, nfree = 0; i < MAXINODES; i++)
+		nfree += !_map_test(&fs->ino_map, i);
+	if (nfree != fs->sb.nfree_inodes) {
+		FSCK_PROBLEM(ck, ck->repair, "%zu inodes are free, but the superblock counts %zu", nfree, fs->sb.nfree_inodes);
+		fs->sb.nfree_inodes = nfree;
+	}
+	for (i = 0; i < MAXINODES && _map_test(&fs->ino_map, i); i++);
+	if (i < fs->sb.free_inodes_base) {
+		FSCK_PROBLEM(ck, ck->repair, "inode %zu is free, but the superblock has no free inodes before %u", i, fs->sb.free_inodes_base);
+		fs->sb.free_inodes_base = (inode_t)i;
+	}
+	retv = FS_OK;
+
+done:
+	free(ents);
+	free(efirst);
+	free(used);
+	free(nlinks);
+	free(reach);
+	free(rewrite);
+	free(queue);
+	return retv;
 }
 
-/* Write the data blocks pointed to by an inode to disk */
-static int _inode_commit_data(inode* ino) {
-	size_t ib1 = 0;
-	size_t ib2 = 0;
-	size_t i = 0;
-	size_t db = 0;
-	size_t blocks_written = 0;
-	
-	block_t blk = 0;
-	
-	uint indirection = DIRECT;
-	
-	while (blocks_written < ino->ndatablocks) {
-		blk = ino->blocks[ino->ninoblocks + blocks_written];
-		db = blocks_written % MAXBLOCKS_DIRECT;
-		
-		if	(blocks_written < MAXBLOCKS_DIRECT)					indirection = DIRECT;
-		else if (blocks_written < MAXBLOCKS_DIRECT + MAXBLOCKS_IB1)			indirection = INDIRECT1;
-		else if (blocks_written < MAXBLOCKS_DIRECT + MAXBLOCKS_IB1 + MAXBLOCKS_IB2)	indirection = INDIRECT2;
-		else if (blocks_written < MAXFILEBLOCKS)					indirection = INDIRECT3;
-		else break;
+/* One check of the whole image, and the repairs it makes if asked */
+static int _fsck_pass(fsck_state* ck) {
+	filesystem* fs = ck->fs;
+	size_t i;
+	uint k;
+	int retv;
+
+	ck->nfixed = 0;
+	ck->report->ninodes = 0;
+	memset(ck->dirty, 0, MAXBLOCKS);
+	memset(ck->problems, 0, MAXINODES*sizeof(uint16_t));
+	memset(ck->dparent, 0, MAXINODES*sizeof(inode_t));
+	for (k = 0; k < ck->nworkers; k++) {
+		memset(ck->workers[k].claims, 0, MAXBLOCKS);
+		ck->workers[k].nents = 0;
+		ck->workers[k].status = FS_OK;
+	}
 
-		switch (indirection) {
+	if (FS_ERR == _fsck_load(ck)) return FS_ERR;
 
-			case DIRECT:
-			{
-				_fs.writeblock(blk, BLKSIZE, ino->directblocks[db]);
-				break;
-			}
-			case INDIRECT1:
-			{
-				_fs.writeblock(blk, BLKSIZE, ino->ib1->blocks[db]);
-				break;
-			}
-			case INDIRECT2:
-			{
-				i = blocks_written - MAXBLOCKS_DIRECT - MAXBLOCKS_IB1;
-				ib1 = i / MAXBLOCKS_IB1;
-				_fs.writeblock(blk, BLKSIZE, ino->ib2->iblocks[ib1]->blocks[db]);
-				break;
-			}
-			case INDIRECT3:
-			{
-				i = blocks_written - MAXBLOCKS_DIRECT - MAXBLOCKS_IB1 - MAXBLOCKS_IB2;
-				ib2 = i / MAXBLOCKS_IB2;
-				ib1 = ib2 / MAXBLOCKS_IB1;
-				_fs.writeblock(blk, BLKSIZE, ino->ib3->iblocks[ib2]->iblocks[ib1]->blocks[db]);
-				break;
-			}
-			default: break;
-		}
-		blocks_written++;
+	_fsck_run(ck, _fsck_checker);
+	for (k = 0; k < ck->nworkers; k++)
+		if (FS_ERR == ck->workers[k].status) return FS_ERR;
+
+	retv = _fsck_merge(ck);
+	if (!ck->repair || 0 == ck->nfixed) return retv;
+
+	/* Write what the repairs changed */
+	for (i = 0; i < MAXBLOCKS; i++)
+		if (ck->dirty[i] && FS_ERR == _fs.writeblock(fs, (block_t)i, BLKSIZE, &fs->block_cache[i]))
+			return FS_ERR;
+	if (FS_ERR == _sync(fs) || 0 != fflush(fs->fp))
+		return FS_ERR;
+	return retv;
+}
+
+/* Check the filesystem in the file @param fname, which must not be open,
+ * on @param nthreads worker threads, or one per processor if 0. With
+ * @param repair, what can be put right is, and the image checked again
+ * until it is clean or FS_FSCK_MAXPASSES checks have been made.
+ * @param report, which must not be NULL, gets what was found; each problem
+ * is told on report->log. Returns FS_OK if the image was, or was left,
+ * consistent, FS_NORMAL if problems remain, FS_ERR if it could not be
+ * checked. */
+static int _fsck(const char* fname, uint nthreads, int repair, fsck_report* report) {
+	fsck_state* ck;
+	filesystem* fs;
+	uint k;
+	size_t problems = 0, before;
+	int retv = FS_ERR;
+
+	if (NULL == fname || NULL == report) return FS_ERR;
+	report->ninodes = report->nblocks = report->nproblems = report->nrepaired = report->nbytes = 0;
+	report->npasses = 0;
+
+#if defined(_WIN64) || defined(_WIN32)
+	nthreads = 1;				/* No worker threads */
+#else
+	if (0 == nthreads) {
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpus > 0 ? (uint)ncpus : 1;
 	}
+#endif
+	if (FS_FSCK_MAXTHREADS < nthreads) nthreads = FS_FSCK_MAXTHREADS;
+	report->nthreads = nthreads;
 
-	return FS_OK;
+	fs = _init(fname, false);
+	if (NULL == fs) return FS_ERR;
+
+	ck = (fsck_state*)calloc(1, sizeof(fsck_state));
+	if (NULL == ck) {
+		_release(fs);
+		return FS_ERR;
+	}
+	ck->fs = fs;
+	ck->report = report;
+	ck->repair = repair;
+	ck->nworkers = nthreads;
+	ck->have = (uint8_t*)malloc(MAXBLOCKS);
+	ck->dirty = (uint8_t*)malloc(MAXBLOCKS);
+	ck->meta = (uint8_t*)malloc(MAXBLOCKS);
+	ck->state = (uint8_t*)calloc(MAXINODES, 1);
+	ck->problems = (uint16_t*)calloc(MAXINODES, sizeof(uint16_t));
+	ck->dparent = (inode_t*)calloc(MAXINODES, sizeof(inode_t));
+	for (k = 0; k < nthreads; k++) {
+		ck->workers[k].ck = ck;
+		ck->workers[k].id = k;
+		ck->workers[k].claims = (uint8_t*)malloc(MAXBLOCKS);
+		if (NULL == ck->workers[k].claims) break;
+	}
+
+	if (k == nthreads && NULL != ck->have && NULL != ck->dirty && NULL != ck->meta && NULL != ck->state && NULL != ck->problems && NULL != ck->dparent) {
+		do {
+			/* A pass finds again what the one before could not repair */
+			report->nproblems -= problems;
+			before = report->nproblems - report->nrepaired;
+			report->npasses++;
+			retv = _fsck_pass(ck);
+			problems = report->nproblems - report->nrepaired - before;
+		} while (FS_OK == retv && repair && 0 < ck->nfixed && report->npasses < FS_FSCK_MAXPASSES);
+
+		/* Problems left are the ones the last pass found and did not repair */
+		if (FS_OK == retv && 0 < problems) retv = FS_NORMAL;
+		if (FS_OK == retv && repair && 0 < ck->nfixed) retv = FS_NORMAL;
+	}
+
+	for (k = 0; k < nthreads; k++) {
+		report->nbytes += ck->workers[k].io.blocks_read*BLKSIZE;
+		fs_io.nreads += ck->workers[k].io.nreads;
+		fs_io.blocks_read += ck->workers[k].io.blocks_read;
+		free(ck->workers[k].claims);
+		free(ck->workers[k].ents);
+	}
+	free(ck->have);
+	free(ck->dirty);
+	free(ck->meta);
+	free(ck->state);
+	free(ck->problems);
+	free(ck->dparent);
+	free(ck);
+	_release(fs);
+	return retv;
 }
 
 /* Read a block from disk */
-static int readblock(void* dest, block_t b) {
-	if (NULL == fp) return FS_ERR;
+static int readblock(filesystem* fs, void* dest, block_t b) {
+	uint64_t t = stats_now();
+
+	if (NULL == fs->fp) return FS_ERR;
 
-	if (0 != fseek(fp, b*BLKSIZE, SEEK_SET))
+	if (0 != fseek(fs->fp, b*BLKSIZE, SEEK_SET))
 		return FS_ERR;
-	if (1 != fread(dest, BLKSIZE, 1, fp))	// fread() returns 0 or 1
+	fs_io.nreads++;
+	if (1 != fread(dest, BLKSIZE, 1, fs->fp))	// fread() returns 0 or 1
 		return FS_ERR;			// Return ok only if exactly one block was read
+	fs_io.blocks_read++;
+	stats_count(SC_BYTES_READ, BLKSIZE);
+	stats_record_args(ST_READBLOCK, t, (long)b, -1);
+	return FS_OK;
+}
+
+/* Read @param count consecutive blocks from disk, starting at block @param b */
+static int readrun(filesystem* fs, void* dest, block_t b, size_t count) {
+	uint64_t t = stats_now();
+
+	if (NULL == fs->fp) return FS_ERR;
+
+	if (0 != fseek(fs->fp, b*BLKSIZE, SEEK_SET))
+		return FS_ERR;
+	fs_io.nreads++;
+	if (count != fread(dest, BLKSIZE, count, fs->fp))
+		return FS_ERR;
+	fs_io.blocks_read += count;
+	stats_count(SC_BYTES_READ, count*BLKSIZE);
+	stats_record_args(ST_READBLOCK, t, (long)b, -1);
 	return FS_OK;
 }
 
 /* Write a block to disk */
-static int writeblock(block_t b, size_t size, void* data) {
-	if (NULL == fp) return FS_ERR;
+static int writeblock(filesystem* fs, block_t b, size_t size, void* data) {
+	uint64_t t = stats_now();
+
+	if (NULL == fs->fp) return FS_ERR;
 	if (NULL == data) return FS_ERR;
 
-	if (0 != fseek(fp, b*BLKSIZE, SEEK_SET))
+	if (0 != fseek(fs->fp, b*BLKSIZE, SEEK_SET))
 		return FS_ERR;
-	if (1 != fwrite(data, size, 1, fp))	// fwrite() returns 0 or 1
+	fs_io.nwrites++;
+	if (1 != fwrite(data, size, 1, fs->fp))	// fwrite() returns 0 or 1
 		return FS_ERR;			// Return ok only if exactly one block was written
+	fs_io.blocks_written += (size + BLKSIZE - 1) / BLKSIZE;
+	stats_count(SC_BYTES_WRITTEN, size);
+	stats_record_args(ST_WRITEBLOCK, t, (long)b, -1);
 
 	return FS_OK;
 }
 
 /* Read an arbitary number of blocks from disk. */
-static int readirectblocks(void* dest, block_t* blocks, size_t numblocks, size_t type_size) {
-	block_t j = blocks[0];
+static int readirectblocks(filesystem* fs, void* dest, block_t* blocks, size_t numblocks, size_t type_size) {
 
 	/* Get strided blocks (more than one block or less than a whole block) */
 	if (BLKSIZE != type_size) {
@@ -2244,28 +6810,27 @@ static int readirectblocks(void* dest, block_t* blocks, size_t numblocks, size_t
 		size_t copysize;
 
 		for (i = 0; i < numblocks; i++) {					/* Get root blocks from disk */
-			k = j;
+			k = blocks[i];
 
 			if (0 == k) break;
 
 			copysize = i+1 == numblocks ? type_size % stride : stride;	/* Get last chunk which may only be a partial block */
 
-			if (FS_ERR == _fs.readblock(&block_cache[k], k))
+			if (FS_ERR == _fs.readblock(fs, &fs->block_cache[k], k))
 				return FS_ERR;
 			if (MAXBLOCKS <= k) return FS_ERR;
 
-			memcpy(&((char*)dest)[i*stride], &block_cache[k].data, copysize);
-			j = block_cache[k].next;
+			memcpy(&((char*)dest)[i*stride], &fs->block_cache[k].data, copysize);
 		}
 	/* Get exactly one block */
-	} else if (FS_ERR == _fs.readblock(dest, j))
+	} else if (FS_ERR == _fs.readblock(fs, dest, blocks[0]))
 		return FS_ERR;
 
 	return FS_OK;
 }
 
 /* Write an arbitrary number of blocks to disk */
-static int writeblocks(void* source, block_t* blocks, size_t numblocks, size_t type_size) {
+static int writeblocks(filesystem* fs, void* source, block_t* blocks, size_t numblocks, size_t type_size) {
 	block_t j = blocks[0];
 
 	// Split @param source into strides if it will not fit in one block
@@ -2276,26 +6841,26 @@ static int writeblocks(void* source, block_t* blocks, size_t numblocks, size_t t
 		for (i = 0; i < numblocks; i++) {					// For all blocks
 			if (0 == j) break;
 
-			block_cache[j].num = blocks[i];
+			fs->block_cache[j].num = blocks[i];
 
 			copysize		= i+1 == numblocks ? type_size % stride : stride;	// Copy either full block or remaining chunk
-			block_cache[j].next	= i+1 == numblocks ? 0 : blocks[i+1];			// Index of next block (0 if no next block)
+			fs->block_cache[j].next	= i+1 == numblocks ? 0 : blocks[i+1];			// Index of next block (0 if no next block)
 
-			memcpy(block_cache[j].data, &((char*)source)[i*stride], copysize);
-			j = block_cache[j].next;
+			memcpy(fs->block_cache[j].data, &((char*)source)[i*stride], copysize);
+			j = fs->block_cache[j].next;
 		}
 		
 		j = blocks[0];
 		for (i = 0; i < numblocks; i++) {
 			if (0 == j) break;	// Sanity check: Do not write inode 0
 
-			if (FS_ERR == _fs.writeblock(j, BLKSIZE, &block_cache[j]))
+			if (FS_ERR == _fs.writeblock(fs, j, BLKSIZE, &fs->block_cache[j]))
 				return FS_ERR;
-			j = block_cache[j].next;
+			j = fs->block_cache[j].next;
 		}
 
 	// Else write @param source to a whole block directly
-	} else return _fs.writeblock(j, type_size, source);
+	} else return _fs.writeblock(fs, j, type_size, source);
 
 	return FS_OK;
 }
@@ -2305,51 +6870,78 @@ static int writeblocks(void* source, block_t* blocks, size_t numblocks, size_t t
  * and the changes need to be put on disk. */
 static int write_commit(filesystem* fs, inode* ino) {
 
-	/* Write the inode metadata. */
-	writeblocks( ino, ino->blocks, ino->ninoblocks, sizeof(inode)); 
+	/* Place the blocks buffered since the last commit */
+	if (FS_FILE == ino->mode && FS_ERR == _inode_alloc_delayed(fs, ino))
+		return FS_ERR;
+
+	/* Write the inode metadata, if it changed */
+	if (ino->dirty && FS_ERR == _inode_store(fs, ino))
+		return FS_ERR;
 
-	/* Write the data the inode points to. */
-	_inode_commit_data(ino);
+	/* Write the data the inode points to. A directory's data was written with its inode. */
+	if (FS_FILE == ino->mode)
+		_inode_commit_data(fs, ino);
 
 	return _fs._sync(fs);
 }
 
-/* Open a filesystem stored on disk */
-static filesystem* _open() {
+/* Open the filesystem stored in the file @param fname */
+static filesystem* _open(const char* fname) {
 	filesystem* fs = NULL;
 	block_t sb_i_location = 2;
 
-	fs = _init(false);
+	fs = _init(fname, false);
 	if (NULL == fs) return NULL;
 
-	_fs.readblock(&fs->fb_map, 0);
-	_fs.readblock(&fs->ino_map, 1);
-	_fs.readirectblocks(&fs->sb_i, &sb_i_location, 1, sizeof(superblock_i));
-	_fs.readirectblocks(&fs->sb, fs->sb_i.blocks, fs->sb_i.nblocks, sizeof(superblock));
+	_fs.readblock(fs, &fs->fb_map, 0);
+	_fs.readblock(fs, &fs->ino_map, 1);
+	_fs.readirectblocks(fs, &fs->sb_i, &sb_i_location, 1, sizeof(superblock_i));
+
+	if (FS_MAGIC != fs->sb_i.magic) {	/* Not a filesystem, or one of an older format */
+		_release(fs);
+		return NULL;
+	}
+	_fs.readirectblocks(fs, &fs->sb, fs->sb_i.blocks, fs->sb_i.nblocks, sizeof(superblock));
+
+	memcpy(&fs->ondisk.fb_map,	&fs->fb_map,	sizeof(map));
+	memcpy(&fs->ondisk.ino_map,	&fs->ino_map,	sizeof(map));
+	memcpy(&fs->ondisk.sb_i,	&fs->sb_i,	sizeof(superblock_i));
+	memcpy(&fs->ondisk.sb,		&fs->sb,	sizeof(superblock));
+
+	if (FS_ERR == _dedup_load(fs)) {
+		_release(fs);
+		return NULL;
+	}
 
 	fs->root = _mkroot(fs, false);
 
 	if (NULL == fs->root || strcmp(fs->root->name,"/")) {	// We determine it's the root by name "/"
-		free(fs);
+		_release(fs);
+		return NULL;
+	}
+
+	/* Removals were pending when it was last written */
+	if ((fs->sb_i.flags & FS_RECLAIMING) && FS_ERR == _reclaim_replay(fs)) {
+		_release(fs);
 		return NULL;
 	}
 
 	return fs;
 }
 
-/* Make a brand-new filesystem. Overwrite any previous. */
-static filesystem* _mkfs() {
+/* Make a brand-new filesystem in the file @param fname. Overwrite any previous. */
+static filesystem* _mkfs(const char* fname) {
 	filesystem *fs = NULL;
 
-	fs = _init(true);
+	fs = _init(fname, true);
 	if (NULL == fs) return NULL;
 	
 	/* Write root inode to disk. */
-	writeblocks( fs->root->ino, fs->root->ino->blocks, fs->root->ino->nblocks, sizeof(inode)); 
+	_inode_store(fs, fs->root->ino); 
 
 	/* Write superblock and other important first blocks */
 	if (FS_ERR == _fs._sync(fs)) {
-		free(fs);
+		_release(fs);
 		return NULL;
 	}
 	return fs;
@@ -2432,9 +7024,8 @@ static void _debug_print() {
 	printf("Size of the filesystem (kB): %d \n", MAXBLOCKS*BLKSIZE/1024);
 	
 	printf("\tMaximum file size (kB): %d\n", MAXFILEBLOCKS*BLKSIZE/1024);
-	printf("\tMaximum path length (chars): %d\n", FS_MAXPATHLEN);
-	printf("\tMaximum directory/file/link name length: %d\n", FS_NAMEMAXLEN);
-	printf("\tMaximum path depth: %d\n\n", FS_MAXPATHFIELDS);
+	printf("\tMaximum inline file size (bytes): %d\n", FS_INLINEDATA);
+	printf("\tMaximum directory/file/link name length: %d\n\n", FS_NAMEMAXLEN);
 	
 	printf("\tInode # direct blocks: %d\n", MAXBLOCKS_DIRECT);
 	printf("\tInode # single indirect blocks: %d\n", MAXBLOCKS_IB1);
@@ -2447,6 +7038,7 @@ static void _debug_print() {
 	printf("\tsizeof(iblock3): %lu\n", sizeof(iblock3));
 	printf("\tsizeof(superblock_i): %lu\n", sizeof(superblock_i));
 	printf("\tsizeof(inode): %lu\n", sizeof(inode));
+	printf("\tsizeof(dinode): %lu (%d per inode table block)\n", sizeof(dinode), FS_INODES_PER_BLOCK);
 	printf("\tsizeof(dent): %lu\n", sizeof(dent));
 	printf("\tsizeof(dentv): %lu\n", sizeof(dentv));
 	printf("\tsizeof(map): %lu\n", sizeof(map));
@@ -2493,13 +7085,13 @@ fs_private_interface const _fs =
 	
 	_new_file, 
 	
-	_new_link, _rmlink,
+	_new_link, _rmlink, _rm,
 	_v_attach, _v_detach,
 
 	_get_fd, _free_fd,			/* File descriptors */
 	_prealloc, _zero,			/* Native filsystem file allocation */
-	_open, _mkfs, _init,			/* Filesystem, opening, creation */
-	__balloc, _mballoc, _bfree, _newBlock,	/* Block allocation */
+	_open, _mkfs, _init, _release,		/* Filesystem, opening, creation */
+	__balloc, _mballoc, _bfree, _mbfree, _newBlock,	/* Block allocation */
 	
 	/* Inode allocation */
 	_new_inode, _free_inode,
@@ -2507,19 +7099,24 @@ fs_private_interface const _fs =
 
 	_inode_fill_blocks_from_data, _inode_fill_blocks_from_disk,
 	
-	_inode_extend_datablocks, _inode_read_direct_blocks, 
-	_inode_read_data, _inode_commit_data,
-	_inode_load, _inode_unload,
+	_inode_block_slot, _inode_hole, _inode_extend_datablocks, _inode_alloc_delayed,
+	_inode_read_data, _inode_commit_data, _punch_hole, _truncate, _fallocate,
+	_zframe_load, _zfile_pack, _zfile_unpack, _compress,
+	_dedup_inode, _dedup, _dedup_report,
+	_inode_nextents, _defrag_inode, _defrag_collect, _defrag_start, _defrag_step, _reclaim_step,
+	_walk, _readdir_plus, _readdir_list, _fsck, _import,
+	_inode_load, _inode_prefetch, _inode_unload,
+	_itable_slot, _inode_store,
 
 	/* Reading and writing disk blocks */
-	readblock, writeblock,
+	readblock, readrun, writeblock,
 	readirectblocks, writeblocks,
 
 	/* Write commits, superblock synchronization, tree traversal */
 	write_commit, 
-	_stat_recurse, _files_iterate, _links_iterate,
+	_lookup, _lookup_forget, _dirs_iterate, _files_iterate, _links_iterate,
 	
-	_sync,
+	_sync, _flush, _group_commit,
 
 	/* Native filesystem interaction */
 	_safeopen, _safeclose,
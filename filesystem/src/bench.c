@@ -0,0 +1,388 @@
+/*
+ * Micro-benchmarks for the filesystem. Links _fs.o and fs.o directly,
+ * so nothing here goes through the shell.
+ *
+ * Every benchmark runs once to warm up and then BENCH_DEFREPS times
+ * (or -r reps). Results go to stdout (or -o file) as JSON, with the mean,
+ * min and max of each benchmark and the disk traffic per repetition.
+ */
+
+#define _POSIX_C_SOURCE 200809L	/* clock_gettime */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fs.h"
+
+#if defined(_WIN64) || defined(_WIN32)
+#include <windows.h>
+#endif
+
+#define BENCH_IMAGE "bench.fs"		// Image the benchmarks run on, removed when done
+#define BENCH_DEFREPS 5			// Repetitions of each benchmark after warm-up
+#define BENCH_MAXREPS 64
+
+#define BENCH_NDIRS 128			// Directories made and removed per repetition
+#define BENCH_NFILES 128		// Small files created per repetition
+#define BENCH_SMALLFILE 1024		// Size in bytes of a small file
+#define BENCH_NLOOKUPS 2000		// Lookups timed per repetition
+#define BENCH_MAXDEPTH 64		// Deepest path looked up
+#define BENCH_CHUNK 4000		// Bytes per read or write call in the throughput benchmarks
+#define BENCH_FILESIZE (2*1000*1000)	// Bytes in the throughput benchmark file. Must fit MAXFILEBLOCKS
+#define BENCH_NRANDOM 256		// Reads or writes per repetition in the random benchmarks
+
+static const size_t depths[] = { 1, 2, 4, 8, 16, 32, BENCH_MAXDEPTH };
+static const size_t widths[] = { 1, 16, 64, 250 };
+
+static char chunk[BENCH_CHUNK + 1];	/* What the benchmarks write */
+static char small[BENCH_SMALLFILE + 1];
+
+typedef double (* bench_fn)(int rep, size_t param);	/* Run once and return the measurement */
+
+static FILE* out = NULL;
+static fs_handle* bfs = NULL;		/* The image the benchmarks run on */
+static int nresults = 0;
+
+/* Wall clock time in seconds */
+static double bench_now() {
+#if defined(_WIN64) || defined(_WIN32)
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+/* Open @param path, creating it for mode "w" */
+static int bench_open(const char* path, char* mode) {
+	fs_path* p = fs.pathFromString(path);
+	char* parent = fs.pathSkipLast(p);
+	char* name = fs.pathGetLast(p);
+	int fd = fs.open(bfs, parent, name, mode);
+
+	fs.pathFree(p);
+	return fd;
+}
+
+/* Make a directory /p/p/.../p of depth @param depth. Returns its path. */
+static char* bench_deep_path(size_t depth) {
+	static char path[2*BENCH_MAXDEPTH + 1];
+	size_t i;
+
+	path[0] = '\0';
+	for (i = 0; i < depth; i++)
+		strcat(path, "/p");
+	return path;
+}
+
+/* Run a benchmark and write its results as one JSON object */
+static void bench_run(const char* name, const char* unit, bench_fn fn, size_t param, int reps) {
+	double v[BENCH_MAXREPS];
+	double sum = 0, lo, hi;
+	io_counts before;
+	int i;
+
+	fn(-1, param);				/* Warm-up, not counted */
+
+	before = fs_io;
+	for (i = 0; i < reps; i++)
+		v[i] = fn(i, param);
+
+	lo = hi = 0;
+	for (i = 0; i < reps; i++) {
+		sum += v[i];
+		if (0 == i || v[i] < lo) lo = v[i];
+		if (0 == i || v[i] > hi) hi = v[i];
+	}
+
+	fprintf(out, "%s\n\t\t{ \"name\": \"%s\", \"param\": %lu, \"unit\": \"%s\", "
+		"\"mean\": %.3f, \"min\": %.3f, \"max\": %.3f, "
+		"\"blocks_read\": %.1f, \"blocks_written\": %.1f }",
+		nresults ? "," : "", name, (unsigned long)param, unit, sum / reps, lo, hi,
+		(double)(fs_io.blocks_read - before.blocks_read) / reps,
+		(double)(fs_io.blocks_written - before.blocks_written) / reps);
+	nresults++;
+	fprintf(stderr, "%-18s %6lu %12.3f %s\n", name, (unsigned long)param, sum / reps, unit);
+}
+
+/* Time to make a new filesystem, ms */
+static double bench_mkfs(int rep, size_t param) {
+	double t;
+	(void)rep; (void)param;
+
+	fs.destruct(bfs);
+	t = bench_now();
+	bfs = fs.mkfs(BENCH_IMAGE);
+	return (bench_now() - t) * 1000.0;
+}
+
+/* Time to open an existing filesystem, ms */
+static double bench_mount(int rep, size_t param) {
+	double t;
+	(void)rep; (void)param;
+
+	fs.syncfs(bfs);
+	fs.destruct(bfs);
+	t = bench_now();
+	bfs = fs.openfs(BENCH_IMAGE);
+	return (bench_now() - t) * 1000.0;
+}
+
+/* Directories made per second, then removed per second (param 1) */
+static double bench_mkdir_rmdir(int rep, size_t rmdir) {
+	char path[64];
+	double t, t_mk, t_rm;
+	int i;
+	(void)rep;
+
+	t = bench_now();
+	for (i = 0; i < BENCH_NDIRS; i++) {
+		sprintf(path, "/d%d", i);
+		fs.mkdir(bfs, "/", path);
+	}
+	t_mk = bench_now() - t;
+
+	t = bench_now();
+	for (i = 0; i < BENCH_NDIRS; i++) {
+		sprintf(path, "/d%d", i);
+		fs.rmdir(bfs, "/", path);
+	}
+	t_rm = bench_now() - t;
+
+	return BENCH_NDIRS / (rmdir ? t_rm : t_mk);
+}
+
+/* Small files created, written and closed per second */
+static double bench_small_files(int rep, size_t param) {
+	char dir[64], path[128];
+	double t;
+	int i, fd;
+	(void)param;
+
+	sprintf(dir, "/small%d", rep + 1);
+	fs.mkdir(bfs, "/", dir);
+
+	t = bench_now();
+	for (i = 0; i < BENCH_NFILES; i++) {
+		sprintf(path, "%s/f%d", dir, i);
+		fd = bench_open(path, "w");
+		if (FS_ERR == fd) continue;
+		fs.write(bfs, (fd_t)fd, small);
+		fs.close(bfs, (fd_t)fd);
+	}
+	return BENCH_NFILES / (bench_now() - t);
+}
+
+/* Lookup time of @param path, us. Cold, the path cache is emptied before
+ * each lookup, so every directory on the way is looked up again. Warm,
+ * all but the first find its directory in the cache. */
+static double bench_lookup(const char* path, int warm) {
+	double t;
+	int i;
+
+	t = bench_now();
+	for (i = 0; i < BENCH_NLOOKUPS; i++) {
+		if (!warm) _fs._lookup_forget(bfs);
+		fs.stat(bfs, (char*)path);
+	}
+	return (bench_now() - t) * 1e6 / BENCH_NLOOKUPS;
+}
+
+/* Lookup time of a directory @param depth levels down, us */
+static double bench_lookup_depth_cold(int rep, size_t depth)	{ (void)rep; return bench_lookup(bench_deep_path(depth), false); }
+static double bench_lookup_depth_warm(int rep, size_t depth)	{ (void)rep; return bench_lookup(bench_deep_path(depth), true); }
+
+/* The last file in a directory of @param width files */
+static const char* bench_wide_path(size_t width) {
+	static char path[64];
+
+	sprintf(path, "/w%lu/f%lu", (unsigned long)width, (unsigned long)width - 1);
+	return path;
+}
+
+/* Lookup time of the last file in a directory of @param width files, us */
+static double bench_lookup_width_cold(int rep, size_t width)	{ (void)rep; return bench_lookup(bench_wide_path(width), false); }
+static double bench_lookup_width_warm(int rep, size_t width)	{ (void)rep; return bench_lookup(bench_wide_path(width), true); }
+
+/* Sequential write of a new file, flushed at close, MB/s */
+static double bench_seq_write(int rep, size_t param) {
+	char path[64];
+	double t;
+	size_t n;
+	int fd;
+	(void)param;
+
+	sprintf(path, "/seq%d", rep + 1);
+
+	t = bench_now();
+	fd = bench_open(path, "w");
+	if (FS_ERR == fd) return 0;
+	for (n = 0; n < BENCH_FILESIZE; n += BENCH_CHUNK)
+		fs.write(bfs, (fd_t)fd, chunk);
+	fs.close(bfs, (fd_t)fd);
+	return n / (bench_now() - t) / 1e6;
+}
+
+/* Sequential read of the whole of /seq0, MB/s */
+static double bench_seq_read(int rep, size_t param) {
+	double t;
+	size_t n = 0, len;
+	char* buf;
+	int fd;
+	(void)rep; (void)param;
+
+	t = bench_now();
+	fd = bench_open("/seq0", "r");
+	if (FS_ERR == fd) return 0;
+	do {
+		buf = fs.read(bfs, (fd_t)fd, BENCH_CHUNK);
+		len = NULL == buf ? 0 : strlen(buf);
+		n += len;
+		free(buf);
+	} while (0 < len);
+	fs.close(bfs, (fd_t)fd);
+	return n / (bench_now() - t) / 1e6;
+}
+
+/* Reads at random offsets in /seq0, MB/s. Runs before random_write changes it. */
+static double bench_random_read(int rep, size_t param) {
+	double t;
+	size_t n = 0;
+	char* buf;
+	int i, fd;
+	(void)rep; (void)param;
+
+	t = bench_now();
+	fd = bench_open("/seq0", "r");
+	if (FS_ERR == fd) return 0;
+	for (i = 0; i < BENCH_NRANDOM; i++) {
+		fs.seek(bfs, (fd_t)fd, (size_t)rand() % (BENCH_FILESIZE - BENCH_CHUNK));
+		buf = fs.read(bfs, (fd_t)fd, BENCH_CHUNK);
+		if (NULL != buf) n += strlen(buf);
+		free(buf);
+	}
+	fs.close(bfs, (fd_t)fd);
+	t = bench_now() - t;
+
+	/* Short reads would make the rate meaningless */
+	if (n != BENCH_NRANDOM*BENCH_CHUNK) {
+		fprintf(stderr, "random_read: read %lu of %lu bytes\n", (unsigned long)n, (unsigned long)(BENCH_NRANDOM*BENCH_CHUNK));
+		return 0;
+	}
+	return n / t / 1e6;
+}
+
+/* Writes at random offsets in /seq0, flushed at close, MB/s */
+static double bench_random_write(int rep, size_t param) {
+	double t;
+	size_t n = 0;
+	int i, fd;
+	(void)rep; (void)param;
+
+	t = bench_now();
+	fd = bench_open("/seq0", "w");
+	if (FS_ERR == fd) return 0;
+	for (i = 0; i < BENCH_NRANDOM; i++) {
+		fs.seek(bfs, (fd_t)fd, (size_t)rand() % (BENCH_FILESIZE - BENCH_CHUNK));
+		n += fs.write(bfs, (fd_t)fd, chunk);
+	}
+	fs.close(bfs, (fd_t)fd);
+	return n / (bench_now() - t) / 1e6;
+}
+
+/* Make the trees the lookup and read benchmarks use */
+static void bench_setup() {
+	char path[128];
+	size_t i, j;
+	int fd;
+
+	for (i = 1; i <= BENCH_MAXDEPTH; i++)
+		fs.mkdir(bfs, "/", bench_deep_path(i));
+
+	for (i = 0; i < sizeof(widths)/sizeof(widths[0]); i++) {
+		sprintf(path, "/w%lu", (unsigned long)widths[i]);
+		fs.mkdir(bfs, "/", path);
+
+		for (j = 0; j < widths[i]; j++) {
+			sprintf(path, "/w%lu/f%lu", (unsigned long)widths[i], (unsigned long)j);
+			fd = bench_open(path, "w");
+			if (FS_ERR != fd) fs.close(bfs, (fd_t)fd);
+		}
+	}
+
+	bench_seq_write(-1, 0);			/* Makes /seq0 */
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr, "usage: %s [-r reps] [-o results.json]\n", prog);
+}
+
+int main(int argc, char** argv) {
+	int reps = BENCH_DEFREPS;
+	size_t i;
+	int a;
+
+	out = stdout;
+	for (a = 1; a < argc; a++) {
+		if (!strcmp(argv[a], "-r") && a+1 < argc) {
+			reps = atoi(argv[++a]);
+			if (reps < 1 || reps > BENCH_MAXREPS) {
+				fprintf(stderr, "reps must be 1 to %d\n", BENCH_MAXREPS);
+				return 1;
+			}
+		} else if (!strcmp(argv[a], "-o") && a+1 < argc) {
+			out = fopen(argv[++a], "w");
+			if (NULL == out) {
+				fprintf(stderr, "Could not open \"%s\"\n", argv[a]);
+				return 1;
+			}
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	srand(560);
+	memset(chunk, 'c', BENCH_CHUNK);
+	memset(small, 's', BENCH_SMALLFILE);
+
+	fprintf(out, "{\n\t\"blksize\": %d,\n\t\"maxblocks\": %d,\n\t\"reps\": %d,\n\t\"results\": [",
+		BLKSIZE, MAXBLOCKS, reps);
+
+	bench_run("mkfs",		"ms",		bench_mkfs,		0, reps);
+	bench_run("mount",		"ms",		bench_mount,		0, reps);
+
+	fs.destruct(bfs);
+	bfs = fs.mkfs(BENCH_IMAGE);
+	bench_run("mkdir",		"dirs/s",	bench_mkdir_rmdir,	0, reps);
+	bench_run("rmdir",		"dirs/s",	bench_mkdir_rmdir,	1, reps);
+	bench_run("create_small",	"files/s",	bench_small_files,	BENCH_SMALLFILE, reps);
+
+	bench_setup();
+	for (i = 0; i < sizeof(depths)/sizeof(depths[0]); i++)
+		bench_run("lookup_depth_cold",	"us",	bench_lookup_depth_cold,	depths[i], reps);
+	for (i = 0; i < sizeof(depths)/sizeof(depths[0]); i++)
+		bench_run("lookup_depth_warm",	"us",	bench_lookup_depth_warm,	depths[i], reps);
+	for (i = 0; i < sizeof(widths)/sizeof(widths[0]); i++)
+		bench_run("lookup_width_cold",	"us",	bench_lookup_width_cold,	widths[i], reps);
+	for (i = 0; i < sizeof(widths)/sizeof(widths[0]); i++)
+		bench_run("lookup_width_warm",	"us",	bench_lookup_width_warm,	widths[i], reps);
+
+	bench_run("seq_write",		"MB/s",		bench_seq_write,	BENCH_FILESIZE, reps);
+	bench_run("seq_read",		"MB/s",		bench_seq_read,		BENCH_FILESIZE, reps);
+	bench_run("random_read",	"MB/s",		bench_random_read,	BENCH_CHUNK, reps);
+	bench_run("random_write",	"MB/s",		bench_random_write,	BENCH_CHUNK, reps);
+
+	fprintf(out, "\n\t]\n}\n");
+	if (stdout != out) fclose(out);
+
+	fs.destruct(bfs);
+	remove(BENCH_IMAGE);
+	return 0;
+}
@@ -4,46 +4,20 @@
 #include "fs.h"
 
 
-filesystem* shfs = NULL; /* The current filesystem */
+/* Close the filesystem @param h and free everything it holds in memory.
+ * Changes not yet synced are lost. */
+static void destruct(fs_handle* h) { _fs._release(h); }
 
-/* Free the memory occupied by a filesystem 
- * TODO: Traverse the whole directory tree and free */
-static void destruct() {
-	//uint i;
-	if (shfs) {
+/* Open the filesystem kept in the file @param fname. NULL if there is none. */
+static fs_handle* openfs(const char* fname) { return _fs._open(fname); }
 
-		if (shfs->root) {
-			free(shfs->root->ino);
-
-			//for (i = 0; i < shfs->root->nfiles; i++)
-			//	free(shfs->root->files[i]);
-			//free(shfs->root->files);
-
-			//for (i = 0; i < shfs->root->nlinks; i++)
-			//	free(shfs->root->links[i]);
-			//free(shfs->root->links);
-
-			if (shfs->root->head)
-				free(shfs->root->head);
-
-			free(shfs->root);
-		}
-		free(shfs);
-	}
-}
-
-/* Open an existing filesystem on disk */
-static void openfs() { shfs = _fs._open(); }
-
-/* Make a new filesystem, write it to disk, and keep an open pointer */
-static void mkfs() { 
-	destruct();
-	shfs =  _fs._mkfs(); 
-}
+/* Make a new filesystem in the file @param fname, overwriting whatever was
+ * there, and return it open */
+static fs_handle* mkfs(const char* fname) { return _fs._mkfs(fname); }
 
 /* cur_path should always be an absolute path; 
  * dir_path can be relative to cur_path */
-static int mkdir(char* cur_path, char* dir_path) {
+static int mkdir(fs_handle* h, char* cur_path, char* dir_path) {
 	dentv* parent_dv = NULL;
 	dentv* new_dv = NULL;
 	inode* parent_inode = NULL;
@@ -56,9 +30,6 @@ static int mkdir(char* cur_path, char* dir_path) {
 	char* parent_str = NULL;
 	char* newdir_name = NULL;
 
-	if (strlen(cur_path) + strlen(dir_path) + 1 >= FS_MAXPATHLEN)
-		return BADPATH;
-
 	if ('/' != cur_path[0])					// Require leading "/"
 		return BADPATH;
 
@@ -79,16 +50,16 @@ static int mkdir(char* cur_path, char* dir_path) {
 	newdir_name = _fs._pathGetLast(abs_path);
 	parent_str = _fs._pathSkipLast(abs_path);
 
-	if (NULL != fs.stat(path_str)) 
+	if (NULL != fs.stat(h, path_str)) 
 		return DIREXISTS;				// The requested directory already exists
 
-	parent_inode = fs.stat(parent_str);
+	parent_inode = fs.stat(h, parent_str);
 	if (NULL == parent_inode)	return BADPATH;
 	parent_dv = parent_inode->datav.dir;
 	
 	if (NULL == parent_dv) return NOTONDISK;		// Give up
 
-	new_dv = _fs._new_dir(shfs, parent_dv, newdir_name);
+	new_dv = _fs._new_dir(h, parent_dv, newdir_name);
 	if (NULL == new_dv) return ERR;
 
 	return OK;
@@ -96,16 +67,13 @@ static int mkdir(char* cur_path, char* dir_path) {
 
 /* Remove the directory of @param dir_path in directory @param cur_path 
  * dir_path can be relative or absolute; cur_path must be absolute */
-static int rmdir(char* cur_path, char* dir_path) { 
+static int rmdir(fs_handle* h, char* cur_path, char* dir_path) { 
 	uint i = 0;
 	inode* target = NULL;
 	fs_path* abs_path = NULL;
 	fs_path* rel_path = NULL;
 	char* path_str = NULL;
 
-	if (strlen(cur_path) + strlen(dir_path) + 1 >= FS_MAXPATHLEN)
-		return FS_ERR;
-
 	if ('/' != cur_path[0])					// Require leading "/"
 		return FS_ERR;
 
@@ -123,53 +91,37 @@ static int rmdir(char* cur_path, char* dir_path) {
 
 	path_str = _fs._stringFromPath(abs_path);
 
-	target = fs.stat(path_str);
+	target = fs.stat(h, path_str);
 	if (NULL == target) 
 		return FS_ERR;
 
 	if (FS_DIR != target->mode)
 		return FS_ERR;
 
-	return _fs._rmdir(shfs, target->datav.dir); 
+	return _fs._rmdir(h, target->datav.dir); 
 }
 
 /*
  * Return the inode of the directory at the path "name"
  */
-static inode* stat(char* name) {
-
-	uint i		= 0;
-	size_t depth	= 0;			// The depth of the path, e.g. depth of "/a/b/c" is 3
-	inode* ino	= NULL;
-	fs_path* dPath	= NULL;
-
-	if (NULL == shfs) return NULL;		// No filesystem yet, bail!
+static inode* stat(fs_handle* h, char* name) {
+	if (NULL == h) return NULL;		// No filesystem yet, bail!
 	
 	if (NULL == name || 0 == strlen(name))
 		return NULL;
 
-	dPath = _fs._tokenize(name, "/");
-	depth = dPath->nfields;
-
-	if (depth == 0) return shfs->root->ino;	// Return if we are at the root
-	else {					// Else traverse the path, get matching inode
-		ino = _fs._stat_recurse(shfs, shfs->root, 0, depth-1, dPath);
-		for (i = 0; i < depth; i++) 
-			free(dPath->fields[i]);
-		return ino;
-	}
+	return _fs._lookup(h, name);
 }
 
 /* Stat using an inode number */
-static inode* statI(inode_t num) {
-	inode* ino = _fs._inode_load(shfs, num);
+static inode* statI(fs_handle* h, inode_t num) {
+	inode* ino = _fs._inode_load(h, num);
 	if (NULL == ino) return NULL;
 	
 	if (!ino->v_attached) {
-		if (FS_ERR == _fs._v_attach(shfs, ino)) {
-			free(ino);
+		/* It stays in the attached inodes, to be freed with them */
+		if (FS_ERR == _fs._v_attach(h, ino))
 			return NULL;
-		}
 	}
 	return ino;
 }
@@ -182,7 +134,7 @@ static char*	stringFromPath(fs_path*p )			{ return _fs._stringFromPath(p); }
 static char*	pathSkipLast(fs_path* p)			{ return _fs._pathSkipLast(p); }
 static char*	pathGetLast(fs_path* p)				{ return _fs._pathGetLast(p); }
 static int	pathAppend(fs_path* p, const char* str)		{ return _fs._pathAppend(p, str); }
-static char*	getAbsolutePathDV(dentv* dv, fs_path* p)	{ return _fs._getAbsolutePathDV(shfs, dv, p); }
+static char*	getAbsolutePathDV(fs_handle* h, dentv* dv, fs_path* p) { return _fs._getAbsolutePathDV(h, dv, p); }
 static char*	getAbsolutePath(char* current_path, char* next)	{ return _fs._getAbsolutePath(current_path, next); }
 static char*	pathTrimSlashes(char* path)			{ return _fs._pathTrimSlashes(path); }
 static char*	strSkipFirst(char* cpy)				{ return _fs._strSkipFirst(cpy); }
@@ -190,11 +142,11 @@ static char*	strSkipLast(char* cpy)				{ return _fs._strSkipLast(cpy); }
 static char*	trim(char* cpy)					{ return _fs._trim(cpy); }
 static int	isNumeric(char* str)				{ return _fs._isNumeric(str); }
 
-static void	inodeUnload(inode* ino)				{ _fs._inode_unload(shfs, ino); }
-static inode*	inodeLoad(inode_t num)				{ return _fs._inode_load(shfs, num); }
+static void	inodeUnload(fs_handle* h, inode* ino)		{ _fs._inode_unload(h, ino); }
+static inode*	inodeLoad(fs_handle* h, inode_t num)		{ return _fs._inode_load(h, num); }
 
 /* Return a file descriptor (just an inode number) corresponding to the file at the path*/
-static int open(char* parent_dir, char* name, char* mode) { 
+static int open(fs_handle* h, char* parent_dir, char* name, char* mode) { 
 	fd_t i = 0;
 	fs_mode_t mode_i = FS_READ;
 	fd_t fd = 0;
@@ -211,9 +163,9 @@ static int open(char* parent_dir, char* name, char* mode) {
 		return -1;
 	}
 	
-	p_ino = stat(parent_dir);
+	p_ino = stat(h, parent_dir);
 	f_path = fs.getAbsolutePath(parent_dir, name);
-	f_ino = stat(f_path);
+	f_ino = stat(h, f_path);
 
 	if (NULL == p_ino) {
 		printf("open: Parent of \"%s\" does not exist.\n", name);
@@ -244,7 +196,7 @@ static int open(char* parent_dir, char* name, char* mode) {
 			f_ino = f_ino->datav.link->dest;
 			
 			if (!f_ino->v_attached)
-				_fs._v_attach(shfs, f_ino);
+				_fs._v_attach(h, f_ino);
 			++recursion;
 		}
 		
@@ -262,7 +214,7 @@ static int open(char* parent_dir, char* name, char* mode) {
 		}
 		
 		if (FS_WRITE == mode_i) {
-			newfv = _fs._new_file(shfs, p_ino->datav.dir, name);	// Create file
+			newfv = _fs._new_file(h, p_ino->datav.dir, name);	// Create file
 			
 			if (NULL == newfv) return FS_ERR;
 			
@@ -275,9 +227,9 @@ static int open(char* parent_dir, char* name, char* mode) {
 	if (NULL == f_ino->datav.file) return FS_ERR;
 	
 	for (i = 0; i < FS_MAXOPENFILES; i++) {
-		if (!shfs->fds[i]) continue;
+		if (!h->fds[i]) continue;
 		
-		if (f_ino->num == shfs->fds[i]->ino->num) {
+		if (f_ino->num == h->fds[i]->ino->num) {
 			printf("open: File is already open with fd %d\n", i);
 			return FS_ERR;
 		}
@@ -286,15 +238,15 @@ static int open(char* parent_dir, char* name, char* mode) {
 	f_ino->datav.file->mode = mode_i;
 
 	/* Return a file descriptor which indexes to the filev */
-	fd = _fs._get_fd(shfs);
-	shfs->fds[fd] = f_ino->datav.file;
+	fd = _fs._get_fd(h);
+	h->fds[fd] = f_ino->datav.file;
 	
 	return fd;
 }
 
-static int close(fd_t fd) {
+static int close(fs_handle* h, fd_t fd) {
 
-	if (NULL == shfs) {
+	if (NULL == h) {
 		printf("No filesystem. Type \"mkfs\".\n");
 		return FS_ERR;
 	}
@@ -304,29 +256,29 @@ static int close(fd_t fd) {
 		return FS_ERR;
 	}
 
-	if (false == shfs->allocated_fds[fd]) {
+	if (false == h->allocated_fds[fd]) {
 		printf("File descriptor \"%d\" not open. \n", fd);
 		return FS_ERR; /* fd not allocated */
 	}
 
-	if (shfs->fds[fd]) {
+	if (h->fds[fd]) {
 
-		_fs._inode_unload(shfs, shfs->fds[fd]->ino);
-		shfs->fds[fd] = NULL;
+		_fs._inode_unload(h, h->fds[fd]->ino);
+		h->fds[fd] = NULL;
 	}
 
-	_fs._free_fd(shfs, fd);
+	_fs._free_fd(h, fd);
 	return FS_OK;
 }
 
-static dentv* opendir(char* path) { 
+static dentv* opendir(fs_handle* h, char* path) { 
 	inode* ino = NULL;
 	inode* parent = NULL;
 	fs_path* p = NULL;
 	
 	p = pathFromString(path);
 
-	ino = stat(path);
+	ino = stat(h, path);
 
 	if (NULL == ino) {
 		if (!strcmp(path, "/"))
@@ -336,7 +288,7 @@ static dentv* opendir(char* path) {
 	}
 
 	if (!strcmp(path, "/")) parent = ino;
-	else	parent = stat(pathSkipLast(p));
+	else	parent = stat(h, pathSkipLast(p));
 	free(p);
 
 	if (NULL == parent) {
@@ -380,7 +332,7 @@ static dentv* opendir(char* path) {
 		}
 		
 		if (!ino->v_attached) {
-			if (FS_ERR == _fs._v_attach(shfs, ino))
+			if (FS_ERR == _fs._v_attach(h, ino))
 				return NULL;
 		}
 		
@@ -396,12 +348,12 @@ static dentv* opendir(char* path) {
 	return ino->datav.dir; 
 }
 
-static void closedir (dentv* dv) { 
+static void closedir (fs_handle* h, dentv* dv) { 
 	if (NULL == dv) return;
 
 	/* Only free dir if it's not the root */
 	if (strcmp(dv->name, "/")) {
-		_fs._v_detach(shfs, dv->ino);
+		_fs._v_detach(h, dv->ino);
 		dv = NULL;
 	}
 }
@@ -409,12 +361,12 @@ static void closedir (dentv* dv) {
 /* Read text from a file
  * @ param fd file descriptor
  * @ param size number of bytes to read from file */
-static char* read(fd_t fd, size_t size) {
+static char* read(fs_handle* h, fd_t fd, size_t size) {
 
 	filev* fv = NULL;
 	char* buf;
 	
-	if (NULL == shfs) {
+	if (NULL == h) {
 		printf("No filesystem. Type \"mkfs\".\n");
 		return NULL;
 	}
@@ -425,13 +377,13 @@ static char* read(fd_t fd, size_t size) {
 	}
 
 	// Check if the fd has been loaded into the shellfs
-	if (false == shfs->allocated_fds[fd]) {
+	if (false == h->allocated_fds[fd]) {
 		printf("File descriptor \"%d\" is not open\n", fd);
 		return NULL; /* fd not allocated, file not open */
 	}
 
 	// Load the file
-	fv = shfs->fds[fd];
+	fv = h->fds[fd];
 	
 	// Check file mode
 	if (fv->mode != FS_READ && fv->mode != FS_RW) {
@@ -444,7 +396,7 @@ static char* read(fd_t fd, size_t size) {
 	
 	/* No need to check file size; _inode_read_data
 	 * will read as many are are allocated */
-	_fs._inode_fill_blocks_from_disk(fv->ino);
+	_fs._inode_fill_blocks_from_disk(h, fv->ino);
 	buf = _fs._inode_read_data(fv->ino, fv->seek_pos, size);
 	
 	if (NULL == buf)
@@ -459,11 +411,11 @@ static char* read(fd_t fd, size_t size) {
 /* Write text to a file
  * @param str the string to write
  * @param fd the file descriptor to write to */
-static size_t write (fd_t fd, char* str) {
+static size_t write (fs_handle* h, fd_t fd, char* str) {
 	filev* fv = NULL;
 	size_t slen;
 	
-	if (NULL == shfs) {
+	if (NULL == h) {
 		printf("No filesystem. Type \"mkfs\".\n");
 		return 0;
 	}
@@ -473,12 +425,12 @@ static size_t write (fd_t fd, char* str) {
 		return 0;
 	}
 
-	if (false == shfs->allocated_fds[fd]) {
+	if (false == h->allocated_fds[fd]) {
 		printf("File descriptor \"%d\" is not open\n", fd);
 		return 0; /* fd not allocated, file not open */
 	}
 
-	fv = shfs->fds[fd];
+	fv = h->fds[fd];
 	
 	if (FS_WRITE != fv->mode) {
 		printf("File descriptor \"%d\" is not open for writing.\n", fd);
@@ -494,20 +446,89 @@ static size_t write (fd_t fd, char* str) {
 
 	slen = strlen(str);
 
-	_fs._inode_fill_blocks_from_data(shfs, fv->ino, fv->seek_pos, str);
+	/* Nothing is written unless all of it fits */
+	if (FS_ERR == _fs._inode_fill_blocks_from_data(h, fv->ino, fv->seek_pos, str)) {
+		printf("Not enough space to write %lu bytes.\n", (unsigned long)slen);
+		return 0;
+	}
 	fv->seek_pos += slen;
 
 	return slen;
 }
 
+/* The open file @param fd, if it is open for writing, else NULL */
+static filev* writable(fs_handle* h, fd_t fd) {
+	filev* fv = NULL;
+
+	if (NULL == h) {
+		printf("No filesystem. Type \"mkfs\".\n");
+		return NULL;
+	}
+
+	if (fd >= FS_MAXOPENFILES) {
+		printf("Invalid file descriptor.\n");
+		return NULL;
+	}
+
+	if (false == h->allocated_fds[fd]) {
+		printf("File descriptor \"%d\" is not open\n", fd);
+		return NULL;
+	}
+
+	fv = h->fds[fd];
+
+	if (FS_WRITE != fv->mode) {
+		printf("File descriptor \"%d\" is not open for writing.\n", fd);
+		return NULL;
+	}
+	return fv;
+}
+
+/* Punch a hole in a file: @param len bytes from @param offset read as
+ * zeros from then on, and the blocks they took are given back. The file
+ * keeps its size. */
+static int punchHole(fs_handle* h, fd_t fd, size_t offset, size_t len) {
+	filev* fv = writable(h, fd);
+
+	if (NULL == fv) return FS_ERR;
+	return _fs._punch_hole(h, fv->ino, offset, len);
+}
+
+/* Cut the file @param fd down, or grow it, to @param len bytes. The
+ * blocks past the new end are freed, and it grows with holes. */
+static int truncate(fs_handle* h, fd_t fd, size_t len) {
+	filev* fv = writable(h, fd);
+
+	if (NULL == fv) return FS_ERR;
+	if (FS_ERR == _fs._truncate(h, fv->ino, len)) {
+		printf("Could not truncate to %lu bytes.\n", (unsigned long)len);
+		return FS_ERR;
+	}
+	return FS_OK;
+}
+
+/* Give @param len bytes at @param offset of the file @param fd blocks
+ * now, in one run where there is room, so that writes there later do not
+ * allocate. The file grows if the range goes past its end. */
+static int fallocate(fs_handle* h, fd_t fd, size_t offset, size_t len) {
+	filev* fv = writable(h, fd);
+
+	if (NULL == fv) return FS_ERR;
+	if (FS_ERR == _fs._fallocate(h, fv->ino, offset, len)) {
+		printf("Not enough space to allocate %lu bytes.\n", (unsigned long)len);
+		return FS_ERR;
+	}
+	return FS_OK;
+}
+
 /* Sets the offset of the corresponding file
  *  @param fd file descriptor
  *  @param offset the offest of the file */
-static void seek(fd_t fd, size_t offset) {
+static void seek(fs_handle* h, fd_t fd, size_t offset) {
 	filev* fv = NULL;
 	
 	//Check if the file is open (fd is in the allocated
-	if (NULL == shfs) {
+	if (NULL == h) {
 		printf("No filesystem. Type \"mkfs\".\n");
 		return;
 	}
@@ -517,13 +538,13 @@ static void seek(fd_t fd, size_t offset) {
 		return;
 	}
 	
-	if (false == shfs->allocated_fds[fd]) {
+	if (false == h->allocated_fds[fd]) {
 		printf("File descriptor \"%d\" is not open.\n", fd);
 		return; /* fd not allocated, file not open */
 	}
 	
 	// Get the file from the file descriptor
-	fv = shfs->fds[fd];
+	fv = h->fds[fd];
 	
 	// Check that the fd is a file
 	if (FS_FILE != fv->ino->mode) {
@@ -540,7 +561,7 @@ static void seek(fd_t fd, size_t offset) {
  * @param path of src file
  * @param path of dst link
  */
-static int link(char* from, char* to) {
+static int link(fs_handle* h, char* from, char* to) {
 	hlinkv* newlv = NULL;
 	fs_path* dst_path = NULL;
 	inode* src_ino = NULL;
@@ -552,47 +573,381 @@ static int link(char* from, char* to) {
 	parent = fs.pathSkipLast(dst_path);
 	name = fs.pathTrimSlashes(fs.pathGetLast(dst_path));
 
-	src_ino = stat(from);
-	p_ino = stat(parent);
+	src_ino = stat(h, from);
+	p_ino = stat(h, parent);
 
 	if (NULL == src_ino) return FS_ERR;
 	if (NULL == p_ino) return FS_ERR;
 
-	newlv = _fs._new_link(shfs, p_ino->datav.dir, src_ino, name);
+	newlv = _fs._new_link(h, p_ino->datav.dir, src_ino, name);
 	if (NULL == newlv) return FS_ERR;
 
 	return FS_OK;
 }
 
-static int ulink(char* target) {
+static int ulink(fs_handle* h, char* target) {
 
 	inode* src_ino = NULL;
 
-	src_ino = stat(target);
+	src_ino = stat(h, target);
+
+	if (NULL == src_ino) {
+		printf("Target doesn't exist: \"%s\"\n", target);
+		return FS_ERR;
+	}
 
 	if (FS_LINK != src_ino->mode) {
 		printf("Not a link: \"%s\"\n", target);
 		return FS_ERR;
 	}
-	
-	if (NULL == src_ino) {
-		printf("Target doesn't exist: \"%s\"\n", target);
+
+	return _fs._rmlink(h, src_ino->datav.link);
+}
+
+/* Is the file @param num, or for a directory a file below it, open ? */
+static int inUse(fs_handle* h, inode_t num) {
+	size_t fd, depth;
+	inode* ino;
+
+	for (fd = 0; fd < FS_MAXOPENFILES; fd++) {
+		if (!h->allocated_fds[fd] || NULL == h->fds[fd]) continue;
+
+		/* Up from the open file to the root */
+		ino = h->fds[fd]->ino;
+		for (depth = 0; NULL != ino && depth < MAXINODES; depth++) {
+			if (num == ino->num) return true;
+			if (h->sb.root == ino->num) break;
+			ino = _fs._inode_load(h, FS_DIR == ino->mode ? ino->data.dir.parent : ino->data.file.parent);
+		}
+	}
+	return false;
+}
+
+/* Walk visitor for rm: stop at the first entry that has links to it,
+ * leaving a copy of its path in the char* at @param arg */
+static int linkedVisit(const fs_walk_entry* e, void* arg) {
+	char** found = (char**)arg;
+
+	if (FS_LINK == e->mode || 0 == e->nlinks) return FS_OK;
+	*found = (char*)malloc(strlen(e->path) + 1);
+	if (NULL != *found) strcpy(*found, e->path);
+	return FS_ERR;
+}
+
+/* Remove the file or link at @param path, or with @param recursive the
+ * directory there and everything below it. The entry goes at once; the
+ * space is freed later, a batch at a time, by reclaimStep. */
+static int rm(fs_handle* h, char* path, int recursive) {
+	inode* ino;
+	char* found = NULL;
+
+	if (NULL == h) {
+		printf("No filesystem. Type \"mkfs\".\n");
+		return FS_ERR;
+	}
+
+	ino = stat(h, path);
+	if (NULL == ino) {
+		printf("rm: No such file or directory \"%s\"\n", path);
+		return FS_ERR;
+	}
+
+	if (h->sb.root == ino->num) {
+		printf("rm: Cannot remove the root directory\n");
+		return FS_ERR;
+	}
+
+	if (FS_DIR == ino->mode && !recursive) {
+		printf("rm: \"%s\" is a directory. Use rm -r\n", path);
 		return FS_ERR;
 	}
 
-	return _fs._rmlink(shfs, src_ino->datav.link);
+	if (FS_LINK != ino->mode && 0 < ino->nlinks) {
+		printf("rm: \"%s\" has links to it. Unlink them first\n", path);
+		return FS_ERR;
+	}
+
+	/* Nor may anything below a directory have links to it */
+	if (FS_DIR == ino->mode && FS_ERR == _fs._walk(h, ino->num, path, 1, linkedVisit, &found)) {
+		if (NULL != found)
+			printf("rm: \"%s\" has links to it. Unlink them first\n", found);
+		free(found);
+		return FS_ERR;
+	}
+
+	if (inUse(h, ino->num)) {
+		printf("rm: \"%s\" is open\n", path);
+		return FS_ERR;
+	}
+
+	return _fs._rm(h, ino);
 }
 
-static size_t getNumUsedBlocks() {
-	size_t i;
-	size_t total = 0;
-	
-	for (i = 0; i < MAXINODES; i++)
-		total += shfs->sb.inode_block_counts[i];
+/* Free up to about @param nblocks blocks of the space removed files held.
+ * Returns how many removed files and directories are left to free. */
+static size_t reclaimStep(fs_handle* h, size_t nblocks) {
+	if (NULL == h) return 0;
+	return _fs._reclaim_step(h, nblocks);
+}
+
+/* Make the data and metadata of an open file durable.
+ * The commit also carries whatever else is dirty, so concurrent
+ * callers share one write sequence and one fdatasync. */
+static int fsync(fs_handle* h, fd_t fd) {
 
-	return total;
+	if (NULL == h) {
+		printf("No filesystem. Type \"mkfs\".\n");
+		return FS_ERR;
+	}
+
+	if (fd >= FS_MAXOPENFILES) {
+		printf("Invalid file descriptor.\n");
+		return FS_ERR;
+	}
+
+	if (false == h->allocated_fds[fd]) {
+		printf("File descriptor \"%d\" not open. \n", fd);
+		return FS_ERR;
+	}
+
+	return _fs._group_commit(h);
+}
+
+/* Make every change to the filesystem durable */
+static int syncfs(fs_handle* h) {
+
+	if (NULL == h) {
+		printf("No filesystem. Type \"mkfs\".\n");
+		return FS_ERR;
+	}
+
+	return _fs._group_commit(h);
+}
+
+/* Defragment the file at @param path, or every file below it if it is
+ * a directory. In the background, this only queues the files, and the
+ * work is done a few files at a time by defragStep. Otherwise the work 
+ * is done now and summed up in @param report. */
+static int defrag(fs_handle* h, char* path, int background, defrag_report* report) {
+	inode* ino = NULL;
+
+	if (NULL == h) {
+		printf("No filesystem. Type \"mkfs\".\n");
+		return FS_ERR;
+	}
+
+	if (NULL != h->defrag.queue) {
+		printf("defrag: Already running\n");
+		return FS_ERR;
+	}
+
+	ino = stat(h, path);
+	if (NULL == ino) {
+		printf("defrag: No such file or directory \"%s\"\n", path);
+		return FS_ERR;
+	}
+
+	if (FS_ERR == _fs._defrag_start(h, ino->num))
+		return FS_ERR;
+
+	if (!background) {
+		while (0 < _fs._defrag_step(h, MAXINODES));
+		if (NULL != report)
+			*report = h->defrag.report;
+	}
+	return FS_OK;
+}
+
+/* Continue a background defragmentation by up to @param nfiles files.
+ * Returns how many are left, and the progress so far in @param report. */
+static size_t defragStep(fs_handle* h, size_t nfiles, defrag_report* report) {
+	size_t left;
+
+	if (NULL == h || NULL == h->defrag.queue) return 0;
+
+	left = _fs._defrag_step(h, nfiles);
+	if (NULL != report)
+		*report = h->defrag.report;
+	return left;
+}
+
+/* The directory at @param path, following links to it. NULL, with a message, if there is none. */
+static inode* walk_start(fs_handle* h, char* path, const char* caller) {
+	inode* ino;
+	size_t recursion;
+
+	if (NULL == h || NULL == path) return NULL;
+
+	ino = stat(h, path);
+	for (recursion = 0; NULL != ino && FS_LINK == ino->mode && recursion < 8; recursion++)
+		ino = statI(h, ino->data.link.dest);
+
+	if (NULL == ino || FS_DIR != ino->mode) {
+		printf("%s: \"%s\" is not a directory.\n", caller, path);
+		return NULL;
+	}
+	return ino;
 }
 
+/* Call @param visit for everything below the directory at @param path, 
+ * on @param nthreads threads, or one per processor if 0. 
+ * See fs_visitor for what the visitor may do. */
+static int walk(fs_handle* h, char* path, uint nthreads, fs_visitor visit, void* arg) {
+	inode* ino = walk_start(h, path, "walk");
+	if (NULL == ino) return FS_ERR;
+
+	return _fs._walk(h, ino->num, path, nthreads, visit, arg);
+}
+
+/* Call @param visit for each entry of the directory at @param path, with its 
+ * name, type, inode number and size, without a stat per entry */
+static int readdirPlus(fs_handle* h, char* path, fs_visitor visit, void* arg) {
+	inode* ino = walk_start(h, path, "readdirPlus");
+	if (NULL == ino) return FS_ERR;
+
+	return _fs._readdir_plus(h, ino->num, path, visit, arg);
+}
+
+/* The entries of the directory at @param path in one buffer, as readdirPlus
+ * finds them. Their number goes in @param n. free() the buffer when done. */
+static fs_walk_entry* readdirPlusList(fs_handle* h, char* path, size_t* n) {
+	inode* ino = walk_start(h, path, "readdirPlus");
+
+	*n = 0;
+	if (NULL == ino) return NULL;
+
+	return _fs._readdir_list(h, ino->num, path, n);
+}
+
+/* Turn compression on or off for the file at @param path, or for the
+ * files created from now on if @param path is NULL. */
+static int compress(fs_handle* h, char* path, int on) {
+	inode* ino;
+	size_t recursion;
+
+	if (NULL == h) {
+		printf("No filesystem. Type \"mkfs\".\n");
+		return FS_ERR;
+	}
+
+	if (NULL == path) {
+		if (on) h->sb_i.flags |= FS_ZVOLUME;
+		else h->sb_i.flags &= ~FS_ZVOLUME;
+		return _fs._sync(h);
+	}
+
+	ino = stat(h, path);
+	for (recursion = 0; NULL != ino && FS_LINK == ino->mode && recursion < 8; recursion++)
+		ino = statI(h, ino->data.link.dest);
+
+	if (NULL == ino || FS_FILE != ino->mode) {
+		printf("compress: \"%s\" is not a file.\n", path);
+		return FS_ERR;
+	}
+
+	return _fs._compress(h, ino, on);
+}
+
+/* Turn on or off sharing of blocks that hold the same data */
+static int dedup(fs_handle* h, int on) {
+
+	if (NULL == h) {
+		printf("No filesystem. Type \"mkfs\".\n");
+		return FS_ERR;
+	}
+
+	return _fs._dedup(h, on);
+}
+
+/* Sum up in @param report how many blocks are shared and what that saves */
+static void dedupStats(fs_handle* h, dedup_report* report) {
+	if (NULL == report) return;
+	_fs._dedup_report(h, report);
+}
+
+/* Check the image in the file @param fname, which must not be open, on
+ * @param nthreads threads, 0 for one per processor. With @param repair
+ * what is wrong is put right where it can be. Returns FS_OK if the image
+ * is consistent, or was made so, FS_NORMAL if problems are left and
+ * FS_ERR if it could not be checked. */
+static int fsck(const char* fname, uint nthreads, int repair, fsck_report* report) {
+	if (NULL == fname || NULL == report) return FS_ERR;
+	return _fs._fsck(fname, nthreads, repair, report);
+}
+
+/* Create the @param n files and directories @param files, given by
+ * absolute path, and the directories above them that are missing, all
+ * in one commit. A file's data is the whole of its contents. What was
+ * done is added to @param report. */
+static int importFiles(fs_handle* h, fs_import_file* files, size_t n, import_report* report) {
+	if (NULL == h) {
+		printf("No filesystem. Type \"mkfs\".\n");
+		return FS_ERR;
+	}
+	if (NULL == files || NULL == report) return FS_ERR;
+
+	return _fs._import(h, files, n, report);
+}
+
+/* Number of blocks in use, metadata included. Kept by the allocator. */
+static size_t getNumUsedBlocks(fs_handle* h) {
+	if (NULL == h) return 0;
+	return MAXBLOCKS - h->sb.nfree_blocks;
+}
+
+/* Number of inode numbers in use */
+static size_t getNumUsedInodes(fs_handle* h) {
+	if (NULL == h) return 0;
+	return MAXINODES - h->sb.nfree_inodes;
+}
+
+/* Copy the free extent histogram into @param classes, which holds 
+ * FS_NFREECLASSES counts. Class k counts the runs of 2^k to 2^(k+1)-1 
+ * free blocks. */
+static void getFreeExtents(fs_handle* h, size_t* classes) {
+	if (NULL == classes) return;
+	if (NULL == h) {
+		memset(classes, 0, FS_NFREECLASSES*sizeof(size_t));
+		return;
+	}
+	memcpy(classes, h->sb.free_extents, FS_NFREECLASSES*sizeof(size_t));
+}
+
+/* The operations as the interface exports them: timed into the stats histograms */
+#define TIMED(op, call)	uint64_t t = stats_now(); call; stats_record(op, t)
+
+static fs_handle* timed_openfs(const char* fname)				{ fs_handle* r; TIMED(ST_OPENFS, r = openfs(fname)); return r; }
+static fs_handle* timed_mkfs(const char* fname)					{ fs_handle* r; TIMED(ST_MKFS, r = mkfs(fname)); return r; }
+static int	timed_mkdir(fs_handle* h, char* cur, char* dir)			{ int r; TIMED(ST_MKDIR, r = mkdir(h, cur, dir)); return r; }
+static int	timed_rmdir(fs_handle* h, char* cur, char* dir)			{ int r; TIMED(ST_RMDIR, r = rmdir(h, cur, dir)); return r; }
+static inode*	timed_stat(fs_handle* h, char* name)				{ inode* r; TIMED(ST_STAT, r = stat(h, name)); return r; }
+static inode*	timed_statI(fs_handle* h, inode_t num)				{ inode* r; TIMED(ST_STATI, r = statI(h, num)); return r; }
+static int	timed_open(fs_handle* h, char* parent, char* name, char* mode)	{ int r; TIMED(ST_OPEN, r = open(h, parent, name, mode)); return r; }
+static int	timed_close(fs_handle* h, fd_t fd)				{ int r; TIMED(ST_CLOSE, r = close(h, fd)); return r; }
+static dentv*	timed_opendir(fs_handle* h, char* path)				{ dentv* r; TIMED(ST_OPENDIR, r = opendir(h, path)); return r; }
+static void	timed_closedir(fs_handle* h, dentv* dv)				{ TIMED(ST_CLOSEDIR, closedir(h, dv)); }
+static char*	timed_read(fs_handle* h, fd_t fd, size_t size)			{ char* r; TIMED(ST_READ, r = read(h, fd, size)); return r; }
+static size_t	timed_write(fs_handle* h, fd_t fd, char* str)			{ size_t r; TIMED(ST_WRITE, r = write(h, fd, str)); return r; }
+static void	timed_seek(fs_handle* h, fd_t fd, size_t offset)		{ TIMED(ST_SEEK, seek(h, fd, offset)); }
+static int	timed_punchHole(fs_handle* h, fd_t fd, size_t off, size_t len)	{ int r; TIMED(ST_PUNCHHOLE, r = punchHole(h, fd, off, len)); return r; }
+static int	timed_truncate(fs_handle* h, fd_t fd, size_t len)		{ int r; TIMED(ST_TRUNCATE, r = truncate(h, fd, len)); return r; }
+static int	timed_fallocate(fs_handle* h, fd_t fd, size_t off, size_t len)	{ int r; TIMED(ST_FALLOCATE, r = fallocate(h, fd, off, len)); return r; }
+static int	timed_link(fs_handle* h, char* from, char* to)			{ int r; TIMED(ST_LINK, r = link(h, from, to)); return r; }
+static int	timed_ulink(fs_handle* h, char* target)				{ int r; TIMED(ST_ULINK, r = ulink(h, target)); return r; }
+static int	timed_rm(fs_handle* h, char* path, int recursive)		{ int r; TIMED(ST_RM, r = rm(h, path, recursive)); return r; }
+static size_t	timed_reclaimStep(fs_handle* h, size_t n)			{ size_t r; TIMED(ST_RECLAIMSTEP, r = reclaimStep(h, n)); return r; }
+static int	timed_fsync(fs_handle* h, fd_t fd)				{ int r; TIMED(ST_FSYNC, r = fsync(h, fd)); return r; }
+static int	timed_syncfs(fs_handle* h)					{ int r; TIMED(ST_SYNCFS, r = syncfs(h)); return r; }
+static int	timed_defrag(fs_handle* h, char* path, int bg, defrag_report* rep)	{ int r; TIMED(ST_DEFRAG, r = defrag(h, path, bg, rep)); return r; }
+static size_t	timed_defragStep(fs_handle* h, size_t n, defrag_report* rep)	{ size_t r; TIMED(ST_DEFRAGSTEP, r = defragStep(h, n, rep)); return r; }
+static int	timed_walk(fs_handle* h, char* path, uint n, fs_visitor v, void* arg)	{ int r; TIMED(ST_WALK, r = walk(h, path, n, v, arg)); return r; }
+static int	timed_readdirPlus(fs_handle* h, char* path, fs_visitor v, void* arg)	{ int r; TIMED(ST_READDIR, r = readdirPlus(h, path, v, arg)); return r; }
+static fs_walk_entry* timed_readdirPlusList(fs_handle* h, char* path, size_t* n)	{ fs_walk_entry* r; TIMED(ST_READDIR, r = readdirPlusList(h, path, n)); return r; }
+static int	timed_compress(fs_handle* h, char* path, int on)			{ int r; TIMED(ST_COMPRESS, r = compress(h, path, on)); return r; }
+static int	timed_dedup(fs_handle* h, int on)					{ int r; TIMED(ST_DEDUP, r = dedup(h, on)); return r; }
+static int	timed_fsck(const char* fname, uint n, int repair, fsck_report* rep)	{ int r; TIMED(ST_FSCK, r = fsck(fname, n, repair, rep)); return r; }
+static int	timed_importFiles(fs_handle* h, fs_import_file* f, size_t n, import_report* rep)	{ int r; TIMED(ST_IMPORT, r = importFiles(h, f, n, rep)); return r; }
+
 fs_public_interface const fs = 
 { 
 	pathFree, newPath, tokenize, pathFromString, stringFromPath,		/* Path management */
@@ -601,10 +956,14 @@ fs_public_interface const fs =
 	
 	inodeLoad, inodeUnload,
 
-	destruct, openfs, mkfs, mkdir, rmdir,
-	stat, statI, open, close, opendir, closedir,
-	read, write, seek,
-	link, ulink,
+	destruct, timed_openfs, timed_mkfs, timed_mkdir, timed_rmdir,
+	timed_stat, timed_statI, timed_open, timed_close, timed_opendir, timed_closedir,
+	timed_read, timed_write, timed_seek, timed_punchHole, timed_truncate, timed_fallocate,
+	timed_link, timed_ulink, timed_rm, timed_reclaimStep,
+	timed_fsync, timed_syncfs,
+	timed_defrag, timed_defragStep,
+	timed_walk, timed_readdirPlus, timed_readdirPlusList,
+	timed_compress, timed_dedup, dedupStats, timed_fsck, timed_importFiles,
 	
-	getNumUsedBlocks
+	getNumUsedBlocks, getNumUsedInodes, getFreeExtents
 };
@@ -0,0 +1,96 @@
+/*
+ * Check, and with -r repair, a filesystem image that is not in use.
+ * Links _fs.o and fs.o directly, like bench.
+ *
+ * Each problem found is printed on a line of its own, then a summary of
+ * what was checked and how fast. The exit status is 0 if the image is
+ * consistent, 1 if it was repaired, 4 if problems are left and 8 if it
+ * could not be checked.
+ */
+
+#define _POSIX_C_SOURCE 200809L	/* clock_gettime */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fs.h"
+
+#if defined(_WIN64) || defined(_WIN32)
+#include <windows.h>
+#endif
+
+#define FSCK_CLEAN 0			// Exit status: nothing wrong
+#define FSCK_REPAIRED 1			// Exit status: problems found, all repaired
+#define FSCK_UNREPAIRED 4		// Exit status: problems left
+#define FSCK_FAILED 8			// Exit status: the image could not be checked
+
+/* Wall clock time in seconds */
+static double fsck_now() {
+#if defined(_WIN64) || defined(_WIN32)
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr, "usage: %s [-r] [-t threads] image\n", prog);
+}
+
+int main(int argc, char** argv) {
+	fsck_report report;
+	const char* image = NULL;
+	int repair = false;
+	int threads = 0;
+	double start, secs;
+	int a, retv;
+
+	for (a = 1; a < argc; a++) {
+		if (!strcmp(argv[a], "-r"))
+			repair = true;
+		else if (!strcmp(argv[a], "-t") && a+1 < argc) {
+			threads = atoi(argv[++a]);
+			if (threads < 1 || threads > FS_FSCK_MAXTHREADS) {
+				fprintf(stderr, "threads must be 1 to %d\n", FS_FSCK_MAXTHREADS);
+				return FSCK_FAILED;
+			}
+		} else if ('-' != argv[a][0] && NULL == image)
+			image = argv[a];
+		else {
+			usage(argv[0]);
+			return FSCK_FAILED;
+		}
+	}
+	if (NULL == image) {
+		usage(argv[0]);
+		return FSCK_FAILED;
+	}
+
+	memset(&report, 0, sizeof(report));
+	report.log = stdout;
+
+	start = fsck_now();
+	retv = fs.fsck(image, (uint)threads, repair, &report);
+	secs = fsck_now() - start;
+
+	if (FS_ERR == retv) {
+		fflush(stdout);
+		fprintf(stderr, "%s: could not check \"%s\"\n", argv[0], image);
+		return FSCK_FAILED;
+	}
+
+	printf("%s: %zu inodes, %zu blocks in use. %zu problems, %zu repaired\n",
+		image, report.ninodes, report.nblocks, report.nproblems, report.nrepaired);
+	printf("%.1f MB read in %.3f s, %.1f MB/s, %u threads, %u passes\n",
+		report.nbytes / 1e6, secs, secs > 0 ? report.nbytes / 1e6 / secs : 0.0, report.nthreads, report.npasses);
+
+	if (FS_OK != retv) return FSCK_UNREPAIRED;
+	return 0 < report.nrepaired ? FSCK_REPAIRED : FSCK_CLEAN;
+}
@@ -0,0 +1,150 @@
+/*
+ * LZ77 compression of file data. See lz.h.
+ *
+ * The compressor is greedy: at each position it looks up the last
+ * position whose next 4 bytes hashed the same, and takes the match if
+ * there is one, else moves on a byte. That is fast and finds most of
+ * the repetition in text.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* The 4 bytes at @param p as a number */
+static uint32_t lz_read32(const unsigned char* p) {
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static size_t lz_hash(uint32_t v) {
+	return (size_t)((v * 2654435761u) >> (32 - LZ_HASHBITS));
+}
+
+/* Write the part of a length that did not fit in its 4 bits of the token */
+static unsigned char* lz_put_length(unsigned char* out, size_t len) {
+	while (len >= 255) {
+		*out++ = 255;
+		len -= 255;
+	}
+	*out++ = (unsigned char)len;
+	return out;
+}
+
+/* Write one sequence: @param litlen literals from @param lit, then a match of
+ * @param mlen bytes @param offset back, or no match if @param mlen is 0.
+ * Returns where the output goes on, or NULL if it would pass @param end. */
+static unsigned char* lz_sequence(unsigned char* out, const unsigned char* end,
+		const unsigned char* lit, size_t litlen, size_t offset, size_t mlen) {
+	unsigned char* token;
+	size_t need = 1 + litlen + litlen/255 + 1;
+
+	if (0 != mlen) need += 2 + mlen/255 + 1;
+	if (need > (size_t)(end - out)) return NULL;
+
+	token = out++;
+	*token = (unsigned char)((litlen >= 15 ? 15 : litlen) << 4);
+	if (litlen >= 15) out = lz_put_length(out, litlen - 15);
+
+	memcpy(out, lit, litlen);
+	out += litlen;
+
+	if (0 != mlen) {
+		*out++ = (unsigned char)(offset & 0xff);
+		*out++ = (unsigned char)(offset >> 8);
+
+		mlen -= LZ_MINMATCH;
+		*token |= (unsigned char)(mlen >= 15 ? 15 : mlen);
+		if (mlen >= 15) out = lz_put_length(out, mlen - 15);
+	}
+	return out;
+}
+
+/* Compress @param n bytes of @param src into @param dst.
+ * Returns the compressed size, or 0 if it would not fit in @param cap bytes. */
+size_t lz_compress(const char* src, size_t n, char* dst, size_t cap) {
+	const unsigned char* in = (const unsigned char*)src;
+	unsigned char* out = (unsigned char*)dst;
+	const unsigned char* end = out + cap;
+	size_t table[1 << LZ_HASHBITS];		/* Last position + 1 with each hash, 0 for none */
+	size_t i = 0, anchor = 0, cand, h, mlen;
+
+	memset(table, 0, sizeof(table));
+
+	while (i + LZ_MINMATCH <= n) {
+		h = lz_hash(lz_read32(&in[i]));
+		cand = table[h];
+		table[h] = i + 1;
+
+		if (0 == cand || i - (cand - 1) > LZ_MAXOFFSET || lz_read32(&in[cand - 1]) != lz_read32(&in[i])) {
+			i++;
+			continue;
+		}
+		cand--;
+
+		for (mlen = LZ_MINMATCH; i + mlen < n && in[cand + mlen] == in[i + mlen]; mlen++);
+
+		out = lz_sequence(out, end, &in[anchor], i - anchor, i - cand, mlen);
+		if (NULL == out) return 0;
+
+		i += mlen;
+		anchor = i;
+	}
+
+	/* What is left goes out as literals */
+	out = lz_sequence(out, end, &in[anchor], n - anchor, 0, 0);
+	if (NULL == out) return 0;
+
+	return (size_t)(out - (unsigned char*)dst);
+}
+
+/* Read the part of a length that did not fit in its 4 bits of the token.
+ * Returns -1 if the input ends first, else 0. */
+static int lz_get_length(const unsigned char** in, const unsigned char* end, size_t* len) {
+	unsigned char b;
+
+	do {
+		if (*in == end) return -1;
+		b = *(*in)++;
+		*len += b;
+	} while (255 == b);
+	return 0;
+}
+
+/* Decompress the @param n bytes of @param src into @param dst, which has
+ * room for @param cap bytes. Returns the decompressed size, or 0 if
+ * @param src is not valid compressed data or would not fit. */
+size_t lz_decompress(const char* src, size_t n, char* dst, size_t cap) {
+	const unsigned char* in = (const unsigned char*)src;
+	const unsigned char* end = in + n;
+	size_t o = 0, len, offset, k;
+	unsigned char token;
+
+	while (in < end) {
+		token = *in++;
+
+		len = token >> 4;
+		if (15 == len && 0 != lz_get_length(&in, end, &len)) return 0;
+		if (len > (size_t)(end - in) || len > cap - o) return 0;
+
+		memcpy(&dst[o], in, len);
+		in += len;
+		o += len;
+
+		if (in == end) break;		/* The last sequence has no match */
+
+		if (end - in < 2) return 0;
+		offset = (size_t)in[0] | (size_t)in[1] << 8;
+		in += 2;
+
+		len = token & 15;
+		if (15 == len && 0 != lz_get_length(&in, end, &len)) return 0;
+		len += LZ_MINMATCH;
+		if (0 == offset || offset > o || len > cap - o) return 0;
+
+		/* Byte by byte: the match may overlap what it is copying */
+		for (k = 0; k < len; k++, o++)
+			dst[o] = dst[o - offset];
+	}
+	return o;
+}
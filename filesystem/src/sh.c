@@ -1,20 +1,33 @@
+#define _POSIX_C_SOURCE 200809L	/* clock_gettime */
+
 #include "sh.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #if defined(_WIN64) || defined(_WIN32)
 #include <windows.h>
 #include "Shlwapi.h"
 #else 
 #include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #endif
 
+fs_handle* shfs = NULL;		/* The filesystem the shell works on */
 dentv* cur_dv = NULL;
 char* current_path;
+int defrag_running = false;	/* Is a background defrag in progress ? */
+int sh_interactive = true;	/* Prompt, colour and SUCCESS lines ? Off in batch modes */
+int sh_timing = false;		/* Report the time and disk traffic of each command ? */
 
 #define NOFS -2
 #define TOOFEWARGS -3
+#define BADCOMMAND -4
+#define SH_EXIT -5
+
+static double sh_now();
 
 static fs_args* newArgs() {
 	uint i = 0;
@@ -138,7 +151,7 @@ char* sh_get_dv_path(dentv* dv) {
 		return dv->name;
 
 	p = fs.newPath();
-	fs.getAbsolutePathDV(dv, p);
+	fs.getAbsolutePathDV(shfs, dv, p);
 	path = fs.stringFromPath(p);
 
 	fs.pathFree(p);
@@ -174,7 +187,7 @@ void sh_print_dir(char* name, int depth) {
 #if defined(_WIN64) || defined(_WIN32)
 	SetConsoleTextAttribute(console, FOREGROUND_BLUE);
 #else
-	printf("%s", ANSI_COLOR_BLUE);
+	sh_color(ANSI_COLOR_BLUE);
 #endif
 	if (0 == depth)	printf("%s/", name);
 	else		printf("%*s" "%s/", depth*2, " ", name);
@@ -184,78 +197,35 @@ void sh_print_dir(char* name, int depth) {
 	SetConsoleTextAttribute(console, saved_attributes);
 	printf(" \n");
 #else
-	printf("%s \n", ANSI_COLOR_RESET);
+	sh_color(ANSI_COLOR_RESET);
+	printf(" \n");
 #endif
 	
 }
 
 void sh_tree_recurse(uint depth, uint maxdepth, dentv* dv) {
-	size_t copysize;
-	uint i;
-	dentv* iterator = NULL;
-	char next[FS_NAMEMAXLEN];
-	char *dv_path;
-	char* newpath;
-		
-	memset(next, 0, FS_NAMEMAXLEN);
+	size_t i;
+	inode* sub;
 
 	if (NULL == dv) return;
-	dv_path = sh_get_dv_path(dv);
-
-	if (NULL == dv->head && 
-		dv->ndirs == 0 &&
-		dv->nfiles == 0 &&
-		dv->nlinks == 0) 
-	{
-//		free(dv_path);
-		return;
-	}
 
-	if (NULL != dv->head) {
-		newpath = sh_path_cat(dv_path, dv->head->data.dir.name);
-		copysize = min(FS_NAMEMAXLEN - 1, strlen(newpath));
-		strncat(next, newpath, copysize);
-		next[copysize] = '\0';
+	for (i = 0; i < dv->ndirs; i++) {	// For each subdir at this level
+		sub = fs.statI(shfs, dv->ino->data.dir.dirs[i]);
+		if (NULL == sub || FS_DIR != sub->mode || NULL == sub->datav.dir) {
+			printf("sh_tree_recurse: Could not open directory %lu", (unsigned long)dv->ino->data.dir.dirs[i]);
+			continue;
+		}
 
-		for (i = 0; i < dv->ndirs; i++) {	// For each subdir at this level
-		
-			iterator = fs.opendir(next);
-			if (NULL == iterator)
-				printf("sh_tree_recurse: Could not open directory \"%s\"",next);
-			else {
+		sh_print_dir(sub->datav.dir->name, depth);
 
-				sh_print_dir(iterator->name, depth);
-				
-				if (depth < maxdepth) sh_tree_recurse(depth+1, maxdepth, iterator);
-
-				if (	NULL == iterator->next ||
-					0 == iterator->next->data.dir.ino ||			/* If the dir has a next */			
-					iterator->ino->num == iterator->next->data.dir.ino)	/* If the dir doesn't point to itself */
-				{
-					//fs.closedir(iterator);
-					//iterator = NULL;
-					break;
-				}
-				
-				newpath = sh_path_cat(dv_path, iterator->next->data.dir.name);
-				copysize = min(FS_NAMEMAXLEN - 1, strlen(newpath));
-				next[0] = '\0';
-				strncat(next, newpath, copysize);
-				next[copysize] = '\0';
-
-				//fs.closedir(iterator);
-				//iterator = NULL;
-			}
-		}
+		if (depth < maxdepth) sh_tree_recurse(depth+1, maxdepth, sub->datav.dir);
 	}
 
 	sh_traverse_files(dv, depth);
 	sh_traverse_links(dv, depth);
-	//free(dv_path);
 }
 
-void sh_traverse_files(dentv* dv, int depth) {
-	size_t i;
+void sh_print_file(char* name, int depth) {
 	
 #if defined(_WIN64) || defined(_WIN32)
 	HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
@@ -265,30 +235,36 @@ void sh_traverse_files(dentv* dv, int depth) {
 	saved_attributes = info.wAttributes;
 #endif
 	
-	for (i = 0; i < dv->nfiles; i++) {	// For each file at this level
-		inode* f_ino = fs.statI(dv->ino->data.dir.files[i]);
-		
 #if defined(_WIN64) || defined(_WIN32)
-		SetConsoleTextAttribute(console, FOREGROUND_GREEN);
+	SetConsoleTextAttribute(console, FOREGROUND_GREEN);
 #else
-		printf("%s", ANSI_COLOR_GREEN);
+	sh_color(ANSI_COLOR_GREEN);
 #endif
-		if (0 == depth)	printf("%s", f_ino->data.file.name);
-		else printf("%*s" "%s", depth*2, " ", f_ino->data.file.name);
+	if (0 == depth)	printf("%s", name);
+	else printf("%*s" "%s", depth*2, " ", name);
 #if defined(_WIN64) || defined(_WIN32)
-		SetConsoleTextAttribute(console, saved_attributes);
-		printf(" \n");
+	SetConsoleTextAttribute(console, saved_attributes);
+	printf(" \n");
 #else
-		printf("%s \n",ANSI_COLOR_RESET);
+	sh_color(ANSI_COLOR_RESET);
+	printf(" \n");
 #endif
+}
+
+void sh_traverse_files(dentv* dv, int depth) {
+	size_t i;
+	
+	for (i = 0; i < dv->nfiles; i++) {	// For each file at this level
+		inode* f_ino = fs.statI(shfs, dv->ino->data.dir.files[i]);
+		
+		sh_print_file(f_ino->data.file.name, depth);
 		
-		//fs.inodeUnload(f_ino);
+		//fs.inodeUnload(shfs, f_ino);
 	}
 
 }
 
-void sh_traverse_links(dentv* dv, int depth) {
-	size_t i;
+void sh_print_link(char* name, uint16_t mode, inode* dest_ino, int depth) {
 
 #if defined(_WIN64) || defined(_WIN32)
 	HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
@@ -298,118 +274,260 @@ void sh_traverse_links(dentv* dv, int depth) {
 	saved_attributes = info.wAttributes;
 #endif
 	
-	for (i = 0; i < dv->nlinks; i++)	{// For each link at this level
-		inode* l_ino = NULL;
-		inode* dest_ino;
-		
-		l_ino = dv->links[i];
-		dest_ino = l_ino->datav.link->dest;
-		
-//		l_ino = fs.statI(dv->ino->data.dir.links[i]);
-//		dest_ino = fs.statI(l_ino->data.link.dest);
-
-		
 #if defined(_WIN64) || defined(_WIN32)
-		SetConsoleTextAttribute(console, FOREGROUND_RED | FOREGROUND_BLUE);
+	SetConsoleTextAttribute(console, FOREGROUND_RED | FOREGROUND_BLUE);
 #else
-		printf("%s", ANSI_COLOR_MAGENTA);
+	sh_color(ANSI_COLOR_MAGENTA);
 #endif
-		if (0 == depth)	printf("%s", l_ino->data.link.name);
-		else printf("%*s" "%s", depth*2, " ", l_ino->data.link.name);
-		
+	if (0 == depth)	printf("%s", name);
+	else printf("%*s" "%s", depth*2, " ", name);
+	
 #if defined(_WIN64) || defined(_WIN32)
-		SetConsoleTextAttribute(console, saved_attributes);
+	SetConsoleTextAttribute(console, saved_attributes);
 #else
-		printf("%s", ANSI_COLOR_RESET);
+	sh_color(ANSI_COLOR_RESET);
 #endif
-		printf(" --> ");
+	printf(" --> ");
 
 #if defined(_WIN64) || defined(_WIN32)
-		SetConsoleTextAttribute(console, FOREGROUND_RED | FOREGROUND_BLUE);
+	SetConsoleTextAttribute(console, FOREGROUND_RED | FOREGROUND_BLUE);
 #else
-		printf("%s", ANSI_COLOR_MAGENTA);
+	sh_color(ANSI_COLOR_MAGENTA);
 #endif
-		if (FS_LINK == l_ino->data.link.mode)
-			printf("%s", dest_ino->data.link.name);
-		
-//		if (FS_LINK == l_ino->data.link.mode) {
-//			char* parent_path = NULL;
-//			char* full_path = NULL;
-//			fs_path* p;
-//			
-//			p = fs.newPath();
-//			parent_path = fs.getAbsolutePathDV(dest_ino->datav.link->parent->datav.dir, p);
-//			fs.pathFree(p);
-//			
-//			full_path = sh_path_cat(parent_path, dest_ino->data.link.name);
-//			printf("%s", full_path);
-//			free(full_path);
-//		}
-		
+	if (FS_LINK == mode)
+		printf("%s", dest_ino->data.link.name);
+	
+//	if (FS_LINK == mode) {
+//		char* parent_path = NULL;
+//		char* full_path = NULL;
+//		fs_path* p;
+//		
+//		p = fs.newPath();
+//		parent_path = fs.getAbsolutePathDV(shfs, dest_ino->datav.link->parent->datav.dir, p);
+//		fs.pathFree(p);
+//		
+//		full_path = sh_path_cat(parent_path, dest_ino->data.link.name);
+//		printf("%s", full_path);
+//		free(full_path);
+//	}
+	
 #if defined(_WIN64) || defined(_WIN32)
-		SetConsoleTextAttribute(console, FOREGROUND_BLUE);
+	SetConsoleTextAttribute(console, FOREGROUND_BLUE);
 #else
-		printf("%s", ANSI_COLOR_BLUE);
+	sh_color(ANSI_COLOR_BLUE);
 #endif
 
-		if (FS_DIR == l_ino->data.link.mode) {
-			char* path = NULL;
-			fs_path* p;
-			
-			p = fs.newPath();
-			path = fs.getAbsolutePathDV(dest_ino->datav.dir, p);
-			fs.pathFree(p);
-			
-			printf("%s", path);
-			free(path);
-		}
+	if (FS_DIR == mode) {
+		char* path = NULL;
+		fs_path* p;
+		
+		p = fs.newPath();
+		path = fs.getAbsolutePathDV(shfs, dest_ino->datav.dir, p);
+		fs.pathFree(p);
 		
+		printf("%s", path);
+		free(path);
+	}
+	
 #if defined(_WIN64) || defined(_WIN32)
-		SetConsoleTextAttribute(console, FOREGROUND_GREEN);
+	SetConsoleTextAttribute(console, FOREGROUND_GREEN);
 #else
-		printf("%s", ANSI_COLOR_GREEN);
+	sh_color(ANSI_COLOR_GREEN);
 #endif
-		if (FS_FILE == l_ino->data.link.mode)
-			printf("%s", dest_ino->data.file.name);
-		
-//		if (FS_FILE == l_ino->data.link.mode) {
-//			char* parent_path = NULL;
-//			char* full_path = NULL;
-//			fs_path* p = NULL;
-//			
-////			inode* dest_ino2 = NULL;
-////			dest_ino2 = fs.statI(l_ino->data.link.dest);
-//			
-//			p = fs.newPath();
-//			parent_path = fs.getAbsolutePathDV(dest_ino->datav.file->parent->datav.dir, p);
-//			fs.pathFree(p);
-//			
-//			full_path = sh_path_cat(parent_path, dest_ino->data.file.name);
-//			printf("%s", full_path);
-//			free(full_path);
-//			free(parent_path);
-//		}
-		
+	if (FS_FILE == mode)
+		printf("%s", dest_ino->data.file.name);
+	
+//	if (FS_FILE == mode) {
+//		char* parent_path = NULL;
+//		char* full_path = NULL;
+//		fs_path* p = NULL;
+//		
+////		inode* dest_ino2 = NULL;
+////		dest_ino2 = fs.statI(shfs, l_ino->data.link.dest);
+//		
+//		p = fs.newPath();
+//		parent_path = fs.getAbsolutePathDV(shfs, dest_ino->datav.file->parent->datav.dir, p);
+//		fs.pathFree(p);
+//		
+//		full_path = sh_path_cat(parent_path, dest_ino->data.file.name);
+//		printf("%s", full_path);
+//		free(full_path);
+//		free(parent_path);
+//	}
+	
 #if defined(_WIN64) || defined(_WIN32)
-		SetConsoleTextAttribute(console, saved_attributes);
-		printf(" \n");
+	SetConsoleTextAttribute(console, saved_attributes);
+	printf(" \n");
 #else
-		printf("%s \n", ANSI_COLOR_RESET);
+	sh_color(ANSI_COLOR_RESET);
+	printf(" \n");
 #endif
-//		fs.inodeUnload(l_ino);
-//		fs.inodeUnload(dest_ino);
+}
+
+void sh_traverse_links(dentv* dv, int depth) {
+	size_t i;
+
+	for (i = 0; i < dv->nlinks; i++)	{// For each link at this level
+		inode* l_ino = NULL;
+		inode* dest_ino;
+		
+		l_ino = dv->links[i];
+		if (NULL == l_ino || !l_ino->v_attached)	/* Detached when its destination was unloaded */
+			l_ino = fs.statI(shfs, dv->ino->data.dir.links[i]);
+		if (NULL == l_ino || NULL == l_ino->datav.link) continue;
+		dest_ino = l_ino->datav.link->dest;
+		
+//		l_ino = fs.statI(shfs, dv->ino->data.dir.links[i]);
+//		dest_ino = fs.statI(shfs, l_ino->data.link.dest);
+
+		sh_print_link(l_ino->data.link.name, l_ino->data.link.mode, dest_ino, depth);
+//		fs.inodeUnload(shfs, l_ino);
+//		fs.inodeUnload(shfs, dest_ino);
+	}
+}
+
+/* Print a directory entry found by a walk or readdirPlus */
+void sh_print_entry(const fs_walk_entry* e, int depth) {
+	inode* dest_ino;
+
+	switch (e->mode) {
+		case FS_DIR:	sh_print_dir((char*)e->name, depth); break;
+		case FS_FILE:	sh_print_file((char*)e->name, depth); break;
+		case FS_LINK:
+		{
+			dest_ino = fs.statI(shfs, e->dest);
+			if (NULL != dest_ino)
+				sh_print_link((char*)e->name, e->destmode, dest_ino, depth);
+			break;
+		}
+	}
+}
+
+/* Does @param name match @param pattern, where '*' matches any run 
+ * of characters and '?' any one character ? */
+int sh_glob(const char* pattern, const char* name) {
+	const char* star = NULL;	/* The last '*' seen, to backtrack to */
+	const char* resume = NULL;	/* Where in name that '*' matched up to */
+
+	while ('\0' != *name) {
+		if ('*' == *pattern) {
+			star = pattern++;
+			resume = name;
+		} else if ('?' == *pattern || *pattern == *name) {
+			pattern++;
+			name++;
+		} else if (NULL != star) {
+			pattern = star + 1;
+			name = ++resume;
+		} else return false;
+	}
+	while ('*' == *pattern) pattern++;
+	return '\0' == *pattern;
+}
+
+/* Visitor that copies each entry a walk finds into the list @param arg,
+ * or only those whose name matches list->pattern if it is set. 
+ * Each worker has its own part of the list. */
+int sh_walk_collect(const fs_walk_entry* e, void* arg) {
+	sh_walk_list* list = (sh_walk_list*)arg;
+	uint w = e->worker;
+	fs_walk_entry* copy;
+	char* path;
+	uint* order;
+
+	if (NULL != list->pattern && !sh_glob(list->pattern, e->name))
+		return FS_OK;
+
+	if (list->n[w] == list->cap[w]) {
+		size_t cap = list->cap[w] ? 2*list->cap[w] : 256;
+		fs_walk_entry* grown = (fs_walk_entry*)realloc(list->entries[w], cap*sizeof(fs_walk_entry));
+		if (NULL == grown) return FS_ERR;
+		list->entries[w] = grown;
+		list->cap[w] = cap;
+	}
+
+	path = (char*)malloc(strlen(e->path) + 1);
+	order = (uint*)malloc(e->depth*sizeof(uint));
+	if (NULL == path || NULL == order) {
+		free(path);
+		free(order);
+		return FS_ERR;
 	}
+	strcpy(path, e->path);
+	memcpy(order, e->order, e->depth*sizeof(uint));
+
+	copy = &list->entries[w][list->n[w]++];
+	*copy = *e;
+	copy->path = path;
+	copy->name = path + (e->name - e->path);
+	copy->order = order;
+	return FS_OK;
+}
+
+/* Order entries as a serial walk would visit them */
+int sh_cmp_walk_order(const void* a, const void* b) {
+	const fs_walk_entry* x = (const fs_walk_entry*)a;
+	const fs_walk_entry* y = (const fs_walk_entry*)b;
+	uint i;
+
+	for (i = 0; i < x->depth && i < y->depth; i++)
+		if (x->order[i] != y->order[i])
+			return x->order[i] < y->order[i] ? -1 : 1;
+	return (int)x->depth - (int)y->depth;	/* A directory comes before its contents */
+}
+
+/* Walk the directory at @param path, collecting what @param list asks for.
+ * Returns the entries in serial walk order, and their number in @param n. */
+fs_walk_entry* sh_walk_sorted(char* path, sh_walk_list* list, size_t* n) {
+	fs_walk_entry* all;
+	uint w;
+
+	*n = 0;
+	if (FS_ERR == fs.walk(shfs, path, SH_WALKTHREADS, sh_walk_collect, list))
+		return NULL;
+
+	for (w = 0; w < FS_WALK_MAXTHREADS; w++)
+		*n += list->n[w];
+
+	all = (fs_walk_entry*)malloc((*n ? *n : 1)*sizeof(fs_walk_entry));
+	if (NULL == all) return NULL;
+
+	*n = 0;
+	for (w = 0; w < FS_WALK_MAXTHREADS; w++) {
+		if (0 == list->n[w]) continue;
+		memcpy(&all[*n], list->entries[w], list->n[w]*sizeof(fs_walk_entry));
+		*n += list->n[w];
+	}
+	qsort(all, *n, sizeof(fs_walk_entry), sh_cmp_walk_order);
+	return all;
+}
+
+/* Free the entries of @param list, and @param all of them sorted */
+void sh_walk_free(sh_walk_list* list, fs_walk_entry* all, size_t n) {
+	size_t i;
+	uint w;
+
+	for (i = 0; i < n; i++) {
+		free((char*)all[i].path);
+		free((uint*)all[i].order);
+	}
+	free(all);
+	for (w = 0; w < FS_WALK_MAXTHREADS; w++)
+		free(list->entries[w]);
 }
 
 void sh_tree(char* name) {
+	sh_walk_list list;
+	fs_walk_entry* all;
 	dentv* dv = NULL;
+	size_t i, n;
 
 	if (NULL == name) {
 		printf("Bad directory name.\n");
 		return;
 	}
 
-	dv = fs.opendir(name);
+	dv = fs.opendir(shfs, name);
 
 	if (NULL == dv) {
 		printf("tree: Could not open the directory. (null dv) \"%s\"\n", name);
@@ -421,11 +539,92 @@ void sh_tree(char* name) {
 		return;
 	}
 
+	memset(&list, 0, sizeof(sh_walk_list));
+	all = sh_walk_sorted(name, &list, &n);
+	if (NULL == all) {
+		printf("tree: Could not walk \"%s\"\n", name);
+		sh_walk_free(&list, NULL, 0);
+		return;
+	}
+
 	if (!strcmp("/", name))	sh_print_dir("", 0);
 	else			sh_print_dir(dv->name, 0);
 
-	sh_tree_recurse(1, FS_MAXPATHFIELDS, dv);
-//	fs.closedir(dv);
+	for (i = 0; i < n; i++)
+		sh_print_entry(&all[i], (int)all[i].depth);
+
+	sh_walk_free(&list, all, n);
+//	fs.closedir(shfs, dv);
+}
+
+/* Visitor for du: add up the sizes in worker @param e->worker's totals */
+int sh_du_visit(const fs_walk_entry* e, void* arg) {
+	sh_du_totals* du = (sh_du_totals*)arg;
+	uint w = e->worker;
+
+	switch (e->mode) {
+		case FS_FILE:	du->nfiles[w]++; du->bytes[w] += e->size; break;
+		case FS_DIR:	du->ndirs[w]++; break;
+		case FS_LINK:	du->nlinks[w]++; break;
+	}
+	du->blocks[w] += e->nblocks;
+	return FS_OK;
+}
+
+/* du [path]: total size of the files below path */
+int sh_du(char* path) {
+	sh_du_totals du;
+	size_t bytes = 0, blocks = 0, nfiles = 0, ndirs = 0, nlinks = 0;
+	uint w;
+
+	memset(&du, 0, sizeof(sh_du_totals));
+	if (FS_ERR == fs.walk(shfs, path, SH_WALKTHREADS, sh_du_visit, &du))
+		return FS_ERR;
+
+	for (w = 0; w < FS_WALK_MAXTHREADS; w++) {
+		bytes += du.bytes[w];
+		blocks += du.blocks[w];
+		nfiles += du.nfiles[w];
+		ndirs += du.ndirs[w];
+		nlinks += du.nlinks[w];
+	}
+
+	printf("%lu bytes in %lu blocks: %lu files, %lu directories, %lu links\t%s\n",
+		(unsigned long)bytes, (unsigned long)blocks, (unsigned long)nfiles,
+		(unsigned long)ndirs, (unsigned long)nlinks, path);
+	return FS_NORMAL;
+}
+
+/* find [path] -name pattern: print the paths below path whose last 
+ * component matches pattern, in tree order */
+int sh_find(fs_args* cmd) {
+	sh_walk_list list;
+	fs_walk_entry* all;
+	char* path;
+	size_t i, n;
+	int retv = FS_NORMAL;
+
+	if (3 == cmd->nfields && !strcmp(cmd->fields[1], "-name"))
+		path = fs.getAbsolutePath(current_path, current_path);
+	else if (4 == cmd->nfields && !strcmp(cmd->fields[2], "-name"))
+		path = fs.getAbsolutePath(current_path, cmd->fields[1]);
+	else {
+		printf("Usage: find [path] -name pattern\n");
+		return FS_ERR;
+	}
+	if (NULL == path) return FS_ERR;
+
+	memset(&list, 0, sizeof(sh_walk_list));
+	list.pattern = cmd->fields[cmd->nfields - 1];
+
+	all = sh_walk_sorted(path, &list, &n);
+	if (NULL == all) retv = FS_ERR;
+	for (i = 0; i < n; i++)
+		printf("%s\n", all[i].path);
+
+	sh_walk_free(&list, all, n);
+	free(path);
+	return retv;
 }
 
 int sh_open(fs_args* cmd){
@@ -448,7 +647,7 @@ int sh_open(fs_args* cmd){
 	parent = fs.pathSkipLast(p);
 	name = fs.pathGetLast(p);
 	
-	fd = fs.open(parent, name, mode);
+	fd = fs.open(shfs, parent, name, mode);
 
 	free(abs_path);
 	fs.pathFree(p);
@@ -465,14 +664,14 @@ int sh_open(fs_args* cmd){
 char* sh_read(int fd, size_t size) {
 	char* rdbuf = NULL;
 	
-	rdbuf = fs.read(fd, size);
+	rdbuf = fs.read(shfs, fd, size);
 	if (NULL == rdbuf)
 		printf("Error: Buffer is empty\n");
 	return rdbuf;
 }
 
 int sh_close(int fd){
-	return fs.close(fd);
+	return fs.close(shfs, fd);
 }
 
 int sh_write(fs_args* cmd) {
@@ -490,7 +689,7 @@ int sh_write(fs_args* cmd) {
 	fd = atoi(cmd->fields[1]);
 
 	write_expected_byte_count = strlen(cmd->fields[2]);
-	write_byte_count = fs.write(fd, cmd->fields[2]);
+	write_byte_count = fs.write(shfs, fd, cmd->fields[2]);
 
 	printf("Wrote %lu of %lu bytes to fd %d \n",
 		write_byte_count, write_expected_byte_count, fd);
@@ -504,7 +703,7 @@ int sh_write(fs_args* cmd) {
 int sh_stat(char* name) {
 	inode* ino;
 
-	ino = fs.stat(name);
+	ino = fs.stat(shfs, name);
 	
 	if (NULL == ino) {
 		printf("inode not found for \"%s\"", name);
@@ -523,7 +722,7 @@ int sh_stat(char* name) {
 #if defined(_WIN64) || defined(_WIN32)
 		SetConsoleTextAttribute(console, FOREGROUND_BLUE);
 #else
-		printf("%s", ANSI_COLOR_BLUE);
+		sh_color(ANSI_COLOR_BLUE);
 #endif
 		printf("\nstat() for \"%s\":\n\n", name);
 		printf("\tInode number: %d\n", ino->num);
@@ -552,6 +751,9 @@ int sh_stat(char* name) {
 		printf("\tLink count: %zu\n", ino->nlinks);
 		printf("\tNumber of blocks: %zu\n", ino->nblocks);
 #endif
+		if (ino->flags & FS_ZSTORED)
+			printf("\tCompressed: %lu data blocks in %lu\n",
+				(unsigned long)ino->ndatablocks, (unsigned long)ino->nzblocks);
 		
 		printf("\tVolatile data attached: ");
 		switch (ino->v_attached) {
@@ -583,7 +785,7 @@ int sh_stat(char* name) {
 #if defined(_WIN64) || defined(_WIN32)
 		SetConsoleTextAttribute(console, saved_attributes);
 #else
-		printf("%s", ANSI_COLOR_RESET);
+		sh_color(ANSI_COLOR_RESET);
 #endif
 	}
 
@@ -597,7 +799,7 @@ int sh_mkdir(char* dir_name) {
 	fs_path *p;
 
 	p = fs.newPath();
-	cur_path = fs.getAbsolutePathDV(cur_dv, p);
+	cur_path = fs.getAbsolutePathDV(shfs, cur_dv, p);
 	fs.pathFree(p);
 	
 	abs_path = fs.getAbsolutePath(cur_path, dir_name);
@@ -607,7 +809,7 @@ int sh_mkdir(char* dir_name) {
 		return FS_ERR;
 	}
 
-	i = fs.mkdir(cur_path, abs_path);
+	i = fs.mkdir(shfs, cur_path, abs_path);
 
 	if (OK == i)
 		return FS_OK;
@@ -622,7 +824,7 @@ int sh_rmdir(char* name) {
 	fs_path *p;
 
 	p = fs.newPath();
-	cur_path = fs.getAbsolutePathDV(cur_dv, p);
+	cur_path = fs.getAbsolutePathDV(shfs, cur_dv, p);
 	fs.pathFree(p);
 	
 	abs_path = fs.getAbsolutePath(cur_path, name);
@@ -632,13 +834,14 @@ int sh_rmdir(char* name) {
 		return FS_ERR;
 	}
 
-	retv = fs.rmdir(cur_path, abs_path);
+	retv = fs.rmdir(shfs, cur_path, abs_path);
 
 	return retv;
 }
 
 // Show the shell prompt
 void prompt() { 
+	if (!sh_interactive) return;
 	if (NULL != cur_dv) 
 		printf("%s ", cur_dv->name); 
 	printf("> ");
@@ -656,7 +859,7 @@ int sh_cd(char* path) {
 	abs_path = fs.getAbsolutePath(current_path, path);
 	if (NULL == abs_path) return FS_ERR;
 
-	dv = fs.opendir(abs_path);
+	dv = fs.opendir(shfs, abs_path);
 	if (NULL == dv) {
 		free(abs_path);
 		return FS_ERR;
@@ -669,8 +872,9 @@ int sh_cd(char* path) {
 }
 
 int sh_ls(char* path) {
-	dentv* dv;
+	fs_walk_entry* list;
 	char* abs_path = NULL;
+	size_t i, n;
 
 	if (NULL == path || 0 == strlen(path)) {
 		printf("sh_ls: Bad arguments\n");
@@ -680,13 +884,16 @@ int sh_ls(char* path) {
 	abs_path = fs.getAbsolutePath(current_path, path);
 	if (NULL == abs_path) return FS_ERR;
 
-	dv = fs.opendir(abs_path);
+	list = fs.readdirPlusList(shfs, abs_path, &n);
 
-	if (NULL == dv) {
+	if (NULL == list) {
 		free(abs_path);
 		return FS_ERR;
 	}
-	sh_tree_recurse(0, 0, dv);
+	for (i = 0; i < n; i++)
+		sh_print_entry(&list[i], 0);
+
+	free(list);
 	free(abs_path);
 	return FS_NORMAL;
 }
@@ -694,7 +901,7 @@ int sh_ls(char* path) {
 int sh_getfsroot() {
 	dentv* dv = NULL;
 
-	dv = fs.opendir("/");
+	dv = fs.opendir(shfs, "/");
 
 	if (NULL == dv || NULL == dv->ino)
 		return FS_ERR;
@@ -724,7 +931,7 @@ int sh_export(fs_args* cmd) {
 	abs_path = fs.getAbsolutePath(current_path, cmd->fields[1]);
 	if (NULL == abs_path) return FS_ERR;
 	
-	src = fs.stat(abs_path);
+	src = fs.stat(shfs, abs_path);
 	if (NULL == src) {
 		printf("Could not stat \"%s\"\n", abs_path);
 		free(abs_path);
@@ -796,6 +1003,14 @@ int sh_import(fs_args* cmd) {
 	fs_args* write_cmd_tmp = NULL;
 	FILE* fp;
 	
+	if (1 < cmd->nfields && !strcmp(cmd->fields[1], "-r")) {
+		if (cmd->nfields < 4) {
+			printf("Not enough arguments, have %zu\n", cmd->nfields);
+			return FS_ERR;
+		}
+		return sh_import_tree(cmd->fields[2], cmd->fields[3]);
+	}
+
 	if (cmd->nfields < 3) {
 		printf("Not enough arguments, have %zu\n", cmd->nfields);
 		return FS_ERR;
@@ -850,6 +1065,262 @@ int sh_import(fs_args* cmd) {
 	return retv;
 }
 
+#if !defined(_WIN64) && !defined(_WIN32)
+/* A new entry for import -r: the host path and the path in the filesystem,
+ * each @param parent's with @param name added, or @param name alone */
+static sh_import_item* sh_import_item_new(const char* hostparent, const char* parent, const char* name, int isdir) {
+	sh_import_item* it = (sh_import_item*)calloc(1, sizeof(sh_import_item));
+	size_t hlen = NULL == hostparent ? 0 : strlen(hostparent) + 1;
+	size_t plen = NULL == parent ? 0 : strlen(parent) + 1;
+
+	if (NULL == it) return NULL;
+	it->host = (char*)malloc(hlen + strlen(name) + 1);
+	it->path = (char*)malloc(plen + strlen(name) + 1);
+	if (NULL == it->host || NULL == it->path) {
+		free(it->host);
+		free(it->path);
+		free(it);
+		return NULL;
+	}
+
+	if (NULL == hostparent) strcpy(it->host, name);
+	else sprintf(it->host, "%s/%s", hostparent, name);
+
+	/* No doubled slash below the root */
+	if (NULL == parent) strcpy(it->path, name);
+	else sprintf(it->path, "%s%s%s", parent, '/' == parent[plen-2] ? "" : "/", name);
+
+	it->isdir = isdir;
+	return it;
+}
+
+static void sh_import_item_free(sh_import_item* it) {
+	if (NULL == it) return;
+	free(it->host);
+	free(it->path);
+	free(it->data);
+	free(it);
+}
+
+/* Read the whole of the host file of @param it */
+static int sh_import_read(sh_import_item* it) {
+	FILE* fp;
+	long fsize;
+
+	fp = fopen(it->host, "rb");
+	if (NULL == fp) return FS_ERR;
+
+	if (0 != fseek(fp, 0, SEEK_END) || 0 > (fsize = ftell(fp)) || 0 != fseek(fp, 0, SEEK_SET)) {
+		fclose(fp);
+		return FS_ERR;
+	}
+
+	it->data = (char*)malloc((size_t)fsize + 1);
+	if (NULL == it->data) {
+		fclose(fp);
+		return FS_ERR;
+	}
+	it->len = fread(it->data, 1, (size_t)fsize, fp);
+	it->data[it->len] = '\0';
+	fclose(fp);
+	return FS_OK;
+}
+
+/* List the host directory of @param it. Its subdirectories and files are
+ * pushed onto the readers' stack, all at once. */
+static int sh_import_list(sh_import_state* st, sh_import_item* it) {
+	DIR* d;
+	struct dirent* de;
+	struct stat sb;
+	sh_import_item* found = NULL;
+	sh_import_item* child;
+	size_t nskipped = 0;
+
+	d = opendir(it->host);
+	if (NULL == d) return FS_ERR;
+
+	while (NULL != (de = readdir(d))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		child = sh_import_item_new(it->host, it->path, de->d_name, false);
+		if (NULL == child || 0 != lstat(child->host, &sb) || !(S_ISDIR(sb.st_mode) || S_ISREG(sb.st_mode))) {
+			sh_import_item_free(child);
+			nskipped++;
+			continue;
+		}
+		child->isdir = S_ISDIR(sb.st_mode);
+		child->next = found;
+		found = child;
+	}
+	closedir(d);
+
+	pthread_mutex_lock(&st->lock);
+	while (NULL != found) {
+		child = found;
+		found = found->next;
+		child->next = st->todo;
+		st->todo = child;
+	}
+	st->nskipped += nskipped;
+	pthread_mutex_unlock(&st->lock);
+	return FS_OK;
+}
+
+/* A reader for import -r. Takes host entries off the stack until there
+ * are none and no reader is listing a directory that could add more.
+ * Directories are listed; files are read whole. Both are handed to the
+ * shell, which waits while too much read data is queued. */
+static void* sh_import_reader(void* arg) {
+	sh_import_state* st = (sh_import_state*)arg;
+	sh_import_item* it;
+	int ok;
+
+	pthread_mutex_lock(&st->lock);
+	while (true) {
+		while (NULL == st->todo && 0 < st->nbusy)
+			pthread_cond_wait(&st->changed, &st->lock);
+		if (NULL == st->todo) break;		/* All read */
+
+		it = st->todo;
+		st->todo = it->next;
+		it->next = NULL;
+		st->nbusy++;
+		pthread_mutex_unlock(&st->lock);
+
+		ok = FS_OK == (it->isdir ? sh_import_list(st, it) : sh_import_read(it));
+
+		pthread_mutex_lock(&st->lock);
+		if (!ok) {
+			printf("import: could not read \"%s\"\n", it->host);
+			st->nskipped++;
+			sh_import_item_free(it);
+		} else {
+			while (st->nbytes >= SH_IMPORTQUEUEBYTES)
+				pthread_cond_wait(&st->changed, &st->lock);
+
+			if (NULL == st->last) st->done = it;
+			else st->last->next = it;
+			st->last = it;
+			st->ndone++;
+			st->nbytes += it->len;
+		}
+		st->nbusy--;
+		pthread_cond_broadcast(&st->changed);
+	}
+	pthread_cond_broadcast(&st->changed);
+	pthread_mutex_unlock(&st->lock);
+	return NULL;
+}
+#endif
+
+/* import -r hostdir fsdir: copy the host directory tree @param hostdir into
+ * @param fsdir, which is made if it is missing. Several threads read the
+ * host files while the shell creates them, a batch to a commit. */
+int sh_import_tree(char* hostdir, char* fsdir) {
+#if defined(_WIN64) || defined(_WIN32)
+	(void)hostdir;
+	(void)fsdir;
+	printf("import -r is not supported on Windows\n");
+	return FS_ERR;
+#else
+	sh_import_state st;
+	pthread_t readers[SH_IMPORTTHREADS];
+	sh_import_item* items[SH_IMPORTBATCH];
+	fs_import_file files[SH_IMPORTBATCH];
+	import_report report;
+	struct stat sb;
+	char* abs_path;
+	size_t i, n, bytes, nthreads = 0;
+	int finished = false;
+	int retv = FS_OK;
+	double start, secs;
+
+	if (NULL == shfs) return NOFS;
+
+	if (0 != stat(hostdir, &sb) || !S_ISDIR(sb.st_mode)) {
+		printf("import: \"%s\" is not a directory\n", hostdir);
+		return FS_ERR;
+	}
+
+	abs_path = fs.getAbsolutePath(current_path, fsdir);
+	if (NULL == abs_path) return FS_ERR;
+
+	memset(&st, 0, sizeof(st));
+	memset(&report, 0, sizeof(report));
+	pthread_mutex_init(&st.lock, NULL);
+	pthread_cond_init(&st.changed, NULL);
+	st.todo = sh_import_item_new(NULL, NULL, hostdir, true);
+	if (NULL == st.todo) {
+		free(abs_path);
+		return FS_ERR;
+	}
+	free(st.todo->path);
+	st.todo->path = abs_path;
+
+	start = sh_now();
+	for (i = 0; i < SH_IMPORTTHREADS; i++)
+		if (0 == pthread_create(&readers[nthreads], NULL, sh_import_reader, &st))
+			nthreads++;
+
+	if (0 == nthreads) {
+		printf("import: could not start a reader\n");
+		sh_import_item_free(st.todo);
+		pthread_cond_destroy(&st.changed);
+		pthread_mutex_destroy(&st.lock);
+		return FS_ERR;
+	}
+
+	while (!finished) {
+		/* A full batch, or what is left */
+		pthread_mutex_lock(&st.lock);
+		while (st.ndone < SH_IMPORTBATCH && st.nbytes < SH_IMPORTBATCHBYTES &&
+			(NULL != st.todo || 0 < st.nbusy))
+			pthread_cond_wait(&st.changed, &st.lock);
+
+		for (n = 0, bytes = 0; NULL != st.done && n < SH_IMPORTBATCH && (0 == n || bytes < SH_IMPORTBATCHBYTES); n++) {
+			items[n] = st.done;
+			st.done = st.done->next;
+			st.ndone--;
+			st.nbytes -= items[n]->len;
+			bytes += items[n]->len;
+		}
+		if (NULL == st.done) st.last = NULL;
+		finished = NULL == st.done && NULL == st.todo && 0 == st.nbusy;
+		pthread_cond_broadcast(&st.changed);
+		pthread_mutex_unlock(&st.lock);
+
+		for (i = 0; i < n; i++) {
+			files[i].path = items[i]->path;
+			files[i].data = items[i]->isdir ? NULL : items[i]->data;
+		}
+		if (0 < n && FS_ERR == fs.importFiles(shfs, files, n, &report))
+			retv = FS_ERR;
+		for (i = 0; i < n; i++)
+			sh_import_item_free(items[i]);
+	}
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(readers[i], NULL);
+	secs = sh_now() - start;
+
+	pthread_cond_destroy(&st.changed);
+	pthread_mutex_destroy(&st.lock);
+
+	printf("%lu files, %lu directories, %.1f MB in %.3f s: %.0f files/s, %.1f MB/s, %lu commits\n",
+		(unsigned long)report.nfiles, (unsigned long)report.ndirs, report.nbytes / 1e6, secs,
+		secs > 0 ? report.nfiles / secs : 0.0, secs > 0 ? report.nbytes / 1e6 / secs : 0.0,
+		(unsigned long)report.ncommits);
+	/* Links and devices on the host are skipped, and do not make it fail */
+	if (0 < report.nfailed || 0 < st.nskipped)
+		printf("%lu failed, %lu skipped\n", (unsigned long)report.nfailed, (unsigned long)st.nskipped);
+	if (0 < report.nfailed)
+		retv = FS_ERR;
+
+	return retv;
+#endif
+}
+
 /* Combine the quoted fields of an fs_arg into one field */
 void sh_fs_args_quote_split(fs_args* cmd) {
 	size_t i, j ,k;
@@ -951,7 +1422,7 @@ int sh_cat(fs_args* cmd){
 	abs_path = fs.getAbsolutePath(current_path, cmd->fields[1]);
 	if (NULL == abs_path) return FS_ERR;
 
-	src = fs.stat(abs_path);
+	src = fs.stat(shfs, abs_path);
 	if(src == NULL){
  		printf("File could not be found\n");
 		free(abs_path);
@@ -1025,7 +1496,7 @@ int sh_cp(char* src_file, char* dest_file){
 	abs_path = fs.getAbsolutePath(current_path, src_file);
 	if (NULL == abs_path) return FS_ERR;
 	
-	s_ino = fs.stat(abs_path);
+	s_ino = fs.stat(shfs, abs_path);
 	if(s_ino == NULL){
  		printf("File could not be found\n");
 		free(abs_path);
@@ -1067,16 +1538,229 @@ int sh_cp(char* src_file, char* dest_file){
 	return FS_OK;
 }
 
-void sh_do_command(fs_args* cmd, char* buf) {
+void sh_print_defrag(defrag_report* report) {
+	printf("Defragmented %lu files, moved %lu (%lu blocks)\n", 
+		(unsigned long)report->nfiles, (unsigned long)report->nmoved, (unsigned long)report->nblocks);
+	printf("\tExtents before: %lu\n", (unsigned long)report->extents_before);
+	printf("\tExtents after: %lu\n", (unsigned long)report->extents_after);
+}
+
+/* defrag [-b] [path] */
+int sh_defrag(fs_args* cmd) {
+	defrag_report report;
+	char* abs_path = NULL;
+	size_t i = 1;
+	int background = false;
+	int retv;
+
+	if (i < cmd->nfields && !strcmp(cmd->fields[i], "-b")) {
+		background = true;
+		i++;
+	}
+
+	if (i < cmd->nfields)
+		abs_path = fs.getAbsolutePath(current_path, cmd->fields[i]);
+	else	abs_path = fs.getAbsolutePath(current_path, "");
+	if (NULL == abs_path) return FS_ERR;
+
+	memset(&report, 0, sizeof(defrag_report));
+	retv = fs.defrag(shfs, abs_path, background, &report);
+	free(abs_path);
+
+	if (FS_OK == retv) {
+		if (background) {
+			defrag_running = true;
+			printf("Defragmenting in the background\n");
+			retv = FS_NORMAL;
+		}
+		else sh_print_defrag(&report);
+	}
+	return retv;
+}
+
+/* Move a few more files along if a background defrag is running */
+void sh_defrag_background() {
+	defrag_report report;
+
+	if (!defrag_running) return;
+
+	if (0 == fs.defragStep(shfs, SH_DEFRAGSTEP, &report)) {
+		defrag_running = false;
+		printf("Background defrag finished. ");
+		sh_print_defrag(&report);
+	}
+}
+
+/* rm [-r] path */
+int sh_rm(fs_args* cmd) {
+	char* abs_path = NULL;
+	inode* target;
+	inode* ino;
+	size_t i = 1, depth;
+	int recursive = false;
+	int retv;
+
+	if (i < cmd->nfields && !strcmp(cmd->fields[i], "-r")) {
+		recursive = true;
+		i++;
+	}
+	if (i >= cmd->nfields) return TOOFEWARGS;
+
+	abs_path = fs.getAbsolutePath(current_path, cmd->fields[i]);
+	if (NULL == abs_path) return FS_ERR;
+
+	/* Not the directory we are in, or one above it */
+	target = fs.stat(shfs, abs_path);
+	ino = NULL == cur_dv ? NULL : cur_dv->ino;
+	for (depth = 0; NULL != target && NULL != ino && depth < MAXINODES; depth++) {
+		if (target->num == ino->num) {
+			printf("rm: \"%s\" is the current directory or above it\n", abs_path);
+			free(abs_path);
+			return FS_ERR;
+		}
+		if (shfs->sb.root == ino->num) break;
+		ino = fs.inodeLoad(shfs, ino->data.dir.parent);
+	}
+
+	retv = fs.rm(shfs, abs_path, recursive);
+	free(abs_path);
+	return retv;
+}
+
+/* Free some more of the space removed files held, if there is any */
+void sh_reclaim_background() {
+	if (NULL != shfs)
+		fs.reclaimStep(shfs, SH_RECLAIMSTEP);
+}
+
+/* compress on|off [path]: for the file at path, or for new files */
+int sh_compress(fs_args* cmd) {
+	char* abs_path = NULL;
+	inode* ino;
+	int on, retv;
+
+	if (cmd->nfields < 2) return TOOFEWARGS;
+
+	if (!strcmp(cmd->fields[1], "on")) on = true;
+	else if (!strcmp(cmd->fields[1], "off")) on = false;
+	else {
+		printf("compress: on or off, not \"%s\"\n", cmd->fields[1]);
+		return FS_ERR;
+	}
+
+	if (cmd->nfields < 3) {
+		retv = fs.compress(shfs, NULL, on);
+		if (FS_OK == retv)
+			printf("New files will %sbe compressed\n", on ? "" : "not ");
+		return retv;
+	}
+
+	abs_path = fs.getAbsolutePath(current_path, cmd->fields[2]);
+	if (NULL == abs_path) return FS_ERR;
+
+	retv = fs.compress(shfs, abs_path, on);
+	ino = FS_OK == retv ? fs.stat(shfs, abs_path) : NULL;
+	free(abs_path);
+
+	if (NULL != ino) {
+		if (ino->flags & FS_ZSTORED)
+			printf("%lu data blocks in %lu\n", (unsigned long)ino->ndatablocks, (unsigned long)ino->nzblocks);
+		else	printf("%lu data blocks, not compressed\n", (unsigned long)ino->ndatablocks);
+	}
+	return retv;
+}
+
+/* dedup on|off|stats */
+int sh_dedup(fs_args* cmd) {
+	dedup_report report;
+	int retv;
+
+	if (cmd->nfields < 2) return TOOFEWARGS;
+
+	if (!strcmp(cmd->fields[1], "on") || !strcmp(cmd->fields[1], "off")) {
+		retv = fs.dedup(shfs, !strcmp(cmd->fields[1], "on"));
+		if (FS_OK == retv)
+			printf("Dedup is %s\n", cmd->fields[1]);
+		return retv;
+	}
+
+	if (strcmp(cmd->fields[1], "stats")) {
+		printf("dedup: on, off or stats, not \"%s\"\n", cmd->fields[1]);
+		return FS_ERR;
+	}
+
+	fs.dedupStats(shfs, &report);
+	printf("Dedup is %s\n", report.on ? "on" : "off");
+	printf("\tIndexed blocks: %lu\n", (unsigned long)report.nindexed);
+	printf("\tShared blocks: %lu\n", (unsigned long)report.nshared);
+	printf("\tFile blocks that are indexed blocks: %lu\n", (unsigned long)report.nrefs);
+	printf("\tBlocks saved: %lu (%lu bytes)\n", (unsigned long)report.nsaved, (unsigned long)(report.nsaved*BLKSIZE));
+	return FS_NORMAL;
+}
+
+/* stats: print the operation counters and latencies.
+ * stats reset: zero them. stats json: print them as JSON. */
+int sh_stats(fs_args* cmd) {
+	if (1 == cmd->nfields) {
+		stats_print(stdout);
+		return FS_NORMAL;
+	}
+	if (!strcmp(cmd->fields[1], "reset")) {
+		stats_reset();
+		return FS_OK;
+	}
+	if (!strcmp(cmd->fields[1], "json")) {
+		stats_json(stdout);
+		return FS_NORMAL;
+	}
+
+	printf("Usage: stats [reset|json]\n");
+	return FS_ERR;
+}
+
+/* trace start: record events into the trace buffer.
+ * trace stop file: stop and write them to file as Chrome trace JSON. */
+int sh_trace(fs_args* cmd) {
+	if (2 == cmd->nfields && !strcmp(cmd->fields[1], "start")) {
+		trace_start();
+		return FS_OK;
+	}
+	if (3 == cmd->nfields && !strcmp(cmd->fields[1], "stop")) {
+		if (0 != trace_stop(cmd->fields[2])) {
+			printf("Could not write %s", cmd->fields[2]);
+			return FS_ERR;
+		}
+		return FS_OK;
+	}
+
+	printf("Usage: trace start|stop file\n");
+	return FS_ERR;
+}
+
+/* Set the terminal colour. Batch output has no colour. */
+void sh_color(const char* color) {
+	if (sh_interactive)
+		printf("%s", color);
+}
+
+int sh_do_command(fs_args* cmd, char* buf) {
 	int retv = FS_NORMAL;
-	printf("\n");
+	if (sh_interactive) printf("\n");
 	
 	if (!strcmp(cmd->fields[0], "mkfs")) {
 		printf("mkfs() ... ");
 		
-		fs.mkfs();
+		fs.destruct(shfs);
+		cur_dv = NULL;
+		shfs = fs.mkfs(SH_IMAGE);
 		retv = sh_getfsroot();
 		
+	} else if (!strcmp(cmd->fields[0], "stats")) {
+		retv = sh_stats(cmd);
+		
+	} else if (!strcmp(cmd->fields[0], "trace")) {
+		retv = sh_trace(cmd);
+		
 	} else if (NULL == current_path || current_path[0] == '\0') {
 		retv = NOFS;
 	}
@@ -1128,6 +1812,20 @@ void sh_do_command(fs_args* cmd, char* buf) {
 		sh_tree(current_path);
 	}
 	
+	else if (!strcmp(cmd->fields[0], "du")) {
+		char* abs_path;
+		abs_path = fs.getAbsolutePath(current_path, 1 < cmd->nfields ? cmd->fields[1] : current_path);
+		if (NULL != abs_path) {
+			retv = sh_du(abs_path);
+			free(abs_path);
+		}
+		else retv = FS_ERR;
+	}
+	
+	else if (!strcmp(cmd->fields[0], "find")) {
+		retv = sh_find(cmd);
+	}
+	
 	else if (!strcmp(cmd->fields[0], "mkdir")) {
 		if (1 < cmd->nfields)
 			retv = sh_mkdir(cmd->fields[1]);
@@ -1140,6 +1838,10 @@ void sh_do_command(fs_args* cmd, char* buf) {
 		else retv = TOOFEWARGS;
 	}
 	
+	else if (!strcmp(cmd->fields[0], "rm")) {
+		retv = sh_rm(cmd);
+	}
+
 	else if (!strcmp(cmd->fields[0], "stat")) {
 		if (1 < cmd->nfields) {
 			char* abs_path;
@@ -1154,10 +1856,25 @@ void sh_do_command(fs_args* cmd, char* buf) {
 	
 	else if (!strcmp(cmd->fields[0], "seek")) {
 		if(2 < cmd->nfields) {
-			fs.seek((fd_t)atoi(cmd->fields[1]), (size_t)atoi(cmd->fields[2]));
+			fs.seek(shfs, (fd_t)atoi(cmd->fields[1]), (size_t)atoi(cmd->fields[2]));
 			retv = FS_OK;
 		} else retv = TOOFEWARGS;
 		
+	} else if (!strcmp(cmd->fields[0], "punch")) {
+		if (3 < cmd->nfields)
+			retv = fs.punchHole(shfs, (fd_t)atoi(cmd->fields[1]), (size_t)atoi(cmd->fields[2]), (size_t)atoi(cmd->fields[3]));
+		else retv = TOOFEWARGS;
+
+	} else if (!strcmp(cmd->fields[0], "truncate")) {
+		if (2 < cmd->nfields)
+			retv = fs.truncate(shfs, (fd_t)atoi(cmd->fields[1]), (size_t)atoi(cmd->fields[2]));
+		else retv = TOOFEWARGS;
+
+	} else if (!strcmp(cmd->fields[0], "fallocate")) {
+		if (3 < cmd->nfields)
+			retv = fs.fallocate(shfs, (fd_t)atoi(cmd->fields[1]), (size_t)atoi(cmd->fields[2]), (size_t)atoi(cmd->fields[3]));
+		else retv = TOOFEWARGS;
+
 	} else if (!strcmp(cmd->fields[0], "open")) {
 		retv = sh_open(cmd);
 		
@@ -1169,7 +1886,7 @@ void sh_do_command(fs_args* cmd, char* buf) {
 		if (2 < cmd->nfields) {
 			char* rdbuf = NULL;
 			
-			rdbuf = fs.read(atoi(cmd->fields[1]), atoi(cmd->fields[2]));
+			rdbuf = fs.read(shfs, atoi(cmd->fields[1]), atoi(cmd->fields[2]));
 			if (NULL == rdbuf) retv = FS_ERR;
 			else {
 				retv = FS_OK;
@@ -1185,10 +1902,25 @@ void sh_do_command(fs_args* cmd, char* buf) {
 		
 		if (1 < cmd->nfields) {
 			
-			fs.close(atoi(cmd->fields[1]));
+			fs.close(shfs, atoi(cmd->fields[1]));
 			retv = FS_OK;
 		}  else retv = TOOFEWARGS;
 		
+	} else if (!strcmp(cmd->fields[0], "defrag")) {
+		retv = sh_defrag(cmd);
+		
+	} else if (!strcmp(cmd->fields[0], "compress")) {
+		retv = sh_compress(cmd);
+
+	} else if (!strcmp(cmd->fields[0], "dedup")) {
+		retv = sh_dedup(cmd);
+
+	} else if (!strcmp(cmd->fields[0], "sync")) {
+		
+		if (1 < cmd->nfields)
+			retv = fs.fsync(shfs, atoi(cmd->fields[1]));
+		else retv = fs.syncfs(shfs);
+		
 	} else if (!strcmp(cmd->fields[0], "link")) {
 		
 		if (2 < cmd->nfields) {
@@ -1199,20 +1931,20 @@ void sh_do_command(fs_args* cmd, char* buf) {
 			abs_path = fs.getAbsolutePath(current_path, cmd->fields[1]);
 			abs_path2 = fs.getAbsolutePath(current_path, cmd->fields[2]);
 			
-			val = fs.stat(abs_path);
-			val2 = fs.stat(abs_path2);
+			val = fs.stat(shfs, abs_path);
+			val2 = fs.stat(shfs, abs_path2);
 			
 			if (NULL != val2) {
 				printf("sh_link: target exists.\n");
-				return;
+				return FS_ERR;
 			}
 			
 			if (NULL == val) {
 				printf("sh_link: Source does not exist \n");
-				return;
+				return FS_ERR;
 			}
 			
-			retv = fs.link(abs_path, abs_path2);
+			retv = fs.link(shfs, abs_path, abs_path2);
 			
 			free(abs_path);
 			free(abs_path2);
@@ -1225,7 +1957,7 @@ void sh_do_command(fs_args* cmd, char* buf) {
 			char* abs_path;
 			abs_path = fs.getAbsolutePath(current_path, cmd->fields[1]);
 			
-			retv = fs.ulink(abs_path);
+			retv = fs.ulink(shfs, abs_path);
 			free(abs_path);
 		} else retv = TOOFEWARGS;
 		
@@ -1247,57 +1979,208 @@ void sh_do_command(fs_args* cmd, char* buf) {
 		else retv = TOOFEWARGS;
 	}
 	
-	else printf("Bad command \"%s\"", buf);
+	else {
+		printf("Bad command \"%s\"", buf);
+		retv = BADCOMMAND;
+	}
 	
 	if	(NOFS == retv)		printf("No filesystem. Type \"mkfs\".");
 	else if (TOOFEWARGS == retv)	printf("Not enough arguments");
-	else if (FS_OK == retv)		printf("SUCCESS");
+	else if (FS_OK == retv)	{	if (sh_interactive) printf("SUCCESS"); }
 	else if (FS_ERR == retv)	printf("ERROR");
-	printf("\n");
+	if (sh_interactive || FS_NORMAL > retv) printf("\n");
+
+	return retv;
 }
 
 void printFreeSpace() {
-	int nused;
+	int nused, ninodes;
 	double percent;
+	size_t classes[FS_NFREECLASSES];
+	int k;
 	
-	nused = (int)fs.getNumUsedBlocks();
+	nused = (int)fs.getNumUsedBlocks(shfs);
+	ninodes = (int)fs.getNumUsedInodes(shfs);
 	percent = (double)nused / (double)MAXBLOCKS;
+	fs.getFreeExtents(shfs, classes);
 	
 	printf("Space usage:\n");
 	printf("\tBlocks used: %d / %d\n", nused, MAXBLOCKS);
-	printf("\t%% used space: %lf)\n\n", percent);
+	printf("\tInodes used: %d / %d\n", ninodes, MAXINODES);
+	printf("\t%% used space: %lf)\n", percent);
+	printf("\tFree extents (blocks: count):\n");
+	for (k = 0; k < FS_NFREECLASSES; k++) {
+		if (0 == classes[k]) continue;
+		printf("\t\t%d-%d: %lu\n", 1 << k, (1 << (k+1)) - 1, (unsigned long)classes[k]);
+	}
+	printf("\n");
+}
+
+/* Wall clock time in seconds, for --time */
+static double sh_now() {
+#if defined(_WIN64) || defined(_WIN32)
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
 }
 
-int main() {
-	char buf[SH_BUFLEN] = "";	// Buffer for user input
+/* Print the time and disk traffic of a command, or of the whole run */
+static void sh_report_time(const char* what, double seconds, io_counts* io) {
+	fprintf(stderr, "time: %10.3f ms  reads %lu (%lu blocks)  writes %lu (%lu blocks)  %s\n",
+		seconds * 1000.0,
+		(unsigned long)io->nreads, (unsigned long)io->blocks_read,
+		(unsigned long)io->nwrites, (unsigned long)io->blocks_written, what);
+}
 
+/* Run one line of input. Returns SH_EXIT for "exit", else the status of the command. */
+static int sh_run_line(char* buf) {
 	fs_args* cmd = NULL;
+	int retv;
+	double start = 0;
+	io_counts io_before, io_used;
+
+	while (' ' == *buf || '\t' == *buf) buf++;
+	if ('\0' == buf[0]) return FS_NORMAL;
+
+	cmd = sh_parse_input(buf);
+
+	if ('#' == cmd->fields[0][0]) {			// Skip commented lines
+		argsFree(cmd);
+		return FS_NORMAL;
+	}
+	if (!strcmp(cmd->fields[0], "exit")) {
+		argsFree(cmd);
+		return SH_EXIT;
+	}
+
+	if (sh_timing) {
+		io_before = fs_io;
+		start = sh_now();
+	}
+
+	retv = sh_do_command(cmd, buf);
+	sh_defrag_background();
+	sh_reclaim_background();
+
+	if (sh_timing) {
+		io_used.nreads		= fs_io.nreads - io_before.nreads;
+		io_used.blocks_read	= fs_io.blocks_read - io_before.blocks_read;
+		io_used.nwrites		= fs_io.nwrites - io_before.nwrites;
+		io_used.blocks_written	= fs_io.blocks_written - io_before.blocks_written;
+		sh_report_time(buf, sh_now() - start, &io_used);
+	}
+
+	argsFree(cmd);
+	return retv;
+}
+
+/* Run the ';'-separated commands in @param cmds. A ';' inside double quotes 
+ * does not separate commands. Returns SH_EXIT if one of them was "exit". */
+static int sh_run_commands(char* cmds, int* failed) {
+	char* next = cmds;
+	char* p;
+	int quoted = false;
+	int retv;
+
+	for (p = cmds; ; p++) {
+		if ('"' == *p) quoted = !quoted;
+		if ('\0' != *p && (';' != *p || quoted)) continue;
+
+		if ('\0' == *p) {
+			retv = sh_run_line(next);
+			if (SH_EXIT == retv) return SH_EXIT;
+			if (FS_NORMAL > retv) *failed = true;
+			return FS_OK;
+		}
+
+		*p = '\0';
+		retv = sh_run_line(next);
+		if (SH_EXIT == retv) return SH_EXIT;
+		if (FS_NORMAL > retv) *failed = true;
+		next = p + 1;
+	}
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr, "usage: %s [--time] [-b script | -c \"cmd; cmd\"]\n", prog);
+}
+
+int main(int argc, char** argv) {
+	static char buf[SH_BUFLEN] = "";	// Buffer for user input
+	FILE* in = stdin;
+	char* cmds = NULL;			// Commands given with -c
+	int failed = false;			// Did a command fail ? Sets the exit status in batch modes
+	int i;
+	size_t len;
+	double start;
+
 	current_path = NULL;
 
-	_fs._debug_print();
-	fs.openfs();
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--time"))
+			sh_timing = true;
+		else if (!strcmp(argv[i], "-b") && i+1 < argc) {
+			in = fopen(argv[++i], "r");
+			if (NULL == in) {
+				fprintf(stderr, "Could not open script \"%s\"\n", argv[i]);
+				return 1;
+			}
+			sh_interactive = false;
+		}
+		else if (!strcmp(argv[i], "-c") && i+1 < argc) {
+			cmds = argv[++i];
+			sh_interactive = false;
+		}
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	/* Batch output goes to a pipe or a file: buffer all of it */
+	if (!sh_interactive)
+		setvbuf(stdout, NULL, _IOFBF, SH_OUTBUFLEN);
+
+	start = sh_now();
+	if (sh_interactive)
+		_fs._debug_print();
+	shfs = fs.openfs(SH_IMAGE);
 	sh_getfsroot();
 	
-	prompt();
-        memset(buf, 0, SH_BUFLEN);				// Clean buffer before printing
-	while (NULL != fgets(buf, SH_BUFLEN-1, stdin)) {	// Get user input
+	if (NULL != cmds) {
+		sh_run_commands(cmds, &failed);
+	} else {
+		prompt();
+		memset(buf, 0, SH_BUFLEN);				// Clean buffer before printing
+		while (NULL != fgets(buf, SH_BUFLEN-1, in)) {		// Get user input
+			len = strlen(buf);
+			if (0 < len && '\n' == buf[len-1])
+				buf[len-1] = '\0';			// Remove trailing newline
+
+			i = sh_run_line(buf);
+			if (SH_EXIT == i) break;
+			if (FS_NORMAL > i) failed = true;
+
+ 			prompt();
+			memset(buf, 0, SH_BUFLEN);
+		}
+	}
 
-		if (0 == strlen(buf) || '\n' == buf[0]) {
-			prompt(); 
-			continue;
-		}		
+	/* Free what removed files still hold before leaving */
+	while (NULL != shfs && 0 < fs.reclaimStep(shfs, MAXBLOCKS));
 
-		buf[strlen(buf)-1] = '\0';			// Remove trailing newline
-		cmd = sh_parse_input(buf);
-		
-		if('#' == cmd->fields[0][0]) continue;		// Skip commented lines //
-		if (!strcmp(cmd->fields[0], "exit")) break;
-		
-		sh_do_command(cmd, buf);
+	if (sh_timing)
+		sh_report_time("total", sh_now() - start, &fs_io);
+	if (sh_interactive)
+		printf("exit()\n");
+	if (stdin != in)
+		fclose(in);
 
-		argsFree(cmd);
- 		prompt();
-		memset(buf, 0, SH_BUFLEN);
-	}
-	printf("exit()\n");
+	return sh_interactive ? 0 : failed;
 }
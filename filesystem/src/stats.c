@@ -0,0 +1,285 @@
+/*
+ * Operation counters and latency histograms. See stats.h.
+ *
+ * Latencies go into log buckets in the style of HDR histograms: each
+ * power of two is split into 2^STATS_SUBBITS linear buckets, so every
+ * bucket is within 25% of the values in it.
+ */
+
+#define _POSIX_C_SOURCE 200809L	/* clock_gettime */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+#include "trace.h"
+
+#if defined(_WIN64) || defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+STATS_THREAD stats_thread* stats_mine = NULL;	/* The calling thread's numbers */
+static stats_thread* stats_all = NULL;		/* Every live thread's numbers */
+static stats_thread stats_retired;		/* The numbers of threads that have exited, added up */
+
+#if !defined(_WIN64) && !defined(_WIN32)
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;			/* Calls stats_retire as a thread exits */
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+#endif
+
+static const char* op_names[ST_NOPS] = {
+	"mkfs", "openfs", "mkdir", "rmdir", "stat", "statI",
+	"open", "close", "opendir", "closedir", "read", "write", "seek",
+	"link", "ulink", "fsync", "syncfs", "defrag", "defragStep", "walk", "readdirPlus", "compress", "dedup", "punchHole", "truncate", "fallocate", "rm", "reclaimStep", "fsck", "import",
+	"readblock", "writeblock", "_sync", "_inode_load", "_inode_unload", "_mballoc",
+	"_load_dir", "_inode_prefetch"
+};
+
+static const char* counter_names[SC_NCOUNTERS] = {
+	"bytes_read", "bytes_written", "alloc_bits_scanned",
+	"itable_cache_hits", "itable_cache_misses",
+	"inode_cache_hits", "inode_cache_misses",
+	"dedup_hits"
+};
+
+/* Monotonic time in ns */
+uint64_t stats_now() {
+#if defined(_WIN64) || defined(_WIN32)
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (uint64_t)((double)count.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* Add the numbers of @param st to @param total */
+static void stats_add(stats_thread* total, const stats_thread* st) {
+	size_t i, b;
+
+	for (i = 0; i < SC_NCOUNTERS; i++)
+		total->counters[i] += st->counters[i];
+
+	for (i = 0; i < ST_NOPS; i++) {
+		total->ops[i].count += st->ops[i].count;
+		total->ops[i].sum += st->ops[i].sum;
+		if (st->ops[i].max > total->ops[i].max)
+			total->ops[i].max = st->ops[i].max;
+		for (b = 0; b < STATS_NBUCKETS; b++)
+			total->ops[i].buckets[b] += st->ops[i].buckets[b];
+	}
+}
+
+#if !defined(_WIN64) && !defined(_WIN32)
+/* Fold the numbers @param arg of an exiting thread into stats_retired
+ * and free them */
+static void stats_retire(void* arg) {
+	stats_thread* st = (stats_thread*)arg;
+	stats_thread** p;
+
+	pthread_mutex_lock(&stats_lock);
+	stats_add(&stats_retired, st);
+	for (p = &stats_all; NULL != *p; p = &(*p)->next)
+		if (st == *p) {
+			*p = st->next;
+			break;
+		}
+	pthread_mutex_unlock(&stats_lock);
+
+	free(st);
+	stats_mine = NULL;
+}
+
+static void stats_key_create() {
+	pthread_key_create(&stats_key, stats_retire);
+}
+#endif
+
+/* Give the calling thread its own numbers and add them to the list.
+ * They are folded into the totals and freed when the thread exits. */
+stats_thread* stats_register() {
+	stats_thread* st = (stats_thread*)calloc(1, sizeof(stats_thread));
+	if (NULL == st) return NULL;
+
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_once(&stats_key_once, stats_key_create);
+	pthread_setspecific(stats_key, st);
+	pthread_mutex_lock(&stats_lock);
+#endif
+	st->next = stats_all;
+	stats_all = st;
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_unlock(&stats_lock);
+#endif
+
+	stats_mine = st;
+	return st;
+}
+
+/* The bucket a latency of @param v ns goes in */
+static size_t bucket_of(uint64_t v) {
+	size_t e = 0;
+
+	if (v < (1u << STATS_SUBBITS)) return (size_t)v;
+
+	while (v >> (e + 1)) e++;		/* e = index of the leading bit */
+	return ((e - STATS_SUBBITS + 1) << STATS_SUBBITS) +
+		(size_t)((v >> (e - STATS_SUBBITS)) & ((1u << STATS_SUBBITS) - 1));
+}
+
+/* The smallest latency that goes in bucket @param b */
+static uint64_t bucket_floor(size_t b) {
+	size_t e, sub;
+
+	if (b < (1u << STATS_SUBBITS)) return b;
+
+	e = (b >> STATS_SUBBITS) + STATS_SUBBITS - 1;
+	sub = b & ((1u << STATS_SUBBITS) - 1);
+	return ((uint64_t)((1u << STATS_SUBBITS) + sub)) << (e - STATS_SUBBITS);
+}
+
+/* Record how long operation @param op took, since @param start */
+void stats_record(stat_op op, uint64_t start) {
+	stats_record_args(op, start, -1, -1);
+}
+
+/* stats_record, and when tracing, a trace event naming the @param block
+ * and @param inode the operation was on (-1 for none) */
+void stats_record_args(stat_op op, uint64_t start, long block, long inode) {
+	uint64_t now = stats_now(), ns = now - start;
+	stats_hist* h;
+
+	if (trace_on) trace_record(op_names[op], start, now, block, inode);
+
+	if (NULL == stats_mine && NULL == stats_register()) return;
+
+	h = &stats_mine->ops[op];
+	h->count++;
+	h->sum += ns;
+	if (ns > h->max) h->max = ns;
+	h->buckets[bucket_of(ns)]++;
+}
+
+/* Zero every thread's numbers. Operations in flight may still land. */
+void stats_reset() {
+	stats_thread* st;
+
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_lock(&stats_lock);
+#endif
+	for (st = stats_all; NULL != st; st = st->next) {
+		memset(st->counters, 0, sizeof(st->counters));
+		memset(st->ops, 0, sizeof(st->ops));
+	}
+	memset(stats_retired.counters, 0, sizeof(stats_retired.counters));
+	memset(stats_retired.ops, 0, sizeof(stats_retired.ops));
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_unlock(&stats_lock);
+#endif
+}
+
+/* Add up the numbers of all threads, live or exited, into @param total */
+static void stats_sum(stats_thread* total) {
+	stats_thread* st;
+
+	memset(total, 0, sizeof(stats_thread));
+
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_lock(&stats_lock);
+#endif
+	stats_add(total, &stats_retired);
+	for (st = stats_all; NULL != st; st = st->next)
+		stats_add(total, st);
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_unlock(&stats_lock);
+#endif
+}
+
+/* The latency, ns, that fraction @param q of the operations in @param h were faster than */
+static uint64_t percentile(stats_hist* h, double q) {
+	uint64_t seen = 0, want;
+	size_t b;
+
+	if (0 == h->count) return 0;
+
+	want = (uint64_t)(q * (double)h->count);
+	if (want >= h->count) want = h->count - 1;
+
+	for (b = 0; b < STATS_NBUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen > want) return bucket_floor(b);
+	}
+	return h->max;
+}
+
+/* Print a table of the counters and of every operation that ran */
+void stats_print(FILE* out) {
+	static stats_thread total;
+	stats_hist* h;
+	size_t i;
+
+	stats_sum(&total);
+
+	fprintf(out, "%-14s %10s %12s %10s %10s %10s %10s %10s\n",
+		"operation", "count", "total ms", "mean us", "p50 us", "p90 us", "p99 us", "max us");
+
+	for (i = 0; i < ST_NOPS; i++) {
+		h = &total.ops[i];
+		if (0 == h->count) continue;
+
+		fprintf(out, "%-14s %10lu %12.3f %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+			op_names[i], (unsigned long)h->count, h->sum / 1e6, h->sum / 1e3 / h->count,
+			percentile(h, 0.5) / 1e3, percentile(h, 0.9) / 1e3,
+			percentile(h, 0.99) / 1e3, h->max / 1e3);
+	}
+
+	fprintf(out, "\n");
+	for (i = 0; i < SC_NCOUNTERS; i++)
+		fprintf(out, "%-20s %lu\n", counter_names[i], (unsigned long)total.counters[i]);
+}
+
+/* Write the counters and histograms as JSON. Only non-empty buckets
+ * are listed, as [smallest ns in bucket, count] pairs. */
+void stats_json(FILE* out) {
+	static stats_thread total;
+	stats_hist* h;
+	size_t i, b;
+	int first = 1, firstb;
+
+	stats_sum(&total);
+
+	fprintf(out, "{\n\t\"counters\": {");
+	for (i = 0; i < SC_NCOUNTERS; i++)
+		fprintf(out, "%s\n\t\t\"%s\": %lu", i ? "," : "",
+			counter_names[i], (unsigned long)total.counters[i]);
+	fprintf(out, "\n\t},\n\t\"operations\": {");
+
+	for (i = 0; i < ST_NOPS; i++) {
+		h = &total.ops[i];
+		if (0 == h->count) continue;
+
+		fprintf(out, "%s\n\t\t\"%s\": { \"count\": %lu, \"sum_ns\": %lu, \"max_ns\": %lu, "
+			"\"p50_ns\": %lu, \"p90_ns\": %lu, \"p99_ns\": %lu, \"buckets\": [",
+			first ? "" : ",", op_names[i], (unsigned long)h->count, (unsigned long)h->sum,
+			(unsigned long)h->max, (unsigned long)percentile(h, 0.5),
+			(unsigned long)percentile(h, 0.9), (unsigned long)percentile(h, 0.99));
+		first = 0;
+
+		firstb = 1;
+		for (b = 0; b < STATS_NBUCKETS; b++) {
+			if (0 == h->buckets[b]) continue;
+			fprintf(out, "%s[%lu, %lu]", firstb ? "" : ", ",
+				(unsigned long)bucket_floor(b), (unsigned long)h->buckets[b]);
+			firstb = 0;
+		}
+		fprintf(out, "] }");
+	}
+	fprintf(out, "\n\t}\n}\n");
+}
@@ -0,0 +1,109 @@
+/*
+ * Ring-buffer event tracer. See trace.h.
+ *
+ * Each event is one Chrome "complete" event (ph "X") with a start and
+ * a duration, so calls made inside another call show up nested under
+ * it on the timeline of their thread.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "stats.h"
+#include "trace.h"
+
+#if !defined(_WIN64) && !defined(_WIN32)
+#include <pthread.h>
+#endif
+
+volatile int trace_on = 0;			/* Are events being recorded ? */
+
+static trace_event events[TRACE_NEVENTS];	/* The ring buffer */
+static uint64_t nevents = 0;			/* Events recorded since trace_start, including overwritten ones */
+static uint64_t trace_t0 = 0;			/* When tracing started */
+static unsigned int ntids = 0;			/* Threads seen so far */
+static STATS_THREAD unsigned int my_tid = 0;	/* The calling thread's id in the trace, 0 until it records */
+
+#if !defined(_WIN64) && !defined(_WIN32)
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Forget earlier events and start recording */
+void trace_start() {
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_lock(&trace_lock);
+#endif
+	nevents = 0;
+	trace_t0 = stats_now();
+	trace_on = 1;
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_unlock(&trace_lock);
+#endif
+}
+
+/* Record one event */
+void trace_record(const char* name, uint64_t start, uint64_t end, long block, long inode) {
+	trace_event* e;
+
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_lock(&trace_lock);
+#endif
+	if (trace_on) {
+		if (0 == my_tid) my_tid = ++ntids;
+
+		e = &events[nevents % TRACE_NEVENTS];
+		e->name = name;
+		e->start = start;
+		e->dur = end - start;
+		e->block = block;
+		e->inode = inode;
+		e->tid = my_tid;
+		nevents++;
+	}
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_unlock(&trace_lock);
+#endif
+}
+
+/* Stop recording and write the events to @param path as Chrome trace JSON.
+ * Returns 0, or -1 if the file could not be written. */
+int trace_stop(const char* path) {
+	FILE* out;
+	trace_event* e;
+	uint64_t i, first;
+	int retv = 0;
+
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_lock(&trace_lock);
+#endif
+	trace_on = 0;
+
+	out = fopen(path, "w");
+	if (NULL == out) retv = -1;
+	else {
+		first = nevents > TRACE_NEVENTS ? nevents - TRACE_NEVENTS : 0;
+
+		fprintf(out, "{\"displayTimeUnit\": \"ns\", \"otherData\": { \"dropped\": %lu },\n\"traceEvents\": [",
+			(unsigned long)first);
+		for (i = first; i < nevents; i++) {
+			e = &events[i % TRACE_NEVENTS];
+
+			fprintf(out, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, \"args\": {",
+				i == first ? "" : ",", e->name, e->tid,
+				(e->start > trace_t0 ? e->start - trace_t0 : 0) / 1e3, e->dur / 1e3);
+			if (0 <= e->block)
+				fprintf(out, "\"block\": %ld%s", e->block, 0 <= e->inode ? ", " : "");
+			if (0 <= e->inode)
+				fprintf(out, "\"inode\": %ld", e->inode);
+			fprintf(out, "}}");
+		}
+		fprintf(out, "\n]}\n");
+
+		if (0 != fclose(out)) retv = -1;
+	}
+#if !defined(_WIN64) && !defined(_WIN32)
+	pthread_mutex_unlock(&trace_lock);
+#endif
+
+	return retv;
+}